@@ -0,0 +1,35 @@
+/* nbd client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libnbd.h"
+#include "flight-recorder.h"
+
+void
+dump_flight_recorder_on_error (struct nbd_handle *nbd)
+{
+  if (nbd_get_flight_recorder (nbd) > 0 && !nbd_aio_is_dead (nbd)) {
+    fflush (stderr);
+    nbd_dump_flight_recorder (nbd, STDERR_FILENO, false);
+  }
+}
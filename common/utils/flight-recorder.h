@@ -0,0 +1,32 @@
+/* nbd client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef LIBNBD_FLIGHT_RECORDER_H
+#define LIBNBD_FLIGHT_RECORDER_H
+
+struct nbd_handle;
+
+/* This function is used in the command line utilities just before
+ * they exit because a call on nbd failed.  If the flight recorder is
+ * enabled (see LIBNBD_FLIGHT_RECORDER in libnbd(3)) it is dumped to
+ * stderr, unless the handle is dead, which has dumped it already.
+ * The caller should print the error first.
+ */
+extern void dump_flight_recorder_on_error (struct nbd_handle *nbd);
+
+#endif /* LIBNBD_FLIGHT_RECORDER_H */
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <unistd.h>
 #include <assert.h>
 
 #include <libnbd.h>
@@ -28,6 +29,7 @@
 #include "nbdcopy.h"
 
 #include "const-string-vector.h"
+#include "flight-recorder.h"
 #include "ispowerof2.h"
 #include "vector.h"
 
@@ -51,6 +53,17 @@ struct rw_nbd {
   bool can_zero;                /* Cached nbd_can_zero. */
 };
 
+/* Print the error from the last call on nbd and exit, dumping the
+ * flight recorder if it is enabled.
+ */
+static void
+fatal_error (struct rw *rw, struct nbd_handle *nbd)
+{
+  fprintf (stderr, "%s: %s\n", rw->name, nbd_get_error ());
+  dump_flight_recorder_on_error (nbd);
+  exit (EXIT_FAILURE);
+}
+
 static void
 open_one_nbd_handle (struct rw_nbd *rwn)
 {
@@ -64,6 +77,11 @@ open_one_nbd_handle (struct rw_nbd *rwn)
 
   nbd_set_debug (nbd, verbose);
 
+  /* The connections all go to the same server, so let them share TLS
+   * credentials and resume each other's sessions.
+   */
+  nbd_set_tls_cache (nbd, true);
+
   /* Set the handle name for debugging.  We could use rwn->rw.name
    * here but it is usually set to the lengthy NBD URI
    * (eg. "nbd://localhost:10809") which makes debug messages very
@@ -193,10 +211,8 @@ nbd_ops_close (struct rw *rw)
   size_t i;
 
   for (i = 0; i < rwn->handles.len; ++i) {
-    if (nbd_shutdown (rwn->handles.ptr[i], 0) == -1) {
-      fprintf (stderr, "%s: %s\n", rw->name, nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    if (nbd_shutdown (rwn->handles.ptr[i], 0) == -1)
+      fatal_error (rw, rwn->handles.ptr[i]);
     nbd_close (rwn->handles.ptr[i]);
   }
 
@@ -212,10 +228,8 @@ nbd_ops_flush (struct rw *rw)
   size_t i;
 
   for (i = 0; i < rwn->handles.len; ++i) {
-    if (nbd_flush (rwn->handles.ptr[i], 0) == -1) {
-      fprintf (stderr, "%s: %s\n", rw->name, nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    if (nbd_flush (rwn->handles.ptr[i], 0) == -1)
+      fatal_error (rw, rwn->handles.ptr[i]);
   }
 }
 
@@ -275,10 +289,8 @@ nbd_ops_synch_read (struct rw *rw,
   if (len == 0)
     return 0;
 
-  if (nbd_pread (rwn->handles.ptr[0], data, len, offset, 0) == -1) {
-    fprintf (stderr, "%s: %s\n", rw->name, nbd_get_error ());
-    exit (EXIT_FAILURE);
-  }
+  if (nbd_pread (rwn->handles.ptr[0], data, len, offset, 0) == -1)
+    fatal_error (rw, rwn->handles.ptr[0]);
 
   return len;
 }
@@ -289,10 +301,8 @@ nbd_ops_synch_write (struct rw *rw,
 {
   struct rw_nbd *rwn = (struct rw_nbd *) rw;
 
-  if (nbd_pwrite (rwn->handles.ptr[0], data, len, offset, 0) == -1) {
-    fprintf (stderr, "%s: %s\n", rw->name, nbd_get_error ());
-    exit (EXIT_FAILURE);
-  }
+  if (nbd_pwrite (rwn->handles.ptr[0], data, len, offset, 0) == -1)
+    fatal_error (rw, rwn->handles.ptr[0]);
 }
 
 static bool
@@ -305,10 +315,8 @@ nbd_ops_synch_zero (struct rw *rw, uint64_t offset, uint64_t count,
     return false;
 
   if (nbd_zero (rwn->handles.ptr[0], count, offset,
-                allocate ? LIBNBD_CMD_FLAG_NO_HOLE : 0) == -1) {
-    fprintf (stderr, "%s: %s\n", rw->name, nbd_get_error ());
-    exit (EXIT_FAILURE);
-  }
+                allocate ? LIBNBD_CMD_FLAG_NO_HOLE : 0) == -1)
+    fatal_error (rw, rwn->handles.ptr[0]);
   return true;
 }
 
@@ -322,10 +330,8 @@ nbd_ops_asynch_read (struct rw *rw,
   if (nbd_aio_pread (rwn->handles.ptr[command->worker->index],
                      slice_ptr (command->slice),
                      command->slice.len, command->offset,
-                     cb, 0) == -1) {
-    fprintf (stderr, "%s: %s\n", rw->name, nbd_get_error ());
-    exit (EXIT_FAILURE);
-  }
+                     cb, 0) == -1)
+    fatal_error (rw, rwn->handles.ptr[command->worker->index]);
 }
 
 static void
@@ -338,10 +344,8 @@ nbd_ops_asynch_write (struct rw *rw,
   if (nbd_aio_pwrite (rwn->handles.ptr[command->worker->index],
                       slice_ptr (command->slice),
                       command->slice.len, command->offset,
-                      cb, 0) == -1) {
-    fprintf (stderr, "%s: %s\n", rw->name, nbd_get_error ());
-    exit (EXIT_FAILURE);
-  }
+                      cb, 0) == -1)
+    fatal_error (rw, rwn->handles.ptr[command->worker->index]);
 }
 
 static bool
@@ -357,10 +361,8 @@ nbd_ops_asynch_zero (struct rw *rw, struct command *command,
 
   if (nbd_aio_zero (rwn->handles.ptr[command->worker->index],
                     command->slice.len, command->offset,
-                    cb, allocate ? LIBNBD_CMD_FLAG_NO_HOLE : 0) == -1) {
-    fprintf (stderr, "%s: %s\n", rw->name, nbd_get_error ());
-    exit (EXIT_FAILURE);
-  }
+                    cb, allocate ? LIBNBD_CMD_FLAG_NO_HOLE : 0) == -1)
+    fatal_error (rw, rwn->handles.ptr[command->worker->index]);
   return true;
 }
 
@@ -395,28 +397,23 @@ nbd_ops_get_polling_fd (struct rw *rw, size_t index,
   return;
 
 error:
-  fprintf (stderr, "%s: %s\n", rw->name, nbd_get_error ());
-  exit (EXIT_FAILURE);
+  fatal_error (rw, nbd);
 }
 
 static void
 nbd_ops_asynch_notify_read (struct rw *rw, size_t index)
 {
   struct rw_nbd *rwn = (struct rw_nbd *) rw;
-  if (nbd_aio_notify_read (rwn->handles.ptr[index]) == -1) {
-    fprintf (stderr, "%s: %s\n", rw->name, nbd_get_error ());
-    exit (EXIT_FAILURE);
-  }
+  if (nbd_aio_notify_read (rwn->handles.ptr[index]) == -1)
+    fatal_error (rw, rwn->handles.ptr[index]);
 }
 
 static void
 nbd_ops_asynch_notify_write (struct rw *rw, size_t index)
 {
   struct rw_nbd *rwn = (struct rw_nbd *) rw;
-  if (nbd_aio_notify_write (rwn->handles.ptr[index]) == -1) {
-    fprintf (stderr, "%s: %s\n", rw->name, nbd_get_error ());
-    exit (EXIT_FAILURE);
-  }
+  if (nbd_aio_notify_write (rwn->handles.ptr[index]) == -1)
+    fatal_error (rw, rwn->handles.ptr[index]);
 }
 
 /* Get the extents.
@@ -428,7 +425,7 @@ nbd_ops_asynch_notify_write (struct rw *rw, size_t index)
  * request for extents in a single round trip.
  */
 static int add_extent (void *vp, const char *metacontext,
-                       uint64_t offset, uint32_t *entries, size_t nr_entries,
+                       uint64_t offset, nbd_extent *entries, size_t nr_entries,
                        int *error);
 
 static void
@@ -449,16 +446,15 @@ nbd_ops_get_extents (struct rw *rw, size_t index,
     size_t i;
 
     exts.len = 0;
-    if (nbd_block_status (nbd, count, offset,
-                          (nbd_extent_callback) {
-                            .user_data = &exts,
-                            .callback = add_extent
-                          }, 0) == -1) {
+    if (nbd_block_status_64 (nbd, count, offset,
+                             (nbd_extent64_callback) {
+                               .user_data = &exts,
+                               .callback = add_extent
+                             }, 0) == -1) {
       /* XXX We could call default_get_extents, but unclear if it's
        * the right thing to do if the server is returning errors.
        */
-      fprintf (stderr, "%s: %s\n", rw->name, nbd_get_error ());
-      exit (EXIT_FAILURE);
+      fatal_error (rw, nbd);
     }
 
     /* Copy the extents returned into the final list (ret). */
@@ -493,7 +489,7 @@ nbd_ops_get_extents (struct rw *rw, size_t index,
 
 static int
 add_extent (void *vp, const char *metacontext,
-            uint64_t offset, uint32_t *entries, size_t nr_entries,
+            uint64_t offset, nbd_extent *entries, size_t nr_entries,
             int *error)
 {
   extent_list *ret = vp;
@@ -502,25 +498,25 @@ add_extent (void *vp, const char *metacontext,
   if (strcmp (metacontext, "base:allocation") != 0 || *error)
     return 0;
 
-  for (i = 0; i < nr_entries; i += 2) {
+  for (i = 0; i < nr_entries; i++) {
     struct extent e;
 
     e.offset = offset;
-    e.length = entries[i];
+    e.length = entries[i].length;
 
     /* Note we deliberately don't care about the HOLE flag.  There is
      * no need to read extent that reads as zeroes.  We will convert
      * to it to a hole or allocated extents based on the command line
      * arguments.
      */
-    e.zero = (entries[i+1] & LIBNBD_STATE_ZERO) != 0;
+    e.zero = (entries[i].flags & LIBNBD_STATE_ZERO) != 0;
 
     if (extent_list_append (ret, e) == -1) {
       perror ("realloc");
       exit (EXIT_FAILURE);
     }
 
-    offset += entries[i];
+    offset += entries[i].length;
   }
 
   return 0;
@@ -33,6 +33,7 @@
 #include <libnbd.h>
 
 #include "ansi-colours.h"
+#include "flight-recorder.h"
 #include "minmax.h"
 #include "rounding.h"
 #include "version.h"
@@ -241,6 +242,7 @@ do_connect (void)
 
   if (r == -1) {
     fprintf (stderr, "%s: %s\n", progname, nbd_get_error ());
+    dump_flight_recorder_on_error (nbd);
     exit (EXIT_FAILURE);
   }
 }
@@ -302,6 +304,7 @@ test_all_zeroes (uint64_t offset, size_t count)
                           .user_data = &entries },
                         0) == -1) {
     fprintf (stderr, "%s: %s\n", progname, nbd_get_error ());
+    dump_flight_recorder_on_error (nbd);
     exit (EXIT_FAILURE);
   }
 
@@ -347,6 +350,7 @@ do_dump (void)
     if (! test_all_zeroes (offset, n)) {
       if (nbd_pread (nbd, buffer, n, offset, 0) == -1) {
         fprintf (stderr, "%s: %s\n", progname, nbd_get_error ());
+        dump_flight_recorder_on_error (nbd);
         exit (EXIT_FAILURE);
       }
     }
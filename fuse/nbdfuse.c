@@ -37,6 +37,7 @@
 
 #include <libnbd.h>
 
+#include "flight-recorder.h"
 #include "version.h"
 #include "nbdfuse.h"
 
@@ -432,10 +433,15 @@ main (int argc, char *argv[])
   if (nbd_is_read_only (nbd.ptr[0]) > 0)
     readonly = true;
 
-  /* Create the background threads which are used to dispatch NBD
-   * operations.
+  /* Let libnbd run a background thread for each connection, which
+   * dispatches the commands issued from the FUSE threads.
    */
-  start_operations_threads ();
+  for (i = 0; i < nbd.len; ++i) {
+    if (nbd_set_background_thread (nbd.ptr[i], true) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
 
   /* This is just used to give an unchanging time when they stat in
    * the mountpoint.
@@ -527,7 +533,7 @@ main (int argc, char *argv[])
 static struct nbd_handle *
 create_and_connect (enum mode mode, int argc, char **argv)
 {
-  int fd;
+  int fd, r = -1;
   uint32_t cid, port;
   struct nbd_handle *h;
 
@@ -538,21 +544,16 @@ create_and_connect (enum mode mode, int argc, char **argv)
     exit (EXIT_FAILURE);
   }
   nbd_set_debug (h, verbose);
+  nbd_set_tls_cache (h, true);
 
   /* Connect to the NBD server synchronously. */
   switch (mode) {
   case MODE_URI:
-    if (nbd_connect_uri (h, argv[optind]) == -1) {
-      fprintf (stderr, "%s\n", nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    r = nbd_connect_uri (h, argv[optind]);
     break;
 
   case MODE_COMMAND:
-    if (nbd_connect_command (h, &argv[optind]) == -1) {
-      fprintf (stderr, "%s\n", nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    r = nbd_connect_command (h, &argv[optind]);
     break;
 
   case MODE_SQUARE_BRACKET:
@@ -563,10 +564,7 @@ create_and_connect (enum mode mode, int argc, char **argv)
     argv[argc-1] = NULL;
     /*FALLTHROUGH*/
   case MODE_SOCKET_ACTIVATION:
-    if (nbd_connect_systemd_socket_activation (h, &argv[optind]) == -1) {
-      fprintf (stderr, "%s\n", nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    r = nbd_connect_systemd_socket_activation (h, &argv[optind]);
     break;
 
   case MODE_FD:
@@ -575,24 +573,15 @@ create_and_connect (enum mode mode, int argc, char **argv)
                argv[0], argv[optind]);
       exit (EXIT_FAILURE);
     }
-    if (nbd_connect_socket (h, fd) == -1) {
-      fprintf (stderr, "%s\n", nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    r = nbd_connect_socket (h, fd);
     break;
 
   case MODE_TCP:
-    if (nbd_connect_tcp (h, argv[optind], argv[optind+1]) == -1) {
-      fprintf (stderr, "%s\n", nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    r = nbd_connect_tcp (h, argv[optind], argv[optind+1]);
     break;
 
   case MODE_UNIX:
-    if (nbd_connect_unix (h, argv[optind]) == -1) {
-      fprintf (stderr, "%s\n", nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    r = nbd_connect_unix (h, argv[optind]);
     break;
 
   case MODE_VSOCK:
@@ -606,12 +595,15 @@ create_and_connect (enum mode mode, int argc, char **argv)
                argv[0], argv[optind]);
       exit (EXIT_FAILURE);
     }
-    if (nbd_connect_vsock (h, cid, port) == -1) {
-      fprintf (stderr, "%s\n", nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    r = nbd_connect_vsock (h, cid, port);
     break;
   }
 
+  if (r == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    dump_flight_recorder_on_error (h);
+    exit (EXIT_FAILURE);
+  }
+
   return h;
 }
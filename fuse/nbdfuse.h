@@ -42,6 +42,5 @@ extern uint64_t size;
 extern bool verbose;
 
 extern struct fuse_operations nbdfuse_operations;
-extern void start_operations_threads (void);
 
 #endif /* LIBNBD_NBDFUSE_H */
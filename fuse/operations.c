@@ -39,7 +39,6 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <pthread.h>
 
 #ifdef HAVE_STDATOMIC_H
 #include <stdatomic.h>
@@ -55,9 +54,6 @@
 
 #define MAX_REQUEST_SIZE (32 * 1024 * 1024)
 
-/* Number of seconds to wait for commands to complete when closing the file. */
-#define RELEASE_TIMEOUT 5
-
 #define DEBUG_OPERATION(name, fs, ...)                                  \
   do {                                                                  \
     if (verbose)                                                        \
@@ -67,154 +63,19 @@
 /* NOTES ON THE THREAD MODEL
  *
  * Once nbdfuse is up and running there will be some number of FUSE
- * threads (controlled by fuse itself, see -o max_idle_threads) and a
- * static number of operations background threads.  Under load there
- * should be more FUSE threads than operations threads -- things work
- * more efficiently when this is the case.
- *
- * The NBD commands are initiated by the FUSE threads (eg. by calling
- * functions like nbd_aio_pread).  The FUSE thread then calls
- * wait_for_completion() which blocks the FUSE thread waiting for the
- * command to retire.
+ * threads (controlled by fuse itself, see -o max_idle_threads), and
+ * one libnbd background thread per NBD connection (see
+ * nbd_set_background_thread(3)).
  *
- * Commands are distributed to operations threads (currently round-
- * robin, but we could be smarter about this).
+ * The FUSE threads make synchronous libnbd calls (eg. nbd_pread).
+ * The command is sent and its reply processed by the background
+ * thread of the handle, while the FUSE thread waits for it, so
+ * several FUSE threads can have commands in flight on the same
+ * connection at once.
  *
- * An operation thread handles a single NBD connection but possibly
- * multiple commands in flight.  It is a loop which waits on a
- * condition for at least one command to be in flight, then loops
- * calling nbd_poll while there are commands in flight, then goes back
- * to waiting on the condition.
- */
-
-static void *operations_thread (void *);
-
-static struct thread {
-  size_t n;
-  pthread_t thread;
-
-  /* This counts the number of commands in flight.  The condition is
-   * used to allow the operations thread to process commands when
-   * in_flight goes from 0 -> 1.  This is roughly equivalent to
-   * nbd_aio_in_flight, but we need to count it ourselves in order to
-   * use the condition.
-   */
-  _Atomic size_t in_flight;
-  pthread_mutex_t in_flight_mutex;
-  pthread_cond_t in_flight_cond;
-} *threads;
-
-static pthread_barrier_t barrier;
-
-void
-start_operations_threads (void)
-{
-  size_t i;
-  int err;
-
-  /* This barrier is used to ensure all operations threads have
-   * started up before we leave this function.
-   */
-  err = pthread_barrier_init (&barrier, NULL, nbd.len + 1);
-  if (err != 0) {
-    errno = err;
-    perror ("nbdfuse: pthread_barrier_init");
-    exit (EXIT_FAILURE);
-  }
-
-  threads = calloc (nbd.len, sizeof (struct thread));
-  if (threads == NULL) {
-    perror ("calloc");
-    exit (EXIT_FAILURE);
-  }
-
-  for (i = 0; i < nbd.len; ++i) {
-    threads[i].n = i;
-    threads[i].in_flight = 0;
-    if ((err = pthread_mutex_init (&threads[i].in_flight_mutex, NULL)) != 0 ||
-        (err = pthread_cond_init (&threads[i].in_flight_cond, NULL)) != 0) {
-      errno = err;
-      perror ("nbdfuse: mutex/cond init");
-      exit (EXIT_FAILURE);
-    }
-    err = pthread_create (&threads[i].thread, NULL,
-                          operations_thread, &threads[i]);
-    if (err != 0) {
-      errno = err;
-      perror ("nbdfuse: pthread_create");
-      exit (EXIT_FAILURE);
-    }
-  }
-
-  /* Wait on the barrier. */
-  pthread_barrier_wait (&barrier);
-  pthread_barrier_destroy (&barrier);
-}
-
-struct completion {
-  pthread_mutex_t mutex;
-  pthread_cond_t cond;
-  bool completed;
-  struct thread *thread;
-} completion;
-
-static void *
-operations_thread (void *arg)
-{
-  struct thread *thread = arg;
-  size_t n = thread->n;
-  struct nbd_handle *h = nbd.ptr[n];
-
-  /* Signal to the main thread that we have initialized. */
-  pthread_barrier_wait (&barrier);
-
-  while (1) {
-    /* Sleep until at least one command is in flight. */
-    pthread_mutex_lock (&thread->in_flight_mutex);
-    while (thread->in_flight == 0)
-      pthread_cond_wait (&thread->in_flight_cond, &thread->in_flight_mutex);
-    pthread_mutex_unlock (&thread->in_flight_mutex);
-
-    /* Dispatch work while there are commands in flight. */
-    while (thread->in_flight > 0) {
-      if (nbd_poll (h, -1) == -1) {
-        fprintf (stderr, "%s\n", nbd_get_error ());
-        exit (EXIT_FAILURE);
-      }
-    }
-  }
-
-  /*NOTREACHED*/
-  return NULL;
-}
-
-/* Completion callback - called from the operations thread when a
- * command completes.
+ * Commands are distributed to connections (currently round-robin,
+ * but we could be smarter about this).
  */
-static int
-completion_callback (void *vp, int *error)
-{
-  struct completion *completion = vp;
-
-  pthread_mutex_lock (&completion->mutex);
-
-  /* Mark the command as completed. */
-  completion->completed = true;
-  pthread_cond_signal (&completion->cond);
-
-  /* We have to decrement this here so that the caller (the operations
-   * thread) does not reenter nbd_poll.
-   */
-  assert (completion->thread->in_flight >= 1);
-  completion->thread->in_flight--;
-
-  pthread_mutex_unlock (&completion->mutex);
-
-  /* Don't retire the command.  We want to get the error indication in
-   * the FUSE thread.
-   */
-  return 0;
-}
 
 /* Report an NBD error and return -errno. */
 static int
@@ -230,11 +91,9 @@ report_nbd_error (void)
     return -EIO;
 }
 
-/* Round-robin assignment of commands to operation threads (and
- * therefore to NBD handle "owned" by that thread).
- */
+/* Round-robin assignment of commands to NBD handles. */
 static size_t
-next_thread (void)
+next_handle (void)
 {
   static _Atomic size_t n = 0;
 
@@ -246,61 +105,16 @@ next_thread (void)
   }
 }
 
-static int
-wait_for_completion (size_t index, struct completion *completion,
-                     int64_t cookie)
-{
-  int r;
-
-  /* Signal to the operations thread to start work, in case it is sleeping. */
-  pthread_mutex_lock (&threads[index].in_flight_mutex);
-  threads[index].in_flight++;
-  pthread_cond_signal (&threads[index].in_flight_cond);
-  pthread_mutex_unlock (&threads[index].in_flight_mutex);
-
-  /* Wait until the completion_callback sets the completed flag.
-   *
-   * We cannot call nbd_aio_command_completed yet because that can
-   * lead to a possible deadlock where completion_callback holds the
-   * NBD handle lock and we try to acquire it by calling
-   * nbd_aio_command_completed.  That is the reason for the
-   * completion.completed flag.
-   */
-  pthread_mutex_lock (&completion->mutex);
-  while (!completion->completed)
-    pthread_cond_wait (&completion->cond, &completion->mutex);
-  pthread_mutex_unlock (&completion->mutex);
-
-  /* nbd_aio_command_completed returns:
-   *  0 => command still in flight (should be impossible)
-   *  1 => completed successfully
-   * -1 => error
-   */
-  r = nbd_aio_command_completed (nbd.ptr[index], cookie);
-  assert (r != 0);
-  return r;
-}
-
-/* Wrap calls to any asynch command and check the error. */
-#define CHECK_NBD_ASYNC_ERROR(CALL)                                     \
+/* Wraps calls to sync libnbd functions and check the error.  CALL
+ * may use the chosen handle h.
+ */
+#define CHECK_NBD_SYNC_ERROR(CALL)                                      \
   do {                                                                  \
-    size_t index = next_thread ();                                      \
-    struct completion completion =                                      \
-      { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,            \
-        false, &threads[index] };                                       \
-    nbd_completion_callback cb =                                        \
-      { .callback = completion_callback, .user_data = &completion };    \
-    struct nbd_handle *h = nbd.ptr[index];                              \
-    int64_t cookie = (CALL);                                            \
-    if (cookie == -1 ||                                                 \
-        wait_for_completion (index, &completion, cookie) == -1)         \
+    struct nbd_handle *h = nbd.ptr[next_handle ()];                     \
+    if ((CALL) == -1)                                                   \
       return report_nbd_error ();                                       \
   } while (0)
 
-/* Wraps calls to sync libnbd functions and check the error. */
-//#define CHECK_NBD_SYNC_ERROR(CALL)
-//  do { if ((CALL) == -1) return report_nbd_error (); } while (0)
-
 static int
 nbdfuse_getattr (const char *path, struct stat *statbuf,
                  struct fuse_file_info *fi)
@@ -394,7 +208,7 @@ nbdfuse_read (const char *path, char *buf,
   if (offset + count > size)
     count = size - offset;
 
-  CHECK_NBD_ASYNC_ERROR (nbd_aio_pread (h, buf, count, offset, cb, 0));
+  CHECK_NBD_SYNC_ERROR (nbd_pread (h, buf, count, offset, 0));
 
   return (int) count;
 }
@@ -423,7 +237,7 @@ nbdfuse_write (const char *path, const char *buf,
   if (offset + count > size)
     count = size - offset;
 
-  CHECK_NBD_ASYNC_ERROR (nbd_aio_pwrite (h, buf, count, offset, cb, 0));
+  CHECK_NBD_SYNC_ERROR (nbd_pwrite (h, buf, count, offset, 0));
 
   return (int) count;
 }
@@ -440,7 +254,7 @@ nbdfuse_fsync (const char *path, int datasync, struct fuse_file_info *fi)
    * silently ignored.
    */
   if (nbd_can_flush (nbd.ptr[0]))
-    CHECK_NBD_ASYNC_ERROR (nbd_aio_flush (h, cb, 0));
+    CHECK_NBD_SYNC_ERROR (nbd_flush (h, 0));
 
   return 0;
 }
@@ -469,7 +283,7 @@ nbdfuse_fallocate (const char *path, int mode, off_t offset, off_t len,
     if (!nbd_can_trim (nbd.ptr[0]))
       return -EOPNOTSUPP;       /* Trim not supported. */
     else {
-      CHECK_NBD_ASYNC_ERROR (nbd_aio_trim (h, len, offset, cb, 0));
+      CHECK_NBD_SYNC_ERROR (nbd_trim (h, len, offset, 0));
       return 0;
     }
   }
@@ -485,13 +299,13 @@ nbdfuse_fallocate (const char *path, int mode, off_t offset, off_t len,
 
       while (len > 0) {
         off_t n = MIN (len, sizeof zerobuf);
-        CHECK_NBD_ASYNC_ERROR (nbd_aio_pwrite (h, zerobuf, n, offset, cb, 0));
+        CHECK_NBD_SYNC_ERROR (nbd_pwrite (h, zerobuf, n, offset, 0));
         len -= n;
       }
       return 0;
     }
     else {
-      CHECK_NBD_ASYNC_ERROR (nbd_aio_zero (h, len, offset, cb, 0));
+      CHECK_NBD_SYNC_ERROR (nbd_zero (h, len, offset, 0));
       return 0;
     }
   }
@@ -503,32 +317,11 @@ nbdfuse_fallocate (const char *path, int mode, off_t offset, off_t len,
 static void
 nbdfuse_destroy (void *data)
 {
-  time_t st;
-  size_t i;
-
   DEBUG_OPERATION ("destroy", "(no parameters)");
 
-  /* Wait until there are no more commands in flight or until a
-   * timeout is reached.
+  /* Every command is synchronous, so none can still be in flight
+   * once FUSE calls this.
    */
-  time (&st);
-  while (time (NULL) - st <= RELEASE_TIMEOUT) {
-    for (i = 0; i < nbd.len; ++i) {
-      if (threads[i].in_flight > 0)
-        break;
-    }
-    if (i == nbd.len) /* no commands in flight */
-      break;
-
-    /* Signal to the operations thread to work. */
-    for (i = 0; i < nbd.len; ++i) {
-      pthread_mutex_lock (&threads[i].in_flight_mutex);
-      pthread_cond_signal (&threads[i].in_flight_cond);
-      pthread_mutex_unlock (&threads[i].in_flight_mutex);
-    }
-
-    sleep (1);
-  }
 }
 
 struct fuse_operations nbdfuse_operations = {
@@ -42,10 +42,13 @@ and arg =
 | BytesPersistOut of string * string
 | Closure of closure
 | Enum of string * enum
+| Extent64 of string
 | Fd of string
 | Flags of string * flags
 | Int of string
 | Int64 of string
+| IOVecPersistIn of string * string
+| IOVecPersistOut of string * string
 | Path of string
 | SizeT of string
 | SockAddrAndLen of string * string
@@ -157,6 +160,14 @@ let extent_closure = {
                             "nr_entries");
              CBMutable (Int "error") ]
 }
+let extent64_closure = {
+  cbname = "extent64";
+  cbargs = [ CBString "metacontext";
+             CBUInt64 "offset";
+             CBArrayAndLen (Extent64 "entries",
+                            "nr_entries");
+             CBMutable (Int "error") ]
+}
 let list_closure = {
   cbname = "list";
   cbargs = [ CBString "name"; CBString "description" ]
@@ -166,8 +177,8 @@ let context_closure = {
   cbargs = [ CBString "name" ]
 }
 let all_closures = [ chunk_closure; completion_closure;
-                     debug_closure; extent_closure; list_closure;
-                     context_closure ]
+                     debug_closure; extent_closure; extent64_closure;
+                     list_closure; context_closure ]
 
 (* Enums. *)
 let tls_enum = {
@@ -187,7 +198,19 @@ let block_size_enum = {
     "PAYLOAD",   3;
   ]
 }
-let all_enums = [ tls_enum; block_size_enum ]
+let stats_cmd_enum = {
+  enum_prefix = "STATS_CMD";
+  enums = [
+    "READ",         0;
+    "WRITE",        1;
+    "ZERO",         2;
+    "TRIM",         3;
+    "FLUSH",        4;
+    "BLOCK_STATUS", 5;
+    "CACHE",        6;
+  ]
+}
+let all_enums = [ tls_enum; block_size_enum; stats_cmd_enum ]
 
 (* Flags. See also Constants below. *)
 let default_flags = { flag_prefix = ""; guard = None; flags = [];
@@ -241,8 +264,17 @@ let shutdown_flags = {
     "ABANDON_PENDING", 1 lsl 16;
   ]
 }
+let flight_recorder_flags = {
+  default_flags with
+  flag_prefix = "FLIGHT_RECORDER";
+  flags = [
+    "DUMP_ON_DEAD", 1 lsl 0;
+    "JSON",         1 lsl 1;
+  ]
+}
 let all_flags = [ cmd_flags; handshake_flags; strict_flags;
-                  allow_transport_flags; shutdown_flags ]
+                  allow_transport_flags; shutdown_flags;
+                  flight_recorder_flags ]
 
 let default_call = { args = []; optargs = []; ret = RErr;
                      shortdesc = ""; longdesc = ""; example = None;
@@ -338,11 +370,29 @@ protocol.
 This number does not necessarily relate to the number of API
 calls made, nor to the number of TCP packets sent over the
 connection.";
-    see_also = [Link "stats_bytes_sent";
+    see_also = [Link "stats_bytes_sent"; Link "stats_send_calls";
                 Link "stats_bytes_received"; Link "stats_chunks_received";
                 Link "set_strict_mode"];
   };
 
+  "stats_send_calls", {
+    default_call with
+    args = []; ret = RUInt64;
+    may_set_error = false;
+    shortdesc = "statistics of calls made to send data so far";
+    longdesc = "\
+Return the number of times that the client has passed data to the
+kernel (or to the TLS library) to be sent to the server, including
+calls that did not send anything because the socket was not ready.
+
+When several commands are queued, libnbd sends their requests,
+and the payloads of small writes, together in one L<sendmsg(2)>
+call.  Comparing this number with L<nbd_stats_chunks_sent(3)>
+shows how many system calls this has saved.";
+    see_also = [Link "stats_chunks_sent"; Link "stats_bytes_sent";
+                Link "stats_recv_calls"];
+  };
+
   "stats_bytes_received", {
     default_call with
     args = []; ret = RUInt64;
@@ -372,11 +422,438 @@ protocol.
 This number does not necessarily relate to the number of API
 calls made, nor to the number of TCP packets received over the
 connection.";
-    see_also = [Link "stats_bytes_received";
+    see_also = [Link "stats_bytes_received"; Link "stats_recv_calls";
                 Link "stats_bytes_sent"; Link "stats_chunks_sent";
                 Link "get_structured_replies_negotiated"];
   };
 
+  "stats_recv_calls", {
+    default_call with
+    args = []; ret = RUInt64;
+    may_set_error = false;
+    shortdesc = "statistics of calls made to receive data so far";
+    longdesc = "\
+Return the number of times that the client has asked the kernel
+(or the TLS library) for data from the server, including calls
+that returned nothing because no data was available.
+
+Once connected, libnbd reads replies through a small read-ahead
+buffer, so that a single L<recv(2)> call can pick up many replies
+which the server has already sent, while large read payloads are
+still received directly into the caller's buffer.  Comparing this
+number with L<nbd_stats_chunks_received(3)> shows how many system
+calls this has saved.";
+    see_also = [Link "stats_chunks_received"; Link "stats_send_calls"];
+  };
+
+  "stats_commands", {
+    default_call with
+    args = [Enum ("cmd", stats_cmd_enum)]; ret = RInt64;
+    shortdesc = "statistics of commands completed so far";
+    longdesc = "\
+Return the number of commands of type C<cmd> to which the server has
+replied, whether the reply reported success or an error.  C<cmd> must
+be one of the following:
+
+=over 4
+
+=item C<LIBNBD_STATS_CMD_READ> = 0
+
+=item C<LIBNBD_STATS_CMD_WRITE> = 1
+
+=item C<LIBNBD_STATS_CMD_ZERO> = 2
+
+=item C<LIBNBD_STATS_CMD_TRIM> = 3
+
+=item C<LIBNBD_STATS_CMD_FLUSH> = 4
+
+=item C<LIBNBD_STATS_CMD_BLOCK_STATUS> = 5
+
+=item C<LIBNBD_STATS_CMD_CACHE> = 6
+
+=back
+
+Commands which never received a reply, for example because the
+connection died first, are not counted.";
+    see_also = [Link "stats_latency_ns"; Link "stats_latency_bucket";
+                Link "stats_queue_ns"; Link "stats_in_flight_max"];
+  };
+
+  "stats_latency_ns", {
+    default_call with
+    args = [Enum ("cmd", stats_cmd_enum)]; ret = RInt64;
+    shortdesc = "statistics of total command latency so far";
+    longdesc = "\
+Return the sum, in nanoseconds, of the times between sending the
+request for each command of type C<cmd> counted by
+L<nbd_stats_commands(3)> and receiving the whole reply.  Dividing
+this by L<nbd_stats_commands(3)> gives the mean latency due to the
+network and the server.  Time spent waiting to be sent is not
+included, see L<nbd_stats_queue_ns(3)>.";
+    see_also = [Link "stats_commands"; Link "stats_latency_bucket";
+                Link "stats_queue_ns"];
+  };
+
+  "stats_latency_bucket", {
+    default_call with
+    args = [Enum ("cmd", stats_cmd_enum); UInt "bucket"]; ret = RInt64;
+    shortdesc = "statistics of command latency as a histogram";
+    longdesc = "\
+Return one bucket of the histogram of the latencies measured by
+L<nbd_stats_latency_ns(3)> for commands of type C<cmd>.  Bucket
+C<0> counts commands which took under 1 microsecond, bucket C<i>
+counts those which took at least 2^(C<i>-1) and under 2^C<i>
+microseconds, and the last bucket also counts every slower command.
+C<bucket> must be less than C<LIBNBD_STATS_LATENCY_BUCKETS>.
+
+The buckets of a type add up to L<nbd_stats_commands(3)> for that
+type.";
+    see_also = [Link "stats_commands"; Link "stats_latency_ns"];
+  };
+
+  "stats_queue_ns", {
+    default_call with
+    args = []; ret = RUInt64;
+    may_set_error = false;
+    shortdesc = "statistics of time commands spent queued so far";
+    longdesc = "\
+Return the total time, in nanoseconds, which commands of all types
+have spent queued in libnbd between being issued by the program and
+their request being sent in full to the server.  This grows quickly
+if the program issues commands faster than they can be sent, or if
+nothing runs the state machine for a while after commands are
+issued.";
+    see_also = [Link "stats_latency_ns"; Link "stats_in_flight_max";
+                Link "aio_in_flight"];
+  };
+
+  "stats_in_flight_max", {
+    default_call with
+    args = []; ret = RUInt64;
+    may_set_error = false;
+    shortdesc = "statistics of the most commands in flight at once";
+    longdesc = "\
+Return the highest value which L<nbd_aio_in_flight(3)> has had
+since the handle was created.";
+    see_also = [Link "aio_in_flight"; Link "stats_queue_ns"];
+  };
+
+  "set_flight_recorder", {
+    default_call with
+    args = [UInt "entries"; Flags ("flags", flight_recorder_flags)];
+    ret = RErr;
+    shortdesc = "record recent protocol events in memory";
+    longdesc = "\
+If C<entries> is not zero, keep a record of the last C<entries>
+protocol events on this handle in a ring buffer in memory, replacing
+any events recorded so far.  If C<entries> is zero, stop recording
+and free the buffer.  The default is zero, unless the environment
+variable C<LIBNBD_FLIGHT_RECORDER> is set (see
+L<libnbd(3)/ENVIRONMENT VARIABLES>).
+
+The events recorded are each request sent and reply header received
+(with cookie, command or reply type, flags, offset, length and error
+field), each command completion with its error, each state
+transition, and the handle entering the dead state with the error
+which caused it.  Every event has a timestamp from the monotonic
+clock.  Events are stored in binary, about 48 bytes each, and are
+only formatted when dumped with L<nbd_dump_flight_recorder(3)>, so
+recording is cheap enough to leave enabled.
+
+C<flags> may contain:
+
+=over 4
+
+=item C<LIBNBD_FLIGHT_RECORDER_DUMP_ON_DEAD> = 1
+
+Dump the recorded events to stderr when the handle enters the dead
+state, for example because the server disconnected abruptly.
+
+=item C<LIBNBD_FLIGHT_RECORDER_JSON> = 2
+
+Use JSON instead of text for the dump made by
+C<LIBNBD_FLIGHT_RECORDER_DUMP_ON_DEAD>.
+
+=back";
+    see_also = [Link "get_flight_recorder"; Link "dump_flight_recorder";
+                Link "set_debug"];
+  };
+
+  "get_flight_recorder", {
+    default_call with
+    args = []; ret = RUInt;
+    may_set_error = false;
+    shortdesc = "return the size of the flight recorder";
+    longdesc = "\
+Return the number of events kept by the flight recorder, or zero if
+it is disabled.  See L<nbd_set_flight_recorder(3)>.";
+    see_also = [Link "set_flight_recorder"; Link "dump_flight_recorder"];
+  };
+
+  "dump_flight_recorder", {
+    default_call with
+    args = [Fd "fd"; Bool "json"]; ret = RErr;
+    shortdesc = "write out the events kept by the flight recorder";
+    longdesc = "\
+Write the events kept by the flight recorder (see
+L<nbd_set_flight_recorder(3)>) to the file descriptor C<fd>, oldest
+first.  If C<json> is false the events are written as text, one per
+line, with times relative to the oldest event.  If C<json> is true
+they are written as a single JSON object containing the handle name,
+the number of events ever recorded, and an array of events with
+absolute monotonic timestamps in nanoseconds.  The file descriptor
+is not closed.
+
+This fails with C<EINVAL> if the flight recorder is disabled.";
+    see_also = [Link "set_flight_recorder"; Link "get_flight_recorder"];
+  };
+
+  "set_block_status_cache", {
+    default_call with
+    args = [UInt64 "max_extents"]; ret = RErr;
+    shortdesc = "cache block status replies in the client";
+    longdesc = "\
+If C<max_extents> is not zero, remember the extents returned by the
+server in replies to block status commands, for every meta context,
+and answer later calls to L<nbd_block_status(3)> and
+L<nbd_block_status_64(3)> without a round trip to the server when
+the cache covers the whole range requested for every negotiated meta
+context.  If C<max_extents> is zero, stop caching and drop everything
+cached so far.  The default is zero.
+
+The cache holds at most C<max_extents> extents in total.  Adjacent
+extents with the same flags are merged.  When the cache is full, it
+is emptied and starts again.  Calling this function again with a
+different non-zero value only changes the limit.
+
+Write, zero and trim commands issued on this handle remove their
+range from the cache, both when they are issued and when the server
+replies.  A block status reply is only stored if no such command was
+issued or replied to while it was in flight.  If the handle belongs
+to a group (see L<nbd_group_create(3)>), the cache of the first
+connection which has one is shared by all the connections of the
+group, so that writes on any of them are seen.  Writes made by other
+clients of the same export, or through other handles, are B<not>
+seen, so only enable the cache if nothing else modifies the export
+while it is in use.
+
+Only the synchronous calls are answered from the cache.  Replies to
+L<nbd_aio_block_status(3)> and L<nbd_aio_block_status_64(3)> are
+stored, but those commands are always sent to the server.  When the
+cache answers, the extents passed to the callback start at the
+requested offset, and the last one may extend past the end of the
+requested range, as with replies from a server.";
+    see_also = [Link "get_block_status_cache";
+                Link "stats_block_status_cache_hits";
+                Link "block_status_64"; Link "add_meta_context"];
+  };
+
+  "get_block_status_cache", {
+    default_call with
+    args = []; ret = RUInt64;
+    may_set_error = false;
+    shortdesc = "return the size limit of the block status cache";
+    longdesc = "\
+Return the maximum number of extents kept by the block status
+cache, or zero if it is disabled.  See
+L<nbd_set_block_status_cache(3)>.";
+    see_also = [Link "set_block_status_cache"];
+  };
+
+  "stats_block_status_cache_hits", {
+    default_call with
+    args = []; ret = RUInt64;
+    may_set_error = false;
+    shortdesc = "statistics of block status calls answered by the cache";
+    longdesc = "\
+Return the number of synchronous block status calls on this handle
+which were answered from the block status cache without asking the
+server (see L<nbd_set_block_status_cache(3)>).";
+    see_also = [Link "stats_block_status_cache_misses";
+                Link "set_block_status_cache"];
+  };
+
+  "stats_block_status_cache_misses", {
+    default_call with
+    args = []; ret = RUInt64;
+    may_set_error = false;
+    shortdesc = "statistics of block status calls not answered by the cache";
+    longdesc = "\
+Return the number of synchronous block status calls on this handle
+which were looked up in the block status cache but had to be sent
+to the server, because the cache did not cover the whole range
+requested for every meta context.  Calls made while the cache is
+disabled are not counted.";
+    see_also = [Link "stats_block_status_cache_hits";
+                Link "set_block_status_cache"];
+  };
+
+  "set_read_cache", {
+    default_call with
+    args = [UInt64 "size"]; ret = RErr;
+    permitted_states = [ Created ];
+    shortdesc = "cache data read from the server in the client";
+    longdesc = "\
+If C<size> is not zero, keep up to C<size> bytes of data read from
+the server in memory, and answer reads made with L<nbd_pread(3)>
+and L<nbd_aio_pread(3)> from memory when possible.  If C<size> is
+zero, do not cache.  The default is zero.  C<size> is rounded down
+to a multiple of the cache block size of 64K, and must be at least
+that large.  This can only be set before connecting.
+
+The cache works in aligned blocks of 64K.  A read is answered from
+memory if every block it touches is cached.  Otherwise each missing
+block is read in full from the server, and the read completes when
+all of them have arrived.  Reads of a block which is already being
+read from the server wait for that request instead of sending
+another one, so many readers of the same data only cost one round
+trip.  When the cache is full, the least recently used block is
+dropped.
+
+Write, zero and trim commands issued on this handle drop the blocks
+they touch, both when they are issued and when the server replies.
+Writes made by other clients are not seen, so the cache is only
+used if the export is read-only or the server advertises multi-conn
+(see L<nbd_can_multi_conn(3)>), which promises that writes completed
+on any connection are visible to all of them.  With a writable
+export and no multi-conn the setting is kept but the cache is
+silently not used.
+
+Reads with flags, and the other read calls such as
+L<nbd_pread_structured(3)> and L<nbd_aio_preadv(3)>, always go to
+the server.  When L<nbd_aio_pread(3)> is answered from memory, the
+completion callback is called before L<nbd_aio_pread(3)> returns.
+
+The reads which fill the cache are commands of their own.  While
+they are in flight they are counted by L<nbd_aio_in_flight(3)> and
+L<nbd_stats_in_flight_max(3)>, so a loop which polls until
+L<nbd_aio_in_flight(3)> reaches zero also waits for them.  Each one
+uses up a cookie, so the cookies returned to the caller are not
+consecutive.  They cannot be waited for or retired by the caller.";
+    see_also = [Link "get_read_cache"; Link "stats_read_cache_hits";
+                Link "pread"; Link "aio_pread"; Link "can_multi_conn";
+                Link "aio_in_flight"];
+  };
+
+  "get_read_cache", {
+    default_call with
+    args = []; ret = RUInt64;
+    may_set_error = false;
+    shortdesc = "return the size of the read cache";
+    longdesc = "\
+Return the size in bytes of the read cache, or zero if it is
+disabled.  See L<nbd_set_read_cache(3)>.";
+    see_also = [Link "set_read_cache"];
+  };
+
+  "stats_read_cache_hits", {
+    default_call with
+    args = []; ret = RUInt64;
+    may_set_error = false;
+    shortdesc = "statistics of cache blocks used by reads";
+    longdesc = "\
+Return the number of times that a read on this handle needed a
+block of the read cache (see L<nbd_set_read_cache(3)>) which was
+already cached, or already being read from the server for another
+read.  Together with L<nbd_stats_read_cache_misses(3)> this gives
+the hit rate of the cache.";
+    see_also = [Link "stats_read_cache_misses"; Link "set_read_cache"];
+  };
+
+  "stats_read_cache_misses", {
+    default_call with
+    args = []; ret = RUInt64;
+    may_set_error = false;
+    shortdesc = "statistics of cache blocks read from the server";
+    longdesc = "\
+Return the number of blocks of the read cache (see
+L<nbd_set_read_cache(3)>) which had to be read from the server.";
+    see_also = [Link "stats_read_cache_hits"; Link "set_read_cache"];
+  };
+
+  "set_readahead", {
+    default_call with
+    args = [UInt64 "size"]; ret = RErr;
+    shortdesc = "read ahead of sequential readers";
+    longdesc = "\
+If C<size> is not zero, detect sequential reads made with
+L<nbd_pread(3)>, L<nbd_aio_pread(3)>, L<nbd_pread_structured(3)> or
+L<nbd_aio_pread_structured(3)>, and start fetching the data which
+follows before it is asked for, up to C<size> bytes ahead of the
+reader.  If C<size> is zero, do not read ahead.  The default is zero.
+C<size> must be between 4K and 64M.  Changing the setting forgets
+any sequential stream seen so far.
+
+A read is sequential if it starts where the previous read on this
+handle ended, or at offset 0.  The first sequential read opens a
+window a few times its own size.  When the reader gets into the last
+part of the window the next window is started, two or four times
+larger, up to the limit.  Any other read closes the window.  This is
+modelled on the on-demand read-ahead of the Linux kernel.
+
+If a read cache is enabled and can be used (see
+L<nbd_set_read_cache(3)>), the data is read into the cache, and the
+window is kept to at most half the size of the cache.  Otherwise if
+the server supports it (see L<nbd_can_cache(3)>), it is asked with
+C<NBD_CMD_CACHE> to prepare the data, which helps servers with slow
+underlying storage.  Otherwise nothing is done.
+
+Data read ahead which is thrown away before it is read, or which is
+not read because the stream ends, halves the limit on the window;
+data which is read raises it again.  See
+L<nbd_stats_readahead_useful_bytes(3)> and
+L<nbd_stats_readahead_wasted_bytes(3)>.
+
+Read-ahead commands are commands of their own.  While they are in
+flight they are counted by L<nbd_aio_in_flight(3)> and
+L<nbd_stats_in_flight_max(3)>, so a loop which polls until
+L<nbd_aio_in_flight(3)> reaches zero also waits for them.  Each one
+uses up a cookie, so the cookies returned to the caller are not
+consecutive.  They cannot be waited for or retired by the caller.";
+    see_also = [Link "get_readahead"; Link "set_read_cache";
+                Link "stats_readahead_useful_bytes"; Link "can_cache";
+                Link "aio_cache"; Link "aio_in_flight"];
+  };
+
+  "get_readahead", {
+    default_call with
+    args = []; ret = RUInt64;
+    may_set_error = false;
+    shortdesc = "return the read-ahead limit";
+    longdesc = "\
+Return the maximum read-ahead window in bytes, or 0 if read-ahead
+is disabled.  See L<nbd_set_readahead(3)>.";
+    see_also = [Link "set_readahead"];
+  };
+
+  "stats_readahead_useful_bytes", {
+    default_call with
+    args = []; ret = RUInt64;
+    may_set_error = false;
+    shortdesc = "statistics of data read ahead which was used";
+    longdesc = "\
+Return the number of bytes fetched by read-ahead (see
+L<nbd_set_readahead(3)>) which were later read by the caller.
+When reading ahead into the read cache this counts whole cache
+blocks.";
+    see_also = [Link "stats_readahead_wasted_bytes";
+                Link "set_readahead"];
+  };
+
+  "stats_readahead_wasted_bytes", {
+    default_call with
+    args = []; ret = RUInt64;
+    may_set_error = false;
+    shortdesc = "statistics of data read ahead which was not used";
+    longdesc = "\
+Return the number of bytes fetched by read-ahead (see
+L<nbd_set_readahead(3)>) which were thrown away before being read,
+because they were evicted from the read cache, overwritten, or
+because the sequential stream ended before reaching them.";
+    see_also = [Link "stats_readahead_useful_bytes";
+                Link "set_readahead"];
+  };
+
   "set_handle_name", {
     default_call with
     args = [ String "handle_name" ]; ret = RErr;
@@ -741,6 +1218,115 @@ Get the verify peer flag.";
     see_also = [Link "set_tls_verify_peer"];
   };
 
+  "set_tls_ktls", {
+    default_call with
+    args = [Bool "ktls"]; ret = RErr;
+    permitted_states = [ Created ];
+    shortdesc = "set whether to offload TLS to the kernel";
+    longdesc = "\
+Set this flag to ask GnuTLS to hand the TLS session over to the
+kernel (kTLS) once the handshake has finished, so that record
+encryption and decryption are done by the kernel and requests and
+replies are sent and received with ordinary socket calls.  This
+defaults to false.
+
+Offload only happens if libnbd was built against a GnuTLS that
+supports kTLS, the kernel has the C<tls> module loaded, the
+negotiated cipher is supported by the kernel in both directions,
+and kTLS is not disabled in the system GnuTLS configuration.  If
+any of these is not the case the connection silently continues to
+use GnuTLS in userspace.  Use L<nbd_get_tls_ktls_active(3)> after
+connecting to find out which happened.
+
+This function may be called regardless of whether TLS is
+supported, but will have no effect unless L<nbd_set_tls(3)>
+is also used to request or require TLS.";
+    see_also = [Link "get_tls_ktls"; Link "get_tls_ktls_active";
+                Link "set_tls"];
+  };
+
+  "get_tls_ktls", {
+    default_call with
+    args = []; ret = RBool;
+    may_set_error = false;
+    shortdesc = "get whether to offload TLS to the kernel";
+    longdesc = "\
+Return the flag set by L<nbd_set_tls_ktls(3)>.";
+    see_also = [Link "set_tls_ktls"; Link "get_tls_ktls_active"];
+  };
+
+  "get_tls_ktls_active", {
+    default_call with
+    args = []; ret = RBool;
+    permitted_states = [ Negotiating; Connected; Closed ];
+    shortdesc = "find out if the TLS session was offloaded to the kernel";
+    longdesc = "\
+After connecting you may call this to find out if the TLS
+session was handed over to the kernel, as requested by
+L<nbd_set_tls_ktls(3)>.  This returns false if TLS was not
+negotiated, or if offload was not requested or not possible.";
+    see_also = [Link "set_tls_ktls"; Link "get_tls_negotiated"];
+  };
+
+  "set_tls_cache", {
+    default_call with
+    args = [Bool "cache"]; ret = RErr;
+    permitted_states = [ Created ];
+    shortdesc = "share TLS credentials and sessions between handles";
+    longdesc = "\
+Set this flag to let the handle share TLS state with other handles
+in the same process which also set it.  This defaults to false.
+
+Credentials (the certificates directory set by
+L<nbd_set_tls_certificates(3)> or the default one, or the key looked
+up in L<nbd_set_tls_psk_file(3)>) are loaded the first time they
+are needed and then kept for the lifetime of the process, so later
+handles skip reading and parsing them.  Changes to the files after
+that are not noticed.
+
+Session tickets sent by a server are also remembered, so that the
+next handle connecting to the same server, with the same
+credentials, can resume the TLS session with an abbreviated
+handshake instead of a full one.  Servers are identified by the
+hostname and port passed to L<nbd_connect_tcp(3)> or in the URI, or
+by the socket address, so this has no effect when connecting to a
+subprocess.  The server may always refuse to resume, in which case
+a full handshake is done.  Use L<nbd_get_tls_session_resumed(3)>
+after connecting to find out which happened.
+
+This is intended for programs that open many connections to the
+same export, such as with multi-conn.
+
+This function may be called regardless of whether TLS is
+supported, but will have no effect unless L<nbd_set_tls(3)>
+is also used to request or require TLS.";
+    see_also = [Link "get_tls_cache"; Link "get_tls_session_resumed";
+                Link "set_tls"; Link "can_multi_conn"];
+  };
+
+  "get_tls_cache", {
+    default_call with
+    args = []; ret = RBool;
+    may_set_error = false;
+    shortdesc = "get whether TLS state is shared between handles";
+    longdesc = "\
+Return the flag set by L<nbd_set_tls_cache(3)>.";
+    see_also = [Link "set_tls_cache"];
+  };
+
+  "get_tls_session_resumed", {
+    default_call with
+    args = []; ret = RBool;
+    permitted_states = [ Negotiating; Connected; Closed ];
+    shortdesc = "find out if a cached TLS session was resumed";
+    longdesc = "\
+After connecting you may call this to find out if the TLS handshake
+resumed a session cached by an earlier handle, as enabled by
+L<nbd_set_tls_cache(3)>.  This returns false if TLS was not
+negotiated, or if a full handshake was needed.";
+    see_also = [Link "set_tls_cache"; Link "get_tls_negotiated"];
+  };
+
   "set_tls_username", {
     default_call with
     args = [String "username"]; ret = RErr;
@@ -797,6 +1383,80 @@ Get the current TLS PSK filename.";
   };
 *)
 
+  "set_request_extended_headers", {
+    default_call with
+    args = [Bool "request"]; ret = RErr;
+    permitted_states = [ Created ];
+    shortdesc = "control use of extended headers";
+    longdesc = "\
+By default, libnbd tries to negotiate extended headers with the
+server, as this protocol extension permits the use of 64-bit
+zero, trim, and block status actions.  However,
+for integration testing, it can be useful to clear this flag
+rather than find a way to alter the server to fail the negotiation
+request.  It is also useful to set this to false prior to using
+L<nbd_set_opt_mode(3)> if it is desired to control when to send
+L<nbd_opt_extended_headers(3)> during negotiation.
+
+Note that even when this is set to true, libnbd still requests
+structured replies (see L<nbd_set_request_structured_replies(3)>)
+if the server does not support extended headers.";
+    see_also = [Link "get_request_extended_headers";
+                Link "set_handshake_flags"; Link "set_strict_mode";
+                Link "opt_extended_headers";
+                Link "get_extended_headers_negotiated";
+                Link "block_status_64";
+                Link "set_request_structured_replies"];
+  };
+
+  "get_request_extended_headers", {
+    default_call with
+    args = []; ret = RBool;
+    may_set_error = false;
+    shortdesc = "see if extended headers are attempted";
+    longdesc = "\
+Return the state of the request extended headers flag on this
+handle.
+
+B<Note:> If you want to find out if extended headers were actually
+negotiated on a particular connection use
+L<nbd_get_extended_headers_negotiated(3)> instead.";
+    see_also = [Link "set_request_extended_headers";
+                Link "get_extended_headers_negotiated";
+                Link "get_request_structured_replies"];
+  };
+
+  "get_extended_headers_negotiated", {
+    default_call with
+    args = []; ret = RBool;
+    permitted_states = [ Negotiating; Connected; Closed ];
+    shortdesc = "see if extended headers are in use";
+    longdesc = "\
+After connecting you may call this to find out if the connection is
+using extended headers.  Note that this setting is sticky; this
+can return true even after a second L<nbd_opt_extended_headers(3)>
+returns false because the server detected a duplicate request.
+
+When extended headers are not in use, commands are limited to a
+32-bit length, even when the libnbd API uses a 64-bit parameter
+to express the length.  But even when extended headers are
+supported, the server may enforce other limits, visible through
+L<nbd_get_block_size(3)>.
+
+Note that when extended headers are negotiated, you should
+prefer the use of L<nbd_block_status_64(3)> instead of
+L<nbd_block_status(3)> if any of the meta contexts you requested
+via L<nbd_add_meta_context(3)> might return 64-bit status
+values; however, all of the well-known meta contexts covered
+by current C<LIBNBD_CONTEXT_*> constants only return 32-bit
+status.";
+    see_also = [Link "set_request_extended_headers";
+                Link "get_request_extended_headers";
+                Link "opt_extended_headers";
+                Link "get_structured_replies_negotiated";
+                Link "get_protocol"];
+  };
+
   "set_request_structured_replies", {
     default_call with
     args = [Bool "request"]; ret = RErr;
@@ -893,6 +1553,45 @@ Return the state of the automatic meta context request flag on this handle.";
     see_also = [Link "set_request_meta_context"];
   };
 
+  "set_pipeline_options", {
+    default_call with
+    args = [Bool "pipeline"]; ret = RErr;
+    permitted_states = [ Created ];
+    shortdesc = "control whether connect sends options without waiting";
+    longdesc = "\
+By default, each option that libnbd sends to the server while
+connecting waits for the server's reply before the next option is
+sent, costing a network round trip per option.  If this is set to
+true, the C<nbd_connect_*> calls (when L<nbd_set_opt_mode(3)> is
+false) instead send NBD_OPT_STRUCTURED_REPLY,
+NBD_OPT_SET_META_CONTEXT and NBD_OPT_GO together, and then process
+the replies in order, which can noticeably shorten connection setup
+on high latency links.
+
+The outcome is the same as without pipelining: if the server
+refuses structured replies, any meta contexts it agreed to are
+discarded and L<nbd_can_meta_context(3)> reports false; and if the
+server does not understand NBD_OPT_GO, libnbd falls back to
+NBD_OPT_EXPORT_NAME.  Options needed to decide what to send next,
+such as NBD_OPT_STARTTLS and NBD_OPT_EXTENDED_HEADERS, are still
+negotiated one at a time first.  Some poorly written servers may
+not cope with several options arriving at once, which is why this
+defaults to false.";
+    see_also = [Link "get_pipeline_options"; Link "set_opt_mode";
+                Link "set_request_structured_replies";
+                Link "set_request_meta_context"];
+  };
+
+  "get_pipeline_options", {
+    default_call with
+    args = []; ret = RBool;
+    may_set_error = false;
+    shortdesc = "see if connect sends options without waiting";
+    longdesc = "\
+Return the state of the option pipelining flag on this handle.";
+    see_also = [Link "set_pipeline_options"];
+  };
+
   "set_handshake_flags", {
     default_call with
     args = [ Flags ("flags", handshake_flags) ]; ret = RErr;
@@ -1002,6 +1701,188 @@ L<nbd_set_pread_initialize(3)>.";
                 Link "aio_pread_structured"];
   };
 
+  "set_command_cache_limit", {
+    default_call with
+    args = [ UInt "limit" ]; ret = RErr;
+    shortdesc = "control how many command objects libnbd keeps for reuse";
+    longdesc = "\
+Each asynchronous command issued by libnbd needs a small amount of
+bookkeeping memory while it is in flight.  Rather than returning this
+memory to the C library as soon as a command is retired, libnbd keeps
+it on a per-handle free list for reuse by later commands.  The free
+list grows to match the deepest queue of commands seen on this handle
+(see L<nbd_aio_in_flight(3)>), but never beyond C<limit> entries.
+
+Setting C<limit> to C<0> disables the cache, so that command memory
+is always freed immediately.  Lowering the limit releases any excess
+entries at once.  The default limit is 4096.";
+    see_also = [Link "get_command_cache_limit"; Link "aio_in_flight"];
+  };
+
+  "get_command_cache_limit", {
+    default_call with
+    args = []; ret = RUInt;
+    may_set_error = false;
+    shortdesc = "see how many command objects libnbd keeps for reuse";
+    longdesc = "\
+Return the maximum number of retired command objects that libnbd
+will keep for reuse, as set by L<nbd_set_command_cache_limit(3)>.";
+    see_also = [Link "set_command_cache_limit"];
+  };
+
+  "set_zerocopy_send", {
+    default_call with
+    args = [Bool "enable"]; ret = RErr;
+    permitted_states = [ Created ];
+    shortdesc = "send large write payloads without copying them";
+    longdesc = "\
+If C<enable> is true, then once the handshake with the server has
+finished, libnbd enables C<SO_ZEROCOPY> on the socket and sends the
+payload of large write commands (currently those of 64K or more)
+with C<MSG_ZEROCOPY>, so that the kernel transmits directly from the
+caller's buffer instead of copying it first.  See the Linux kernel
+documentation for F<msg_zerocopy.rst>.
+
+Since the kernel keeps using the buffer after the data is sent, a
+write command sent this way does not complete (its completion
+callback is not called, and L<nbd_aio_command_completed(3)> keeps
+returning 0) until the kernel has released the buffer as well as the
+server having replied.  Callers therefore keep the usual guarantee
+that the buffer may be reused as soon as the command completes.
+
+The exception is when the connection fails or is shut down while
+such writes are outstanding.  The socket is closed at that point, and
+with it the error queue, so libnbd cannot tell when the kernel has
+finished with the buffers.  The commands are completed anyway as the
+handle moves to the dead or closed state, those without a reply from
+the server being aborted with an error.  The kernel may still read
+the buffer of an aborted command for a short time afterwards, while
+it sends or discards the data left in the socket.  The kernel holds
+its own reference to the pages, so freeing the buffer is safe, but
+anything written to it in that window may reach the server.
+
+Notifications from the kernel arrive on the socket error queue,
+which L<nbd_poll(3)> handles; applications with their own main loop
+should call L<nbd_aio_notify_read(3)> when the socket reports an
+error condition (C<POLLERR>) as well as when it is readable.
+
+Zero-copy sends only work over TCP, and are not used for
+connections which negotiated TLS or which use io_uring (see
+L<nbd_set_uring(3)>).  Otherwise, and on failure, libnbd silently
+copies as usual.  Zero-copy sends have a fixed cost per call, and
+usually only pay off for large writes on fast networks.  The
+default is false.";
+    see_also = [Link "get_zerocopy_send"; Link "aio_pwrite";
+                Link "aio_pwritev"];
+  };
+
+  "get_zerocopy_send", {
+    default_call with
+    args = []; ret = RBool;
+    may_set_error = false;
+    shortdesc = "see if zero-copy sends were requested";
+    longdesc = "\
+Return the setting made by L<nbd_set_zerocopy_send(3)>.";
+    see_also = [Link "set_zerocopy_send"];
+  };
+
+  "set_uring", {
+    default_call with
+    args = [Bool "enable"]; ret = RErr;
+    permitted_states = [ Created ];
+    shortdesc = "use io_uring for socket I/O";
+    longdesc = "\
+If C<enable> is true, then once the handshake with the server has
+finished, libnbd performs socket I/O through a Linux L<io_uring(7)>
+ring instead of calling L<send(2)> and L<recv(2)> directly.
+Outgoing requests are copied into a staging buffer, and a receive
+is always kept posted, so that L<nbd_poll(3)> can submit everything
+queued and wait for replies using a single system call.
+
+The io_uring transport is not used if the connection negotiated
+TLS, or if the kernel does not support io_uring.  In that case
+libnbd carries on with the normal transport; use
+L<nbd_get_uring_active(3)> to find out which is in use.
+
+While io_uring is in use, L<nbd_aio_get_fd(3)> returns an
+L<eventfd(2)> which becomes readable whenever some I/O has
+completed, and L<nbd_aio_get_direction(3)> only ever returns
+C<LIBNBD_AIO_DIRECTION_READ>.  Applications with their own main
+loop should wait for that file descriptor to become readable and
+then call L<nbd_aio_notify_read(3)>, which also submits any I/O
+that libnbd has queued.
+
+This call fails with C<ENOTSUP> if libnbd was compiled without
+liburing (see L<nbd_supports_uring(3)>).  The default is false.";
+    see_also = [Link "get_uring"; Link "get_uring_active";
+                Link "supports_uring"; Link "poll"; Link "aio_get_fd"];
+  };
+
+  "get_uring", {
+    default_call with
+    args = []; ret = RBool;
+    may_set_error = false;
+    shortdesc = "see if io_uring was requested";
+    longdesc = "\
+Return the setting made by L<nbd_set_uring(3)>.";
+    see_also = [Link "set_uring"; Link "get_uring_active"];
+  };
+
+  "get_uring_active", {
+    default_call with
+    args = []; ret = RBool;
+    permitted_states = [ Connected; Closed ];
+    shortdesc = "see if the connection uses io_uring";
+    longdesc = "\
+After connecting, return true if socket I/O for this connection is
+done through io_uring, as requested by L<nbd_set_uring(3)>.";
+    see_also = [Link "set_uring"; Link "get_uring"];
+  };
+
+  "set_background_thread", {
+    default_call with
+    args = [Bool "enable"]; ret = RErr;
+    permitted_states = [ Connected ];
+    shortdesc = "drive the connection from a thread owned by libnbd";
+    longdesc = "\
+If C<enable> is true, libnbd starts a thread which calls
+L<nbd_poll(3)> on this handle in a loop, so that commands issued with
+the C<nbd_aio_*> calls from any thread are sent and their replies
+processed without the application running a main loop.  Completion
+callbacks are called from the background thread.  Commands can also
+be retired with L<nbd_aio_command_completed(3)>, possibly after
+waiting for L<nbd_aio_get_completion_fd(3)> to become readable.
+
+While the background thread is running, L<nbd_poll(3)> called from
+other threads, and the synchronous calls such as L<nbd_pread(3)>,
+just wait for the background thread to make progress, so several
+threads can wait for their own synchronous commands on one handle at
+the same time.  L<nbd_poll2(3)> cannot be used, and the handle must
+not be driven with L<nbd_aio_notify_read(3)> or
+L<nbd_aio_notify_write(3)>.
+
+The thread exits by itself once the connection is closed or dies.
+If C<enable> is false, libnbd stops the thread and waits for it to
+exit.  L<nbd_close(3)> also stops it.  A completion callback must not
+call this function.
+
+This cannot be combined with io_uring (see L<nbd_set_uring(3)>).
+The default is false.";
+    see_also = [Link "get_background_thread"; Link "poll";
+                Link "aio_get_completion_fd"; Link "set_uring"];
+  };
+
+  "get_background_thread", {
+    default_call with
+    args = []; ret = RBool;
+    shortdesc = "see if the background thread is running";
+    longdesc = "\
+Return true if the thread started by L<nbd_set_background_thread(3)>
+is running.  This becomes false again once the connection has been
+closed or has died.";
+    see_also = [Link "set_background_thread"];
+  };
+
   "set_strict_mode", {
     default_call with
     args = [ Flags ("flags", strict_flags) ]; ret = RErr;
@@ -1117,10 +1998,11 @@ proceeding all the way to the ready state, when communicating with a
 newstyle server.  This setting has no effect when connecting to an
 oldstyle server.
 
-Note that libnbd defaults to attempting C<NBD_OPT_STARTTLS> and
-C<NBD_OPT_STRUCTURED_REPLY> before letting you control remaining
-negotiation steps; if you need control over these steps as well,
-first set L<nbd_set_tls(3)> to C<LIBNBD_TLS_DISABLE> and
+Note that libnbd defaults to attempting C<NBD_OPT_STARTTLS>,
+C<NBD_OPT_EXTENDED_HEADERS>, and C<NBD_OPT_STRUCTURED_REPLY> before
+letting you control remaining negotiation steps; if you need control
+over these steps as well, first set L<nbd_set_tls(3)> to
+C<LIBNBD_TLS_DISABLE>, and L<nbd_set_request_extended_headers(3)> and
 L<nbd_set_request_structured_replies(3)> to false before starting
 the connection attempt.
 
@@ -1230,6 +2112,34 @@ established, as reported by L<nbd_get_tls_negotiated(3)>.";
                 Link "supports_tls"]
   };
 
+  "opt_extended_headers", {
+    default_call with
+    args = []; ret = RBool;
+    permitted_states = [ Negotiating ];
+    shortdesc = "request the server to enable extended headers";
+    longdesc = "\
+Request that the server use extended headers, by sending
+C<NBD_OPT_EXTENDED_HEADERS>.  This can only be used if
+L<nbd_set_opt_mode(3)> enabled option mode; furthermore, libnbd
+defaults to automatically requesting this unless you use
+L<nbd_set_request_extended_headers(3)> prior to connecting.
+This function is mainly useful for integration testing of corner
+cases in server handling.
+
+This function returns true if the server replies with success,
+false if the server replies with an error, and fails only if
+the server does not reply (such as for a loss of connection).
+Note that some servers fail a second request as redundant;
+libnbd assumes that once one request has succeeded, then
+extended headers are supported (as visible by
+L<nbd_get_extended_headers_negotiated(3)>) regardless if
+later calls to this function return false.  If this function
+returns true, the use of structured replies is implied.";
+    see_also = [Link "set_opt_mode"; Link "aio_opt_extended_headers";
+                Link "opt_go"; Link "set_request_extended_headers";
+                Link "opt_structured_reply"]
+  };
+
   "opt_structured_reply", {
     default_call with
     args = []; ret = RBool;
@@ -1942,6 +2852,12 @@ Connect (synchronously) to the NBD server listening on
 C<hostname:port>.  The C<port> may be a port name such
 as C<\"nbd\">, or it may be a port number as a string
 such as C<\"10809\">.
+
+If C<hostname> resolves to several addresses, connections are
+attempted as described in RFC 8305 (\"Happy Eyeballs\"): IPv6 and
+IPv4 addresses are tried alternately, a new attempt is started every
+250 milliseconds without abandoning earlier ones, and the first
+connection to succeed is used.
 " ^ blocking_connect_call_description;
     see_also = [Link "aio_connect_tcp"; Link "set_opt_mode"];
   };
@@ -2661,7 +3577,9 @@ may extend beyond the requested range. If multiple contexts
 are supported, the number of blocks and cumulative length
 of those blocks need not be identical between contexts.
 
-Note that not all servers can support a C<count> of 4GiB or larger.
+Note that not all servers can support a C<count> of 4GiB or larger;
+L<nbd_get_extended_headers_negotiated(3)> indicates which servers
+will parse a request larger than 32 bits.
 The NBD protocol does not yet have a way for a client to learn if
 the server will enforce an even smaller maximum block status size,
 although a future extension may add a constraint visible in
@@ -2694,6 +3612,13 @@ On entry to the callback, the C<error> parameter contains the errno
 value of any previously detected error, but even if an earlier error
 was detected, the current C<metacontext> and C<entries> are valid.
 
+If the server negotiated extended headers, it may report extents
+longer than 32 bits.  This function truncates such a reply at the
+first extent that does not fit, clamping its length to a large
+aligned value, and fails the command with C<EOVERFLOW> if any
+status value does not fit in 32 bits.  Use
+L<nbd_block_status_64(3)> to see the full 64-bit information.
+
 It is possible for the extent function to be called
 more times than you expect (if the server is buggy),
 so always check the C<metacontext> field to ensure you
@@ -2710,7 +3635,49 @@ does not exceed C<count> bytes; however, libnbd does not
 validate that the server obeyed the flag."
 ^ strict_call_description;
     see_also = [Link "add_meta_context"; Link "can_meta_context";
-                Link "aio_block_status"; Link "set_strict_mode"];
+                Link "aio_block_status"; Link "set_strict_mode";
+                Link "block_status_64"];
+  };
+
+  "block_status_64", {
+    default_call with
+    args = [ UInt64 "count"; UInt64 "offset"; Closure extent64_closure ];
+    optargs = [ OFlags ("flags", cmd_flags, Some ["REQ_ONE"]) ];
+    ret = RErr;
+    permitted_states = [ Connected ];
+    shortdesc = "send block status command to the NBD server, with 64-bit callback";
+    longdesc = "\
+Issue the block status command to the NBD server.  If
+supported by the server, this causes metadata context
+information about blocks beginning from the specified
+offset to be returned.  This function behaves like
+L<nbd_block_status(3)>, except that the C<extent64> callback
+receives an array of C<nbd_extent> structures rather than pairs
+of 32-bit integers, so that extents longer than 4GiB and 64-bit
+status values reported by a server that negotiated extended
+headers are passed through unmodified.
+
+The C<extent64> function is called once per type of metadata
+available, with the C<user_data> passed to this function.  The
+C<metacontext> parameter is a string such as
+C<\"base:allocation\">.  The C<entries> array has C<nr_entries>
+elements, each with a C<length> (in bytes) of the block and a
+C<flags> field which is specific to the metadata context.  The
+NBD protocol document in the section about
+C<NBD_REPLY_TYPE_BLOCK_STATUS_EXT> describes the meaning of this
+array; for contexts known to libnbd, B<E<lt>libnbd.hE<gt>>
+contains constants beginning with C<LIBNBD_STATE_> that may help
+decipher the values.  The C<error> parameter and the C<flags>
+parameter behave as documented in L<nbd_block_status(3)>.
+
+This function works whether or not extended headers were
+negotiated; without them, all lengths and status values are
+guaranteed to fit in 32 bits."
+^ strict_call_description;
+    see_also = [Link "block_status"; Link "aio_block_status_64";
+                Link "add_meta_context"; Link "can_meta_context";
+                Link "get_extended_headers_negotiated";
+                Link "set_block_status_cache"; Link "set_strict_mode"];
   };
 
   "poll", {
@@ -2727,6 +3694,11 @@ that eventual action is actually expected - for example, if
 the connection is established but there are no commands in
 flight, using an infinite timeout will permanently block).
 
+While it is blocked this function does not hold the handle lock,
+so other threads may issue commands on the same handle, for example
+with L<nbd_aio_pread(3)>.  The blocked call wakes up to send them
+and returns C<1>.
+
 This function is mainly useful as an example of how you might
 integrate libnbd with your own main loop, rather than being
 intended as something you would use.";
@@ -2806,6 +3778,11 @@ L<nbd_connect_vsock(3)>.
     longdesc = "\
 Begin connecting to the NBD server listening on C<hostname:port>.
 Parameters behave as documented in L<nbd_connect_tcp(3)>.
+
+Looking up C<hostname> and connecting happen in a short-lived
+helper thread, so this call and the state machine never block on
+DNS.  Until they complete, L<nbd_aio_get_fd(3)> returns a file
+descriptor which becomes readable when there is progress to make.
 " ^ async_connect_call_description;
     see_also = [ Link "connect_tcp"; Link "set_opt_mode" ];
   };
@@ -2913,6 +3890,30 @@ callback.";
     see_also = [Link "set_opt_mode"; Link "opt_starttls"];
   };
 
+  "aio_opt_extended_headers", {
+    default_call with
+    args = [];
+    optargs = [ OClosure completion_closure ];
+    ret = RErr;
+    permitted_states = [ Negotiating ];
+    shortdesc = "request the server to enable extended headers";
+    longdesc = "\
+Request that the server use extended headers, by sending
+C<NBD_OPT_EXTENDED_HEADERS>.  This behaves like the synchronous
+counterpart L<nbd_opt_extended_headers(3)>, except that it does
+not wait for the server's response.
+
+To determine when the request completes, wait for
+L<nbd_aio_is_connecting(3)> to return false.  Or supply the optional
+C<completion_callback> which will be invoked as described in
+L<libnbd(3)/Completion callbacks>, except that it is automatically
+retired regardless of return value.  Note that detecting whether the
+server returns an error (as is done by the return value of the
+synchronous counterpart) is only possible with a completion
+callback.";
+    see_also = [Link "set_opt_mode"; Link "opt_extended_headers"];
+  };
+
   "aio_opt_structured_reply", {
     default_call with
     args = [];
@@ -3135,6 +4136,39 @@ Other parameters behave as documented in L<nbd_pread(3)>."
                 Link "set_strict_mode"; Link "set_pread_initialize"];
   };
 
+  "aio_preadv", {
+    default_call with
+    args = [ IOVecPersistOut ("iov", "iovcnt"); UInt64 "offset" ];
+    optargs = [ OClosure completion_closure;
+                OFlags ("flags", cmd_flags, Some []) ];
+    ret = RCookie;
+    permitted_states = [ Connected ];
+    shortdesc = "read from the NBD server into multiple buffers";
+    longdesc = "\
+Issue a read command to the NBD server, scattering the data into
+the C<iovcnt> buffers described by C<iov>, in order.  The total
+length of the read is the sum of the lengths of the buffers.  This
+is the vectored equivalent of L<nbd_aio_pread(3)>: data sent by the
+server is received directly into the buffers, without an
+intermediate copy.
+
+The C<iov> array itself is copied by libnbd and need not outlive
+the call, but you must ensure that each buffer it points to is
+valid until the command has completed.  The treatment of the
+buffers on failure and the effect of L<nbd_set_pread_initialize(3)>
+are the same as for L<nbd_aio_pread(3)>.
+
+To check if the command completed, call L<nbd_aio_command_completed(3)>.
+Or supply the optional C<completion_callback> which will be invoked
+as described in L<libnbd(3)/Completion callbacks>.
+
+Other parameters behave as documented in L<nbd_pread(3)>."
+^ strict_call_description;
+    see_also = [SectionLink "Issuing asynchronous commands";
+                Link "aio_pread"; Link "aio_pwritev";
+                Link "set_strict_mode"; Link "set_pread_initialize"];
+  };
+
   "aio_pread_structured", {
     default_call with
     args = [ BytesPersistOut ("buf", "count"); UInt64 "offset";
@@ -3190,6 +4224,38 @@ completed.  Other parameters behave as documented in L<nbd_pwrite(3)>."
                 Link "is_read_only"; Link "pwrite"; Link "set_strict_mode"];
   };
 
+  "aio_pwritev", {
+    default_call with
+    args = [ IOVecPersistIn ("iov", "iovcnt"); UInt64 "offset" ];
+    optargs = [ OClosure completion_closure;
+                OFlags ("flags", cmd_flags, Some ["FUA"]) ];
+    ret = RCookie;
+    permitted_states = [ Connected ];
+    shortdesc = "write to the NBD server from multiple buffers";
+    longdesc = "\
+Issue a write command to the NBD server, gathering the data from
+the C<iovcnt> buffers described by C<iov>, in order.  The total
+length of the write is the sum of the lengths of the buffers.  This
+is the vectored equivalent of L<nbd_aio_pwrite(3)>: where the
+transport allows it, the request header and all of the buffers are
+handed to the kernel in a single L<sendmsg(2)> call, without
+first being copied into one contiguous buffer.
+
+The C<iov> array itself is copied by libnbd and need not outlive
+the call, but you must ensure that each buffer it points to is
+valid until the command has completed.
+
+To check if the command completed, call L<nbd_aio_command_completed(3)>.
+Or supply the optional C<completion_callback> which will be invoked
+as described in L<libnbd(3)/Completion callbacks>.
+
+Other parameters behave as documented in L<nbd_pwrite(3)>."
+^ strict_call_description;
+    see_also = [SectionLink "Issuing asynchronous commands";
+                Link "aio_pwrite"; Link "aio_preadv";
+                Link "is_read_only"; Link "set_strict_mode"];
+  };
+
   "aio_disconnect", {
     default_call with
     args = []; optargs = [ OFlags ("flags", cmd_flags, Some []) ]; ret = RErr;
@@ -3319,7 +4385,29 @@ Other parameters behave as documented in L<nbd_block_status(3)>."
 ^ strict_call_description;
     see_also = [SectionLink "Issuing asynchronous commands";
                 Link "can_meta_context"; Link "block_status";
-                Link "set_strict_mode"];
+                Link "set_strict_mode"; Link "aio_block_status_64"];
+  };
+
+  "aio_block_status_64", {
+    default_call with
+    args = [ UInt64 "count"; UInt64 "offset"; Closure extent64_closure ];
+    optargs = [ OClosure completion_closure;
+                OFlags ("flags", cmd_flags, Some ["REQ_ONE"]) ];
+    ret = RCookie;
+    permitted_states = [ Connected ];
+    shortdesc = "send block status command to the NBD server, with 64-bit callback";
+    longdesc = "\
+Send the block status command to the NBD server.
+
+To check if the command completed, call L<nbd_aio_command_completed(3)>.
+Or supply the optional C<completion_callback> which will be invoked
+as described in L<libnbd(3)/Completion callbacks>.
+
+Other parameters behave as documented in L<nbd_block_status_64(3)>."
+^ strict_call_description;
+    see_also = [SectionLink "Issuing asynchronous commands";
+                Link "can_meta_context"; Link "block_status_64";
+                Link "aio_block_status"; Link "set_strict_mode"];
   };
 
   "aio_get_fd", {
@@ -3331,8 +4419,11 @@ Return the underlying file descriptor associated with this
 connection.  You can use this to check if the file descriptor
 is ready for reading or writing and call L<nbd_aio_notify_read(3)>
 or L<nbd_aio_notify_write(3)>.  See also L<nbd_aio_get_direction(3)>.
-Do not do anything else with the file descriptor.";
-    see_also = [Link "aio_get_direction"];
+Do not do anything else with the file descriptor.
+
+If the connection uses io_uring (see L<nbd_set_uring(3)>), this
+returns an L<eventfd(2)> rather than the socket.";
+    see_also = [Link "aio_get_direction"; Link "set_uring"];
   };
 
   "aio_get_direction", {
@@ -3543,6 +4634,33 @@ those commands as failed with a status of C<ENOTCONN>.";
     see_also = [Link "aio_disconnect"];
   };
 
+  "aio_get_completion_fd", {
+    default_call with
+    args = []; ret = RFd;
+    shortdesc = "return a file descriptor which is readable when commands complete";
+    longdesc = "\
+Return a file descriptor which is readable while at least one
+completed command is waiting to be retired, that is, while
+L<nbd_aio_peek_command_completed(3)> would return a cookie.  It stops
+being readable once all such commands have been retired with
+L<nbd_aio_command_completed(3)> (or, from C, in batches with
+L<nbd_aio_reap_completed(3)>).  Commands whose completion callback
+retires them automatically never make it readable.
+
+This lets a thread which only consumes completions sleep in
+L<poll(2)> on this file descriptor, while another thread drives the
+connection with L<nbd_poll(3)> or L<nbd_aio_get_fd(3)>.  Do not read
+from or write to the file descriptor, which is owned by the handle
+and closed by L<nbd_close(3)>.  Where available it is an
+L<eventfd(2)>.
+
+The file descriptor is created on the first call, and the same one
+is returned by later calls.";
+    see_also = [Link "aio_peek_command_completed";
+                Link "aio_command_completed"; Link "aio_reap_completed";
+                Link "aio_get_fd"];
+  };
+
   "connection_state", {
     default_call with
     args = []; ret = RStaticString;
@@ -3664,6 +4782,16 @@ to support NBD URIs, or false if not.";
                 Link "get_uri"];
   };
 
+  "supports_uring", {
+    default_call with
+    args = []; ret = RBool; is_locked = false; may_set_error = false;
+    shortdesc = "true if libnbd was compiled with support for io_uring";
+    longdesc = "\
+Returns true if libnbd was compiled with liburing which is required
+to support the io_uring transport, or false if not.";
+    see_also = [Link "set_uring"];
+  };
+
   "get_uri", {
     default_call with
     args = []; ret = RString;
@@ -3844,6 +4972,56 @@ let first_version = [
   "aio_opt_structured_reply", (1, 16);
   "opt_starttls", (1, 16);
   "aio_opt_starttls", (1, 16);
+  "set_request_extended_headers", (1, 16);
+  "get_request_extended_headers", (1, 16);
+  "get_extended_headers_negotiated", (1, 16);
+  "opt_extended_headers", (1, 16);
+  "aio_opt_extended_headers", (1, 16);
+  "block_status_64", (1, 16);
+  "aio_block_status_64", (1, 16);
+  "set_command_cache_limit", (1, 16);
+  "get_command_cache_limit", (1, 16);
+  "aio_preadv", (1, 16);
+  "aio_pwritev", (1, 16);
+  "stats_send_calls", (1, 16);
+  "stats_recv_calls", (1, 16);
+  "set_uring", (1, 16);
+  "get_uring", (1, 16);
+  "get_uring_active", (1, 16);
+  "supports_uring", (1, 16);
+  "set_zerocopy_send", (1, 16);
+  "get_zerocopy_send", (1, 16);
+  "set_tls_ktls", (1, 16);
+  "get_tls_ktls", (1, 16);
+  "get_tls_ktls_active", (1, 16);
+  "set_tls_cache", (1, 16);
+  "get_tls_cache", (1, 16);
+  "get_tls_session_resumed", (1, 16);
+  "set_pipeline_options", (1, 16);
+  "get_pipeline_options", (1, 16);
+  "aio_get_completion_fd", (1, 16);
+  "set_background_thread", (1, 16);
+  "get_background_thread", (1, 16);
+  "stats_commands", (1, 16);
+  "stats_latency_ns", (1, 16);
+  "stats_latency_bucket", (1, 16);
+  "stats_queue_ns", (1, 16);
+  "stats_in_flight_max", (1, 16);
+  "set_flight_recorder", (1, 16);
+  "get_flight_recorder", (1, 16);
+  "dump_flight_recorder", (1, 16);
+  "set_block_status_cache", (1, 16);
+  "get_block_status_cache", (1, 16);
+  "stats_block_status_cache_hits", (1, 16);
+  "stats_block_status_cache_misses", (1, 16);
+  "set_read_cache", (1, 16);
+  "get_read_cache", (1, 16);
+  "stats_read_cache_hits", (1, 16);
+  "stats_read_cache_misses", (1, 16);
+  "set_readahead", (1, 16);
+  "get_readahead", (1, 16);
+  "stats_readahead_useful_bytes", (1, 16);
+  "stats_readahead_wasted_bytes", (1, 16);
 
   (* These calls are proposed for a future version of libnbd, but
    * have not been added to any released version so far.
@@ -3861,6 +5039,8 @@ let constants = [
   "READ_DATA",           1;
   "READ_HOLE",           2;
   "READ_ERROR",          3;
+
+  "STATS_LATENCY_BUCKETS", 32;
 ]
 
 let metadata_namespaces = [
@@ -3881,7 +5061,8 @@ let verify_link =
   let pages = List.map fst handle_calls in
   function
   | Link "create" | Link "close"
-  | Link "get_error" | Link "get_errno" -> ()
+  | Link "get_error" | Link "get_errno"
+  | Link "aio_reap_completed" -> ()
   | Link page ->
      if not (List.mem page pages) then
        failwithf "verify_link: page nbd_%s does not exist" page
@@ -3958,6 +5139,7 @@ let () =
                 (function
                  | Closure _ | Enum _ | Flags _
                  | BytesIn _ | BytesOut _ | BytesPersistIn _ | BytesPersistOut _
+                 | IOVecPersistIn _ | IOVecPersistOut _
                  | SockAddrAndLen _ | Path _ | String _ | StringList _-> true
                  | _ -> false) args ->
        failwithf "%s: if args contains any non-null pointer parameter, may_set_error must be false" name
@@ -4009,13 +5191,14 @@ let () =
 
   (* Because of the way we use completion free callbacks to
    * free persistent buffers in non-C languages, any function
-   * with a BytesPersistIn/Out parameter must have only one.
-   * And it must have an OClosure completion optarg.
+   * with a BytesPersistIn/Out or IOVecPersistIn/Out parameter must
+   * have only one.  And it must have an OClosure completion optarg.
    *)
   List.iter (
     fun (name, { args; optargs }) ->
       let is_persistent_buffer_arg = function
-        | BytesPersistIn _ | BytesPersistOut _ -> true
+        | BytesPersistIn _ | BytesPersistOut _
+        | IOVecPersistIn _ | IOVecPersistOut _ -> true
         | _ -> false
       and is_oclosure_completion = function
         | OClosure { cbname = "completion" } -> true
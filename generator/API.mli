@@ -52,10 +52,15 @@ and arg =
 | BytesPersistOut of string * string
 | Closure of closure       (** function pointer + void *opaque *)
 | Enum of string * enum    (** enum/union type, int in C *)
+| Extent64 of string       (** extent descriptor, nbd_extent in C *)
 | Fd of string             (** file descriptor *)
 | Flags of string * flags  (** flags, uint32_t in C *)
 | Int of string            (** small int *)
 | Int64 of string          (** 64 bit signed int *)
+| IOVecPersistIn of string * string (** struct iovec array + count,
+                                        buffers persist, read by libnbd *)
+| IOVecPersistOut of string * string (** struct iovec array + count,
+                                         buffers persist, written by libnbd *)
 | Path of string           (** filename or path *)
 | SizeT of string          (** like size_t, for counting array elements *)
 | SockAddrAndLen of string * string (** struct sockaddr * + socklen_t *)
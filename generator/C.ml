@@ -24,6 +24,65 @@ open Utils
 
 type closure_style = Direct | AddressOf | Pointer
 
+(* Multi-conn connection groups (lib/group.c), replica sets
+ * (lib/replica.c), striped sets (lib/stripe.c), reactors
+ * (lib/reactor.c) and batched retirement of commands (lib/aio.c) are
+ * only available from C, so like nbd_create they are not part of
+ * handle_calls.
+ *)
+let group_calls = [
+  "nbd_aio_reap_completed";
+  "nbd_group_create";
+  "nbd_group_close";
+  "nbd_group_get_size";
+  "nbd_group_get_handle";
+  "nbd_group_aio_pread";
+  "nbd_group_aio_pwrite";
+  "nbd_group_aio_flush";
+  "nbd_group_aio_trim";
+  "nbd_group_aio_zero";
+  "nbd_group_aio_cache";
+  "nbd_group_aio_command_completed";
+  "nbd_group_aio_peek_command_completed";
+  "nbd_group_aio_in_flight";
+  "nbd_group_poll";
+  "nbd_group_shutdown";
+  "nbd_replica_create";
+  "nbd_replica_close";
+  "nbd_replica_get_size";
+  "nbd_replica_get_handle";
+  "nbd_replica_set_hedge_percentile";
+  "nbd_replica_get_hedge_percentile";
+  "nbd_replica_aio_pread";
+  "nbd_replica_aio_command_completed";
+  "nbd_replica_aio_peek_command_completed";
+  "nbd_replica_aio_in_flight";
+  "nbd_replica_poll";
+  "nbd_replica_shutdown";
+  "nbd_stripe_create";
+  "nbd_stripe_close";
+  "nbd_stripe_get_size";
+  "nbd_stripe_get_handle";
+  "nbd_stripe_get_stripe_size";
+  "nbd_stripe_get_export_size";
+  "nbd_stripe_aio_pread";
+  "nbd_stripe_aio_pwrite";
+  "nbd_stripe_aio_flush";
+  "nbd_stripe_aio_trim";
+  "nbd_stripe_aio_zero";
+  "nbd_stripe_aio_block_status";
+  "nbd_stripe_aio_command_completed";
+  "nbd_stripe_aio_peek_command_completed";
+  "nbd_stripe_aio_in_flight";
+  "nbd_stripe_poll";
+  "nbd_stripe_shutdown";
+  "nbd_reactor_create";
+  "nbd_reactor_close";
+  "nbd_reactor_add";
+  "nbd_reactor_remove";
+  "nbd_reactor_run";
+]
+
 let generate_lib_libnbd_syms () =
   generate_header HashStyle;
 
@@ -46,6 +105,8 @@ let generate_lib_libnbd_syms () =
         pr "    nbd_get_errno;\n";
         pr "    nbd_get_error;\n"
       );
+      if (major, minor) = (1, 16) then
+        List.iter (pr "    %s;\n") group_calls;
       List.iter (fun (name, _) -> pr "    nbd_%s;\n" name) calls;
       (match !prev with
        | None ->
@@ -93,10 +154,13 @@ let name_of_arg =
   | Closure { cbname } ->
      [ sprintf "%s_callback" cbname; sprintf "%s_user_data" cbname ]
   | Enum (n, _) -> [n]
+  | Extent64 _ -> assert false (* only used in extent64_closure *)
   | Fd n -> [n]
   | Flags (n, _) -> [n]
   | Int n -> [n]
   | Int64 n -> [n]
+  | IOVecPersistIn (n, len) -> [n; len]
+  | IOVecPersistOut (n, len) -> [n; len]
   | Path n -> [n]
   | SizeT n -> [n]
   | SockAddrAndLen (n, len) -> [n; len]
@@ -121,6 +185,8 @@ let arg_attr_nonnull =
   (* BytesIn/Out are passed using a non-null pointer, and size_t *)
   | BytesIn _ | BytesOut _
   | BytesPersistIn _ | BytesPersistOut _ -> [ true; false ]
+  (* so is an array of struct iovec, with its count *)
+  | IOVecPersistIn _ | IOVecPersistOut _ -> [ true; false ]
   (* sockaddr is also non-null pointer, and length *)
   | SockAddrAndLen (n, len) -> [ true; false ]
   (* strings should be marked as non-null *)
@@ -131,6 +197,7 @@ let arg_attr_nonnull =
   | Bool _ | Closure _ | Enum _ | Fd _ | Flags _
   | Int _ | Int64 _ | SizeT _
   | UInt _ | UInt32 _ | UInt64 _ | UIntPtr _ -> [ false ]
+  | Extent64 _ -> assert false (* only used in extent64_closure *)
 
 let optarg_attr_nonnull (OClosure _ | OFlags _) = [ false ]
 
@@ -182,6 +249,7 @@ and print_arg_list' ?(handle = false) ?(types = true) ?(closure_style = Direct)
       | Enum (n, _) ->
          if types then pr "int ";
          pr "%s" n
+      | Extent64 _ -> assert false (* only used in extent64_closure *)
       | Flags (n, _) ->
          if types then pr "uint32_t ";
          pr "%s" n
@@ -191,6 +259,12 @@ and print_arg_list' ?(handle = false) ?(types = true) ?(closure_style = Direct)
       | Int64 n ->
          if types then pr "int64_t ";
          pr "%s" n
+      | IOVecPersistIn (n, len)
+      | IOVecPersistOut (n, len) ->
+         if types then pr "const struct iovec *";
+         pr "%s, " n;
+         if types then pr "size_t ";
+         pr "%s" len
       | SizeT n ->
          if types then pr "size_t ";
          pr "%s" n
@@ -292,6 +366,11 @@ and print_cbarg_list' ?(types = true) cbargs =
          pr "%s, " n;
          if types then pr "size_t ";
          pr "%s" len
+      | CBArrayAndLen (Extent64 n, len) ->
+         if types then pr "nbd_extent *";
+         pr "%s, " n;
+         if types then pr "size_t ";
+         pr "%s" len
       | CBArrayAndLen _ -> assert false
       | CBBytesIn (n, len) ->
          if types then pr "const void *";
@@ -321,6 +400,13 @@ and print_cbarg_list' ?(types = true) cbargs =
 
 (* Callback structs/typedefs in <libnbd.h> *)
 let print_closure_structs () =
+  pr "/* Extent descriptor passed to the extent64 callback. */\n";
+  pr "typedef struct {\n";
+  pr "  uint64_t length;\n";
+  pr "  uint64_t flags;\n";
+  pr "} nbd_extent;\n";
+  pr "#define LIBNBD_HAVE_NBD_EXTENT 1\n";
+  pr "\n";
   pr "/* These are used for callback parameters.  They are passed\n";
   pr " * by value not by reference.  See CALLBACKS in libnbd(3).\n";
   pr " */\n";
@@ -379,6 +465,189 @@ let print_ns ns ctxts =
   ) ctxts;
   pr "\n"
 
+let print_group_decls () =
+  pr "struct nbd_group;\n";
+  pr "\n";
+  pr "typedef int (*nbd_group_connect_callback) (void *user_data,\n";
+  pr "                                           struct nbd_handle *h,\n";
+  pr "                                           unsigned i);\n";
+  pr "\n";
+  pr "extern void nbd_group_close (struct nbd_group *g); /* g can be NULL */\n";
+  pr "extern struct nbd_group *nbd_group_create (unsigned connections,\n";
+  pr "                                           nbd_group_connect_callback connect,\n";
+  pr "                                           void *user_data)\n";
+  pr "    LIBNBD_ATTRIBUTE_ALLOC_DEALLOC (nbd_group_close);\n";
+  pr "extern unsigned nbd_group_get_size (struct nbd_group *g)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern struct nbd_handle *nbd_group_get_handle (struct nbd_group *g,\n";
+  pr "                                                unsigned i)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int64_t nbd_group_aio_pread (struct nbd_group *g,\n";
+  pr "                                    void *buf, size_t count,\n";
+  pr "                                    uint64_t offset,\n";
+  pr "                                    nbd_completion_callback completion_callback,\n";
+  pr "                                    uint32_t flags)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1, 2);\n";
+  pr "extern int64_t nbd_group_aio_pwrite (struct nbd_group *g,\n";
+  pr "                                     const void *buf, size_t count,\n";
+  pr "                                     uint64_t offset,\n";
+  pr "                                     nbd_completion_callback completion_callback,\n";
+  pr "                                     uint32_t flags)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1, 2);\n";
+  pr "extern int64_t nbd_group_aio_flush (struct nbd_group *g,\n";
+  pr "                                    nbd_completion_callback completion_callback,\n";
+  pr "                                    uint32_t flags)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  List.iter (
+    fun name ->
+      let fn = sprintf "nbd_group_aio_%s" name in
+      let indent = String.make (String.length fn + 16) ' ' in
+      pr "extern int64_t %s (struct nbd_group *g,\n" fn;
+      pr "%suint64_t count, uint64_t offset,\n" indent;
+      pr "%snbd_completion_callback completion_callback,\n" indent;
+      pr "%suint32_t flags)\n" indent;
+      pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n"
+  ) [ "trim"; "zero"; "cache" ];
+  pr "extern int nbd_group_aio_command_completed (struct nbd_group *g,\n";
+  pr "                                            int64_t cookie)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int64_t nbd_group_aio_peek_command_completed (struct nbd_group *g)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int nbd_group_aio_in_flight (struct nbd_group *g)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int nbd_group_poll (struct nbd_group *g, int timeout)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int nbd_group_shutdown (struct nbd_group *g, uint32_t flags)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "#define LIBNBD_HAVE_NBD_GROUP_CREATE 1\n";
+  pr "\n"
+
+let print_replica_decls () =
+  pr "struct nbd_replica;\n";
+  pr "\n";
+  pr "typedef int (*nbd_replica_connect_callback) (void *user_data,\n";
+  pr "                                             struct nbd_handle *h,\n";
+  pr "                                             unsigned i);\n";
+  pr "\n";
+  pr "extern void nbd_replica_close (struct nbd_replica *r); /* r can be NULL */\n";
+  pr "extern struct nbd_replica *nbd_replica_create (unsigned replicas,\n";
+  pr "                                               nbd_replica_connect_callback connect,\n";
+  pr "                                               void *user_data)\n";
+  pr "    LIBNBD_ATTRIBUTE_ALLOC_DEALLOC (nbd_replica_close);\n";
+  pr "extern unsigned nbd_replica_get_size (struct nbd_replica *r)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern struct nbd_handle *nbd_replica_get_handle (struct nbd_replica *r,\n";
+  pr "                                                  unsigned i)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int nbd_replica_set_hedge_percentile (struct nbd_replica *r,\n";
+  pr "                                             unsigned percentile)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern unsigned nbd_replica_get_hedge_percentile (struct nbd_replica *r)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int64_t nbd_replica_aio_pread (struct nbd_replica *r,\n";
+  pr "                                      void *buf, size_t count,\n";
+  pr "                                      uint64_t offset,\n";
+  pr "                                      nbd_completion_callback completion_callback,\n";
+  pr "                                      uint32_t flags)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1, 2);\n";
+  pr "extern int nbd_replica_aio_command_completed (struct nbd_replica *r,\n";
+  pr "                                              int64_t cookie)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int64_t nbd_replica_aio_peek_command_completed (struct nbd_replica *r)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int nbd_replica_aio_in_flight (struct nbd_replica *r)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int nbd_replica_poll (struct nbd_replica *r, int timeout)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int nbd_replica_shutdown (struct nbd_replica *r, uint32_t flags)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "#define LIBNBD_HAVE_NBD_REPLICA_CREATE 1\n";
+  pr "\n"
+
+let print_stripe_decls () =
+  pr "struct nbd_stripe;\n";
+  pr "\n";
+  pr "typedef int (*nbd_stripe_connect_callback) (void *user_data,\n";
+  pr "                                            struct nbd_handle *h,\n";
+  pr "                                            unsigned i);\n";
+  pr "\n";
+  pr "extern void nbd_stripe_close (struct nbd_stripe *s); /* s can be NULL */\n";
+  pr "extern struct nbd_stripe *nbd_stripe_create (unsigned members,\n";
+  pr "                                             uint64_t stripe_size,\n";
+  pr "                                             nbd_stripe_connect_callback connect,\n";
+  pr "                                             void *user_data)\n";
+  pr "    LIBNBD_ATTRIBUTE_ALLOC_DEALLOC (nbd_stripe_close);\n";
+  pr "extern unsigned nbd_stripe_get_size (struct nbd_stripe *s)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern struct nbd_handle *nbd_stripe_get_handle (struct nbd_stripe *s,\n";
+  pr "                                                 unsigned i)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern uint64_t nbd_stripe_get_stripe_size (struct nbd_stripe *s)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int64_t nbd_stripe_get_export_size (struct nbd_stripe *s)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int64_t nbd_stripe_aio_pread (struct nbd_stripe *s,\n";
+  pr "                                     void *buf, size_t count,\n";
+  pr "                                     uint64_t offset,\n";
+  pr "                                     nbd_completion_callback completion_callback,\n";
+  pr "                                     uint32_t flags)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1, 2);\n";
+  pr "extern int64_t nbd_stripe_aio_pwrite (struct nbd_stripe *s,\n";
+  pr "                                      const void *buf, size_t count,\n";
+  pr "                                      uint64_t offset,\n";
+  pr "                                      nbd_completion_callback completion_callback,\n";
+  pr "                                      uint32_t flags)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1, 2);\n";
+  pr "extern int64_t nbd_stripe_aio_flush (struct nbd_stripe *s,\n";
+  pr "                                     nbd_completion_callback completion_callback,\n";
+  pr "                                     uint32_t flags)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  List.iter (
+    fun name ->
+      let fn = sprintf "nbd_stripe_aio_%s" name in
+      let indent = String.make (String.length fn + 16) ' ' in
+      pr "extern int64_t %s (struct nbd_stripe *s,\n" fn;
+      pr "%suint64_t count, uint64_t offset,\n" indent;
+      pr "%snbd_completion_callback completion_callback,\n" indent;
+      pr "%suint32_t flags)\n" indent;
+      pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n"
+  ) [ "trim"; "zero" ];
+  pr "extern int64_t nbd_stripe_aio_block_status (struct nbd_stripe *s,\n";
+  pr "                                            uint64_t count, uint64_t offset,\n";
+  pr "                                            nbd_extent64_callback extent64_callback,\n";
+  pr "                                            nbd_completion_callback completion_callback,\n";
+  pr "                                            uint32_t flags)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int nbd_stripe_aio_command_completed (struct nbd_stripe *s,\n";
+  pr "                                             int64_t cookie)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int64_t nbd_stripe_aio_peek_command_completed (struct nbd_stripe *s)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int nbd_stripe_aio_in_flight (struct nbd_stripe *s)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int nbd_stripe_poll (struct nbd_stripe *s, int timeout)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "extern int nbd_stripe_shutdown (struct nbd_stripe *s, uint32_t flags)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "#define LIBNBD_HAVE_NBD_STRIPE_CREATE 1\n";
+  pr "\n"
+
+let print_reactor_decls () =
+  pr "struct nbd_reactor;\n";
+  pr "\n";
+  pr "extern void nbd_reactor_close (struct nbd_reactor *r); /* r can be NULL */\n";
+  pr "extern struct nbd_reactor *nbd_reactor_create (void)\n";
+  pr "    LIBNBD_ATTRIBUTE_ALLOC_DEALLOC (nbd_reactor_close);\n";
+  pr "extern int nbd_reactor_add (struct nbd_reactor *r, struct nbd_handle *h)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1, 2);\n";
+  pr "extern int nbd_reactor_remove (struct nbd_reactor *r,\n";
+  pr "                               struct nbd_handle *h)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1, 2);\n";
+  pr "extern int nbd_reactor_run (struct nbd_reactor *r, int timeout)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1);\n";
+  pr "#define LIBNBD_HAVE_NBD_REACTOR_CREATE 1\n";
+  pr "\n"
+
 let generate_include_libnbd_h () =
   generate_header CStyle;
 
@@ -395,6 +664,7 @@ let generate_include_libnbd_h () =
   pr "#include <stdbool.h>\n";
   pr "#include <stdint.h>\n";
   pr "#include <sys/socket.h>\n";
+  pr "#include <sys/uio.h>\n";
   pr "\n";
   pr "#ifdef __cplusplus\n";
   pr "extern \"C\" {\n";
@@ -468,6 +738,16 @@ let generate_include_libnbd_h () =
     fun (name, { args; optargs; ret }) ->
       print_fndecl_and_define ~wrap:true name args optargs ret
   ) handle_calls;
+  pr "extern ssize_t nbd_aio_reap_completed (struct nbd_handle *h,\n";
+  pr "                                       int64_t *cookies, int *errors,\n";
+  pr "                                       size_t n)\n";
+  pr "    LIBNBD_ATTRIBUTE_NONNULL (1, 2, 3);\n";
+  pr "#define LIBNBD_HAVE_NBD_AIO_REAP_COMPLETED 1\n";
+  pr "\n";
+  print_group_decls ();
+  print_replica_decls ();
+  print_stripe_decls ();
+  print_reactor_decls ();
   List.iter (
     fun (ns, ctxts) -> print_ns ns ctxts
   ) metadata_namespaces;
@@ -571,6 +851,9 @@ let generate_lib_api_c () =
       | BytesPersistOut (n, count) ->
          pr "  if (h->pread_initialize)\n";
          pr "    memset (%s, 0, %s);\n" n count
+      | IOVecPersistOut (n, count) ->
+         pr "  if (h->pread_initialize && %s != NULL)\n" n;
+         pr "    nbd_internal_zero_iovec (%s, %s);\n" n count
       | _ -> ()
     ) args;
 
@@ -645,6 +928,7 @@ let generate_lib_api_c () =
          print_flags_check n flags None
       | BytesIn (n, _) | BytesOut (n, _)
       | BytesPersistIn (n, _) | BytesPersistOut (n, _)
+      | IOVecPersistIn (n, _) | IOVecPersistOut (n, _)
       | SockAddrAndLen (n, _)
       | Path n
       | String n
@@ -716,9 +1000,11 @@ let generate_lib_api_c () =
          pr "    char *%s_printable =\n" n;
          pr "        nbd_internal_printable_string_list (%s);\n" n
       | BytesOut _ | BytesPersistOut _
+      | IOVecPersistIn _ | IOVecPersistOut _
       | Bool _ | Closure _ | Enum _ | Flags _ | Fd _ | Int _
       | Int64 _ | SizeT _
       | SockAddrAndLen _ | UInt _ | UInt32 _ | UInt64 _ | UIntPtr _ -> ()
+      | Extent64 _ -> assert false (* only used in extent64_closure *)
     ) args;
     if may_set_error then
       pr "    debug (h, \"enter:"
@@ -735,9 +1021,12 @@ let generate_lib_api_c () =
          pr " %s=\\\"%%s\\\" %s=%%zu" n count
       | Closure { cbname } -> pr " %s=<fun>" cbname
       | Enum (n, _) -> pr " %s=%%d" n
+      | Extent64 _ -> assert false (* only used in extent64_closure *)
       | Flags (n, _) -> pr " %s=0x%%x" n
       | Fd n | Int n -> pr " %s=%%d" n
       | Int64 n -> pr " %s=%%\" PRIi64 \"" n
+      | IOVecPersistIn (n, count)
+      | IOVecPersistOut (n, count) -> pr " %s=<iovec> %s=%%zu" n count
       | SizeT n -> pr " %s=%%zu" n
       | SockAddrAndLen (n, len) -> pr " %s=<sockaddr> %s=%%d" n len
       | Path n
@@ -764,8 +1053,11 @@ let generate_lib_api_c () =
          pr ", %s_printable ? %s_printable : \"\", %s" n n count
       | Closure { cbname } -> ()
       | Enum (n, _) -> pr ", %s" n
+      | Extent64 _ -> assert false (* only used in extent64_closure *)
       | Flags (n, _) -> pr ", %s" n
       | Fd n | Int n | Int64 n | SizeT n -> pr ", %s" n
+      | IOVecPersistIn (_, count)
+      | IOVecPersistOut (_, count) -> pr ", %s" count
       | SockAddrAndLen (_, len) -> pr ", (int) %s" len
       | Path n | String n | StringList n ->
          pr ", %s_printable ? %s_printable : \"\"" n n
@@ -787,9 +1079,11 @@ let generate_lib_api_c () =
       | StringList n ->
          pr "    free (%s_printable);\n" n
       | BytesOut _ | BytesPersistOut _
+      | IOVecPersistIn _ | IOVecPersistOut _
       | Bool _ | Closure _ | Enum _ | Flags _ | Fd _ | Int _
       | Int64 _ | SizeT _
       | SockAddrAndLen _ | UInt _ | UInt32 _ | UInt64 _ | UIntPtr _ -> ()
+      | Extent64 _ -> assert false (* only used in extent64_closure *)
     ) args;
     pr "  }\n"
   (* Print the trace when we leave a call with debugging enabled. *)
@@ -881,6 +1175,11 @@ let generate_docs_api_links_pod () =
     "nbd_close(3)" ::
     "nbd_get_error(3)" ::
     "nbd_get_errno(3)" ::
+    "nbd_aio_reap_completed(3)" ::
+    "nbd_group_create(3)" ::
+    "nbd_replica_create(3)" ::
+    "nbd_stripe_create(3)" ::
+    "nbd_reactor_create(3)" ::
     pages in
   let pages = List.sort compare pages in
 
@@ -49,10 +49,13 @@ let go_name_of_arg = function
   | BytesPersistOut (n, len) -> n
   | Closure { cbname } -> cbname
   | Enum (n, _) -> n
+  | Extent64 n -> n
   | Fd n -> n
   | Flags (n, _) -> n
   | Int n -> n
   | Int64 n -> n
+  | IOVecPersistIn (n, len) -> n
+  | IOVecPersistOut (n, len) -> n
   | Path n -> n
   | SizeT n -> n
   | SockAddrAndLen (n, len) -> n
@@ -71,10 +74,12 @@ let go_arg_type = function
   | BytesPersistOut _ -> "AioBuffer"
   | Closure { cbname } -> sprintf "%sCallback" (camel_case cbname)
   | Enum (_, { enum_prefix }) -> camel_case enum_prefix
+  | Extent64 _ -> assert false (* only used in extent64_closure *)
   | Fd _ -> "int"
   | Flags (_, { flag_prefix }) -> camel_case flag_prefix
   | Int _ -> "int"
   | Int64 _ -> "int64"
+  | IOVecPersistIn _ | IOVecPersistOut _ -> "[]AioBuffer"
   | Path _ -> "string"
   | SizeT _ -> "int"
   | SockAddrAndLen _ -> "string"
@@ -262,6 +267,7 @@ let print_binding (name, { args; optargs; ret; shortdesc }) =
        pr "    c_%s.user_data = C.alloc_cbid(C.long(%s_cbid))\n" cbname cbname
     | Enum (n, _) ->
        pr "    c_%s := C.int (%s)\n" n n
+    | Extent64 _ -> assert false (* only used in extent64_closure *)
     | Fd n ->
        pr "    c_%s := C.int (%s)\n" n n
     | Flags (n, _) ->
@@ -270,6 +276,10 @@ let print_binding (name, { args; optargs; ret; shortdesc }) =
        pr "    c_%s := C.int (%s)\n" n n
     | Int64 n ->
        pr "    c_%s := C.int64_t (%s)\n" n n
+    | IOVecPersistIn (n, len) | IOVecPersistOut (n, len) ->
+       pr "    c_%s := arg_iovec (%s)\n" n n;
+       pr "    defer C.free (unsafe.Pointer (c_%s))\n" n;
+       pr "    c_%s := C.size_t (len (%s))\n" len n
     | Path n ->
        pr "    c_%s := C.CString (%s)\n" n n;
        pr "    defer C.free (unsafe.Pointer (c_%s))\n" n
@@ -334,10 +344,13 @@ let print_binding (name, { args; optargs; ret; shortdesc }) =
     | BytesPersistOut (n, len) ->  pr ", c_%s, c_%s" n len
     | Closure { cbname } ->  pr ", c_%s" cbname
     | Enum (n, _) -> pr ", c_%s" n
+    | Extent64 _ -> assert false (* only used in extent64_closure *)
     | Fd n -> pr ", c_%s" n
     | Flags (n, _) -> pr ", c_%s" n
     | Int n -> pr ", c_%s" n
     | Int64 n -> pr ", c_%s" n
+    | IOVecPersistIn (n, len) | IOVecPersistOut (n, len) ->
+       pr ", c_%s, c_%s" n len
     | Path n -> pr ", c_%s" n
     | SizeT n -> pr ", c_%s" n
     | SockAddrAndLen (n, len) -> pr ", c_%s, c_%s" n len
@@ -524,6 +537,22 @@ func copy_uint32_array (entries *C.uint32_t, count C.size_t) []uint32 {
     copy(ret, s)
     return ret
 }
+
+type LibnbdExtent struct {
+    Length uint64 // length of the extent
+    Flags  uint64 // flags describing properties of the extent
+}
+
+func copy_extent64_array (entries *C.nbd_extent, count C.size_t) []LibnbdExtent {
+    ret := make([]LibnbdExtent, int (count))
+    // See https://github.com/golang/go/wiki/cgo#turning-c-arrays-into-go-slices
+    // TODO: Use unsafe.Slice() when we require Go 1.17.
+    s := (*[1<<30]C.nbd_extent)(unsafe.Pointer(entries))[:count:count]
+    for i, e := range s {
+        ret[i] = LibnbdExtent{ Length: uint64 (e.length), Flags: uint64 (e.flags) }
+    }
+    return ret
+}
 ";
 
   List.iter (
@@ -537,6 +566,8 @@ func copy_uint32_array (entries *C.uint32_t, count C.size_t) []uint32 {
           match cbarg with
           | CBArrayAndLen (UInt32 n, _) ->
              pr "%s []uint32" n;
+          | CBArrayAndLen (Extent64 n, _) ->
+             pr "%s []LibnbdExtent" n;
           | CBBytesIn (n, len) ->
              pr "%s []byte" n;
           | CBInt n ->
@@ -563,6 +594,8 @@ func copy_uint32_array (entries *C.uint32_t, count C.size_t) []uint32 {
           match cbarg with
           | CBArrayAndLen (UInt32 n, count) ->
              pr "%s *C.uint32_t, %s C.size_t" n count
+          | CBArrayAndLen (Extent64 n, count) ->
+             pr "%s *C.nbd_extent, %s C.size_t" n count
           | CBBytesIn (n, len) ->
              pr "%s unsafe.Pointer, %s C.size_t" n len
           | CBInt n ->
@@ -605,6 +638,8 @@ func copy_uint32_array (entries *C.uint32_t, count C.size_t) []uint32 {
           match cbarg with
           | CBArrayAndLen (UInt32 n, count) ->
              pr "copy_uint32_array (%s, %s)" n count
+          | CBArrayAndLen (Extent64 n, count) ->
+             pr "copy_extent64_array (%s, %s)" n count
           | CBBytesIn (n, len) ->
              pr "C.GoBytes (%s, C.int (%s))" n len
           | CBInt n ->
@@ -756,6 +791,8 @@ missing_function (struct error *err, const char *fn)
            match cbarg with
            | CBArrayAndLen (UInt32 n, count) ->
               pr "uint32_t *%s, size_t %s" n count
+           | CBArrayAndLen (Extent64 n, count) ->
+              pr "nbd_extent *%s, size_t %s" n count
            | CBBytesIn (n, len) ->
               pr "void *%s, size_t %s" n len
            | CBInt n ->
@@ -44,10 +44,12 @@ and ocaml_arg_to_string = function
   | Closure { cbargs } ->
      sprintf "(%s)" (ocaml_closuredecl_to_string cbargs)
   | Enum (_, { enum_prefix }) -> sprintf "%s.t" enum_prefix
+  | Extent64 _ -> "(int64 * int64)"
   | Fd _ -> "Unix.file_descr"
   | Flags (_, { flag_prefix }) -> sprintf "%s.t list" flag_prefix
   | Int _ -> "int"
   | Int64 _ -> "int64"
+  | IOVecPersistIn _ | IOVecPersistOut _ -> "Buffer.t list"
   | Path _ -> "string"
   | SockAddrAndLen _ -> "Unix.sockaddr"
   | SizeT _ -> "int" (* OCaml int type is always sufficient for counting *)
@@ -102,10 +104,13 @@ let ocaml_name_of_arg = function
   | BytesPersistOut (n, len) -> n
   | Closure { cbname } -> cbname
   | Enum (n, _) -> n
+  | Extent64 n -> n
   | Fd n -> n
   | Flags (n, _) -> n
   | Int n -> n
   | Int64 n -> n
+  | IOVecPersistIn (n, len) -> n
+  | IOVecPersistOut (n, len) -> n
   | Path n -> n
   | SizeT n -> n
   | SockAddrAndLen (n, len) -> n
@@ -498,7 +503,8 @@ let print_ocaml_closure_wrapper { cbname; cbargs } =
   let argnames =
     List.map (
       function
-      | CBArrayAndLen (UInt32 n, _) | CBBytesIn (n, _)
+      | CBArrayAndLen (UInt32 n, _) | CBArrayAndLen (Extent64 n, _)
+      | CBBytesIn (n, _)
       | CBInt n | CBInt64 n
       | CBMutable (Int n) | CBString n | CBUInt n | CBUInt64 n ->
          n ^ "v"
@@ -526,6 +532,9 @@ let print_ocaml_closure_wrapper { cbname; cbargs } =
     | CBArrayAndLen (UInt32 n, count) ->
        pr "  %sv = nbd_internal_ocaml_alloc_int64_from_uint32_array (%s, %s);\n"
          n n count;
+    | CBArrayAndLen (Extent64 n, count) ->
+       pr "  %sv = nbd_internal_ocaml_alloc_extent64_array (%s, %s);\n"
+         n n count;
     | CBBytesIn (n, len) ->
        pr "  %sv = caml_alloc_initialized_string (%s, %s);\n" n len n
     | CBInt n | CBUInt n ->
@@ -550,6 +559,7 @@ let print_ocaml_closure_wrapper { cbname; cbargs } =
   List.iter (
     function
     | CBArrayAndLen (UInt32 _, _)
+    | CBArrayAndLen (Extent64 _, _)
     | CBBytesIn _
     | CBInt _
     | CBInt64 _
@@ -688,6 +698,7 @@ let print_ocaml_binding (name, { args; optargs; ret }) =
        pr "  %s_callback.free = free_user_data;\n" cbname
     | Enum (n, { enum_prefix }) ->
        pr "  int %s = %s_val (%sv);\n" n enum_prefix n
+    | Extent64 _ -> assert false (* only used in extent64_closure *)
     | Fd n ->
        pr "  /* OCaml Unix.file_descr is just an int, at least on Unix. */\n";
        pr "  int %s = Int_val (%sv);\n" n n
@@ -697,6 +708,10 @@ let print_ocaml_binding (name, { args; optargs; ret }) =
        pr "  int %s = Int_val (%sv);\n" n n
     | Int64 n ->
        pr "  int64_t %s = Int64_val (%sv);\n" n n
+    | IOVecPersistIn (n, count) | IOVecPersistOut (n, count) ->
+       pr "  size_t %s;\n" count;
+       pr "  struct iovec *%s = nbd_internal_ocaml_iovec (%sv, &%s);\n"
+         n n count
     | Path n | String n ->
        pr "  const char *%s = String_val (%sv);\n" n n
     | SizeT n ->
@@ -727,7 +742,8 @@ let print_ocaml_binding (name, { args; optargs; ret }) =
    *)
   List.iter (
     function
-    | BytesPersistIn (n, _) | BytesPersistOut (n, _) ->
+    | BytesPersistIn (n, _) | BytesPersistOut (n, _)
+    | IOVecPersistIn (n, _) | IOVecPersistOut (n, _) ->
        pr "  completion_user_data->bufv = %sv;\n" n;
        pr "  caml_register_generational_global_root (&completion_user_data->bufv);\n"
     | _ -> ()
@@ -766,6 +782,7 @@ let print_ocaml_binding (name, { args; optargs; ret }) =
   List.iter (
     function
     | StringList n -> pr "  free (%s);\n" n
+    | IOVecPersistIn (n, _) | IOVecPersistOut (n, _) -> pr "  free (%s);\n" n
     | Bool _
     | BytesIn _
     | BytesPersistIn _
@@ -785,6 +802,7 @@ let print_ocaml_binding (name, { args; optargs; ret }) =
     | UInt32 _
     | UInt64 _
     | UIntPtr _ -> ()
+    | Extent64 _ -> assert false (* only used in extent64_closure *)
   ) args;
 
   pr "  CAMLreturn (rv);\n";
@@ -32,6 +32,7 @@ let generate_python_methods_h () =
   pr "#include <Python.h>\n";
   pr "\n";
   pr "#include <assert.h>\n";
+  pr "#include <sys/uio.h>\n";
   pr "\n";
   pr "\
 extern char **nbd_internal_py_get_string_list (PyObject *);
@@ -40,6 +41,9 @@ extern int nbd_internal_py_get_sockaddr (PyObject *,
     struct sockaddr_storage *, socklen_t *);
 extern PyObject *nbd_internal_py_get_aio_view (PyObject *, int);
 extern int nbd_internal_py_init_aio_buffer (PyObject *);
+extern PyObject *nbd_internal_py_get_aio_iovec (PyObject *, int,
+    struct iovec **, size_t *);
+extern int nbd_internal_py_init_aio_iovec (PyObject *);
 extern PyObject *nbd_internal_py_get_nbd_buffer_type (void);
 extern PyObject *nbd_internal_py_wrap_errptr (int);
 extern PyObject *nbd_internal_py_get_subview (PyObject *, const char *, size_t);
@@ -165,6 +169,7 @@ let print_python_closure_wrapper { cbname; cbargs } =
   List.iter (
     function
     | CBArrayAndLen (UInt32 n, _)
+    | CBArrayAndLen (Extent64 n, _)
     | CBBytesIn (n, _)
     | CBMutable (Int n) ->
        pr "  PyObject *py_%s = NULL;\n" n
@@ -182,6 +187,17 @@ let print_python_closure_wrapper { cbname; cbargs } =
        pr "    if (!py_e_%s) { PyErr_PrintEx (0); goto out; }\n" n;
        pr "    PyList_SET_ITEM (py_%s, i_%s, py_e_%s);\n" n n n;
        pr "  }\n"
+    | CBArrayAndLen (Extent64 n, len) ->
+       pr "  py_%s = PyList_New (%s);\n" n len;
+       pr "  if (!py_%s) { PyErr_PrintEx (0); goto out; }\n" n;
+       pr "  size_t i_%s;\n" n;
+       pr "  for (i_%s = 0; i_%s < %s; ++i_%s) {\n" n n len n;
+       pr "    PyObject *py_e_%s = Py_BuildValue (\"(KK)\",\n" n;
+       pr "                                       %s[i_%s].length,\n" n n;
+       pr "                                       %s[i_%s].flags);\n" n n;
+       pr "    if (!py_e_%s) { PyErr_PrintEx (0); goto out; }\n" n;
+       pr "    PyList_SET_ITEM (py_%s, i_%s, py_e_%s);\n" n n n;
+       pr "  }\n"
     | CBBytesIn (n, len) ->
        pr "  py_%s = nbd_internal_py_get_subview (data->view, %s, %s);\n" n n len;
        pr "  if (!py_%s) { PyErr_PrintEx (0); goto out; }\n" n
@@ -201,6 +217,7 @@ let print_python_closure_wrapper { cbname; cbargs } =
     List.map (
       function
       | CBArrayAndLen (UInt32 n, _) -> "O", sprintf "py_%s" n
+      | CBArrayAndLen (Extent64 n, _) -> "O", sprintf "py_%s" n
       | CBBytesIn (n, _) -> "O", sprintf "py_%s" n
       | CBInt n -> "i", n
       | CBInt64 n -> "L", n
@@ -249,7 +266,8 @@ let print_python_closure_wrapper { cbname; cbargs } =
   pr " out:\n";
   List.iter (
     function
-    | CBArrayAndLen (UInt32 n, _) ->
+    | CBArrayAndLen (UInt32 n, _)
+    | CBArrayAndLen (Extent64 n, _) ->
        pr "  Py_XDECREF (py_%s);\n" n
     | CBBytesIn (n, _) ->
        pr "  Py_XDECREF (py_%s);\n" n
@@ -302,6 +320,7 @@ let print_python_binding name { args; optargs; ret; may_set_error } =
            pr ".callback = %s_wrapper, .free = free_user_data" cbname);
        pr " };\n"
     | Enum (n, _) -> pr "  int %s;\n" n
+    | Extent64 _ -> assert false (* only used in extent64_closure *)
     | Flags (n, _) ->
        pr "  uint32_t %s_u32;\n" n;
        pr "  unsigned int %s; /* really uint32_t */\n" n
@@ -309,6 +328,12 @@ let print_python_binding name { args; optargs; ret; may_set_error } =
     | Int64 n ->
        pr "  int64_t %s_i64;\n" n;
        pr "  long long %s; /* really int64_t */\n" n
+    | IOVecPersistIn (n, count)
+    | IOVecPersistOut (n, count) ->
+       pr "  PyObject *%s; /* Sequence of buffer-like objects or nbd.Buffer */\n" n;
+       pr "  PyObject *%s_views = NULL; /* Tuple of PyMemoryView */\n" n;
+       pr "  struct iovec *%s_iov = NULL;\n" n;
+       pr "  size_t %s;\n" count
     | Path n ->
        pr "  PyObject *py_%s = NULL;\n" n;
        pr "  char *%s = NULL;\n" n
@@ -358,9 +383,12 @@ let print_python_binding name { args; optargs; ret; may_set_error } =
          "O", sprintf "&%s" n, sprintf "py_%s->buf, py_%s->len" n n
       | Closure { cbname } -> "O", sprintf "&py_%s_fn" cbname, cbname
       | Enum (n, _) -> "i", sprintf "&%s" n, n
+      | Extent64 _ -> assert false (* only used in extent64_closure *)
       | Flags (n, _) -> "I", sprintf "&%s" n, sprintf "%s_u32" n
       | Fd n | Int n -> "i", sprintf "&%s" n, n
       | Int64 n -> "L", sprintf "&%s" n, sprintf "%s_i64" n
+      | IOVecPersistIn (n, count) | IOVecPersistOut (n, count) ->
+         "O", sprintf "&%s" n, sprintf "%s_iov, %s" n count
       | Path n -> "O&", sprintf "PyUnicode_FSConverter, &py_%s" n, n
       | SizeT n -> "n", sprintf "&%s" n, sprintf "(size_t)%s" n
       | SockAddrAndLen (n, _) ->
@@ -449,9 +477,20 @@ let print_python_binding name { args; optargs; ret; may_set_error } =
          pr "  if (!chunk_user_data->view) goto out;\n"
        )
     | Enum _ -> ()
+    | Extent64 _ -> assert false (* only used in extent64_closure *)
     | Flags (n, _) -> pr "  %s_u32 = %s;\n" n n
     | Fd _ | Int _ -> ()
     | Int64 n -> pr "  %s_i64 = %s;\n" n n
+    | IOVecPersistIn (n, count) ->
+       pr "  %s_views = nbd_internal_py_get_aio_iovec (%s, PyBUF_READ,\n" n n;
+       pr "                                             &%s_iov, &%s);\n" n count;
+       pr "  if (!%s_views) goto out;\n" n;
+       pr "  completion_user_data->view = %s_views;\n" n
+    | IOVecPersistOut (n, count) ->
+       pr "  %s_views = nbd_internal_py_get_aio_iovec (%s, PyBUF_WRITE,\n" n n;
+       pr "                                             &%s_iov, &%s);\n" n count;
+       pr "  if (!%s_views) goto out;\n" n;
+       pr "  completion_user_data->view = %s_views;\n" n
     | Path n ->
        pr "  %s = PyBytes_AS_STRING (py_%s);\n" n n;
        pr "  assert (%s != NULL);\n" n
@@ -475,6 +514,8 @@ let print_python_binding name { args; optargs; ret; may_set_error } =
     function
     | BytesPersistOut (n, _) ->
        pr "  if (nbd_internal_py_init_aio_buffer (%s) < 0) goto out;\n" n
+    | IOVecPersistOut (n, _) ->
+       pr "  if (nbd_internal_py_init_aio_iovec (%s) < 0) goto out;\n" n
     | _ -> ()
   ) args;
   pr "  Py_BEGIN_ALLOW_THREADS;\n";
@@ -547,9 +588,12 @@ let print_python_binding name { args; optargs; ret; may_set_error } =
     | Closure { cbname } ->
        pr "  free_user_data (%s_user_data);\n" cbname
     | Enum _ -> ()
+    | Extent64 _ -> assert false (* only used in extent64_closure *)
     | Flags _ -> ()
     | Fd _ | Int _ -> ()
     | Int64 _ -> ()
+    | IOVecPersistIn (n, _) | IOVecPersistOut (n, _) ->
+       pr "  free (%s_iov);\n" n
     | Path n ->
        pr "  Py_XDECREF (py_%s);\n" n
     | SizeT _ -> ()
@@ -876,9 +920,11 @@ class NBD(object):
           | BytesPersistOut (n, _) -> n, None
           | Closure { cbname } -> cbname, None
           | Enum (n, _) -> n, None
+          | Extent64 _ -> assert false (* only used in extent64_closure *)
           | Flags (n, _) -> n, None
           | Fd n | Int n -> n, None
           | Int64 n -> n, None
+          | IOVecPersistIn (n, _) | IOVecPersistOut (n, _) -> n, None
           | Path n -> n, None
           | SizeT n -> n, None
           | SockAddrAndLen (n, _) -> n, None
@@ -164,25 +164,11 @@ and connect_tcp_state_machine = [
     external_events = [];
   };
 
-  State {
-    default_state with
-    name = "CONNECT";
-    comment = "Initial call to connect(2) on a TCP socket";
-    external_events = [ NotifyWrite, "CONNECTING" ];
-  };
-
   State {
     default_state with
     name = "CONNECTING";
-    comment = "Connecting to the remote server over a TCP socket";
-    external_events = [ NotifyWrite, "" ];
-  };
-
-  State {
-    default_state with
-    name = "NEXT_ADDRESS";
-    comment = "Connecting to the next address over a TCP socket";
-    external_events = [];
+    comment = "Resolving and connecting to the remote server in a helper thread";
+    external_events = [ NotifyRead, "" ];
   };
 ]
 
@@ -297,6 +283,11 @@ and newstyle_state_machine = [
    * NEGOTIATING after OPT_STRUCTURED_REPLY or any failed OPT_GO.
    *)
   Group ("OPT_STARTTLS", newstyle_opt_starttls_state_machine);
+  Group ("OPT_EXTENDED_HEADERS", newstyle_opt_extended_headers_state_machine);
+  (* With nbd_set_pipeline_options, OPT_PIPELINE sends the next three
+   * options in one go, then hands each reply to their CHECK_REPLY.
+   *)
+  Group ("OPT_PIPELINE", newstyle_opt_pipeline_state_machine);
   Group ("OPT_STRUCTURED_REPLY", newstyle_opt_structured_reply_state_machine);
   Group ("OPT_META_CONTEXT", newstyle_opt_meta_context_state_machine);
   Group ("OPT_GO", newstyle_opt_go_state_machine);
@@ -441,127 +432,152 @@ and newstyle_opt_list_state_machine = [
   };
 ]
 
-(* Fixed newstyle NBD_OPT_STRUCTURED_REPLY option.
- * Implementation: generator/states-newstyle-opt-structured-reply.c
+(* Fixed newstyle NBD_OPT_EXTENDED_HEADERS option.
+ * Implementation: generator/states-newstyle-opt-extended-headers.c
  *)
-and newstyle_opt_structured_reply_state_machine = [
+and newstyle_opt_extended_headers_state_machine = [
   State {
     default_state with
     name = "START";
-    comment = "Try to negotiate newstyle NBD_OPT_STRUCTURED_REPLY";
+    comment = "Try to negotiate newstyle NBD_OPT_EXTENDED_HEADERS";
     external_events = [];
   };
 
   State {
     default_state with
     name = "SEND";
-    comment = "Send newstyle NBD_OPT_STRUCTURED_REPLY negotiation request";
+    comment = "Send newstyle NBD_OPT_EXTENDED_HEADERS negotiation request";
     external_events = [ NotifyWrite, "" ];
   };
 
   State {
     default_state with
     name = "RECV_REPLY";
-    comment = "Receive newstyle NBD_OPT_STRUCTURED_REPLY option reply";
+    comment = "Receive newstyle NBD_OPT_EXTENDED_HEADERS option reply";
     external_events = [ NotifyRead, "" ];
   };
 
   State {
     default_state with
     name = "RECV_REPLY_PAYLOAD";
-    comment = "Receive any newstyle NBD_OPT_STRUCTURED_REPLY reply payload";
+    comment = "Receive any newstyle NBD_OPT_EXTENDED_HEADERS reply payload";
     external_events = [ NotifyRead, "" ];
   };
 
   State {
     default_state with
     name = "CHECK_REPLY";
-    comment = "Check newstyle NBD_OPT_STRUCTURED_REPLY option reply";
+    comment = "Check newstyle NBD_OPT_EXTENDED_HEADERS option reply";
     external_events = [];
   };
 ]
 
-(* Fixed newstyle NBD_OPT_SET/LIST_META_CONTEXT option.
- * Implementation: generator/states-newstyle-opt-meta-context.c
+(* Fixed newstyle options sent back-to-back.
+ * Implementation: generator/states-newstyle-opt-pipeline.c
  *)
-and newstyle_opt_meta_context_state_machine = [
+and newstyle_opt_pipeline_state_machine = [
   State {
     default_state with
     name = "START";
-    comment = "Try to negotiate newstyle NBD_OPT_SET_META_CONTEXT";
+    comment = "Prepare to send several newstyle options at once";
     external_events = [];
   };
 
   State {
     default_state with
     name = "SEND";
-    comment = "Send newstyle NBD_OPT_SET_META_CONTEXT";
-    external_events = [ NotifyWrite, "" ];
+    comment = "Send pipelined newstyle options";
+    external_events = [ NotifyWrite, "";
+                        NotifyRead, "PREPARE_FOR_REPLY" ];
   };
 
   State {
     default_state with
-    name = "SEND_EXPORTNAMELEN";
-    comment = "Send newstyle NBD_OPT_SET_META_CONTEXT export name length";
-    external_events = [ NotifyWrite, "" ];
+    name = "PREPARE_FOR_REPLY";
+    comment = "Prepare to receive the next pipelined option reply";
+    external_events = [];
   };
 
   State {
     default_state with
-    name = "SEND_EXPORTNAME";
-    comment = "Send newstyle NBD_OPT_SET_META_CONTEXT export name";
-    external_events = [ NotifyWrite, "" ];
+    name = "RECV_REPLY";
+    comment = "Receive a pipelined option reply";
+    external_events = [ NotifyRead, "" ];
   };
 
   State {
     default_state with
-    name = "SEND_NRQUERIES";
-    comment = "Send newstyle NBD_OPT_SET_META_CONTEXT number of queries";
-    external_events = [ NotifyWrite, "" ];
+    name = "RECV_REPLY_PAYLOAD";
+    comment = "Receive a pipelined option reply payload";
+    external_events = [ NotifyRead, "" ];
   };
 
   State {
     default_state with
-    name = "PREPARE_NEXT_QUERY";
-    comment = "Prepare to send newstyle NBD_OPT_SET_META_CONTEXT query";
+    name = "CHECK_REPLY";
+    comment = "Pass a pipelined option reply to its option's checks";
     external_events = [];
   };
 
   State {
     default_state with
-    name = "SEND_QUERYLEN";
-    comment = "Send newstyle NBD_OPT_SET_META_CONTEXT query length";
-    external_events = [ NotifyWrite, "" ];
+    name = "NEXT_REPLY";
+    comment = "Continue sending, or wait for the next pipelined reply";
+    external_events = [];
   };
+]
 
+(* Fixed newstyle NBD_OPT_STRUCTURED_REPLY option.
+ * Implementation: generator/states-newstyle-opt-structured-reply.c
+ *)
+and newstyle_opt_structured_reply_state_machine = [
   State {
     default_state with
-    name = "SEND_QUERY";
-    comment = "Send newstyle NBD_OPT_SET_META_CONTEXT query";
-    external_events = [ NotifyWrite, "" ];
+    name = "START";
+    comment = "Try to negotiate newstyle NBD_OPT_STRUCTURED_REPLY";
+    external_events = [];
   };
 
   State {
     default_state with
-    name = "PREPARE_FOR_REPLY";
-    comment = "Prepare to receive newstyle NBD_OPT_SET_META_CONTEXT option reply";
-    external_events = [];
+    name = "SEND";
+    comment = "Send newstyle NBD_OPT_STRUCTURED_REPLY negotiation request";
+    external_events = [ NotifyWrite, "" ];
   };
 
   State {
     default_state with
     name = "RECV_REPLY";
-    comment = "Receive newstyle NBD_OPT_SET_META_CONTEXT option reply";
+    comment = "Receive newstyle NBD_OPT_STRUCTURED_REPLY option reply";
     external_events = [ NotifyRead, "" ];
   };
 
   State {
     default_state with
     name = "RECV_REPLY_PAYLOAD";
-    comment = "Receive newstyle NBD_OPT_SET_META_CONTEXT option reply payload";
+    comment = "Receive any newstyle NBD_OPT_STRUCTURED_REPLY reply payload";
     external_events = [ NotifyRead, "" ];
   };
 
+  State {
+    default_state with
+    name = "CHECK_REPLY";
+    comment = "Check newstyle NBD_OPT_STRUCTURED_REPLY option reply";
+    external_events = [];
+  };
+]
+
+(* Fixed newstyle NBD_OPT_SET/LIST_META_CONTEXT option.
+ * Implementation: generator/states-newstyle-opt-meta-context.c
+ *)
+and newstyle_opt_meta_context_state_machine = [
+  State {
+    default_state with
+    name = "START";
+    comment = "Try to negotiate newstyle NBD_OPT_SET_META_CONTEXT";
+    external_events = [];
+  };
+
   State {
     default_state with
     name = "CHECK_REPLY";
@@ -871,6 +887,13 @@ and structured_reply_state_machine = [
     external_events = [];
   };
 
+  State {
+    default_state with
+    name = "RECV_BS_HEADER";
+    comment = "Receive header of a structured reply block-status payload";
+    external_events = [];
+  };
+
   State {
     default_state with
     name = "RECV_BS_ENTRIES";
@@ -374,6 +374,9 @@ let generate_lib_states_c () =
       pr "    debug (h, \"transition: %%s -> %%s\",\n";
       pr "           \"%s\",\n" display_name;
       pr "           nbd_internal_state_short_string (next_state));\n";
+      pr "    probe_state (h, \"%s\",\n" display_name;
+      pr "                 nbd_internal_state_short_string (next_state));\n";
+      pr "    flight_record (h, state, %s, next_state);\n" state_enum;
       pr "    set_next_state (h, next_state);\n";
       pr "  }\n";
       pr "  return r;\n";
@@ -400,6 +403,9 @@ let generate_lib_states_run_c () =
   pr "  int r;\n";
   pr "  bool blocked;\n";
   pr "\n";
+  pr "  /* Another thread may be in nbd_poll with the lock released. */\n";
+  pr "  nbd_internal_wait_for_poller (h);\n";
+  pr "\n";
   pr "  /* Validate and handle the external event. */\n";
   pr "  switch (get_next_state (h))\n";
   pr "  {\n";
@@ -414,6 +420,8 @@ let generate_lib_states_run_c () =
             pr "    case %s:\n" (c_string_of_external_event e);
             if state != next_state then (
               pr "      set_next_state (h, %s);\n" next_state.parsed.state_enum;
+              pr "      flight_record (h, state, %s, %s);\n"
+                 state_enum next_state.parsed.state_enum;
               pr "      debug (h, \"event %%s: %%s -> %%s\",\n";
               pr "             \"%s\", \"%s\", \"%s\");\n"
                  (string_of_external_event e)
@@ -451,9 +459,13 @@ let generate_lib_states_run_c () =
   pr "\n";
   pr "    if (r == -1) {\n";
   pr "      assert (nbd_get_error () != NULL);\n";
+  pr "      nbd_internal_reactor_update (h);\n";
   pr "      return -1;\n";
   pr "    }\n";
   pr "  } while (!blocked);\n";
+  pr "\n";
+  pr "  /* If the handle is in a reactor, register the new direction. */\n";
+  pr "  nbd_internal_reactor_update (h);\n";
   pr "  return 0;\n";
   pr "}\n";
   pr "\n";
@@ -128,66 +128,51 @@ STATE_MACHINE {
   }
 
  CONNECT_TCP.START:
-  int r;
+  int fd;
 
   assert (h->hostname != NULL);
   assert (h->port != NULL);
+  assert (!h->sock);
 
-  if (h->result) {
-    freeaddrinfo (h->result);
-    h->result = NULL;
-  }
-
-  h->connect_errno = 0;
-
-  memset (&h->hints, 0, sizeof h->hints);
-  h->hints.ai_family = AF_UNSPEC;
-  h->hints.ai_socktype = SOCK_STREAM;
-  h->hints.ai_flags = 0;
-  h->hints.ai_protocol = 0;
-
-  /* XXX Unfortunately getaddrinfo blocks.  getaddrinfo_a isn't
-   * portable and in any case isn't an alternative because it can't be
-   * integrated into a main loop.
+  /* Resolving the name and connecting both happen in a helper
+   * thread, see lib/connect-tcp.c.  Meanwhile h->sock holds a socket
+   * which becomes readable when the thread is done.
    */
-  r = getaddrinfo (h->hostname, h->port, &h->hints, &h->result);
-  if (r != 0) {
-    SET_NEXT_STATE (%^START);
-    set_error (0, "getaddrinfo: hostname \"%s\" port \"%s\": %s",
-               h->hostname, h->port, gai_strerror (r));
-    return -1;
+  fd = nbd_internal_connect_tcp_start (h);
+  if (fd == -1) {
+    SET_NEXT_STATE (%.DEAD);
+    return 0;
   }
-
-  h->rp = h->result;
-  SET_NEXT_STATE (%CONNECT);
+  h->sock = nbd_internal_socket_create (fd);
+  if (!h->sock) {
+    close (fd);
+    nbd_internal_connect_tcp_abandon (h);
+    SET_NEXT_STATE (%.DEAD);
+    return 0;
+  }
+  SET_NEXT_STATE (%CONNECTING);
   return 0;
 
- CONNECT_TCP.CONNECT:
+ CONNECT_TCP.CONNECTING:
+  char c;
   int fd;
 
-  assert (!h->sock);
+  if (read (h->sock->ops->get_fd (h->sock), &c, 1) == -1 &&
+      (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 0;
 
-  if (h->rp == NULL) {
-    /* We tried all the results from getaddrinfo without success.
-     * Save errno from most recent connect(2) call. XXX
-     */
-    SET_NEXT_STATE (%^START);
-    set_error (h->connect_errno,
-               "connect: %s:%s: could not connect to remote host",
-               h->hostname, h->port);
-    return -1;
-  }
+  nbd_internal_reactor_drop (h);
+  h->sock->ops->close (h->sock);
+  h->sock = NULL;
 
-  fd = nbd_internal_socket (h->rp->ai_family,
-                            h->rp->ai_socktype,
-                            h->rp->ai_protocol,
-                            true);
+  fd = nbd_internal_connect_tcp_finish (h);
   if (fd == -1) {
-    SET_NEXT_STATE (%NEXT_ADDRESS);
-    return 0;
+    SET_NEXT_STATE (%^START);
+    return -1;
   }
   h->sock = nbd_internal_socket_create (fd);
   if (!h->sock) {
+    close (fd);
     SET_NEXT_STATE (%.DEAD);
     return 0;
   }
@@ -195,46 +180,7 @@ STATE_MACHINE {
   disable_nagle (fd);
   disable_sigpipe (fd);
 
-  if (connect (fd, h->rp->ai_addr, h->rp->ai_addrlen) == -1) {
-    if (errno != EINPROGRESS) {
-      if (h->connect_errno == 0)
-        h->connect_errno = errno;
-      SET_NEXT_STATE (%NEXT_ADDRESS);
-      return 0;
-    }
-  }
-
-  SET_NEXT_STATE (%CONNECTING);
-  return 0;
-
- CONNECT_TCP.CONNECTING:
-  int status;
-  socklen_t len = sizeof status;
-
-  if (getsockopt (h->sock->ops->get_fd (h->sock),
-                  SOL_SOCKET, SO_ERROR, &status, &len) == -1) {
-    SET_NEXT_STATE (%.DEAD);
-    set_error (errno, "getsockopt: SO_ERROR");
-    return 0;
-  }
-  /* This checks the status of the original connect call. */
-  if (status == 0)
-    SET_NEXT_STATE (%^MAGIC.START);
-  else {
-    if (h->connect_errno == 0)
-      h->connect_errno = status;
-    SET_NEXT_STATE (%NEXT_ADDRESS);
-  }
-  return 0;
-
- CONNECT_TCP.NEXT_ADDRESS:
-  if (h->sock) {
-    h->sock->ops->close (h->sock);
-    h->sock = NULL;
-  }
-  if (h->rp)
-    h->rp = h->rp->ai_next;
-  SET_NEXT_STATE (%CONNECT);
+  SET_NEXT_STATE (%^MAGIC.START);
   return 0;
 
  CONNECT_COMMAND.START:
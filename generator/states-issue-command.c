@@ -18,6 +18,144 @@
 
 /* State machine for issuing commands (requests) to the server. */
 
+/* Encode the request header for cmd, returning its length. */
+static size_t
+encode_request (struct nbd_handle *h, struct command *cmd,
+                union request_header *req)
+{
+  /* These fields are coincident between req.compact and req.extended */
+  req->compact.flags = htobe16 (cmd->flags);
+  req->compact.type = htobe16 (cmd->type);
+  req->compact.handle = htobe64 (cmd->cookie);
+  req->compact.offset = htobe64 (cmd->offset);
+  if (h->extended_headers) {
+    req->extended.magic = htobe32 (NBD_EXTENDED_REQUEST_MAGIC);
+    req->extended.count = htobe64 (cmd->count);
+    return sizeof (req->extended);
+  }
+  else {
+    assert (cmd->count <= UINT32_MAX);
+    req->compact.magic = htobe32 (NBD_REQUEST_MAGIC);
+    req->compact.count = htobe32 (cmd->count);
+    return sizeof (req->compact);
+  }
+}
+
+/* Should the payload of cmd be sent with MSG_ZEROCOPY?  Such
+ * payloads are always sent on their own, never batched or combined
+ * with the request header, because the kernel keeps referring to the
+ * pages after send returns.
+ */
+static bool
+use_zerocopy (struct nbd_handle *h, struct command *cmd)
+{
+  return h->zerocopy_active && cmd->type == NBD_CMD_WRITE &&
+    cmd->count >= ZEROCOPY_MIN;
+}
+
+/* When more than one command is queued, gather the requests for as
+ * many as we can (including the payloads of small writes) into
+ * h->batch_iov, so that send_from_wbuf can pass them all to a single
+ * sendv call.  Returns false if fewer than two commands would fit,
+ * in which case the caller issues the first command on its own.
+ */
+static bool
+prepare_batch (struct nbd_handle *h)
+{
+  struct command *cmd;
+  struct iovec *iov = h->batch_iov;
+  char *hdr = h->batch_hdr;
+  size_t n = 0, nr_iov = 0, nr_payload, len;
+  uint64_t end = 0, payload = 0;
+
+  for (cmd = h->cmds_to_issue; cmd != NULL && n < ISSUE_BATCH_MAX;
+       cmd = cmd->next) {
+    union request_header req;
+
+    /* NBD_CMD_DISC needs a write shutdown after it, so is never
+     * batched.
+     */
+    if (cmd->type == NBD_CMD_DISC || use_zerocopy (h, cmd))
+      break;
+
+    nr_payload = 0;
+    if (cmd->type == NBD_CMD_WRITE) {
+      if (payload + cmd->count > ISSUE_BATCH_BYTES)
+        break;
+      nr_payload = cmd->iov ? cmd->iovcnt : cmd->count > 0;
+    }
+    if (nr_iov + 1 + nr_payload > ARRAY_SIZE (h->batch_iov))
+      break;
+
+    len = encode_request (h, cmd, &req);
+    memcpy (hdr, &req, len);
+    /* Consecutive headers are adjacent, so can share a segment. */
+    if (nr_iov > 0 &&
+        (char *) iov[nr_iov-1].iov_base + iov[nr_iov-1].iov_len == hdr)
+      iov[nr_iov-1].iov_len += len;
+    else {
+      iov[nr_iov].iov_base = hdr;
+      iov[nr_iov].iov_len = len;
+      nr_iov++;
+    }
+    hdr += len;
+    end += len;
+
+    if (cmd->type == NBD_CMD_WRITE) {
+      if (cmd->iov)
+        memcpy (&iov[nr_iov], cmd->iov, cmd->iovcnt * sizeof *iov);
+      else if (cmd->count > 0) {
+        iov[nr_iov].iov_base = cmd->data;
+        iov[nr_iov].iov_len = cmd->count;
+      }
+      nr_iov += nr_payload;
+      end += cmd->count;
+      payload += cmd->count;
+    }
+    h->batch_end[n++] = end;
+  }
+
+  if (n < 2)
+    return false;
+
+  h->chunks_sent += n;
+  h->batch_len = n;
+  h->batch_done = 0;
+  h->batch_start = h->bytes_sent;
+  h->wbuf = iov[0].iov_base;
+  h->wlen = iov[0].iov_len;
+  h->wiov = &iov[1];
+  h->wiovcnt = nr_iov - 1;
+  if (cmd != NULL)
+    h->wflags = MSG_MORE;
+  return true;
+}
+
+/* Move the commands in the current batch whose requests have been
+ * sent in full to cmds_in_flight.  This has to happen as we go,
+ * rather than when the whole batch has been sent, because the server
+ * may reply to the first commands while we are still sending.
+ */
+static void
+batch_progress (struct nbd_handle *h)
+{
+  struct command *cmd;
+
+  while (h->batch_done < h->batch_len &&
+         h->bytes_sent - h->batch_start >= h->batch_end[h->batch_done]) {
+    cmd = h->cmds_to_issue;
+    assert (cmd != NULL);
+    h->cmds_to_issue = cmd->next;
+    if (h->cmds_to_issue_tail == cmd)
+      h->cmds_to_issue_tail = NULL;
+    nbd_internal_stats_sent (h, cmd);
+    probe_command (cmd__send, h, cmd);
+    flight_record (h, request, cmd);
+    nbd_internal_push_cmd_in_flight (h, cmd);
+    h->batch_done++;
+  }
+}
+
 STATE_MACHINE {
  ISSUE_COMMAND.START:
   struct command *cmd;
@@ -41,24 +179,45 @@ STATE_MACHINE {
     return 0;
   }
 
-  h->request.magic = htobe32 (NBD_REQUEST_MAGIC);
-  h->request.flags = htobe16 (cmd->flags);
-  h->request.type = htobe16 (cmd->type);
-  h->request.handle = htobe64 (cmd->cookie);
-  h->request.offset = htobe64 (cmd->offset);
-  h->request.count = htobe32 ((uint32_t) cmd->count);
+  /* If several commands are queued, try to send them all at once. */
+  if (cmd->next && h->sock->ops->sendv && prepare_batch (h)) {
+    SET_NEXT_STATE (%SEND_REQUEST);
+    return 0;
+  }
+
+  h->wlen = encode_request (h, cmd, &h->req);
   h->chunks_sent++;
-  h->wbuf = &h->request;
-  h->wlen = sizeof (h->request);
-  if (cmd->type == NBD_CMD_WRITE || cmd->next)
+  h->wbuf = &h->req;
+  cmd->zerocopy = use_zerocopy (h, cmd);
+  if (cmd->type == NBD_CMD_WRITE && cmd->iov && h->sock->ops->sendv &&
+      !cmd->zerocopy) {
+    /* Vectored write: send the header and payload together. */
+    h->wiov = cmd->iov;
+    h->wiovcnt = cmd->iovcnt;
+    if (cmd->next && cmd->count < 64 * 1024)
+      h->wflags = MSG_MORE;
+  }
+  else if (cmd->type == NBD_CMD_WRITE || cmd->next)
     h->wflags = MSG_MORE;
   SET_NEXT_STATE (%SEND_REQUEST);
   return 0;
 
  ISSUE_COMMAND.SEND_REQUEST:
-  switch (send_from_wbuf (h)) {
+  int r = send_from_wbuf (h);
+
+  if (h->batch_len)
+    batch_progress (h);
+  switch (r) {
   case -1: SET_NEXT_STATE (%.DEAD); return 0;
-  case 0:  SET_NEXT_STATE (%PREPARE_WRITE_PAYLOAD);
+  case 0:
+    if (h->batch_len) {
+      /* The whole batch was sent. */
+      assert (h->batch_done == h->batch_len);
+      h->batch_len = 0;
+      SET_NEXT_STATE (%.READY);
+    }
+    else
+      SET_NEXT_STATE (%PREPARE_WRITE_PAYLOAD);
   }
   return 0;
 
@@ -74,12 +233,26 @@ STATE_MACHINE {
 
   assert (h->cmds_to_issue != NULL);
   cmd = h->cmds_to_issue;
-  assert (cmd->cookie == be64toh (h->request.handle));
-  if (cmd->type == NBD_CMD_WRITE) {
-    h->wbuf = cmd->data;
-    h->wlen = cmd->count;
+  assert (cmd->cookie == be64toh (h->req.compact.handle));
+  if (cmd->type == NBD_CMD_WRITE && cmd->iov && h->sock->ops->sendv &&
+      !cmd->zerocopy)
+    /* Payload was already sent along with the request. */
+    SET_NEXT_STATE (%FINISH);
+  else if (cmd->type == NBD_CMD_WRITE) {
+    if (cmd->iov == NULL) {
+      h->wbuf = cmd->data;
+      h->wlen = cmd->count;
+    }
+    else if (cmd->iovcnt > 0) {
+      h->wbuf = cmd->iov[0].iov_base;
+      h->wlen = cmd->iov[0].iov_len;
+      h->wiov = &cmd->iov[1];
+      h->wiovcnt = cmd->iovcnt - 1;
+    }
     if (cmd->next && cmd->count < 64 * 1024)
       h->wflags = MSG_MORE;
+    if (cmd->zerocopy)
+      h->wflags |= MSG_ZEROCOPY;
     SET_NEXT_STATE (%SEND_WRITE_PAYLOAD);
   }
   else if (cmd->type == NBD_CMD_DISC) {
@@ -120,12 +293,16 @@ STATE_MACHINE {
   assert (!h->wlen);
   assert (h->cmds_to_issue != NULL);
   cmd = h->cmds_to_issue;
-  assert (cmd->cookie == be64toh (h->request.handle));
+  assert (cmd->cookie == be64toh (h->req.compact.handle));
   h->cmds_to_issue = cmd->next;
   if (h->cmds_to_issue_tail == cmd)
     h->cmds_to_issue_tail = NULL;
-  cmd->next = h->cmds_in_flight;
-  h->cmds_in_flight = cmd;
+  if (cmd->zerocopy)
+    cmd->zc_seq = h->zc_next - 1;
+  nbd_internal_stats_sent (h, cmd);
+  probe_command (cmd__send, h, cmd);
+  flight_record (h, request, cmd);
+  nbd_internal_push_cmd_in_flight (h, cmd);
   SET_NEXT_STATE (%.READY);
   return 0;
 
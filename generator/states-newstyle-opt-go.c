@@ -224,6 +224,10 @@ STATE_MACHINE {
       }
     }
     /* Server is allowed to send any number of NBD_REP_INFO, read next one. */
+    if (h->pipeline_nr) {
+      SET_NEXT_STATE (%^OPT_PIPELINE.NEXT_REPLY);
+      return 0;
+    }
     h->rbuf = &h->sbuf;
     h->rlen = sizeof (h->sbuf.or.option_reply);
     SET_NEXT_STATE (%RECV_REPLY);
@@ -231,6 +235,7 @@ STATE_MACHINE {
   case NBD_REP_ERR_UNSUP:
     if (h->opt_current == NBD_OPT_GO) {
       debug (h, "server is confused by NBD_OPT_GO, continuing anyway");
+      pipeline_pop (h);
       SET_NEXT_STATE (%^OPT_EXPORT_NAME.START);
       return 0;
     }
@@ -257,6 +262,9 @@ STATE_MACHINE {
     case NBD_REP_ERR_TLS_REQD:
       set_error (ENOTSUP, "handshake: server requires TLS encryption first");
       break;
+    case NBD_REP_ERR_EXT_HEADER_REQD:
+      set_error (ENOTSUP, "handshake: server requires extended headers");
+      break;
     case NBD_REP_ERR_UNKNOWN:
       set_error (ENOENT, "handshake: server has no export named '%s'",
                  h->export_name);
@@ -281,6 +289,8 @@ STATE_MACHINE {
     break;
   }
 
+  /* NBD_OPT_GO is always the last option in a pipeline. */
+  pipeline_pop (h);
   if (err == 0 && h->opt_current == NBD_OPT_GO)
     SET_NEXT_STATE (%^FINISHED);
   else if (h->opt_mode)
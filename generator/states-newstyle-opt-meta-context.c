@@ -21,7 +21,7 @@
 STATE_MACHINE {
  NEWSTYLE.OPT_META_CONTEXT.START:
   size_t i;
-  uint32_t len, opt;
+  uint32_t opt;
 
   /* This state group is reached from:
    * h->opt_mode == false (h->opt_current == 0):
@@ -44,6 +44,9 @@ STATE_MACHINE {
    * If OPT_GO is later successful, it populates h->exportsize and friends,
    * and also sets h->meta_valid if h->request_meta but we skipped SET here.
    * There is a callback if and only if the command is unconditional.
+   * With h->pipeline_options, nbd_connect_*() instead starts in
+   * OPT_PIPELINE.START, which sends SET together with the other
+   * options; replies for SET still come back to CHECK_REPLY here.
    */
   assert (h->gflags & LIBNBD_HANDSHAKE_FLAG_FIXED_NEWSTYLE);
   if (h->opt_current == NBD_OPT_LIST_META_CONTEXT) {
@@ -76,131 +79,15 @@ STATE_MACHINE {
     }
   }
 
-  /* Calculate the length of the option request data. */
-  len = 4 /* exportname len */ + strlen (h->export_name) + 4 /* nr queries */;
-  for (i = 0; i < h->querylist.len; ++i)
-    len += 4 /* length of query */ + strlen (h->querylist.ptr[i]);
-
-  h->sbuf.option.version = htobe64 (NBD_NEW_VERSION);
-  h->sbuf.option.option = htobe32 (opt);
-  h->sbuf.option.optlen = htobe32 (len);
-  h->chunks_sent++;
-  h->wbuf = &h->sbuf;
-  h->wlen = sizeof (h->sbuf.option);
-  h->wflags = MSG_MORE;
-  SET_NEXT_STATE (%SEND);
-  return 0;
-
- NEWSTYLE.OPT_META_CONTEXT.SEND:
-  switch (send_from_wbuf (h)) {
-  case -1: SET_NEXT_STATE (%.DEAD); return 0;
-  case 0:
-    h->sbuf.len = htobe32 (strlen (h->export_name));
-    h->wbuf = &h->sbuf.len;
-    h->wlen = sizeof h->sbuf.len;
-    h->wflags = MSG_MORE;
-    SET_NEXT_STATE (%SEND_EXPORTNAMELEN);
-  }
-  return 0;
-
- NEWSTYLE.OPT_META_CONTEXT.SEND_EXPORTNAMELEN:
-  switch (send_from_wbuf (h)) {
-  case -1: SET_NEXT_STATE (%.DEAD); return 0;
-  case 0:
-    h->wbuf = h->export_name;
-    h->wlen = strlen (h->export_name);
-    h->wflags = MSG_MORE;
-    SET_NEXT_STATE (%SEND_EXPORTNAME);
-  }
-  return 0;
-
- NEWSTYLE.OPT_META_CONTEXT.SEND_EXPORTNAME:
-  switch (send_from_wbuf (h)) {
-  case -1: SET_NEXT_STATE (%.DEAD); return 0;
-  case 0:
-    h->sbuf.nrqueries = htobe32 (h->querylist.len);
-    h->wbuf = &h->sbuf;
-    h->wlen = sizeof h->sbuf.nrqueries;
-    h->wflags = MSG_MORE;
-    SET_NEXT_STATE (%SEND_NRQUERIES);
-  }
-  return 0;
-
- NEWSTYLE.OPT_META_CONTEXT.SEND_NRQUERIES:
-  switch (send_from_wbuf (h)) {
-  case -1: SET_NEXT_STATE (%.DEAD); return 0;
-  case 0:
-    h->querynum = 0;
-    SET_NEXT_STATE (%PREPARE_NEXT_QUERY);
-  }
-  return 0;
-
- NEWSTYLE.OPT_META_CONTEXT.PREPARE_NEXT_QUERY:
-  if (h->querynum >= h->querylist.len) {
-    /* end of list of requested meta contexts */
-    SET_NEXT_STATE (%PREPARE_FOR_REPLY);
+  /* The whole option goes out in one write, and any reply arriving
+   * in the meantime is read straight away, to avoid a deadlock with
+   * servers that start replying before they have read every query.
+   */
+  if (pipeline_start (h, false, opt, false) == -1) {
+    SET_NEXT_STATE (%.DEAD);
     return 0;
   }
-  const char *query = h->querylist.ptr[h->querynum];
-
-  h->sbuf.len = htobe32 (strlen (query));
-  h->wbuf = &h->sbuf.len;
-  h->wlen = sizeof h->sbuf.len;
-  h->wflags = MSG_MORE;
-  SET_NEXT_STATE (%SEND_QUERYLEN);
-  return 0;
-
- NEWSTYLE.OPT_META_CONTEXT.SEND_QUERYLEN:
-  const char *query = h->querylist.ptr[h->querynum];
-
-  switch (send_from_wbuf (h)) {
-  case -1: SET_NEXT_STATE (%.DEAD); return 0;
-  case 0:
-    h->wbuf = query;
-    h->wlen = strlen (query);
-    SET_NEXT_STATE (%SEND_QUERY);
-  }
-  return 0;
-
- NEWSTYLE.OPT_META_CONTEXT.SEND_QUERY:
-  switch (send_from_wbuf (h)) {
-  case -1: SET_NEXT_STATE (%.DEAD); return 0;
-  case 0:
-    h->querynum++;
-    SET_NEXT_STATE (%PREPARE_NEXT_QUERY);
-  }
-  return 0;
-
- NEWSTYLE.OPT_META_CONTEXT.PREPARE_FOR_REPLY:
-  h->rbuf = &h->sbuf.or.option_reply;
-  h->rlen = sizeof h->sbuf.or.option_reply;
-  SET_NEXT_STATE (%RECV_REPLY);
-  return 0;
-
- NEWSTYLE.OPT_META_CONTEXT.RECV_REPLY:
-  uint32_t opt;
-
-  if (h->opt_current == NBD_OPT_LIST_META_CONTEXT)
-    opt = h->opt_current;
-  else
-    opt = NBD_OPT_SET_META_CONTEXT;
-
-  switch (recv_into_rbuf (h)) {
-  case -1: SET_NEXT_STATE (%.DEAD); return 0;
-  case 0:
-    if (prepare_for_reply_payload (h, opt) == -1) {
-      SET_NEXT_STATE (%.DEAD);
-      return 0;
-    }
-    SET_NEXT_STATE (%RECV_REPLY_PAYLOAD);
-  }
-  return 0;
-
- NEWSTYLE.OPT_META_CONTEXT.RECV_REPLY_PAYLOAD:
-  switch (recv_into_rbuf (h)) {
-  case -1: SET_NEXT_STATE (%.DEAD); return 0;
-  case 0:  SET_NEXT_STATE (%CHECK_REPLY);
-  }
+  SET_NEXT_STATE (%^OPT_PIPELINE.SEND);
   return 0;
 
  NEWSTYLE.OPT_META_CONTEXT.CHECK_REPLY:
@@ -209,6 +96,7 @@ STATE_MACHINE {
   const size_t maxpayload = sizeof h->sbuf.or.payload.context;
   struct meta_context meta_context;
   uint32_t opt;
+  size_t i;
   int err = 0;
 
   if (h->opt_current == NBD_OPT_LIST_META_CONTEXT)
@@ -220,9 +108,21 @@ STATE_MACHINE {
   len = be32toh (h->sbuf.or.option_reply.replylen);
   switch (reply) {
   case NBD_REP_ACK:           /* End of list of replies. */
-    if (opt == NBD_OPT_SET_META_CONTEXT)
-      h->meta_valid = true;
-    if (opt == h->opt_current) {
+    if (opt == NBD_OPT_SET_META_CONTEXT) {
+      /* A pipelined SET may have been sent alongside a request for
+       * structured replies that the server then refused.
+       */
+      if (h->structured_replies || opt == h->opt_current)
+        h->meta_valid = true;
+      else {
+        for (i = 0; i < h->meta_contexts.len; ++i)
+          free (h->meta_contexts.ptr[i].name);
+        meta_vector_reset (&h->meta_contexts);
+      }
+    }
+    if (pipeline_pop (h))
+      SET_NEXT_STATE (%^OPT_PIPELINE.NEXT_REPLY);
+    else if (opt == h->opt_current) {
       SET_NEXT_STATE (%.NEGOTIATING);
       CALL_CALLBACK (h->opt_cb.completion, &err);
       nbd_internal_free_option (h);
@@ -258,7 +158,7 @@ STATE_MACHINE {
         return 0;
       }
     }
-    SET_NEXT_STATE (%PREPARE_FOR_REPLY);
+    SET_NEXT_STATE (%^OPT_PIPELINE.NEXT_REPLY);
     break;
   default:
     /* Anything else is an error, report it for explicit LIST/SET, ignore it
@@ -269,7 +169,12 @@ STATE_MACHINE {
       return 0;
     }
 
-    if (opt == h->opt_current) {
+    if (pipeline_pop (h)) {
+      debug (h, "handshake: ignoring unexpected error from "
+             "NBD_OPT_SET_META_CONTEXT (%" PRIu32 ")", reply);
+      SET_NEXT_STATE (%^OPT_PIPELINE.NEXT_REPLY);
+    }
+    else if (opt == h->opt_current) {
       /* XXX Should we decode specific expected errors, like
        * REP_ERR_UNKNOWN to ENOENT or REP_ERR_TOO_BIG to ERANGE?
        */
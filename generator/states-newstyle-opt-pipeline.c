@@ -0,0 +1,285 @@
+/* nbd client library in userspace: state machine
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* State machine for sending several newstyle options back-to-back.
+ *
+ * The options are encoded into h->pipeline_buf and sent as one
+ * write.  While sending, any reply which arrives is read at once, so
+ * that a server which replies to an option before reading all of it
+ * can never leave both sides blocked in write.  Each reply is passed
+ * to the CHECK_REPLY state of the option it belongs to, which calls
+ * pipeline_pop once the option is finished.  Replies come back in
+ * the order the options were sent, as recorded in h->pipeline.
+ *
+ * This is used for every NBD_OPT_SET/LIST_META_CONTEXT (queries can
+ * be large), and with nbd_set_pipeline_options for the whole of
+ * NBD_OPT_STRUCTURED_REPLY, NBD_OPT_SET_META_CONTEXT and NBD_OPT_GO
+ * during nbd_connect_*.
+ */
+
+static char *
+pipeline_put_be16 (char *p, uint16_t v)
+{
+  v = htobe16 (v);
+  memcpy (p, &v, sizeof v);
+  return p + sizeof v;
+}
+
+static char *
+pipeline_put_be32 (char *p, uint32_t v)
+{
+  v = htobe32 (v);
+  memcpy (p, &v, sizeof v);
+  return p + sizeof v;
+}
+
+static char *
+pipeline_put_string (char *p, const char *str)
+{
+  const size_t len = strlen (str);
+
+  p = pipeline_put_be32 (p, len);
+  memcpy (p, str, len);
+  return p + len;
+}
+
+static char *
+pipeline_put_option (char *p, uint32_t option, uint32_t optlen)
+{
+  uint64_t version = htobe64 (NBD_NEW_VERSION);
+
+  memcpy (p, &version, sizeof version);
+  p += sizeof version;
+  p = pipeline_put_be32 (p, option);
+  return pipeline_put_be32 (p, optlen);
+}
+
+/* Encode the requested options into h->pipeline_buf, ready for
+ * OPT_PIPELINE.SEND.  meta_opt is NBD_OPT_SET_META_CONTEXT,
+ * NBD_OPT_LIST_META_CONTEXT or 0 to skip it, and the queries come
+ * from h->querylist.  If go is true, h->opt_current must already be
+ * NBD_OPT_GO or NBD_OPT_INFO.
+ */
+static int
+pipeline_start (struct nbd_handle *h, bool sr, uint32_t meta_opt, bool go)
+{
+  const size_t exportnamelen = strlen (h->export_name);
+  uint32_t meta_len = 0, go_len = 0;
+  uint16_t nrinfos = 0;
+  size_t len = 0, i;
+  char *p;
+
+  assert (h->pipeline_buf == NULL);
+  assert (h->pipeline_nr == 0);
+
+  if (sr)
+    len += sizeof h->sbuf.option;
+  if (meta_opt) {
+    meta_len = 4 /* exportname len */ + exportnamelen + 4 /* nr queries */;
+    for (i = 0; i < h->querylist.len; ++i)
+      meta_len += 4 /* length of query */ + strlen (h->querylist.ptr[i]);
+    len += sizeof h->sbuf.option + meta_len;
+  }
+  if (go) {
+    if (h->request_block_size)
+      nrinfos++;
+    if (h->full_info)
+      nrinfos += 2;
+    go_len = 4 /* exportname len */ + exportnamelen
+      + sizeof nrinfos + 2 * nrinfos;
+    len += sizeof h->sbuf.option + go_len;
+  }
+
+  h->pipeline_buf = p = malloc (len);
+  if (p == NULL) {
+    set_error (errno, "malloc");
+    return -1;
+  }
+
+  if (sr) {
+    p = pipeline_put_option (p, NBD_OPT_STRUCTURED_REPLY, 0);
+    h->pipeline[h->pipeline_nr++] = NBD_OPT_STRUCTURED_REPLY;
+    h->chunks_sent++;
+  }
+  if (meta_opt) {
+    p = pipeline_put_option (p, meta_opt, meta_len);
+    p = pipeline_put_string (p, h->export_name);
+    p = pipeline_put_be32 (p, h->querylist.len);
+    for (i = 0; i < h->querylist.len; ++i)
+      p = pipeline_put_string (p, h->querylist.ptr[i]);
+    h->pipeline[h->pipeline_nr++] = meta_opt;
+    h->chunks_sent++;
+  }
+  if (go) {
+    p = pipeline_put_option (p, h->opt_current, go_len);
+    p = pipeline_put_string (p, h->export_name);
+    p = pipeline_put_be16 (p, nrinfos);
+    if (h->request_block_size)
+      p = pipeline_put_be16 (p, NBD_INFO_BLOCK_SIZE);
+    if (h->full_info) {
+      p = pipeline_put_be16 (p, NBD_INFO_NAME);
+      p = pipeline_put_be16 (p, NBD_INFO_DESCRIPTION);
+    }
+    h->pipeline[h->pipeline_nr++] = h->opt_current;
+    h->chunks_sent++;
+  }
+  assert (p == h->pipeline_buf + len);
+  assert (h->pipeline_nr > 0);
+
+  h->pipeline_head = 0;
+  h->wbuf = h->pipeline_buf;
+  h->wlen = len;
+  h->wflags = 0;
+  return 0;
+}
+
+/* Called by an option's CHECK_REPLY state when its final reply has
+ * been handled.  Returns true if more pipelined replies are still to
+ * come, in which case the caller should move to
+ * OPT_PIPELINE.NEXT_REPLY instead of its usual next state.
+ */
+static bool
+pipeline_pop (struct nbd_handle *h)
+{
+  if (h->pipeline_nr == 0)
+    return false;
+
+  if (++h->pipeline_head < h->pipeline_nr)
+    return true;
+
+  /* PREPARE_FOR_REPLY never reads a reply to the last option before
+   * all of it has been sent.
+   */
+  assert (h->pipeline_buf == NULL);
+  h->pipeline_nr = h->pipeline_head = 0;
+  return false;
+}
+
+STATE_MACHINE {
+ NEWSTYLE.OPT_PIPELINE.START:
+  bool sr;
+  uint32_t meta_opt = 0;
+  size_t i;
+
+  assert (h->gflags & LIBNBD_HANDSHAKE_FLAG_FIXED_NEWSTYLE);
+  assert (h->pipeline_options && !h->opt_mode && !h->opt_current);
+  assert (CALLBACK_IS_NULL (h->opt_cb.completion));
+
+  /* Same decisions as the sequential path, except that we cannot
+   * wait to see if structured replies were agreed before asking for
+   * meta contexts.  OPT_META_CONTEXT.CHECK_REPLY discards the
+   * contexts if the server then turns out not to support them.
+   */
+  sr = h->request_sr && !h->extended_headers;
+  if (h->request_meta) {
+    for (i = 0; i < h->meta_contexts.len; ++i)
+      free (h->meta_contexts.ptr[i].name);
+    meta_vector_reset (&h->meta_contexts);
+    h->meta_valid = false;
+    if ((sr || h->structured_replies) && h->request_meta_contexts.len > 0) {
+      if (nbd_internal_set_querylist (h, NULL) == -1) {
+        SET_NEXT_STATE (%.DEAD);
+        return 0;
+      }
+      meta_opt = NBD_OPT_SET_META_CONTEXT;
+    }
+  }
+
+  nbd_internal_reset_size_and_flags (h);
+  h->opt_current = NBD_OPT_GO;
+  if (pipeline_start (h, sr, meta_opt, true) == -1) {
+    SET_NEXT_STATE (%.DEAD);
+    return 0;
+  }
+  debug (h, "sending %u options without waiting for replies",
+         h->pipeline_nr);
+  SET_NEXT_STATE (%SEND);
+  return 0;
+
+ NEWSTYLE.OPT_PIPELINE.SEND:
+  switch (send_from_wbuf (h)) {
+  case -1: SET_NEXT_STATE (%.DEAD); return 0;
+  case 0:
+    free (h->pipeline_buf);
+    h->pipeline_buf = NULL;
+    SET_NEXT_STATE (%PREPARE_FOR_REPLY);
+  }
+  return 0;
+
+ NEWSTYLE.OPT_PIPELINE.PREPARE_FOR_REPLY:
+  assert (h->pipeline_head < h->pipeline_nr);
+  /* Early replies to the options already sent in full are fine, but
+   * the server cannot reply to the last option before it has all of
+   * it.
+   */
+  if (h->pipeline_buf && h->pipeline_head == h->pipeline_nr - 1) {
+    set_error (EPROTO, "handshake: server replied to option %" PRIu32
+               " before it was sent", h->pipeline[h->pipeline_head]);
+    SET_NEXT_STATE (%.DEAD);
+    return 0;
+  }
+  h->rbuf = &h->sbuf.or.option_reply;
+  h->rlen = sizeof h->sbuf.or.option_reply;
+  SET_NEXT_STATE (%RECV_REPLY);
+  return 0;
+
+ NEWSTYLE.OPT_PIPELINE.RECV_REPLY:
+  switch (recv_into_rbuf (h)) {
+  case -1: SET_NEXT_STATE (%.DEAD); return 0;
+  case 0:
+    if (prepare_for_reply_payload (h, h->pipeline[h->pipeline_head]) == -1) {
+      SET_NEXT_STATE (%.DEAD);
+      return 0;
+    }
+    SET_NEXT_STATE (%RECV_REPLY_PAYLOAD);
+  }
+  return 0;
+
+ NEWSTYLE.OPT_PIPELINE.RECV_REPLY_PAYLOAD:
+  switch (recv_into_rbuf (h)) {
+  case -1: SET_NEXT_STATE (%.DEAD); return 0;
+  case 0:  SET_NEXT_STATE (%CHECK_REPLY);
+  }
+  return 0;
+
+ NEWSTYLE.OPT_PIPELINE.CHECK_REPLY:
+  switch (h->pipeline[h->pipeline_head]) {
+  case NBD_OPT_STRUCTURED_REPLY:
+    SET_NEXT_STATE (%^OPT_STRUCTURED_REPLY.CHECK_REPLY);
+    break;
+  case NBD_OPT_SET_META_CONTEXT:
+  case NBD_OPT_LIST_META_CONTEXT:
+    SET_NEXT_STATE (%^OPT_META_CONTEXT.CHECK_REPLY);
+    break;
+  case NBD_OPT_GO:
+  case NBD_OPT_INFO:
+    SET_NEXT_STATE (%^OPT_GO.CHECK_REPLY);
+    break;
+  default: abort ();
+  }
+  return 0;
+
+ NEWSTYLE.OPT_PIPELINE.NEXT_REPLY:
+  /* Go back to sending if we broke off to read a reply early. */
+  if (h->pipeline_buf)
+    SET_NEXT_STATE (%SEND);
+  else
+    SET_NEXT_STATE (%PREPARE_FOR_REPLY);
+  return 0;
+
+} /* END STATE MACHINE */
@@ -25,7 +25,14 @@ STATE_MACHINE {
     assert (h->opt_mode);
   else {
     assert (CALLBACK_IS_NULL (h->opt_cb.completion));
-    if (!h->request_sr) {
+    if (h->pipeline_options && !h->opt_mode) {
+      SET_NEXT_STATE (%^OPT_PIPELINE.START);
+      return 0;
+    }
+    /* Extended headers imply structured replies, so there is no
+     * need to also negotiate them separately.
+     */
+    if (!h->request_sr || h->extended_headers) {
       if (h->opt_mode)
         SET_NEXT_STATE (%.NEGOTIATING);
       else
@@ -100,7 +107,9 @@ STATE_MACHINE {
   }
 
   /* Next option. */
-  if (h->opt_mode)
+  if (pipeline_pop (h))
+    SET_NEXT_STATE (%^OPT_PIPELINE.NEXT_REPLY);
+  else if (h->opt_mode)
     SET_NEXT_STATE (%.NEGOTIATING);
   else
     SET_NEXT_STATE (%^OPT_META_CONTEXT.START);
@@ -146,6 +146,9 @@ STATE_MACHINE {
     case NBD_OPT_STRUCTURED_REPLY:
       SET_NEXT_STATE (%OPT_STRUCTURED_REPLY.START);
       return 0;
+    case NBD_OPT_EXTENDED_HEADERS:
+      SET_NEXT_STATE (%OPT_EXTENDED_HEADERS.START);
+      return 0;
     case NBD_OPT_STARTTLS:
       SET_NEXT_STATE (%OPT_STARTTLS.START);
       return 0;
@@ -242,6 +245,8 @@ STATE_MACHINE {
   return 0;
 
  NEWSTYLE.FINISHED:
+  nbd_internal_uring_start (h);
+  nbd_internal_zerocopy_start (h);
   SET_NEXT_STATE (%.READY);
   return 0;
 
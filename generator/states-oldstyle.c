@@ -72,6 +72,8 @@ STATE_MACHINE {
 
   h->protocol = "oldstyle";
 
+  nbd_internal_uring_start (h);
+  nbd_internal_zerocopy_start (h);
   SET_NEXT_STATE (%.READY);
 
   return 0;
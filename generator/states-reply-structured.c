@@ -22,19 +22,31 @@
 #include <stdint.h>
 #include <inttypes.h>
 
+/* Return the payload length of the current structured or extended
+ * reply header.
+ */
+static uint64_t
+structured_reply_length (struct nbd_handle *h)
+{
+  if (h->extended_headers)
+    return be64toh (h->sbuf.reply.hdr.extended.length);
+  else
+    return be32toh (h->sbuf.reply.hdr.structured.length);
+}
+
 /* Structured reply must be completely inside the bounds of the
  * requesting command.
  */
 static bool
-structured_reply_in_bounds (uint64_t offset, uint32_t length,
+structured_reply_in_bounds (uint64_t offset, uint64_t length,
                             const struct command *cmd)
 {
   if (offset < cmd->offset ||
       offset >= cmd->offset + cmd->count ||
-      offset + length > cmd->offset + cmd->count) {
+      length > cmd->offset + cmd->count - offset) {
     set_error (0, "range of structured reply is out of bounds, "
                "offset=%" PRIu64 ", cmd->offset=%" PRIu64 ", "
-               "length=%" PRIu32 ", cmd->count=%" PRIu32 ": "
+               "length=%" PRIu64 ", cmd->count=%" PRIu64 ": "
                "this is likely to be a bug in the NBD server",
                offset, cmd->offset, length, cmd->count);
     return false;
@@ -46,12 +58,15 @@ structured_reply_in_bounds (uint64_t offset, uint32_t length,
 STATE_MACHINE {
  REPLY.STRUCTURED_REPLY.START:
   /* We've only read the simple_reply.  The structured_reply is longer,
-   * so read the remaining part.
+   * so read the remaining part.  (With extended headers, the whole
+   * header was already read, and REPLY.CHECK_SIMPLE_OR_STRUCTURED_REPLY
+   * skips directly to CHECK.)
    */
-  h->rbuf = &h->sbuf;
-  h->rbuf = (char *) h->rbuf + sizeof h->sbuf.simple_reply;
-  h->rlen = sizeof h->sbuf.sr.structured_reply;
-  h->rlen -= sizeof h->sbuf.simple_reply;
+  assert (!h->extended_headers);
+  h->rbuf = &h->sbuf.reply.hdr;
+  h->rbuf = (char *) h->rbuf + sizeof h->sbuf.reply.hdr.simple;
+  h->rlen = sizeof h->sbuf.reply.hdr.structured;
+  h->rlen -= sizeof h->sbuf.reply.hdr.simple;
   SET_NEXT_STATE (%RECV_REMAINING);
   return 0;
 
@@ -69,11 +84,12 @@ STATE_MACHINE {
  REPLY.STRUCTURED_REPLY.CHECK:
   struct command *cmd = h->reply_cmd;
   uint16_t flags, type;
-  uint32_t length;
+  uint64_t length;
 
-  flags = be16toh (h->sbuf.sr.structured_reply.flags);
-  type = be16toh (h->sbuf.sr.structured_reply.type);
-  length = be32toh (h->sbuf.sr.structured_reply.length);
+  /* These fields are coincident between hdr.structured and hdr.extended */
+  flags = be16toh (h->sbuf.reply.hdr.structured.flags);
+  type = be16toh (h->sbuf.reply.hdr.structured.type);
+  length = structured_reply_length (h);
 
   /* Reject a server that replies with too much information, but don't
    * reject a single structured reply to NBD_CMD_READ on the largest
@@ -82,8 +98,8 @@ STATE_MACHINE {
    * oversized reply is going to take long enough to resync that it is
    * not worth keeping the connection alive.
    */
-  if (length > MAX_REQUEST_SIZE + sizeof h->sbuf.sr.payload.offset_data) {
-    set_error (0, "invalid server reply length %" PRIu32, length);
+  if (length > MAX_REQUEST_SIZE + sizeof h->sbuf.reply.payload.offset_data) {
+    set_error (0, "invalid server reply length %" PRIu64, length);
     SET_NEXT_STATE (%.DEAD);
     return 0;
   }
@@ -105,40 +121,40 @@ STATE_MACHINE {
      * them as an extension, so we use < instead of <=.
      */
     if (cmd->type != NBD_CMD_READ ||
-        length < sizeof h->sbuf.sr.payload.offset_data)
+        length < sizeof h->sbuf.reply.payload.offset_data)
       goto resync;
-    h->rbuf = &h->sbuf.sr.payload.offset_data;
-    h->rlen = sizeof h->sbuf.sr.payload.offset_data;
+    h->rbuf = &h->sbuf.reply.payload.offset_data;
+    h->rlen = sizeof h->sbuf.reply.payload.offset_data;
     SET_NEXT_STATE (%RECV_OFFSET_DATA);
     break;
 
   case NBD_REPLY_TYPE_OFFSET_HOLE:
     if (cmd->type != NBD_CMD_READ ||
-        length != sizeof h->sbuf.sr.payload.offset_hole)
+        length != sizeof h->sbuf.reply.payload.offset_hole)
       goto resync;
-    h->rbuf = &h->sbuf.sr.payload.offset_hole;
-    h->rlen = sizeof h->sbuf.sr.payload.offset_hole;
+    h->rbuf = &h->sbuf.reply.payload.offset_hole;
+    h->rlen = sizeof h->sbuf.reply.payload.offset_hole;
     SET_NEXT_STATE (%RECV_OFFSET_HOLE);
     break;
 
   case NBD_REPLY_TYPE_BLOCK_STATUS:
-    if (cmd->type != NBD_CMD_BLOCK_STATUS ||
+    if (h->extended_headers || cmd->type != NBD_CMD_BLOCK_STATUS ||
         length < 12 || ((length-4) & 7) != 0)
       goto resync;
     assert (CALLBACK_IS_NOT_NULL (cmd->cb.fn.extent));
-    /* We read the context ID followed by all the entries into a
-     * single array and deal with it at the end.
-     */
-    free (h->bs_entries);
-    h->bs_entries = malloc (length);
-    if (h->bs_entries == NULL) {
-      SET_NEXT_STATE (%.DEAD);
-      set_error (errno, "malloc");
-      break;
-    }
-    h->rbuf = h->bs_entries;
-    h->rlen = length;
-    SET_NEXT_STATE (%RECV_BS_ENTRIES);
+    h->rbuf = &h->sbuf.reply.payload.bs_hdr;
+    h->rlen = sizeof h->sbuf.reply.payload.bs_hdr;
+    SET_NEXT_STATE (%RECV_BS_HEADER);
+    break;
+
+  case NBD_REPLY_TYPE_BLOCK_STATUS_EXT:
+    if (!h->extended_headers || cmd->type != NBD_CMD_BLOCK_STATUS ||
+        length < 24 || ((length-8) & 15) != 0)
+      goto resync;
+    assert (CALLBACK_IS_NOT_NULL (cmd->cb.fn.extent));
+    h->rbuf = &h->sbuf.reply.payload.bs_ext_hdr;
+    h->rlen = sizeof h->sbuf.reply.payload.bs_ext_hdr;
+    SET_NEXT_STATE (%RECV_BS_HEADER);
     break;
 
   default:
@@ -148,10 +164,10 @@ STATE_MACHINE {
        * compliant, will favor the wire error over EPROTO during more
        * length checks in RECV_ERROR_MESSAGE and RECV_ERROR_TAIL.
        */
-      if (length < sizeof h->sbuf.sr.payload.error.error.error)
+      if (length < sizeof h->sbuf.reply.payload.error.error.error)
         goto resync;
-      h->rbuf = &h->sbuf.sr.payload.error.error;
-      h->rlen = MIN (length, sizeof h->sbuf.sr.payload.error.error);
+      h->rbuf = &h->sbuf.reply.payload.error.error;
+      h->rlen = MIN (length, sizeof h->sbuf.reply.payload.error.error);
       SET_NEXT_STATE (%RECV_ERROR);
     }
     else
@@ -168,7 +184,8 @@ STATE_MACHINE {
 
  REPLY.STRUCTURED_REPLY.RECV_ERROR:
   struct command *cmd = h->reply_cmd;
-  uint32_t length, msglen, error;
+  uint64_t length;
+  uint32_t msglen, error;
 
   switch (recv_into_rbuf (h)) {
   case -1: SET_NEXT_STATE (%.DEAD); return 0;
@@ -177,19 +194,19 @@ STATE_MACHINE {
     SET_NEXT_STATE (%.READY);
     return 0;
   case 0:
-    length = be32toh (h->sbuf.sr.structured_reply.length);
-    assert (length >= sizeof h->sbuf.sr.payload.error.error.error);
+    length = structured_reply_length (h);
+    assert (length >= sizeof h->sbuf.reply.payload.error.error.error);
     assert (cmd);
 
-    if (length < sizeof h->sbuf.sr.payload.error.error)
+    if (length < sizeof h->sbuf.reply.payload.error.error)
       goto resync;
 
-    msglen = be16toh (h->sbuf.sr.payload.error.error.len);
-    if (msglen > length - sizeof h->sbuf.sr.payload.error.error ||
-        msglen > sizeof h->sbuf.sr.payload.error.msg)
+    msglen = be16toh (h->sbuf.reply.payload.error.error.len);
+    if (msglen > length - sizeof h->sbuf.reply.payload.error.error ||
+        msglen > sizeof h->sbuf.reply.payload.error.msg)
       goto resync;
 
-    h->rbuf = h->sbuf.sr.payload.error.msg;
+    h->rbuf = h->sbuf.reply.payload.error.msg;
     h->rlen = msglen;
     SET_NEXT_STATE (%RECV_ERROR_MESSAGE);
   }
@@ -197,16 +214,17 @@ STATE_MACHINE {
 
  resync:
   /* Favor the error packet's errno over RESYNC's EPROTO. */
-  error = be32toh (h->sbuf.sr.payload.error.error.error);
+  error = be32toh (h->sbuf.reply.payload.error.error.error);
   if (cmd->error == 0)
     cmd->error = nbd_internal_errno_of_nbd_error (error);
   h->rbuf = NULL;
-  h->rlen = length - MIN (length, sizeof h->sbuf.sr.payload.error.error);
+  h->rlen = length - MIN (length, sizeof h->sbuf.reply.payload.error.error);
   SET_NEXT_STATE (%RESYNC);
   return 0;
 
  REPLY.STRUCTURED_REPLY.RECV_ERROR_MESSAGE:
-  uint32_t length, msglen;
+  uint64_t length;
+  uint32_t msglen;
   uint16_t type;
 
   switch (recv_into_rbuf (h)) {
@@ -216,15 +234,15 @@ STATE_MACHINE {
     SET_NEXT_STATE (%.READY);
     return 0;
   case 0:
-    length = be32toh (h->sbuf.sr.structured_reply.length);
-    msglen = be16toh (h->sbuf.sr.payload.error.error.len);
-    type = be16toh (h->sbuf.sr.structured_reply.type);
+    length = structured_reply_length (h);
+    msglen = be16toh (h->sbuf.reply.payload.error.error.len);
+    type = be16toh (h->sbuf.reply.hdr.structured.type);
 
-    length -= sizeof h->sbuf.sr.payload.error.error + msglen;
+    length -= sizeof h->sbuf.reply.payload.error.error + msglen;
 
     if (msglen)
       debug (h, "structured error server message: %.*s", (int) msglen,
-             h->sbuf.sr.payload.error.msg);
+             h->sbuf.reply.payload.error.msg);
 
     /* Special case two specific errors; silently ignore tail for all others */
     h->rbuf = NULL;
@@ -236,11 +254,11 @@ STATE_MACHINE {
                "the server may have a bug");
       break;
     case NBD_REPLY_TYPE_ERROR_OFFSET:
-      if (length != sizeof h->sbuf.sr.payload.error.offset)
+      if (length != sizeof h->sbuf.reply.payload.error.offset)
         debug (h, "unable to safely extract error offset, "
                "the server may have a bug");
       else
-        h->rbuf = &h->sbuf.sr.payload.error.offset;
+        h->rbuf = &h->sbuf.reply.payload.error.offset;
       break;
     }
     SET_NEXT_STATE (%RECV_ERROR_TAIL);
@@ -259,8 +277,8 @@ STATE_MACHINE {
     SET_NEXT_STATE (%.READY);
     return 0;
   case 0:
-    error = be32toh (h->sbuf.sr.payload.error.error.error);
-    type = be16toh (h->sbuf.sr.structured_reply.type);
+    error = be32toh (h->sbuf.reply.payload.error.error.error);
+    type = be16toh (h->sbuf.reply.hdr.structured.type);
 
     assert (cmd); /* guaranteed by CHECK */
 
@@ -275,7 +293,7 @@ STATE_MACHINE {
      * user callback if present.  Ignore the offset if it was bogus.
      */
     if (type == NBD_REPLY_TYPE_ERROR_OFFSET && h->rbuf) {
-      uint64_t offset = be64toh (h->sbuf.sr.payload.error.offset);
+      uint64_t offset = be64toh (h->sbuf.reply.payload.error.offset);
       if (structured_reply_in_bounds (offset, 0, cmd) &&
           cmd->type == NBD_CMD_READ &&
           CALLBACK_IS_NOT_NULL (cmd->cb.fn.chunk)) {
@@ -307,7 +325,7 @@ STATE_MACHINE {
  REPLY.STRUCTURED_REPLY.RECV_OFFSET_DATA:
   struct command *cmd = h->reply_cmd;
   uint64_t offset;
-  uint32_t length;
+  uint64_t length;
 
   switch (recv_into_rbuf (h)) {
   case -1: SET_NEXT_STATE (%.DEAD); return 0;
@@ -316,12 +334,12 @@ STATE_MACHINE {
     SET_NEXT_STATE (%.READY);
     return 0;
   case 0:
-    length = be32toh (h->sbuf.sr.structured_reply.length);
-    offset = be64toh (h->sbuf.sr.payload.offset_data.offset);
+    length = structured_reply_length (h);
+    offset = be64toh (h->sbuf.reply.payload.offset_data.offset);
 
     assert (cmd); /* guaranteed by CHECK */
 
-    assert (cmd->data && cmd->type == NBD_CMD_READ);
+    assert ((cmd->data || cmd->iov) && cmd->type == NBD_CMD_READ);
 
     /* Length of the data following. */
     length -= 8;
@@ -337,8 +355,7 @@ STATE_MACHINE {
     offset -= cmd->offset;
 
     /* Set up to receive the data directly to the user buffer. */
-    h->rbuf = (char *) cmd->data + offset;
-    h->rlen = length;
+    set_rbuf_to_cmd (h, cmd, offset, length);
     SET_NEXT_STATE (%RECV_OFFSET_DATA_DATA);
   }
   return 0;
@@ -346,7 +363,7 @@ STATE_MACHINE {
  REPLY.STRUCTURED_REPLY.RECV_OFFSET_DATA_DATA:
   struct command *cmd = h->reply_cmd;
   uint64_t offset;
-  uint32_t length;
+  uint64_t length;
 
   switch (recv_into_rbuf (h)) {
   case -1: SET_NEXT_STATE (%.DEAD); return 0;
@@ -355,8 +372,8 @@ STATE_MACHINE {
     SET_NEXT_STATE (%.READY);
     return 0;
   case 0:
-    length = be32toh (h->sbuf.sr.structured_reply.length);
-    offset = be64toh (h->sbuf.sr.payload.offset_data.offset);
+    length = structured_reply_length (h);
+    offset = be64toh (h->sbuf.reply.payload.offset_data.offset);
 
     assert (cmd); /* guaranteed by CHECK */
     if (CALLBACK_IS_NOT_NULL (cmd->cb.fn.chunk)) {
@@ -386,12 +403,12 @@ STATE_MACHINE {
     SET_NEXT_STATE (%.READY);
     return 0;
   case 0:
-    offset = be64toh (h->sbuf.sr.payload.offset_hole.offset);
-    length = be32toh (h->sbuf.sr.payload.offset_hole.length);
+    offset = be64toh (h->sbuf.reply.payload.offset_hole.offset);
+    length = be32toh (h->sbuf.reply.payload.offset_hole.length);
 
     assert (cmd); /* guaranteed by CHECK */
 
-    assert (cmd->data && cmd->type == NBD_CMD_READ);
+    assert ((cmd->data || cmd->iov) && cmd->type == NBD_CMD_READ);
 
     /* Is the data within bounds? */
     if (! structured_reply_in_bounds (offset, length, cmd)) {
@@ -408,7 +425,7 @@ STATE_MACHINE {
      * them as an extension, and this works even when length == 0.
      */
     if (!cmd->initialized)
-      memset ((char *) cmd->data + offset, 0, length);
+      zero_cmd_data (cmd, offset, length);
     if (CALLBACK_IS_NOT_NULL (cmd->cb.fn.chunk)) {
       int error = cmd->error;
 
@@ -424,11 +441,69 @@ STATE_MACHINE {
   }
   return 0;
 
+ REPLY.STRUCTURED_REPLY.RECV_BS_HEADER:
+  struct command *cmd = h->reply_cmd;
+  uint64_t length;
+  uint16_t type;
+  size_t hdrlen, desclen;
+
+  switch (recv_into_rbuf (h)) {
+  case -1: SET_NEXT_STATE (%.DEAD); return 0;
+  case 1:
+    save_reply_state (h);
+    SET_NEXT_STATE (%.READY);
+    return 0;
+  case 0:
+    length = structured_reply_length (h);
+    type = be16toh (h->sbuf.reply.hdr.structured.type);
+
+    assert (cmd); /* guaranteed by CHECK */
+    assert (cmd->type == NBD_CMD_BLOCK_STATUS);
+
+    if (type == NBD_REPLY_TYPE_BLOCK_STATUS_EXT) {
+      hdrlen = sizeof h->sbuf.reply.payload.bs_ext_hdr;
+      desclen = sizeof (struct nbd_block_descriptor_ext);
+    }
+    else {
+      hdrlen = sizeof h->sbuf.reply.payload.bs_hdr;
+      desclen = sizeof (struct nbd_block_descriptor);
+    }
+    length -= hdrlen;
+    h->bs_count = length / desclen;
+
+    /* The extended header repeats the descriptor count, which must
+     * agree with the payload length.
+     */
+    if (type == NBD_REPLY_TYPE_BLOCK_STATUS_EXT &&
+        be32toh (h->sbuf.reply.payload.bs_ext_hdr.count) != h->bs_count) {
+      h->rbuf = NULL;
+      h->rlen = length;
+      SET_NEXT_STATE (%RESYNC);
+      return 0;
+    }
+
+    /* We read all the descriptors into a single array and deal with
+     * it at the end.
+     */
+    free (h->bs_raw);
+    h->bs_raw = malloc (length);
+    if (h->bs_raw == NULL) {
+      SET_NEXT_STATE (%.DEAD);
+      set_error (errno, "malloc");
+      return 0;
+    }
+    h->rbuf = h->bs_raw;
+    h->rlen = length;
+    SET_NEXT_STATE (%RECV_BS_ENTRIES);
+  }
+  return 0;
+
  REPLY.STRUCTURED_REPLY.RECV_BS_ENTRIES:
   struct command *cmd = h->reply_cmd;
-  uint32_t length;
+  uint16_t type;
   size_t i;
   uint32_t context_id;
+  nbd_extent *cooked;
 
   switch (recv_into_rbuf (h)) {
   case -1: SET_NEXT_STATE (%.DEAD); return 0;
@@ -437,34 +512,67 @@ STATE_MACHINE {
     SET_NEXT_STATE (%.READY);
     return 0;
   case 0:
-    length = be32toh (h->sbuf.sr.structured_reply.length);
+    type = be16toh (h->sbuf.reply.hdr.structured.type);
 
     assert (cmd); /* guaranteed by CHECK */
     assert (cmd->type == NBD_CMD_BLOCK_STATUS);
     assert (CALLBACK_IS_NOT_NULL (cmd->cb.fn.extent));
-    assert (h->bs_entries);
-    assert (length >= 12);
+    assert (h->bs_raw);
+    assert (h->bs_count > 0);
     assert (h->meta_valid);
 
-    /* Need to byte-swap the entries returned, but apart from that we
-     * don't validate them.
+    cooked = realloc (h->bs_cooked, h->bs_count * sizeof *cooked);
+    if (cooked == NULL) {
+      SET_NEXT_STATE (%.DEAD);
+      set_error (errno, "realloc");
+      return 0;
+    }
+    h->bs_cooked = cooked;
+
+    /* Need to byte-swap the entries returned, and widen them if they
+     * came from a 32 bit reply, but apart from that we don't validate
+     * them.
      */
-    for (i = 0; i < length/4; ++i)
-      h->bs_entries[i] = be32toh (h->bs_entries[i]);
+    if (type == NBD_REPLY_TYPE_BLOCK_STATUS_EXT) {
+      const struct nbd_block_descriptor_ext *raw = h->bs_raw;
 
-    /* Look up the context ID. */
-    context_id = h->bs_entries[0];
+      for (i = 0; i < h->bs_count; ++i) {
+        cooked[i].length = be64toh (raw[i].length);
+        cooked[i].flags = be64toh (raw[i].status_flags);
+      }
+    }
+    else {
+      const struct nbd_block_descriptor *raw = h->bs_raw;
+
+      for (i = 0; i < h->bs_count; ++i) {
+        cooked[i].length = be32toh (raw[i].length);
+        cooked[i].flags = be32toh (raw[i].status_flags);
+      }
+    }
+
+    /* Look up the context ID.  This field is coincident between
+     * bs_hdr and bs_ext_hdr.
+     */
+    context_id = be32toh (h->sbuf.reply.payload.bs_hdr.context_id);
     for (i = 0; i < h->meta_contexts.len; ++i)
       if (context_id == h->meta_contexts.ptr[i].context_id)
         break;
 
     if (i < h->meta_contexts.len) {
-      /* Call the caller's extent function. */
       int error = cmd->error;
 
+      /* Cache the extents before the caller's extent function gets a
+       * chance to modify them.
+       */
+      if (h->extent_cache)
+        nbd_internal_extent_cache_insert (h, cmd,
+                                          h->meta_contexts.ptr[i].name,
+                                          cooked, h->bs_count);
+
+      /* Call the caller's extent function. */
       if (CALL_CALLBACK (cmd->cb.fn.extent,
                          h->meta_contexts.ptr[i].name, cmd->offset,
-                         &h->bs_entries[1], (length-4) / 4,
+                         cooked, h->bs_count,
                          &error) == -1)
         if (cmd->error == 0)
           cmd->error = error ? error : EPROTO;
@@ -481,7 +589,7 @@ STATE_MACHINE {
  REPLY.STRUCTURED_REPLY.RESYNC:
   struct command *cmd = h->reply_cmd;
   uint16_t type;
-  uint32_t length;
+  uint64_t length;
 
   assert (h->rbuf == NULL);
   switch (recv_into_rbuf (h)) {
@@ -500,9 +608,9 @@ STATE_MACHINE {
       SET_NEXT_STATE (%^FINISH_COMMAND);
       return 0;
     }
-    type = be16toh (h->sbuf.sr.structured_reply.type);
-    length = be32toh (h->sbuf.sr.structured_reply.length);
-    debug (h, "unexpected reply type %u or payload length %" PRIu32
+    type = be16toh (h->sbuf.reply.hdr.structured.type);
+    length = structured_reply_length (h);
+    debug (h, "unexpected reply type %u or payload length %" PRIu64
            " for cookie %" PRIu64 " and command %" PRIu32
            ", this is probably a server bug",
            type, length, cmd->cookie, cmd->type);
@@ -515,7 +623,7 @@ STATE_MACHINE {
  REPLY.STRUCTURED_REPLY.FINISH:
   uint16_t flags;
 
-  flags = be16toh (h->sbuf.sr.structured_reply.flags);
+  flags = be16toh (h->sbuf.reply.hdr.structured.flags);
   if (flags & NBD_REPLY_FLAG_DONE) {
     SET_NEXT_STATE (%^FINISH_COMMAND);
   }
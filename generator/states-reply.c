@@ -62,27 +62,47 @@ STATE_MACHINE {
    */
   ssize_t r;
 
-  /* We read all replies initially as if they are simple replies, but
-   * check the magic in CHECK_SIMPLE_OR_STRUCTURED_REPLY below.
-   * This works because the structured_reply header is larger.
+  /* With extended headers, there is only one size to read, so we can
+   * do it all in one syscall.  But for older structured replies, we
+   * don't know if we have a simple or structured reply until we read
+   * the magic number, requiring a two-part read with
+   * CHECK_SIMPLE_OR_STRUCTURED_REPLY below.  This works because the
+   * structured_reply header is larger.
    */
   assert (h->reply_cmd == NULL);
   assert (h->rlen == 0);
 
-  h->rbuf = &h->sbuf;
-  h->rlen = sizeof h->sbuf.simple_reply;
+  /* We only get here in the transmission phase, so it is now safe to
+   * start reading ahead (earlier, we might have swallowed the start
+   * of a TLS handshake).  If the allocation fails, we just carry on
+   * without.  The io_uring transport already buffers received data.
+   */
+  if (h->rahead == NULL && !h->uring_active)
+    h->rahead = malloc (READ_AHEAD_SIZE);
+
+  h->rbuf = &h->sbuf.reply.hdr;
+  if (h->extended_headers)
+    h->rlen = sizeof h->sbuf.reply.hdr.extended;
+  else
+    h->rlen = sizeof h->sbuf.reply.hdr.simple;
 
-  r = h->sock->ops->recv (h, h->sock, h->rbuf, h->rlen);
+  r = recv_buffered (h, h->rbuf, h->rlen);
   if (r == -1) {
     /* In theory this should never happen because when we enter this
      * state we should have notification that the socket is ready to
      * read.  However it can in fact happen when using TLS in
-     * conjunction with a slow, remote server.  If it does happen,
-     * ignore it - we will reenter this same state again next time the
-     * socket is ready to read.
+     * conjunction with a slow, remote server, or when the socket
+     * woke up only for MSG_ZEROCOPY completions.  If it does happen,
+     * go back to READY (so that new commands can still be issued) -
+     * we will reenter this same state again next time the socket is
+     * ready to read.
      */
-    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      h->rbuf = NULL;
+      h->rlen = 0;
+      SET_NEXT_STATE (%.READY);
       return 0;
+    }
 
     /* sock->ops->recv called set_error already. */
     SET_NEXT_STATE (%.DEAD);
@@ -115,56 +135,62 @@ STATE_MACHINE {
   uint32_t magic;
   uint64_t cookie;
 
-  magic = be32toh (h->sbuf.simple_reply.magic);
-  if (magic == NBD_SIMPLE_REPLY_MAGIC) {
+  flight_record (h, reply);
+  magic = be32toh (h->sbuf.reply.hdr.simple.magic);
+  switch (magic) {
+  case NBD_SIMPLE_REPLY_MAGIC:
+    if (h->extended_headers)
+      goto invalid;
     SET_NEXT_STATE (%SIMPLE_REPLY.START);
-  }
-  else if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+    break;
+  case NBD_STRUCTURED_REPLY_MAGIC:
+    if (h->extended_headers)
+      goto invalid;
     SET_NEXT_STATE (%STRUCTURED_REPLY.START);
-  }
-  else {
-    /* We've probably lost synchronization. */
-    SET_NEXT_STATE (%.DEAD);
-    set_error (0, "invalid reply magic 0x%" PRIx32, magic);
-#if 0 /* uncomment to see desynchronized data */
-    nbd_internal_hexdump (&h->sbuf.simple_reply,
-                          sizeof (h->sbuf.simple_reply),
-                          stderr);
-#endif
-    return 0;
+    break;
+  case NBD_EXTENDED_REPLY_MAGIC:
+    if (!h->extended_headers)
+      goto invalid;
+    /* The whole header was already read by REPLY.START. */
+    SET_NEXT_STATE (%STRUCTURED_REPLY.CHECK);
+    break;
+  default:
+    goto invalid;
   }
 
-  /* NB: This works for both simple and structured replies because the
-   * handle (our cookie) is stored at the same offset.
+  /* NB: This works for all three reply types because the handle (our
+   * cookie) is stored at the same offset.
    */
   h->chunks_received++;
-  cookie = be64toh (h->sbuf.simple_reply.handle);
+  cookie = be64toh (h->sbuf.reply.hdr.simple.handle);
   /* Find the command amongst the commands in flight. If the server sends
    * a reply for an unknown cookie, FINISH will diagnose that later.
    */
-  for (cmd = h->cmds_in_flight; cmd != NULL; cmd = cmd->next) {
-    if (cmd->cookie == cookie)
-      break;
-  }
+  cmd = nbd_internal_command_index_find (&h->cmds_in_flight_index, cookie);
   h->reply_cmd = cmd;
   return 0;
 
+ invalid:
+  /* We've probably lost synchronization. */
+  SET_NEXT_STATE (%.DEAD);
+  set_error (0, "invalid or unexpected reply magic 0x%" PRIx32, magic);
+#if 0 /* uncomment to see desynchronized data */
+  nbd_internal_hexdump (&h->sbuf.reply.hdr.simple,
+                        sizeof (h->sbuf.reply.hdr.simple),
+                        stderr);
+#endif
+  return 0;
+
  REPLY.FINISH_COMMAND:
-  struct command *prev_cmd, *cmd;
+  struct command *cmd;
   uint64_t cookie;
-  bool retire;
 
-  /* NB: This works for both simple and structured replies because the
-   * handle (our cookie) is stored at the same offset.
+  /* NB: This works for all three reply types because the handle (our
+   * cookie) is stored at the same offset.
    */
-  cookie = be64toh (h->sbuf.simple_reply.handle);
+  cookie = be64toh (h->sbuf.reply.hdr.simple.handle);
   /* Find the command amongst the commands in flight. */
-  for (cmd = h->cmds_in_flight, prev_cmd = NULL;
-       cmd != NULL;
-       prev_cmd = cmd, cmd = cmd->next) {
-    if (cmd->cookie == cookie)
-      break;
-  }
+  cmd = nbd_internal_command_index_find (&h->cmds_in_flight_index, cookie);
   assert (h->reply_cmd == cmd);
   if (cmd == NULL) {
     debug (h, "skipped reply for unexpected cookie %" PRIu64
@@ -173,45 +199,33 @@ STATE_MACHINE {
     return 0;
   }
 
-  retire = cmd->type == NBD_CMD_DISC;
   h->reply_cmd = NULL;
-
-  /* Notify the user */
-  if (CALLBACK_IS_NOT_NULL (cmd->cb.completion)) {
-    int error = cmd->error;
-    int r;
-
-    assert (cmd->type != NBD_CMD_DISC);
-    r = CALL_CALLBACK (cmd->cb.completion, &error);
-    switch (r) {
-    case -1:
-      if (error)
-        cmd->error = error;
-      break;
-    case 1:
-      retire = true;
-      break;
+  nbd_internal_unlink_cmd_in_flight (h, cmd);
+  nbd_internal_stats_reply (h, cmd);
+  probe_command (cmd__reply, h, cmd);
+  if (h->extent_cache)
+    nbd_internal_extent_cache_replied (h, cmd);
+  if (h->read_cache)
+    nbd_internal_read_cache_replied (h, cmd);
+
+  /* If the kernel may still be using the write buffer, the user must
+   * not be told yet.
+   */
+  if (cmd->zerocopy && !nbd_internal_zerocopy_released (h, cmd)) {
+    if (nbd_internal_zerocopy_reap (h) == -1) {
+      SET_NEXT_STATE (%.DEAD);
+      return 0;
     }
-  }
-
-  /* Move it to the end of the cmds_done list. */
-  if (prev_cmd != NULL)
-    prev_cmd->next = cmd->next;
-  else
-    h->cmds_in_flight = cmd->next;
-  cmd->next = NULL;
-  if (retire)
-    nbd_internal_retire_and_free_command (cmd);
-  else {
-    if (h->cmds_done_tail != NULL)
-      h->cmds_done_tail = h->cmds_done_tail->next = cmd;
-    else {
-      assert (h->cmds_done == NULL);
-      h->cmds_done = h->cmds_done_tail = cmd;
+    if (!nbd_internal_zerocopy_released (h, cmd)) {
+      cmd->next = h->cmds_zc_wait;
+      h->cmds_zc_wait = cmd;
+      SET_NEXT_STATE (%.READY);
+      return 0;
     }
   }
-  h->in_flight--;
-  assert (h->in_flight >= 0);
+
+  /* Notify the user and move it to the end of the cmds_done list. */
+  nbd_internal_complete_command (h, cmd);
 
   SET_NEXT_STATE (%.READY);
   return 0;
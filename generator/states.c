@@ -33,6 +33,7 @@
 #include <unistd.h>
 #include <assert.h>
 
+#include "array-size.h"
 #include "minmax.h"
 
 #include "internal.h"
@@ -40,6 +41,60 @@
 /* Uncomment this to dump received protocol packets to stderr. */
 /*#define DUMP_PACKETS 1*/
 
+/* Receive up to len bytes into buf, with the same return convention
+ * as sock->ops->recv.
+ *
+ * Once REPLY.START has allocated h->rahead, small reads are served
+ * from that read-ahead buffer, so that a single recv call can pick up
+ * many replies that the server has already sent.  Reads of at least
+ * READ_AHEAD_DIRECT bytes bypass the buffer once it is empty, so
+ * that read payloads are still received straight into the caller's
+ * buffer.
+ */
+static ssize_t
+recv_buffered (struct nbd_handle *h, void *buf, size_t len)
+{
+  ssize_t r;
+  size_t n, done = 0;
+
+  if (h->rahead == NULL) {
+    h->recv_calls++;
+    return h->sock->ops->recv (h, h->sock, buf, len);
+  }
+
+  while (done < len) {
+    if (h->rahead_len > 0) {
+      n = MIN (len - done, h->rahead_len);
+      memcpy ((char *) buf + done, &h->rahead[h->rahead_start], n);
+      h->rahead_start += n;
+      h->rahead_len -= n;
+      done += n;
+      continue;
+    }
+
+    h->recv_calls++;
+    if (len - done >= READ_AHEAD_DIRECT)
+      r = h->sock->ops->recv (h, h->sock, (char *) buf + done, len - done);
+    else
+      r = h->sock->ops->recv (h, h->sock, h->rahead, READ_AHEAD_SIZE);
+    if (r <= 0) {
+      /* Return what we have.  EAGAIN, EOF or the error will be seen
+       * again on the next call.
+       */
+      if (done > 0)
+        return done;
+      return r;
+    }
+    if (len - done >= READ_AHEAD_DIRECT)
+      done += r;
+    else {
+      h->rahead_start = 0;
+      h->rahead_len = r;
+    }
+  }
+  return done;
+}
+
 static int
 recv_into_rbuf (struct nbd_handle *h)
 {
@@ -75,7 +130,7 @@ recv_into_rbuf (struct nbd_handle *h)
     rlen = MIN (h->rlen, sizeof sink);
   }
 
-  r = h->sock->ops->recv (h, h->sock, rbuf, rlen);
+  r = recv_buffered (h, rbuf, rlen);
   if (r == -1) {
     if (errno == EAGAIN || errno == EWOULDBLOCK)
       return 1;                 /* more data */
@@ -93,20 +148,100 @@ recv_into_rbuf (struct nbd_handle *h)
   if (h->rbuf)
     h->rbuf = (char *) h->rbuf + r;
   h->rlen -= r;
+  if (h->rlen == 0 && h->rvec_left > 0) {
+    /* Vectored read: move on to the next segment. */
+    h->rbuf = h->riov->iov_base;
+    h->rlen = MIN (h->riov->iov_len, h->rvec_left);
+    h->rvec_left -= h->rlen;
+    h->riov++;
+  }
   if (h->rlen == 0)
     return 0;                   /* move to next state */
   else
     return 1;                   /* more data */
 }
 
+/* Set up rbuf to receive length bytes of the read data of cmd,
+ * starting at offset bytes into the command.  For vectored reads
+ * this may span several segments, which recv_into_rbuf visits in
+ * turn.
+ */
+static void
+set_rbuf_to_cmd (struct nbd_handle *h, struct command *cmd,
+                 uint64_t offset, uint64_t length)
+{
+  const struct iovec *iov;
+
+  if (cmd->iov == NULL) {
+    h->rbuf = (char *) cmd->data + offset;
+    h->rlen = length;
+    return;
+  }
+  if (length == 0) {
+    h->rbuf = NULL;
+    h->rlen = 0;
+    return;
+  }
+
+  for (iov = cmd->iov; offset >= iov->iov_len; iov++)
+    offset -= iov->iov_len;
+  h->rbuf = (char *) iov->iov_base + offset;
+  h->rlen = MIN (iov->iov_len - offset, length);
+  h->riov = iov + 1;
+  h->rvec_left = length - h->rlen;
+}
+
+/* Zero length bytes of the read data of cmd, starting at offset. */
+static void
+zero_cmd_data (struct command *cmd, uint64_t offset, uint64_t length)
+{
+  const struct iovec *iov;
+  size_t n;
+
+  if (cmd->iov == NULL) {
+    memset ((char *) cmd->data + offset, 0, length);
+    return;
+  }
+
+  for (iov = cmd->iov; length > 0; iov++) {
+    if (offset >= iov->iov_len) {
+      offset -= iov->iov_len;
+      continue;
+    }
+    n = MIN (iov->iov_len - offset, length);
+    memset ((char *) iov->iov_base + offset, 0, n);
+    length -= n;
+    offset = 0;
+  }
+}
+
+/* Maximum number of segments passed to a single sendv call. */
+#define SENDV_MAX 128
+
 static int
 send_from_wbuf (struct nbd_handle *h)
 {
   ssize_t r;
+  size_t n;
 
   if (h->wlen == 0)
     goto next_state;
-  r = h->sock->ops->send (h, h->sock, h->wbuf, h->wlen, h->wflags);
+  if (h->wiovcnt > 0 && h->sock->ops->sendv) {
+    struct iovec iov[SENDV_MAX];
+    size_t i;
+
+    /* Send wbuf and as many of the following segments as we can. */
+    n = MIN (h->wiovcnt, SENDV_MAX - 1);
+    iov[0].iov_base = (void *) h->wbuf;
+    iov[0].iov_len = h->wlen;
+    for (i = 0; i < n; ++i)
+      iov[i+1] = h->wiov[i];
+    r = h->sock->ops->sendv (h, h->sock, iov, n+1, h->wflags);
+  }
+  else
+    r = h->sock->ops->send (h, h->sock, h->wbuf, h->wlen,
+                            h->wflags | (h->wiovcnt > 0 ? MSG_MORE : 0));
+  h->send_calls++;
   if (r == -1) {
     if (errno == EAGAIN || errno == EWOULDBLOCK)
       return 1;                 /* more data */
@@ -114,8 +249,22 @@ send_from_wbuf (struct nbd_handle *h)
     return -1;
   }
   h->bytes_sent += r;
-  h->wbuf = (char *) h->wbuf + r;
-  h->wlen -= r;
+  if (r > 0 && (h->wflags & MSG_ZEROCOPY))
+    h->zc_next++;               /* the kernel numbers each such call */
+  for (;;) {
+    n = MIN ((size_t) r, h->wlen);
+    h->wbuf = (char *) h->wbuf + n;
+    h->wlen -= n;
+    r -= n;
+    if (h->wlen > 0 || h->wiovcnt == 0)
+      break;
+    /* Move on to the next segment, which is never empty. */
+    h->wbuf = h->wiov->iov_base;
+    h->wlen = h->wiov->iov_len;
+    h->wiov++;
+    h->wiovcnt--;
+  }
+  assert (r == 0);
   if (h->wlen == 0)
     goto next_state;
   else
@@ -146,6 +295,7 @@ nbd_internal_abort_commands (struct nbd_handle *h, struct command **list)
     bool retire = cmd->type == NBD_CMD_DISC;
 
     next = cmd->next;
+    nbd_internal_command_index_remove (&h->cmds_in_flight_index, cmd);
     if (CALLBACK_IS_NOT_NULL (cmd->cb.completion)) {
       int error = cmd->error ? cmd->error : ENOTCONN;
       int r;
@@ -164,18 +314,12 @@ nbd_internal_abort_commands (struct nbd_handle *h, struct command **list)
     }
     if (cmd->error == 0)
       cmd->error = ENOTCONN;
+    probe_command (cmd__complete, h, cmd);
+    flight_record (h, complete, cmd);
     if (retire)
-      nbd_internal_retire_and_free_command (cmd);
-    else {
-      cmd->next = NULL;
-      if (h->cmds_done_tail)
-        h->cmds_done_tail->next = cmd;
-      else {
-        assert (h->cmds_done == NULL);
-        h->cmds_done = cmd;
-      }
-      h->cmds_done_tail = cmd;
-    }
+      nbd_internal_retire_and_free_command (h, cmd);
+    else
+      nbd_internal_append_cmd_done (h, cmd);
   }
 }
 
@@ -185,7 +329,8 @@ STATE_MACHINE {
     SET_NEXT_STATE (%ISSUE_COMMAND.START);
   else {
     assert (h->sock);
-    if (h->sock->ops->pending && h->sock->ops->pending (h->sock))
+    if (h->rahead_len > 0 ||
+        (h->sock->ops->pending && h->sock->ops->pending (h->sock)))
       SET_NEXT_STATE (%REPLY.START);
   }
   return 0;
@@ -198,21 +343,26 @@ STATE_MACHINE {
   debug (h, "handle dead: %s", err);
 
   abort_option (h);
+  nbd_internal_zerocopy_release_all (h);
   nbd_internal_abort_commands (h, &h->cmds_to_issue);
   nbd_internal_abort_commands (h, &h->cmds_in_flight);
   h->in_flight = 0;
   if (h->sock) {
+    nbd_internal_reactor_drop (h);
     h->sock->ops->close (h->sock);
     h->sock = NULL;
   }
+  flight_record (h, dead);
   return -1;
 
  CLOSED:
   abort_option (h);
+  nbd_internal_zerocopy_release_all (h);
   nbd_internal_abort_commands (h, &h->cmds_to_issue);
   nbd_internal_abort_commands (h, &h->cmds_in_flight);
   h->in_flight = 0;
   if (h->sock) {
+    nbd_internal_reactor_drop (h);
     h->sock->ops->close (h->sock);
     h->sock = NULL;
   }
@@ -126,6 +126,23 @@ func arg_string_list(xs []string) []*C.char {
 	return r
 }
 
+// arg_iovec converts a slice of AioBuffer to a C array of struct
+// iovec, allocated with C.malloc, which the caller must free.
+func arg_iovec(bufs []AioBuffer) *C.struct_iovec {
+	n := len(bufs)
+	if n == 0 {
+		n = 1
+	}
+	p := (*C.struct_iovec)(C.malloc(C.size_t(n) * C.sizeof_struct_iovec))
+	// TODO: Use unsafe.Slice() when we require Go 1.17.
+	iov := (*[1 << 26]C.struct_iovec)(unsafe.Pointer(p))[:len(bufs):len(bufs)]
+	for i, b := range bufs {
+		iov[i].iov_base = b.P
+		iov[i].iov_len = C.size_t(b.Size)
+	}
+	return p
+}
+
 func free_string_list(argv []*C.char) {
 	for i := 0; argv[i] != nil; i++ {
 		C.free(unsafe.Pointer(argv[i]))
@@ -0,0 +1,92 @@
+/* libnbd golang tests
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+package libnbd
+
+import "bytes"
+import "testing"
+
+func waitForCommand(t *testing.T, h *Libnbd, cookie uint64) {
+	for {
+		b, err := h.AioCommandCompleted(cookie)
+		if err != nil {
+			t.Fatalf("%s", err)
+		}
+		if b {
+			break
+		}
+		h.Poll(-1)
+	}
+}
+
+func Test515AioPreadvPwritev(t *testing.T) {
+	h, err := Create()
+	if err != nil {
+		t.Fatalf("could not create handle: %s", err)
+	}
+	defer h.Close()
+
+	err = h.ConnectCommand([]string{
+		"nbdkit", "-s", "--exit-with-parent", "-v",
+		"memory", "size=1M",
+	})
+	if err != nil {
+		t.Fatalf("could not connect: %s", err)
+	}
+
+	/* Write a pattern from several segments. */
+	wbufs := []AioBuffer{
+		MakeAioBuffer(300), MakeAioBuffer(212), MakeAioBuffer(512),
+	}
+	var expected []byte
+	for i := range wbufs {
+		defer wbufs[i].Free()
+		s := wbufs[i].Slice()
+		for i := range s {
+			s[i] = byte(i * 7)
+		}
+		expected = append(expected, s...)
+	}
+
+	cookie, err := h.AioPwritev(wbufs, 1000, nil)
+	if err != nil {
+		t.Fatalf("%s", err)
+	}
+	waitForCommand(t, h, cookie)
+
+	/* Read back into a different split. */
+	rbufs := []AioBuffer{
+		MakeAioBuffer(1), MakeAioBuffer(600), MakeAioBuffer(423),
+	}
+	for i := range rbufs {
+		defer rbufs[i].Free()
+	}
+	cookie, err = h.AioPreadv(rbufs, 1000, nil)
+	if err != nil {
+		t.Fatalf("%s", err)
+	}
+	waitForCommand(t, h, cookie)
+
+	var got []byte
+	for i := range rbufs {
+		got = append(got, rbufs[i].Slice()...)
+	}
+	if !bytes.Equal(got, expected) {
+		t.Fatalf("did not read back same data as written")
+	}
+}
@@ -27,6 +27,7 @@
 
 #include <libnbd.h>
 
+#include "flight-recorder.h"
 #include "vector.h"
 
 #include "nbdinfo.h"
@@ -60,6 +61,7 @@ collect_exports (void)
   if (nbd_opt_list (nbd,
                     (nbd_list_callback) {.callback = collect_export}) == -1) {
     fprintf (stderr, "%s: %s\n", progname, nbd_get_error ());
+    dump_flight_recorder_on_error (nbd);
     exit (EXIT_FAILURE);
   }
   if (probe_content)
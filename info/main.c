@@ -31,6 +31,7 @@
 #include <libnbd.h>
 
 #include "ansi-colours.h"
+#include "flight-recorder.h"
 #include "version.h"
 
 #include "nbdinfo.h"
@@ -388,6 +389,7 @@ do_connect (struct nbd_handle *nbd)
 
   if (r == -1) {
     fprintf (stderr, "%s: %s\n", progname, nbd_get_error ());
+    dump_flight_recorder_on_error (nbd);
     exit (EXIT_FAILURE);
   }
 }
@@ -29,6 +29,7 @@
 #include <libnbd.h>
 
 #include "ansi-colours.h"
+#include "flight-recorder.h"
 #include "human-size.h"
 #include "string-vector.h"
 
@@ -337,6 +338,7 @@ get_content (struct nbd_handle *nbd, int64_t size)
   if (nbd_aio_is_negotiating (nbd) &&
       nbd_opt_go (nbd) == -1) {
     fprintf (stderr, "%s: %s\n", progname, nbd_get_error ());
+    dump_flight_recorder_on_error (nbd);
     exit (EXIT_FAILURE);
   }
 
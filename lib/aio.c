@@ -21,24 +21,391 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <assert.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 #include "internal.h"
+#include "minmax.h"
+
+/* Allocate a zeroed command, reusing one from the per-handle cache
+ * if possible.
+ */
+struct command *
+nbd_internal_alloc_command (struct nbd_handle *h)
+{
+  struct command *cmd;
+
+  if (h->cmd_cache != NULL) {
+    cmd = h->cmd_cache;
+    h->cmd_cache = cmd->next;
+    h->cmd_cache_len--;
+    memset (cmd, 0, sizeof *cmd);
+    return cmd;
+  }
 
-/* Internal function which retires and frees a command. */
+  cmd = calloc (1, sizeof *cmd);
+  if (cmd == NULL) {
+    set_error (errno, "calloc");
+    return NULL;
+  }
+  return cmd;
+}
+
+/* Internal function which retires and frees a command.  The memory
+ * is kept in the per-handle cache if the cache has room, sized from
+ * the deepest queue seen so far.
+ */
 void
-nbd_internal_retire_and_free_command (struct command *cmd)
+nbd_internal_retire_and_free_command (struct nbd_handle *h,
+                                      struct command *cmd)
 {
+  unsigned limit;
+
   /* Free the callbacks. */
   if (cmd->type == NBD_CMD_BLOCK_STATUS)
     FREE_CALLBACK (cmd->cb.fn.extent);
   if (cmd->type == NBD_CMD_READ)
     FREE_CALLBACK (cmd->cb.fn.chunk);
   FREE_CALLBACK (cmd->cb.completion);
+  free (cmd->iov);
+
+  limit = MIN (h->cmd_cache_limit, (unsigned) h->in_flight_max);
+  if (h->cmd_cache_len < limit) {
+    cmd->next = h->cmd_cache;
+    h->cmd_cache = cmd;
+    h->cmd_cache_len++;
+  }
+  else
+    free (cmd);
+}
+
+/* Free cached commands until no more than limit remain. */
+void
+nbd_internal_trim_command_cache (struct nbd_handle *h, unsigned limit)
+{
+  while (h->cmd_cache_len > limit) {
+    struct command *cmd = h->cmd_cache;
+
+    h->cmd_cache = cmd->next;
+    h->cmd_cache_len--;
+    free (cmd);
+  }
+}
+
+/* Initial number of buckets in a command index.  The table doubles
+ * whenever the load factor exceeds 1.
+ */
+#define COMMAND_INDEX_INITIAL_BUCKETS 64
+
+int
+nbd_internal_command_index_init (struct command_index *idx)
+{
+  idx->buckets = calloc (COMMAND_INDEX_INITIAL_BUCKETS,
+                         sizeof *idx->buckets);
+  if (idx->buckets == NULL) {
+    set_error (errno, "calloc");
+    return -1;
+  }
+  idx->nr_buckets = COMMAND_INDEX_INITIAL_BUCKETS;
+  idx->nr_entries = 0;
+  return 0;
+}
+
+void
+nbd_internal_command_index_free (struct command_index *idx)
+{
+  free (idx->buckets);
+  idx->buckets = NULL;
+  idx->nr_buckets = idx->nr_entries = 0;
+}
+
+static inline size_t
+command_index_bucket (const struct command_index *idx, uint64_t cookie)
+{
+  return cookie & (idx->nr_buckets - 1);
+}
+
+/* Double the number of buckets.  Failure to allocate is not fatal,
+ * the table just gets longer chains.
+ */
+static void
+command_index_grow (struct command_index *idx)
+{
+  struct command **buckets;
+  size_t nr_buckets = idx->nr_buckets * 2;
+  size_t i;
+
+  buckets = calloc (nr_buckets, sizeof *buckets);
+  if (buckets == NULL)
+    return;
+
+  for (i = 0; i < idx->nr_buckets; ++i) {
+    struct command *cmd, *next;
+
+    for (cmd = idx->buckets[i]; cmd != NULL; cmd = next) {
+      size_t b = cmd->cookie & (nr_buckets - 1);
+
+      next = cmd->index_next;
+      cmd->index_next = buckets[b];
+      buckets[b] = cmd;
+    }
+  }
+
+  free (idx->buckets);
+  idx->buckets = buckets;
+  idx->nr_buckets = nr_buckets;
+}
+
+void
+nbd_internal_command_index_add (struct command_index *idx,
+                                struct command *cmd)
+{
+  size_t b;
+
+  assert (idx->buckets != NULL);
+  if (idx->nr_entries >= idx->nr_buckets)
+    command_index_grow (idx);
 
-  free (cmd);
+  b = command_index_bucket (idx, cmd->cookie);
+  cmd->index_next = idx->buckets[b];
+  idx->buckets[b] = cmd;
+  idx->nr_entries++;
+}
+
+struct command *
+nbd_internal_command_index_find (struct command_index *idx, uint64_t cookie)
+{
+  struct command *cmd;
+
+  if (idx->buckets == NULL)
+    return NULL;
+
+  for (cmd = idx->buckets[command_index_bucket (idx, cookie)];
+       cmd != NULL;
+       cmd = cmd->index_next) {
+    if (cmd->cookie == cookie)
+      return cmd;
+  }
+  return NULL;
+}
+
+/* Remove a command from the index.  It is not an error if the
+ * command is not present.
+ */
+void
+nbd_internal_command_index_remove (struct command_index *idx,
+                                   struct command *cmd)
+{
+  struct command **p;
+
+  if (idx->buckets == NULL)
+    return;
+
+  for (p = &idx->buckets[command_index_bucket (idx, cmd->cookie)];
+       *p != NULL;
+       p = &(*p)->index_next) {
+    if (*p == cmd) {
+      *p = cmd->index_next;
+      cmd->index_next = NULL;
+      assert (idx->nr_entries > 0);
+      idx->nr_entries--;
+      return;
+    }
+  }
+}
+
+/* Add an issued command to the (unordered) cmds_in_flight list. */
+void
+nbd_internal_push_cmd_in_flight (struct nbd_handle *h, struct command *cmd)
+{
+  cmd->prev = NULL;
+  cmd->next = h->cmds_in_flight;
+  if (h->cmds_in_flight)
+    h->cmds_in_flight->prev = cmd;
+  h->cmds_in_flight = cmd;
+  nbd_internal_command_index_add (&h->cmds_in_flight_index, cmd);
+}
+
+/* Remove a command from cmds_in_flight. */
+void
+nbd_internal_unlink_cmd_in_flight (struct nbd_handle *h, struct command *cmd)
+{
+  if (cmd->prev)
+    cmd->prev->next = cmd->next;
+  else {
+    assert (h->cmds_in_flight == cmd);
+    h->cmds_in_flight = cmd->next;
+  }
+  if (cmd->next)
+    cmd->next->prev = cmd->prev;
+  cmd->next = cmd->prev = NULL;
+  nbd_internal_command_index_remove (&h->cmds_in_flight_index, cmd);
+}
+
+/* Notify the user that cmd, which is no longer in cmds_in_flight,
+ * has completed, and move it to the end of the cmds_done list.
+ */
+void
+nbd_internal_complete_command (struct nbd_handle *h, struct command *cmd)
+{
+  bool retire = cmd->type == NBD_CMD_DISC;
+
+  if (CALLBACK_IS_NOT_NULL (cmd->cb.completion)) {
+    int error = cmd->error;
+    int r;
+
+    assert (cmd->type != NBD_CMD_DISC);
+    r = CALL_CALLBACK (cmd->cb.completion, &error);
+    switch (r) {
+    case -1:
+      if (error)
+        cmd->error = error;
+      break;
+    case 1:
+      retire = true;
+      break;
+    }
+  }
+  probe_command (cmd__complete, h, cmd);
+  flight_record (h, complete, cmd);
+
+  if (retire)
+    nbd_internal_retire_and_free_command (h, cmd);
+  else
+    nbd_internal_append_cmd_done (h, cmd);
+  h->in_flight--;
+  assert (h->in_flight >= 0);
+}
+
+/* Point the read with this cookie, which must be queued, in flight
+ * or waiting on the read cache, at another buffer of the same size,
+ * copying across whatever it has read so far.  This fails if the
+ * read is not found, or if its reply is being received right now,
+ * since h->rbuf may then point into the old buffer.
+ */
+int
+nbd_internal_redirect_read (struct nbd_handle *h, uint64_t cookie, void *buf)
+{
+  struct command *cmd;
+
+  cmd = nbd_internal_command_index_find (&h->cmds_in_flight_index, cookie);
+  if (cmd == NULL) {
+    for (cmd = h->cmds_to_issue; cmd != NULL; cmd = cmd->next)
+      if (cmd->cookie == cookie)
+        break;
+  }
+  if (cmd == NULL) {
+    for (cmd = h->cmds_rc_wait; cmd != NULL; cmd = cmd->next)
+      if (cmd->cookie == cookie)
+        break;
+  }
+  if (cmd == NULL || cmd == h->reply_cmd ||
+      cmd->type != NBD_CMD_READ || cmd->data == NULL)
+    return -1;
+
+  memcpy (buf, cmd->data, cmd->count);
+  cmd->data = buf;
+  return 0;
+}
+
+/* The completion fd (see nbd_aio_get_completion_fd) is readable
+ * exactly while cmds_done is not empty.  It is only written when the
+ * queue goes from empty to non-empty, and drained when it empties
+ * again, so a busy handle does not pay a system call per command.
+ */
+static void
+signal_done_fd (struct nbd_handle *h)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  const uint64_t one = 1;
+#else
+  const char one = 0;
+#endif
+
+  if (h->done_fds[1] == -1)
+    return;
+  if (write (h->done_fds[1], &one, sizeof one) == -1 && errno != EAGAIN)
+    debug (h, "write: completion fd: %s", strerror (errno));
+}
+
+static void
+drain_done_fd (struct nbd_handle *h)
+{
+  char buf[16];
+
+  if (h->done_fds[0] == -1)
+    return;
+  while (read (h->done_fds[0], buf, sizeof buf) > 0)
+    ;
+}
+
+/* Add a command to the back of the cmds_done queue. */
+void
+nbd_internal_append_cmd_done (struct nbd_handle *h, struct command *cmd)
+{
+  cmd->next = NULL;
+  cmd->prev = h->cmds_done_tail;
+  if (h->cmds_done_tail != NULL)
+    h->cmds_done_tail->next = cmd;
+  else {
+    assert (h->cmds_done == NULL);
+    h->cmds_done = cmd;
+    signal_done_fd (h);
+  }
+  h->cmds_done_tail = cmd;
+  nbd_internal_command_index_add (&h->cmds_done_index, cmd);
+}
+
+/* Remove a command from the cmds_done queue. */
+static void
+unlink_cmd_done (struct nbd_handle *h, struct command *cmd)
+{
+  if (h->cmds_done_tail == cmd) {
+    assert (cmd->next == NULL);
+    h->cmds_done_tail = cmd->prev;
+  }
+  if (cmd->prev != NULL)
+    cmd->prev->next = cmd->next;
+  else {
+    assert (h->cmds_done == cmd);
+    h->cmds_done = cmd->next;
+  }
+  if (cmd->next != NULL)
+    cmd->next->prev = cmd->prev;
+  nbd_internal_command_index_remove (&h->cmds_done_index, cmd);
+
+  if (h->cmds_done == NULL)
+    drain_done_fd (h);
+}
+
+/* The errno that retiring a completed command reports. */
+static int
+cmd_done_error (struct nbd_handle *h, struct command *cmd)
+{
+  assert (cmd->type != NBD_CMD_DISC);
+  /* The spec states that a 0-length read request is unspecified; but
+   * it is easy enough to treat it as successful as an extension.
+   * Conversely, make sure a server sending structured replies sent
+   * enough data chunks to cover the overall count (although we do not
+   * detect if it duplicated some bytes while omitting others).
+   */
+  if (cmd->type == NBD_CMD_READ && cmd->data_seen != cmd->count &&
+      !cmd->error) {
+    debug (h, "server sent wrong byte length without error; using EPROTO");
+    return EPROTO;
+  }
+  return cmd->error;
 }
 
 int
@@ -51,15 +418,37 @@ nbd_unlocked_aio_get_fd (struct nbd_handle *h)
   return h->sock->ops->get_fd (h->sock);
 }
 
+/* With io_uring the file descriptor is an eventfd, which only says
+ * that some I/O completed.  Collect it, run the state machine, and
+ * submit whatever it queued before returning to the application.
+ */
+static int
+notify_async (struct nbd_handle *h)
+{
+  if (h->sock->ops->wait (h, h->sock, 0) == -1)
+    return -1;
+  if (h->sock && h->sock->ops->flush &&
+      h->sock->ops->flush (h, h->sock) == -1)
+    return -1;
+  return 0;
+}
+
 int
 nbd_unlocked_aio_notify_read (struct nbd_handle *h)
 {
+  if (h->sock && h->sock->ops->wait)
+    return notify_async (h);
+  /* The socket may have woken up for MSG_ZEROCOPY completions. */
+  if (h->cmds_zc_wait && nbd_internal_zerocopy_reap (h) == -1)
+    return -1;
   return nbd_internal_run (h, notify_read);
 }
 
 int
 nbd_unlocked_aio_notify_write (struct nbd_handle *h)
 {
+  if (h->sock && h->sock->ops->wait)
+    return notify_async (h);
   return nbd_internal_run (h, notify_write);
 }
 
@@ -67,7 +456,7 @@ int
 nbd_unlocked_aio_command_completed (struct nbd_handle *h,
                                     uint64_t cookie)
 {
-  struct command *prev_cmd, *cmd;
+  struct command *cmd;
   uint16_t type;
   uint32_t error;
 
@@ -77,40 +466,16 @@ nbd_unlocked_aio_command_completed (struct nbd_handle *h,
   }
 
   /* Find the command amongst the completed commands. */
-  for (cmd = h->cmds_done, prev_cmd = NULL;
-       cmd != NULL;
-       prev_cmd = cmd, cmd = cmd->next) {
-    if (cmd->cookie == cookie)
-      break;
-  }
+  cmd = nbd_internal_command_index_find (&h->cmds_done_index, cookie);
   if (!cmd)
     return 0;
 
   type = cmd->type;
-  error = cmd->error;
-  assert (cmd->type != NBD_CMD_DISC);
-  /* The spec states that a 0-length read request is unspecified; but
-   * it is easy enough to treat it as successful as an extension.
-   * Conversely, make sure a server sending structured replies sent
-   * enough data chunks to cover the overall count (although we do not
-   * detect if it duplicated some bytes while omitting others).
-   */
-  if (type == NBD_CMD_READ && cmd->data_seen != cmd->count && !error) {
-    debug (h, "server sent wrong byte length without error; using EPROTO");
-    error = EPROTO;
-  }
+  error = cmd_done_error (h, cmd);
 
   /* Retire it from the list and free it. */
-  if (h->cmds_done_tail == cmd) {
-    assert (cmd->next == NULL);
-    h->cmds_done_tail = prev_cmd;
-  }
-  if (prev_cmd != NULL)
-    prev_cmd->next = cmd->next;
-  else
-    h->cmds_done = cmd->next;
-
-  nbd_internal_retire_and_free_command (cmd);
+  unlink_cmd_done (h, cmd);
+  nbd_internal_retire_and_free_command (h, cmd);
 
   /* If the command was successful, return true. */
   if (error == 0)
@@ -130,7 +495,8 @@ nbd_unlocked_aio_peek_command_completed (struct nbd_handle *h)
     return h->cmds_done->cookie;
   }
 
-  if (h->cmds_in_flight != NULL || h->cmds_to_issue != NULL) {
+  if (h->cmds_in_flight != NULL || h->cmds_to_issue != NULL ||
+      h->cmds_zc_wait != NULL || h->cmds_rc_wait != NULL) {
     set_error (0, "no in-flight command has completed yet");
     return 0;
   }
@@ -143,3 +509,71 @@ nbd_unlocked_aio_in_flight (struct nbd_handle *h)
 {
   return h->in_flight;
 }
+
+/* Retire up to n completed commands in queue order, under a single
+ * acquisition of the lock.  This is hand-written rather than
+ * generated because the bindings have no array output parameters.
+ */
+ssize_t
+nbd_aio_reap_completed (struct nbd_handle *h,
+                        int64_t *cookies, int *errors, size_t n)
+{
+  struct command *cmd;
+  size_t i;
+
+  nbd_internal_set_error_context ("nbd_aio_reap_completed");
+
+  if (n > SSIZE_MAX)
+    n = SSIZE_MAX;
+
+  pthread_mutex_lock (&h->lock);
+  for (i = 0; i < n && h->cmds_done != NULL; ++i) {
+    cmd = h->cmds_done;
+    cookies[i] = cmd->cookie;
+    errors[i] = cmd_done_error (h, cmd);
+    unlink_cmd_done (h, cmd);
+    nbd_internal_retire_and_free_command (h, cmd);
+  }
+  pthread_mutex_unlock (&h->lock);
+  return i;
+}
+
+int
+nbd_unlocked_aio_get_completion_fd (struct nbd_handle *h)
+{
+  int fds[2];
+
+  if (h->done_fds[0] >= 0)
+    return h->done_fds[0];
+
+#ifdef HAVE_SYS_EVENTFD_H
+  fds[0] = fds[1] = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fds[0] == -1) {
+    set_error (errno, "eventfd");
+    return -1;
+  }
+#else
+  int i, flags;
+
+  if (nbd_internal_socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+    set_error (errno, "socketpair");
+    return -1;
+  }
+  for (i = 0; i < 2; ++i) {
+    flags = fcntl (fds[i], F_GETFL, 0);
+    if (flags == -1 || fcntl (fds[i], F_SETFL, flags|O_NONBLOCK) == -1) {
+      set_error (errno, "fcntl");
+      close (fds[0]);
+      close (fds[1]);
+      return -1;
+    }
+  }
+#endif
+  h->done_fds[0] = fds[0];
+  h->done_fds[1] = fds[1];
+
+  /* Commands may have completed before the fd existed. */
+  if (h->cmds_done != NULL)
+    signal_done_fd (h);
+  return h->done_fds[0];
+}
@@ -0,0 +1,395 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Resolving and connecting for nbd_aio_connect_tcp.
+ *
+ * getaddrinfo blocks, and there is no portable non-blocking
+ * replacement which can be driven from a main loop, so it runs in a
+ * short-lived helper thread.  The same thread then races connections
+ * to the resulting addresses as described in RFC 8305 ("Happy
+ * Eyeballs"): address families are interleaved, a new attempt is
+ * started every CONNECTION_ATTEMPT_DELAY ms (or as soon as one
+ * fails) while earlier attempts carry on, and the first to connect
+ * wins.
+ *
+ * The state machine waits for the thread by polling the read end of
+ * a socketpair, which the thread writes to when it has finished.
+ * The thread holds its own reference to struct connect_tcp, so the
+ * handle can be closed without waiting for it.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "internal.h"
+
+/* RFC 8305 section 5 recommends 250ms. */
+#define CONNECTION_ATTEMPT_DELAY 250
+
+struct connect_tcp {
+  _Atomic unsigned refs;
+  char *hostname, *port;
+  int notify_fd;                /* Write end, owned by the thread. */
+
+  /* Results, only valid once the thread has notified. */
+  int fd;                       /* Connected socket, or -1. */
+  int gai_err;                  /* getaddrinfo error, or 0. */
+  int err;                      /* errno of the first failure, or 0. */
+  unsigned nr_addrs;            /* Number of addresses tried. */
+  _Atomic bool done;            /* Set before notifying. */
+};
+
+static void
+connect_tcp_unref (struct connect_tcp *ct)
+{
+  if (--ct->refs > 0)
+    return;
+
+  if (ct->fd >= 0)
+    close (ct->fd);
+  free (ct->hostname);
+  free (ct->port);
+  free (ct);
+}
+
+static int64_t
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * INT64_C (1000) + ts.tv_nsec / 1000000;
+}
+
+static struct addrinfo *
+next_of_family (struct addrinfo *rp, int family, bool same)
+{
+  for (; rp; rp = rp->ai_next)
+    if ((rp->ai_family == family) == same)
+      break;
+  return rp;
+}
+
+/* Order the addresses as RFC 8305 section 4 suggests, alternating
+ * between address families, starting with the family that
+ * getaddrinfo preferred.  addrs must have room for every address in
+ * result.
+ */
+static void
+interleave (struct addrinfo *result, struct addrinfo **addrs)
+{
+  const int family = result->ai_family;
+  struct addrinfo *a = result;
+  struct addrinfo *b = next_of_family (result, family, false);
+  size_t n = 0;
+
+  while (a || b) {
+    if (a) {
+      addrs[n++] = a;
+      a = next_of_family (a->ai_next, family, true);
+    }
+    if (b) {
+      addrs[n++] = b;
+      b = next_of_family (b->ai_next, family, false);
+    }
+  }
+}
+
+/* Start a non-blocking connection to addr.  Returns the socket, or
+ * -1 with ct->err updated if the attempt failed straight away.  Sets
+ * *connected if the connection completed at once.
+ */
+static int
+start_attempt (struct connect_tcp *ct, const struct addrinfo *addr,
+               bool *connected)
+{
+  int fd;
+
+  fd = nbd_internal_socket (addr->ai_family, addr->ai_socktype,
+                            addr->ai_protocol, true);
+  if (fd == -1) {
+    if (ct->err == 0)
+      ct->err = errno;
+    return -1;
+  }
+  if (connect (fd, addr->ai_addr, addr->ai_addrlen) == 0)
+    *connected = true;
+  else if (errno != EINPROGRESS) {
+    if (ct->err == 0)
+      ct->err = errno;
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Race connections to the addresses, returning the winning socket or
+ * -1 with ct->err set.
+ */
+static int
+race (struct connect_tcp *ct, struct addrinfo **addrs, size_t nr_addrs)
+{
+  struct pollfd *pfds;
+  size_t next = 0, active = 0, i;
+  int64_t next_attempt = 0, now;
+  int winner = -1, timeout, status;
+  socklen_t len;
+
+  pfds = malloc (nr_addrs * sizeof *pfds);
+  if (pfds == NULL) {
+    ct->err = errno;
+    return -1;
+  }
+
+  while (winner == -1) {
+    now = now_ms ();
+
+    /* Start the next attempt if it is due, or if nothing is running. */
+    if (next < nr_addrs && (active == 0 || now >= next_attempt)) {
+      bool connected = false;
+      int fd = start_attempt (ct, addrs[next++], &connected);
+
+      if (connected) {
+        winner = fd;
+        break;
+      }
+      if (fd >= 0) {
+        pfds[active].fd = fd;
+        pfds[active].events = POLLOUT;
+        active++;
+        next_attempt = now + CONNECTION_ATTEMPT_DELAY;
+      }
+      continue;
+    }
+    if (active == 0) {
+      /* Every address failed. */
+      assert (next == nr_addrs);
+      if (ct->err == 0)
+        ct->err = ECONNREFUSED;
+      break;
+    }
+
+    if (next < nr_addrs)
+      timeout = next_attempt > now ? next_attempt - now : 0;
+    else
+      timeout = -1;
+    if (poll (pfds, active, timeout) == -1) {
+      if (errno == EINTR)
+        continue;
+      ct->err = errno;
+      break;
+    }
+
+    for (i = 0; i < active; ) {
+      if (pfds[i].revents == 0) {
+        i++;
+        continue;
+      }
+      len = sizeof status;
+      if (getsockopt (pfds[i].fd, SOL_SOCKET, SO_ERROR, &status, &len) == -1)
+        status = errno;
+      if (status == 0) {
+        winner = pfds[i].fd;
+        pfds[i] = pfds[--active];
+        break;
+      }
+      if (ct->err == 0)
+        ct->err = status;
+      close (pfds[i].fd);
+      pfds[i] = pfds[--active];
+      /* RFC 8305 section 5: start the next attempt at once. */
+      next_attempt = now;
+    }
+  }
+
+  /* Abandon the attempts which lost the race. */
+  for (i = 0; i < active; ++i)
+    close (pfds[i].fd);
+  free (pfds);
+  return winner;
+}
+
+static void *
+connect_tcp_thread (void *arg)
+{
+  struct connect_tcp *ct = arg;
+  const struct addrinfo hints = {
+    .ai_family = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+  };
+  struct addrinfo *result, *rp, **addrs;
+  int r;
+
+  r = getaddrinfo (ct->hostname, ct->port, &hints, &result);
+  if (r != 0) {
+    ct->gai_err = r;
+    if (r == EAI_SYSTEM)
+      ct->err = errno;
+  }
+  else {
+    for (rp = result; rp; rp = rp->ai_next)
+      ct->nr_addrs++;
+    addrs = malloc (ct->nr_addrs * sizeof *addrs);
+    if (addrs == NULL)
+      ct->err = errno;
+    else {
+      interleave (result, addrs);
+      ct->fd = race (ct, addrs, ct->nr_addrs);
+      free (addrs);
+    }
+    freeaddrinfo (result);
+  }
+
+  ct->done = true;
+
+  /* Wake up the state machine.  If the handle has gone away, the
+   * send fails harmlessly.
+   */
+  while (send (ct->notify_fd, "", 1, MSG_NOSIGNAL) == -1 && errno == EINTR)
+    ;
+  close (ct->notify_fd);
+  connect_tcp_unref (ct);
+  return NULL;
+}
+
+/* Start resolving and connecting to h->hostname and h->port.
+ * Returns a non-blocking fd which becomes readable when
+ * nbd_internal_connect_tcp_finish can be called, or -1 on error.
+ */
+int
+nbd_internal_connect_tcp_start (struct nbd_handle *h)
+{
+  struct connect_tcp *ct;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int fds[2], flags, err;
+
+  assert (h->connect_tcp == NULL);
+
+  ct = calloc (1, sizeof *ct);
+  if (ct == NULL) {
+    set_error (errno, "calloc");
+    return -1;
+  }
+  ct->refs = 2;
+  ct->fd = -1;
+  ct->hostname = strdup (h->hostname);
+  ct->port = strdup (h->port);
+  if (ct->hostname == NULL || ct->port == NULL) {
+    set_error (errno, "strdup");
+    goto err1;
+  }
+
+  if (nbd_internal_socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+    set_error (errno, "socketpair");
+    goto err1;
+  }
+  flags = fcntl (fds[0], F_GETFL, 0);
+  if (flags == -1 || fcntl (fds[0], F_SETFL, flags|O_NONBLOCK) == -1) {
+    set_error (errno, "fcntl");
+    goto err2;
+  }
+  ct->notify_fd = fds[1];
+
+  err = pthread_attr_init (&attr);
+  if (err == 0) {
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create (&thread, &attr, connect_tcp_thread, ct);
+    pthread_attr_destroy (&attr);
+  }
+  if (err != 0) {
+    set_error (err, "pthread_create");
+    goto err2;
+  }
+
+  h->connect_tcp = ct;
+  return fds[0];
+
+ err2:
+  close (fds[0]);
+  close (fds[1]);
+ err1:
+  free (ct->hostname);
+  free (ct->port);
+  free (ct);
+  return -1;
+}
+
+/* Collect the outcome from the helper thread.  Returns the connected,
+ * non-blocking socket, or -1 with the error set.
+ */
+int
+nbd_internal_connect_tcp_finish (struct nbd_handle *h)
+{
+  struct connect_tcp *ct = h->connect_tcp;
+  int fd;
+
+  assert (ct != NULL);
+  assert (ct->done);
+  h->connect_tcp = NULL;
+
+  if (ct->gai_err != 0) {
+    if (ct->gai_err == EAI_SYSTEM)
+      set_error (ct->err, "getaddrinfo: hostname \"%s\" port \"%s\"",
+                 h->hostname, h->port);
+    else
+      set_error (0, "getaddrinfo: hostname \"%s\" port \"%s\": %s",
+                 h->hostname, h->port, gai_strerror (ct->gai_err));
+    connect_tcp_unref (ct);
+    return -1;
+  }
+  if (ct->fd == -1) {
+    set_error (ct->err,
+               "connect: %s:%s: could not connect to remote host",
+               h->hostname, h->port);
+    connect_tcp_unref (ct);
+    return -1;
+  }
+
+  debug (h, "connected to %s:%s (%u addresses available)",
+         h->hostname, h->port, ct->nr_addrs);
+  fd = ct->fd;
+  ct->fd = -1;
+  connect_tcp_unref (ct);
+  return fd;
+}
+
+/* Called from nbd_close if the thread may still be running. */
+void
+nbd_internal_connect_tcp_abandon (struct nbd_handle *h)
+{
+  if (h->connect_tcp) {
+    connect_tcp_unref (h->connect_tcp);
+    h->connect_tcp = NULL;
+  }
+}
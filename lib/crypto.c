@@ -24,7 +24,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/socket.h>
 #include <assert.h>
+#include <pthread.h>
 
 #ifdef HAVE_GNUTLS
 #include <gnutls/gnutls.h>
@@ -96,6 +98,46 @@ nbd_unlocked_get_tls_verify_peer (struct nbd_handle *h)
   return h->tls_verify_peer;
 }
 
+int
+nbd_unlocked_set_tls_ktls (struct nbd_handle *h, bool ktls)
+{
+  h->tls_ktls = ktls;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_tls_ktls (struct nbd_handle *h)
+{
+  return h->tls_ktls;
+}
+
+int
+nbd_unlocked_get_tls_ktls_active (struct nbd_handle *h)
+{
+  return h->tls_ktls_active;
+}
+
+int
+nbd_unlocked_set_tls_cache (struct nbd_handle *h, bool cache)
+{
+  h->tls_cache = cache;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_tls_cache (struct nbd_handle *h)
+{
+  return h->tls_cache;
+}
+
+int
+nbd_unlocked_get_tls_session_resumed (struct nbd_handle *h)
+{
+  return h->tls_session_resumed;
+}
+
 int
 nbd_unlocked_set_tls_username (struct nbd_handle *h, const char *username)
 {
@@ -178,6 +220,77 @@ nbd_unlocked_set_tls_psk_file (struct nbd_handle *h, const char *filename)
 
 #ifdef HAVE_GNUTLS
 
+/* Credentials, which with nbd_set_tls_cache are shared between
+ * handles and kept for the lifetime of the process.  Exactly one of
+ * psk and x509 is set.  The fields never change once the credentials
+ * are loaded, and GnuTLS allows credentials to be used by several
+ * sessions at once.
+ */
+struct tls_creds {
+  struct tls_creds *next;       /* Next in tls_cache_creds. */
+  unsigned refs;                /* Protected by tls_cache_lock. */
+  char *key;
+  gnutls_psk_client_credentials_t psk;
+  gnutls_certificate_credentials_t x509;
+  bool verify;                  /* Loaded from a certificates directory. */
+};
+
+/* The most recent resumable session for each server. */
+struct tls_ticket {
+  struct tls_ticket *next;
+  char *key;
+  gnutls_datum_t data;
+};
+
+static pthread_mutex_t tls_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tls_creds *tls_cache_creds;
+static struct tls_ticket *tls_cache_tickets;
+
+static void
+free_creds (struct tls_creds *creds)
+{
+  if (creds->psk)
+    gnutls_psk_free_client_credentials (creds->psk);
+  if (creds->x509)
+    gnutls_certificate_free_credentials (creds->x509);
+  free (creds->key);
+  free (creds);
+}
+
+static void
+put_creds (struct tls_creds *creds)
+{
+  bool last;
+
+  pthread_mutex_lock (&tls_cache_lock);
+  last = --creds->refs == 0;
+  pthread_mutex_unlock (&tls_cache_lock);
+  if (last)
+    free_creds (creds);
+}
+
+/* Free the cache when the library is unloaded. */
+static void tls_cache_free (void) __attribute__ ((destructor));
+
+static void
+tls_cache_free (void)
+{
+  struct tls_creds *creds;
+  struct tls_ticket *ticket;
+
+  while ((creds = tls_cache_creds) != NULL) {
+    tls_cache_creds = creds->next;
+    if (--creds->refs == 0)
+      free_creds (creds);
+  }
+  while ((ticket = tls_cache_tickets) != NULL) {
+    tls_cache_tickets = ticket->next;
+    gnutls_free (ticket->data.data);
+    free (ticket->key);
+    free (ticket);
+  }
+}
+
 static ssize_t
 tls_recv (struct nbd_handle *h, struct socket *sock, void *buf, size_t len)
 {
@@ -231,6 +344,30 @@ tls_send (struct nbd_handle *h,
   return r;
 }
 
+/* GnuTLS has no vectored send, so send each segment as a separate
+ * record, stopping at the first short write.
+ */
+static ssize_t
+tls_sendv (struct nbd_handle *h, struct socket *sock,
+           const struct iovec *iov, size_t iovcnt, int flags)
+{
+  ssize_t r, total = 0;
+  size_t i;
+
+  for (i = 0; i < iovcnt; ++i) {
+    r = tls_send (h, sock, iov[i].iov_base, iov[i].iov_len, flags);
+    if (r == -1) {
+      if (total > 0 && errno == EAGAIN)
+        break;
+      return -1;
+    }
+    total += r;
+    if ((size_t) r < iov[i].iov_len)
+      break;
+  }
+  return total;
+}
+
 static bool
 tls_pending (struct socket *sock)
 {
@@ -267,10 +404,8 @@ tls_close (struct socket *sock)
 
   r = sock->u.tls.oldsock->ops->close (sock->u.tls.oldsock);
   gnutls_deinit (sock->u.tls.session);
-  if (sock->u.tls.pskcreds)
-    gnutls_psk_free_client_credentials (sock->u.tls.pskcreds);
-  if (sock->u.tls.xcreds)
-    gnutls_certificate_free_credentials (sock->u.tls.xcreds);
+  put_creds (sock->u.tls.creds);
+  free (sock->u.tls.ticket_key);
   free (sock);
   return r;
 }
@@ -278,12 +413,70 @@ tls_close (struct socket *sock)
 static struct socket_ops crypto_ops = {
   .recv = tls_recv,
   .send = tls_send,
+  .sendv = tls_sendv,
+  .pending = tls_pending,
+  .get_fd = tls_get_fd,
+  .shut_writes = tls_shut_writes,
+  .close = tls_close,
+};
+
+#ifdef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
+
+/* Once the kernel has taken over both directions of the session,
+ * application data is encrypted and decrypted by the kernel, so we
+ * can send and receive it with plain socket calls (and so use
+ * vectored sends).  The exception is that recv(2) fails with EIO when
+ * the next record is not application data (eg. a session ticket or
+ * an alert), and GnuTLS must be used to consume it.  GnuTLS is also
+ * still responsible for shutting down and closing the session.
+ */
+static ssize_t
+ktls_recv (struct nbd_handle *h, struct socket *sock, void *buf, size_t len)
+{
+  struct socket *oldsock = sock->u.tls.oldsock;
+  ssize_t r;
+
+  if (tls_pending (sock))
+    return tls_recv (h, sock, buf, len);
+
+  r = recv (oldsock->ops->get_fd (oldsock), buf, len, 0);
+  if (r == -1 && errno == EIO)
+    return tls_recv (h, sock, buf, len);
+  if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+    set_error (errno, "recv");
+  return r;
+}
+
+static ssize_t
+ktls_send (struct nbd_handle *h,
+           struct socket *sock, const void *buf, size_t len, int flags)
+{
+  struct socket *oldsock = sock->u.tls.oldsock;
+
+  return oldsock->ops->send (h, oldsock, buf, len, flags);
+}
+
+static ssize_t
+ktls_sendv (struct nbd_handle *h, struct socket *sock,
+            const struct iovec *iov, size_t iovcnt, int flags)
+{
+  struct socket *oldsock = sock->u.tls.oldsock;
+
+  return oldsock->ops->sendv (h, oldsock, iov, iovcnt, flags);
+}
+
+static struct socket_ops ktls_ops = {
+  .recv = ktls_recv,
+  .send = ktls_send,
+  .sendv = ktls_sendv,
   .pending = tls_pending,
   .get_fd = tls_get_fd,
   .shut_writes = tls_shut_writes,
   .close = tls_close,
 };
 
+#endif /* HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED */
+
 /* Look up the user's key in the PSK file. */
 static int
 lookup_key (const char *pskfile, const char *username,
@@ -338,20 +531,12 @@ lookup_key (const char *pskfile, const char *username,
   return -1;
 }
 
-static gnutls_psk_client_credentials_t
-set_up_psk_credentials (struct nbd_handle *h, gnutls_session_t session)
+static int
+load_psk_credentials (struct nbd_handle *h, struct tls_creds *creds)
 {
   int err;
-  const char prio[] = TLS_PRIORITY ":" "+ECDHE-PSK:+DHE-PSK:+PSK";
   gnutls_datum_t key = { .data = NULL };
   char *username = NULL;
-  gnutls_psk_client_credentials_t ret = NULL;
-
-  err = gnutls_priority_set_direct (session, prio, NULL);
-  if (err < 0) {
-    set_error (0, "gnutls_priority_set_direct: %s", gnutls_strerror (err));
-    goto error;
-  }
 
   username = nbd_unlocked_get_tls_username (h);
   if (username == NULL)
@@ -360,13 +545,13 @@ set_up_psk_credentials (struct nbd_handle *h, gnutls_session_t session)
   if (lookup_key (h->tls_psk_file, username, &key) == -1)
     goto error;
 
-  err = gnutls_psk_allocate_client_credentials (&ret);
+  err = gnutls_psk_allocate_client_credentials (&creds->psk);
   if (err < 0) {
     set_error (0, "gnutls_psk_allocate_client_credentials: %s",
                gnutls_strerror (err));
     goto error;
   }
-  err = gnutls_psk_set_client_credentials (ret, username,
+  err = gnutls_psk_set_client_credentials (creds->psk, username,
                                            &key, GNUTLS_PSK_KEY_HEX);
   if (err < 0) {
     set_error (0, "gnutls_psk_set_client_credentials: %s",
@@ -374,22 +559,14 @@ set_up_psk_credentials (struct nbd_handle *h, gnutls_session_t session)
     goto error;
   }
 
-  err = gnutls_credentials_set (session, GNUTLS_CRD_PSK, ret);
-  if (err < 0) {
-    set_error (0, "gnutls_credentials_set: %s", gnutls_strerror (err));
-    goto error;
-  }
-
   free (username);
   free (key.data);
-  return ret;
+  return 0;
 
  error:
   free (username);
   free (key.data);
-  if (ret)
-    gnutls_psk_free_client_credentials (ret);
-  return NULL;
+  return -1;
 }
 
 static int
@@ -477,38 +654,27 @@ load_certificates (const char *path, gnutls_certificate_credentials_t *ret)
   return -1;
 }
 
-static gnutls_certificate_credentials_t
-set_up_certificate_credentials (struct nbd_handle *h,
-                                gnutls_session_t session, bool *is_error)
+static int
+load_certificate_credentials (struct nbd_handle *h, struct tls_creds *creds)
 {
-  int err;
   gnutls_certificate_credentials_t ret = NULL;
   const char *home = getenv ("HOME");
   char *path = NULL;
-
-  err = gnutls_priority_set_direct (session, TLS_PRIORITY, NULL);
-  if (err < 0) {
-    set_error (0, "gnutls_priority_set_direct: %s", gnutls_strerror (err));
-    goto error;
-  }
+  int err;
 
   /* Try to load the certificates from the directory. */
   if (h->tls_certificates) {
     if (load_certificates (h->tls_certificates, &ret) == -1)
       goto error;
-    if (ret)
-      goto found_certificates;
   }
-  else {
-    if (geteuid () != 0 && home != NULL) {
-      if (asprintf (&path, "%s/.pki/%s", home, PACKAGE_NAME) == -1) {
-        set_error (errno, "asprintf");
-        goto error;
-      }
-      if (load_certificates (path, &ret) == -1)
-        goto error;
-      if (ret)
-        goto found_certificates;
+  else if (geteuid () != 0 && home != NULL) {
+    if (asprintf (&path, "%s/.pki/%s", home, PACKAGE_NAME) == -1) {
+      set_error (errno, "asprintf");
+      goto error;
+    }
+    if (load_certificates (path, &ret) == -1)
+      goto error;
+    if (ret == NULL) {
       free (path);
       if (asprintf (&path, "%s/.config/pki/%s", home, PACKAGE_NAME) == -1) {
         set_error (errno, "asprintf");
@@ -516,80 +682,229 @@ set_up_certificate_credentials (struct nbd_handle *h,
       }
       if (load_certificates (path, &ret) == -1)
         goto error;
-      if (ret)
-        goto found_certificates;
-    }
-    else { /* geteuid () == 0 */
-      if (load_certificates (sysconfdir "/pki/" PACKAGE_NAME, &ret) == -1)
-        goto error;
-      if (ret)
-        goto found_certificates;
     }
   }
-
-  /* Not found. */
+  else { /* geteuid () == 0 */
+    if (load_certificates (sysconfdir "/pki/" PACKAGE_NAME, &ret) == -1)
+      goto error;
+  }
   free (path);
-  return NULL;
 
- found_certificates:
-#ifdef HAVE_GNUTLS_SESSION_SET_VERIFY_CERT
-  if (h->hostname && h->tls_verify_peer)
-    gnutls_session_set_verify_cert (session, h->hostname, 0);
-#else
-  debug (h, "ignoring nbd_set_tls_verify_peer, this requires GnuTLS >= 3.4.6");
-#endif
+  if (ret) {
+    creds->x509 = ret;
+    creds->verify = true;
+    return 0;
+  }
 
-  err = gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, ret);
+  /* Not found, fall back to the system CA. */
+  err = gnutls_certificate_allocate_credentials (&ret);
   if (err < 0) {
-    set_error (0, "gnutls_credentials_set: %s", gnutls_strerror (err));
-    goto error;
+    set_error (0, "gnutls_certificate_allocate_credentials: %s",
+               gnutls_strerror (err));
+    return -1;
   }
 
-  free (path);
-  return ret;
+  err = gnutls_certificate_set_x509_system_trust (ret);
+  if (err < 0) {
+    set_error (0, "gnutls_certificate_set_x509_system_trust: %s",
+               gnutls_strerror (err));
+    gnutls_certificate_free_credentials (ret);
+    return -1;
+  }
+
+  creds->x509 = ret;
+  return 0;
 
  error:
-  gnutls_certificate_free_credentials (ret);
   free (path);
-  *is_error = true;
-  return NULL;
+  return -1;
 }
 
-static gnutls_certificate_credentials_t
-set_up_system_CA (struct nbd_handle *h, gnutls_session_t session)
+/* Return the credentials for this handle, loading them unless a
+ * cached copy can be used.  The key describes everything that the
+ * credentials were loaded from.
+ */
+static struct tls_creds *
+get_creds (struct nbd_handle *h)
 {
-  int err;
-  gnutls_certificate_credentials_t ret = NULL;
+  struct tls_creds *creds, *c;
+  char *username = NULL;
+  char *key;
+  int r;
 
-  err = gnutls_priority_set_direct (session, TLS_PRIORITY, NULL);
-  if (err < 0) {
-    set_error (0, "gnutls_priority_set_direct: %s", gnutls_strerror (err));
+  if (h->tls_psk_file) {
+    username = nbd_unlocked_get_tls_username (h);
+    if (username == NULL)
+      return NULL;
+    r = asprintf (&key, "psk:%s:%s", h->tls_psk_file, username);
+    free (username);
+  }
+  else
+    r = asprintf (&key, "x509:%s",
+                  h->tls_certificates ? h->tls_certificates : "");
+  if (r == -1) {
+    set_error (errno, "asprintf");
     return NULL;
   }
 
-  err = gnutls_certificate_allocate_credentials (&ret);
-  if (err < 0) {
-    set_error (0, "gnutls_certificate_allocate_credentials: %s",
-               gnutls_strerror (err));
+  if (h->tls_cache) {
+    pthread_mutex_lock (&tls_cache_lock);
+    for (c = tls_cache_creds; c != NULL; c = c->next) {
+      if (strcmp (c->key, key) == 0) {
+        c->refs++;
+        break;
+      }
+    }
+    pthread_mutex_unlock (&tls_cache_lock);
+    if (c) {
+      debug (h, "reusing cached TLS credentials");
+      free (key);
+      return c;
+    }
+  }
+
+  creds = calloc (1, sizeof *creds);
+  if (creds == NULL) {
+    set_error (errno, "calloc");
+    free (key);
+    return NULL;
+  }
+  creds->refs = 1;
+  creds->key = key;
+  if (h->tls_psk_file)
+    r = load_psk_credentials (h, creds);
+  else
+    r = load_certificate_credentials (h, creds);
+  if (r == -1) {
+    free_creds (creds);
     return NULL;
   }
 
-  err = gnutls_certificate_set_x509_system_trust (ret);
-  if (err < 0) {
-    set_error (0, "gnutls_certificate_set_x509_system_trust: %s",
-               gnutls_strerror (err));
-    gnutls_certificate_free_credentials (ret);
+  if (h->tls_cache) {
+    /* Another handle may have loaded the same credentials meanwhile,
+     * in which case use those.
+     */
+    pthread_mutex_lock (&tls_cache_lock);
+    for (c = tls_cache_creds; c != NULL; c = c->next) {
+      if (strcmp (c->key, key) == 0) {
+        c->refs++;
+        break;
+      }
+    }
+    if (c == NULL) {
+      creds->refs++;
+      creds->next = tls_cache_creds;
+      tls_cache_creds = creds;
+    }
+    pthread_mutex_unlock (&tls_cache_lock);
+    if (c) {
+      free_creds (creds);
+      creds = c;
+    }
+  }
+
+  return creds;
+}
+
+/* Return the hostname which the server certificate is checked
+ * against, or NULL if it is not checked.  This must match
+ * nbd_internal_crypto_create_session.
+ */
+static const char *
+verify_hostname (struct nbd_handle *h, const struct tls_creds *creds)
+{
+#ifdef HAVE_GNUTLS_SESSION_SET_VERIFY_CERT
+  if (creds->x509 && creds->verify && h->hostname && h->tls_verify_peer)
+    return h->hostname;
+#endif
+  return NULL;
+}
+
+/* Return the key under which sessions with this server are cached,
+ * or NULL if the server cannot be identified, for example when
+ * connected to a subprocess.
+ *
+ * A resumed session skips the certificate check, so the key includes
+ * how the certificate was checked.  Otherwise a ticket from a session
+ * which did not verify the server could be resumed by a handle which
+ * requires verification.
+ */
+static char *
+ticket_key (struct nbd_handle *h, const struct tls_creds *creds)
+{
+  const unsigned char *addr = (const unsigned char *) &h->connaddr;
+  const char *verify = verify_hostname (h, creds);
+  char *prefix, *key, *p;
+  socklen_t i;
+
+  if (asprintf (&prefix, "%s\nverify:%s", creds->key,
+                verify ? verify : "") == -1) {
+    set_error (errno, "asprintf");
     return NULL;
   }
 
-  err = gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, ret);
-  if (err < 0) {
-    set_error (0, "gnutls_credentials_set: %s", gnutls_strerror (err));
-    gnutls_certificate_free_credentials (ret);
+  if (h->hostname && h->port) {
+    if (asprintf (&key, "%s\ntcp:%s:%s",
+                  prefix, h->hostname, h->port) == -1) {
+      set_error (errno, "asprintf");
+      free (prefix);
+      return NULL;
+    }
+    free (prefix);
+    return key;
+  }
+
+  if (h->connaddrlen == 0) {
+    free (prefix);
     return NULL;
   }
+  key = malloc (strlen (prefix) + 6 + 2 * h->connaddrlen + 1);
+  if (key == NULL) {
+    set_error (errno, "malloc");
+    free (prefix);
+    return NULL;
+  }
+  p = key + sprintf (key, "%s\naddr:", prefix);
+  for (i = 0; i < h->connaddrlen; ++i)
+    p += sprintf (p, "%02x", addr[i]);
+  free (prefix);
+  return key;
+}
+
+/* Called by GnuTLS when the server sends a session ticket.  With
+ * TLS 1.3 this happens after the handshake, possibly while reading
+ * the first replies.
+ */
+static int
+save_ticket (gnutls_session_t session, unsigned htype, unsigned when,
+             unsigned incoming, const gnutls_datum_t *msg)
+{
+  const char *key = gnutls_session_get_ptr (session);
+  gnutls_datum_t data;
+  struct tls_ticket *t;
 
-  return ret;
+  if (key == NULL || gnutls_session_get_data2 (session, &data) < 0)
+    return 0;
+
+  pthread_mutex_lock (&tls_cache_lock);
+  for (t = tls_cache_tickets; t != NULL; t = t->next)
+    if (strcmp (t->key, key) == 0)
+      break;
+  if (t == NULL) {
+    t = calloc (1, sizeof *t);
+    if (t == NULL || (t->key = strdup (key)) == NULL) {
+      free (t);
+      pthread_mutex_unlock (&tls_cache_lock);
+      gnutls_free (data.data);
+      return 0;
+    }
+    t->next = tls_cache_tickets;
+    tls_cache_tickets = t;
+  }
+  gnutls_free (t->data.data);
+  t->data = data;
+  pthread_mutex_unlock (&tls_cache_lock);
+  return 0;
 }
 
 /* Called from the state machine after receiving an ACK from
@@ -604,13 +919,18 @@ nbd_internal_crypto_create_session (struct nbd_handle *h,
   int err;
   struct socket *sock;
   gnutls_session_t session;
-  gnutls_psk_client_credentials_t pskcreds = NULL;
-  gnutls_certificate_credentials_t xcreds = NULL;
+  struct tls_creds *creds;
+  char *key = NULL;
+  struct tls_ticket *t;
   unsigned init_flags;
 
   init_flags = GNUTLS_CLIENT | GNUTLS_NONBLOCK;
 #ifdef GNUTLS_NO_SIGNAL
   init_flags |= GNUTLS_NO_SIGNAL;
+#endif
+#ifdef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
+  if (h->tls_ktls)
+    init_flags |= GNUTLS_ENABLE_KTLS;
 #endif
   err = gnutls_init (&session, init_flags);
   if (err < 0) {
@@ -629,29 +949,67 @@ nbd_internal_crypto_create_session (struct nbd_handle *h,
     }
   }
 
-  if (h->tls_psk_file) {
-    pskcreds = set_up_psk_credentials (h, session);
-    if (pskcreds == NULL) {
-      gnutls_deinit (session);
-      return NULL;
+  creds = get_creds (h);
+  if (creds == NULL) {
+    gnutls_deinit (session);
+    return NULL;
+  }
+
+  if (creds->psk) {
+    const char prio[] = TLS_PRIORITY ":" "+ECDHE-PSK:+DHE-PSK:+PSK";
+
+    err = gnutls_priority_set_direct (session, prio, NULL);
+    if (err < 0) {
+      set_error (0, "gnutls_priority_set_direct: %s", gnutls_strerror (err));
+      goto error;
     }
+    err = gnutls_credentials_set (session, GNUTLS_CRD_PSK, creds->psk);
   }
   else {
-    bool is_error = false;
-
-    xcreds = set_up_certificate_credentials (h, session, &is_error);
-    if (xcreds == NULL) {
-      if (!is_error) {
-        /* Fallback case: use system CA. */
-        xcreds = set_up_system_CA (h, session);
-        if (xcreds == NULL)
-          is_error = true;
-      }
+    err = gnutls_priority_set_direct (session, TLS_PRIORITY, NULL);
+    if (err < 0) {
+      set_error (0, "gnutls_priority_set_direct: %s", gnutls_strerror (err));
+      goto error;
     }
+    if (creds->verify) {
+#ifdef HAVE_GNUTLS_SESSION_SET_VERIFY_CERT
+      const char *verify = verify_hostname (h, creds);
 
-    if (is_error) {
-      gnutls_deinit (session);
-      return NULL;
+      if (verify)
+        gnutls_session_set_verify_cert (session, verify, 0);
+#else
+      debug (h, "ignoring nbd_set_tls_verify_peer, "
+             "this requires GnuTLS >= 3.4.6");
+#endif
+    }
+    err = gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE,
+                                  creds->x509);
+  }
+  if (err < 0) {
+    set_error (0, "gnutls_credentials_set: %s", gnutls_strerror (err));
+    goto error;
+  }
+
+  /* Offer to resume the last session with this server, and keep any
+   * new session tickets for the next handle.
+   */
+  if (h->tls_cache) {
+    key = ticket_key (h, creds);
+    if (key) {
+      pthread_mutex_lock (&tls_cache_lock);
+      for (t = tls_cache_tickets; t != NULL; t = t->next) {
+        if (strcmp (t->key, key) == 0) {
+          if (gnutls_session_set_data (session,
+                                       t->data.data, t->data.size) == 0)
+            debug (h, "trying to resume TLS session");
+          break;
+        }
+      }
+      pthread_mutex_unlock (&tls_cache_lock);
+      gnutls_session_set_ptr (session, key);
+      gnutls_handshake_set_hook_function (session,
+                                          GNUTLS_HANDSHAKE_NEW_SESSION_TICKET,
+                                          GNUTLS_HOOK_POST, save_ticket);
     }
   }
 
@@ -664,19 +1022,20 @@ nbd_internal_crypto_create_session (struct nbd_handle *h,
   sock = malloc (sizeof *sock);
   if (sock == NULL) {
     set_error (errno, "malloc");
-    gnutls_deinit (session);
-    if (pskcreds)
-      gnutls_psk_free_client_credentials (pskcreds);
-    if (xcreds)
-      gnutls_certificate_free_credentials (xcreds);
-    return NULL;
+    goto error;
   }
   sock->u.tls.session = session;
-  sock->u.tls.pskcreds = pskcreds;
-  sock->u.tls.xcreds = xcreds;
+  sock->u.tls.creds = creds;
+  sock->u.tls.ticket_key = key;
   sock->u.tls.oldsock = oldsock;
   sock->ops = &crypto_ops;
   return sock;
+
+ error:
+  gnutls_deinit (session);
+  put_creds (creds);
+  free (key);
+  return NULL;
 }
 
 /* Return the read/write direction. */
@@ -700,8 +1059,25 @@ nbd_internal_crypto_handshake (struct nbd_handle *h)
 
   assert (session);
   err = gnutls_handshake (session);
-  if (err == 0)
+  if (err == 0) {
+    if (gnutls_session_is_resumed (session)) {
+      debug (h, "resumed previous TLS session");
+      h->tls_session_resumed = true;
+    }
+#ifdef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
+    /* GnuTLS only hands the session to the kernel if the kernel
+     * supports the negotiated cipher.  If it managed one direction
+     * but not the other, keep using GnuTLS for everything.
+     */
+    if (h->tls_ktls &&
+        gnutls_transport_is_ktls_enabled (session) == GNUTLS_KTLS_DUPLEX) {
+      debug (h, "TLS session offloaded to the kernel");
+      h->sock->ops = &ktls_ops;
+      h->tls_ktls_active = true;
+    }
+#endif
     return 0;
+  }
   if (!gnutls_error_is_fatal (err))
     return 1;
 
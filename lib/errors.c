@@ -139,6 +139,44 @@ nbd_internal_set_last_error (int errnum, char *error)
   last_error->errnum = errnum;
 }
 
+/* Take the last error out of thread-local storage, leaving none, so
+ * that it can be put back with nbd_internal_restore_last_error after
+ * an internal call whose failure the caller must not see.
+ */
+char *
+nbd_internal_take_last_error (int *errnum)
+{
+  struct last_error *last_error = pthread_getspecific (errors_key);
+  char *error;
+
+  *errnum = 0;
+  if (!last_error)
+    return NULL;
+  error = last_error->error;
+  *errnum = last_error->errnum;
+  last_error->error = NULL;
+  last_error->errnum = 0;
+  return error;
+}
+
+/* Put back an error from nbd_internal_take_last_error, replacing any
+ * error set since.
+ */
+void
+nbd_internal_restore_last_error (int errnum, char *error)
+{
+  struct last_error *last_error = pthread_getspecific (errors_key);
+
+  if (!last_error) {
+    /* Nothing was ever set in this thread, so error is NULL. */
+    free (error);
+    return;
+  }
+  free (last_error->error);
+  last_error->error = error;
+  last_error->errnum = errnum;
+}
+
 const char *
 nbd_internal_get_error_context (void)
 {
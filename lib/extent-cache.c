@@ -0,0 +1,516 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Block status cache (see nbd_set_block_status_cache(3)).
+ *
+ * For each meta context the cache holds a sorted list of
+ * non-overlapping extents learned from block status replies.  Write,
+ * zero and trim commands remove their range from every context both
+ * when they are issued and when they are replied to, since the server
+ * may process commands in flight in any order.  For the same reason a
+ * block status reply is only stored if nothing was invalidated since
+ * its command was issued, which is tracked with a generation count.
+ *
+ * The cache has its own lock so that it can be shared by the
+ * connections of a group (lib/group.c).  It is always taken after
+ * the handle lock, and no callbacks are called while holding it.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "internal.h"
+#include "minmax.h"
+#include "vector.h"
+
+struct cached_extent {
+  uint64_t offset;
+  uint64_t length;
+  uint64_t flags;
+};
+DEFINE_VECTOR_TYPE (cached_extent_vector, struct cached_extent);
+
+struct cached_context {
+  char *name;
+  cached_extent_vector extents;
+};
+DEFINE_VECTOR_TYPE (cached_context_vector, struct cached_context);
+
+DEFINE_VECTOR_TYPE (extent_vector, nbd_extent);
+
+struct extent_cache {
+  pthread_mutex_t lock;
+  unsigned refs;                /* Handles using this cache. */
+  uint64_t gen;                 /* Incremented by every invalidation. */
+  uint64_t max_extents;
+  uint64_t nr_extents;          /* Total over all contexts. */
+  cached_context_vector contexts;
+};
+
+static struct extent_cache *
+cache_create (uint64_t max_extents)
+{
+  struct extent_cache *c;
+
+  c = calloc (1, sizeof *c);
+  if (c == NULL) {
+    set_error (errno, "calloc");
+    return NULL;
+  }
+  pthread_mutex_init (&c->lock, NULL);
+  c->refs = 1;
+  /* Commands issued while there was no cache have cache_gen == 0, so
+   * their replies are never stored.
+   */
+  c->gen = 1;
+  c->max_extents = max_extents;
+  return c;
+}
+
+static void
+cache_empty (struct extent_cache *c)
+{
+  size_t i;
+
+  for (i = 0; i < c->contexts.len; ++i)
+    c->contexts.ptr[i].extents.len = 0;
+  c->nr_extents = 0;
+}
+
+static void
+cache_unref (struct extent_cache *c)
+{
+  size_t i;
+  bool last;
+
+  if (c == NULL)
+    return;
+
+  pthread_mutex_lock (&c->lock);
+  last = --c->refs == 0;
+  pthread_mutex_unlock (&c->lock);
+  if (!last)
+    return;
+
+  for (i = 0; i < c->contexts.len; ++i) {
+    free (c->contexts.ptr[i].name);
+    cached_extent_vector_reset (&c->contexts.ptr[i].extents);
+  }
+  cached_context_vector_reset (&c->contexts);
+  pthread_mutex_destroy (&c->lock);
+  free (c);
+}
+
+static struct cached_context *
+find_context (struct extent_cache *c, const char *name, bool create)
+{
+  struct cached_context ctx = { .extents = empty_vector };
+  size_t i;
+
+  for (i = 0; i < c->contexts.len; ++i)
+    if (strcmp (c->contexts.ptr[i].name, name) == 0)
+      return &c->contexts.ptr[i];
+  if (!create)
+    return NULL;
+
+  ctx.name = strdup (name);
+  if (ctx.name == NULL)
+    return NULL;
+  if (cached_context_vector_append (&c->contexts, ctx) == -1) {
+    free (ctx.name);
+    return NULL;
+  }
+  return &c->contexts.ptr[c->contexts.len - 1];
+}
+
+/* Return the index of the first extent which ends after offset. */
+static size_t
+find_extent (const cached_extent_vector *v, uint64_t offset)
+{
+  size_t lo = 0, hi = v->len, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (v->ptr[mid].offset + v->ptr[mid].length <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Remove [start, end) from the extents of one context, splitting or
+ * trimming the extents at either end.  Returns the index where
+ * extents for the removed range should be inserted.
+ */
+static size_t
+remove_range (struct extent_cache *c, cached_extent_vector *v,
+              uint64_t start, uint64_t end)
+{
+  size_t i = find_extent (v, start), j;
+  struct cached_extent *e;
+  uint64_t e_end;
+
+  if (i < v->len && v->ptr[i].offset < start) {
+    e = &v->ptr[i];
+    e_end = e->offset + e->length;
+    e->length = start - e->offset;
+    i++;
+    if (e_end > end) {
+      struct cached_extent tail =
+        { .offset = end, .length = e_end - end, .flags = e->flags };
+
+      /* If this fails, losing the tail is harmless. */
+      if (cached_extent_vector_insert (v, tail, i) == 0)
+        c->nr_extents++;
+      return i;
+    }
+  }
+
+  for (j = i; j < v->len && v->ptr[j].offset + v->ptr[j].length <= end; ++j)
+    ;
+  if (j > i) {
+    memmove (&v->ptr[i], &v->ptr[j], (v->len - j) * sizeof v->ptr[0]);
+    v->len -= j - i;
+    c->nr_extents -= j - i;
+  }
+  if (i < v->len && v->ptr[i].offset < end) {
+    e = &v->ptr[i];
+    e->length -= end - e->offset;
+    e->offset = end;
+  }
+  return i;
+}
+
+static void
+invalidate (struct extent_cache *c, uint64_t offset, uint64_t count)
+{
+  size_t i;
+
+  pthread_mutex_lock (&c->lock);
+  c->gen++;
+  if (count > 0) {
+    for (i = 0; i < c->contexts.len; ++i)
+      remove_range (c, &c->contexts.ptr[i].extents,
+                    offset, offset + count);
+  }
+  pthread_mutex_unlock (&c->lock);
+}
+
+static bool
+modifies_data (uint16_t type)
+{
+  return type == NBD_CMD_WRITE || type == NBD_CMD_WRITE_ZEROES ||
+    type == NBD_CMD_TRIM;
+}
+
+/* Called from command_common as each command is queued. */
+void
+nbd_internal_extent_cache_queued (struct nbd_handle *h, struct command *cmd)
+{
+  struct extent_cache *c = h->extent_cache;
+
+  if (cmd->type == NBD_CMD_BLOCK_STATUS) {
+    pthread_mutex_lock (&c->lock);
+    cmd->cache_gen = c->gen;
+    pthread_mutex_unlock (&c->lock);
+  }
+  else if (modifies_data (cmd->type))
+    invalidate (c, cmd->offset, cmd->count);
+}
+
+/* Called when the reply to cmd has been received. */
+void
+nbd_internal_extent_cache_replied (struct nbd_handle *h,
+                                   const struct command *cmd)
+{
+  if (modifies_data (cmd->type))
+    invalidate (h->extent_cache, cmd->offset, cmd->count);
+}
+
+/* Store the extents for one meta context from the block status reply
+ * to cmd.  Extents are clipped to the export size.
+ */
+void
+nbd_internal_extent_cache_insert (struct nbd_handle *h,
+                                  const struct command *cmd,
+                                  const char *name,
+                                  const nbd_extent *entries, size_t n)
+{
+  struct extent_cache *c = h->extent_cache;
+  struct cached_context *ctx;
+  cached_extent_vector *v;
+  struct cached_extent e, *prev;
+  uint64_t offset = cmd->offset, end = offset;
+  size_t i, pos, nr;
+
+  pthread_mutex_lock (&c->lock);
+  if (cmd->cache_gen != c->gen)
+    goto out;
+
+  /* Work out how much of the reply can be used. */
+  n = MIN (n, c->max_extents);
+  for (nr = 0; nr < n; ++nr) {
+    if (entries[nr].length == 0 || end >= h->exportsize)
+      break;
+    end += MIN (entries[nr].length, h->exportsize - end);
+  }
+  if (nr == 0)
+    goto out;
+
+  /* When full, start again rather than choosing what to evict. */
+  if (c->nr_extents + nr > c->max_extents)
+    cache_empty (c);
+
+  ctx = find_context (c, name, true);
+  if (ctx == NULL)
+    goto out;
+  v = &ctx->extents;
+  pos = remove_range (c, v, offset, end);
+
+  for (i = 0; i < nr; ++i) {
+    e.offset = offset;
+    e.length = MIN (entries[i].length, end - offset);
+    e.flags = entries[i].flags;
+    offset += e.length;
+
+    prev = pos > 0 ? &v->ptr[pos-1] : NULL;
+    if (prev && prev->offset + prev->length == e.offset &&
+        prev->flags == e.flags) {
+      prev->length += e.length;
+      continue;
+    }
+    if (cached_extent_vector_insert (v, e, pos) == -1) {
+      /* Leave a gap, the extents stored so far are still correct. */
+      pos = remove_range (c, v, e.offset, end);
+      break;
+    }
+    c->nr_extents++;
+    pos++;
+  }
+
+  /* Merge with the following extent if possible. */
+  if (pos > 0 && pos < v->len &&
+      v->ptr[pos-1].offset + v->ptr[pos-1].length == v->ptr[pos].offset &&
+      v->ptr[pos-1].flags == v->ptr[pos].flags) {
+    v->ptr[pos-1].length += v->ptr[pos].length;
+    cached_extent_vector_remove (v, pos);
+    c->nr_extents--;
+  }
+
+ out:
+  pthread_mutex_unlock (&c->lock);
+}
+
+/* Copy the cached extents of one context covering [offset, end)
+ * onto exts.  Returns false if they do not cover the whole range.
+ */
+static bool
+copy_extents (struct extent_cache *c, const char *name,
+              uint64_t offset, uint64_t end, bool req_one,
+              extent_vector *exts)
+{
+  struct cached_context *ctx;
+  const cached_extent_vector *v;
+  const struct cached_extent *e;
+  nbd_extent ext;
+  size_t i;
+  uint64_t pos = offset;
+
+  ctx = find_context (c, name, false);
+  if (ctx == NULL)
+    return false;
+  v = &ctx->extents;
+
+  for (i = find_extent (v, offset); i < v->len && pos < end; ++i) {
+    e = &v->ptr[i];
+    if (e->offset > pos)
+      return false;
+    ext.length = e->offset + e->length - pos;
+    ext.flags = e->flags;
+    if (extent_vector_append (exts, ext) == -1)
+      return false;
+    pos += ext.length;
+    if (req_one)
+      return true;
+  }
+  return pos >= end;
+}
+
+/* Try to answer a synchronous block status command from the cache.
+ * Returns 1 if the callback was called for every meta context (and
+ * freed), 0 if the server must be asked, or -1 if the callback
+ * failed.
+ */
+int
+nbd_internal_extent_cache_lookup (struct nbd_handle *h,
+                                  uint64_t count, uint64_t offset,
+                                  nbd_extent64_callback *extent64,
+                                  uint32_t flags)
+{
+  struct extent_cache *c = h->extent_cache;
+  const bool req_one = flags & LIBNBD_CMD_FLAG_REQ_ONE;
+  extent_vector exts = empty_vector;
+  size_t *starts = NULL;
+  size_t i, nr_contexts = h->meta_contexts.len;
+  bool hit = false;
+  int err = 0, error;
+
+  /* Leave anything the server would reject to the server. */
+  if (count == 0 || !h->meta_valid || nr_contexts == 0 ||
+      h->disconnect_request)
+    return 0;
+  if (h->block_minimum && (h->strict & LIBNBD_STRICT_ALIGN) &&
+      (offset | count) & (h->block_minimum - 1))
+    return 0;
+
+  starts = malloc ((nr_contexts + 1) * sizeof *starts);
+  if (starts == NULL)
+    goto out;
+
+  pthread_mutex_lock (&c->lock);
+  for (i = 0; i < nr_contexts; ++i) {
+    starts[i] = exts.len;
+    if (!copy_extents (c, h->meta_contexts.ptr[i].name,
+                       offset, offset + count, req_one, &exts))
+      break;
+  }
+  starts[i] = exts.len;
+  hit = i == nr_contexts;
+  pthread_mutex_unlock (&c->lock);
+
+  if (!hit) {
+    h->extent_cache_misses++;
+    goto out;
+  }
+  h->extent_cache_hits++;
+
+  for (i = 0; i < nr_contexts; ++i) {
+    error = 0;
+    if (CALL_CALLBACK (*extent64, h->meta_contexts.ptr[i].name, offset,
+                       &exts.ptr[starts[i]], starts[i+1] - starts[i],
+                       &error) == -1)
+      if (err == 0)
+        err = error ? error : EPROTO;
+  }
+  FREE_CALLBACK (*extent64);
+
+ out:
+  free (starts);
+  extent_vector_reset (&exts);
+  if (err) {
+    set_error (err, "%s: command failed",
+               nbd_internal_name_of_nbd_cmd (NBD_CMD_BLOCK_STATUS));
+    return -1;
+  }
+  return hit;
+}
+
+/* Make handle to use the same cache as handle from, for the
+ * connections of a group.  Does nothing if from has no cache.
+ */
+void
+nbd_internal_extent_cache_share (struct nbd_handle *from,
+                                 struct nbd_handle *to)
+{
+  struct extent_cache *c, *old;
+
+  pthread_mutex_lock (&from->lock);
+  c = from->extent_cache;
+  if (c) {
+    pthread_mutex_lock (&c->lock);
+    c->refs++;
+    pthread_mutex_unlock (&c->lock);
+  }
+  pthread_mutex_unlock (&from->lock);
+  if (c == NULL)
+    return;
+
+  pthread_mutex_lock (&to->lock);
+  old = to->extent_cache;
+  to->extent_cache = c;
+  pthread_mutex_unlock (&to->lock);
+  cache_unref (old);
+}
+
+void
+nbd_internal_extent_cache_free (struct nbd_handle *h)
+{
+  cache_unref (h->extent_cache);
+  h->extent_cache = NULL;
+}
+
+int
+nbd_unlocked_set_block_status_cache (struct nbd_handle *h,
+                                     uint64_t max_extents)
+{
+  struct extent_cache *c = h->extent_cache;
+
+  if (max_extents == 0) {
+    nbd_internal_extent_cache_free (h);
+    return 0;
+  }
+
+  if (c == NULL) {
+    h->extent_cache = cache_create (max_extents);
+    return h->extent_cache == NULL ? -1 : 0;
+  }
+
+  pthread_mutex_lock (&c->lock);
+  c->max_extents = max_extents;
+  if (c->nr_extents > max_extents)
+    cache_empty (c);
+  pthread_mutex_unlock (&c->lock);
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+uint64_t
+nbd_unlocked_get_block_status_cache (struct nbd_handle *h)
+{
+  struct extent_cache *c = h->extent_cache;
+  uint64_t r;
+
+  if (c == NULL)
+    return 0;
+  pthread_mutex_lock (&c->lock);
+  r = c->max_extents;
+  pthread_mutex_unlock (&c->lock);
+  return r;
+}
+
+/* NB: may_set_error = false. */
+uint64_t
+nbd_unlocked_stats_block_status_cache_hits (struct nbd_handle *h)
+{
+  return h->extent_cache_hits;
+}
+
+/* NB: may_set_error = false. */
+uint64_t
+nbd_unlocked_stats_block_status_cache_misses (struct nbd_handle *h)
+{
+  return h->extent_cache_misses;
+}
@@ -0,0 +1,342 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* The flight recorder, see nbd_set_flight_recorder(3).  Events are
+ * stored in binary in a fixed size ring, and only formatted when the
+ * ring is dumped.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+static int dump_to_fd (struct nbd_handle *h, int fd, bool json);
+
+/* Return the next slot in the ring, overwriting the oldest event if
+ * the ring is full.
+ */
+static struct flight_event *
+next_event (struct nbd_handle *h, uint16_t kind)
+{
+  struct flight_event *ev = &h->flight[h->flight_count++ % h->flight_size];
+
+  memset (ev, 0, sizeof *ev);
+  ev->ns = nbd_internal_stats_now ();
+  ev->kind = kind;
+  return ev;
+}
+
+void
+nbd_internal_flight_request (struct nbd_handle *h, const struct command *cmd)
+{
+  struct flight_event *ev = next_event (h, FLIGHT_REQUEST);
+
+  ev->cookie = cmd->cookie;
+  ev->offset = cmd->offset;
+  ev->count = cmd->count;
+  ev->type = cmd->type;
+  ev->flags = cmd->flags;
+}
+
+/* Called when a reply header has been received into h->sbuf, before
+ * its magic number is checked.
+ */
+void
+nbd_internal_flight_reply (struct nbd_handle *h)
+{
+  struct flight_event *ev = next_event (h, FLIGHT_REPLY);
+
+  ev->magic = be32toh (h->sbuf.reply.hdr.simple.magic);
+  ev->cookie = be64toh (h->sbuf.reply.hdr.simple.handle);
+  switch (ev->magic) {
+  case NBD_SIMPLE_REPLY_MAGIC:
+    ev->error = be32toh (h->sbuf.reply.hdr.simple.error);
+    break;
+  case NBD_STRUCTURED_REPLY_MAGIC:
+    ev->flags = be16toh (h->sbuf.reply.hdr.structured.flags);
+    ev->type = be16toh (h->sbuf.reply.hdr.structured.type);
+    ev->count = be32toh (h->sbuf.reply.hdr.structured.length);
+    break;
+  case NBD_EXTENDED_REPLY_MAGIC:
+    ev->flags = be16toh (h->sbuf.reply.hdr.extended.flags);
+    ev->type = be16toh (h->sbuf.reply.hdr.extended.type);
+    ev->offset = be64toh (h->sbuf.reply.hdr.extended.offset);
+    ev->count = be64toh (h->sbuf.reply.hdr.extended.length);
+    break;
+  }
+}
+
+void
+nbd_internal_flight_complete (struct nbd_handle *h, const struct command *cmd)
+{
+  struct flight_event *ev = next_event (h, FLIGHT_COMPLETE);
+
+  ev->cookie = cmd->cookie;
+  ev->type = cmd->type;
+  ev->error = cmd->error;
+}
+
+void
+nbd_internal_flight_state (struct nbd_handle *h,
+                           enum state from, enum state to)
+{
+  struct flight_event *ev = next_event (h, FLIGHT_STATE);
+
+  ev->from = from;
+  ev->to = to;
+}
+
+/* Called when the handle enters the DEAD state.  This is not a hot
+ * path, so the error message is kept too, and the ring is dumped if
+ * the caller asked for it.  DEAD is final, so there is at most one
+ * such event in the life of a handle, and the message is kept in the
+ * handle rather than in the event.
+ */
+void
+nbd_internal_flight_dead (struct nbd_handle *h)
+{
+  struct flight_event *ev = next_event (h, FLIGHT_DEAD);
+  const char *err = nbd_get_error ();
+
+  ev->error = nbd_get_errno ();
+  free (h->flight_dead_msg);
+  h->flight_dead_msg = err ? strdup (err) : NULL;
+
+  if (h->flight_flags & LIBNBD_FLIGHT_RECORDER_DUMP_ON_DEAD) {
+    fflush (stderr);
+    if (dump_to_fd (h, STDERR_FILENO,
+                    h->flight_flags & LIBNBD_FLIGHT_RECORDER_JSON) == -1)
+      debug (h, "flight recorder: %s", strerror (errno));
+  }
+}
+
+int
+nbd_unlocked_set_flight_recorder (struct nbd_handle *h, unsigned entries,
+                                  uint32_t flags)
+{
+  struct flight_event *ring = NULL;
+
+  if (entries > 0) {
+    ring = calloc (entries, sizeof *ring);
+    if (ring == NULL) {
+      set_error (errno, "calloc");
+      return -1;
+    }
+  }
+
+  free (h->flight);
+  h->flight = ring;
+  h->flight_size = entries;
+  h->flight_count = 0;
+  h->flight_flags = flags;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+unsigned
+nbd_unlocked_get_flight_recorder (struct nbd_handle *h)
+{
+  return h->flight_size;
+}
+
+static const char *
+name_of_reply_magic (uint32_t magic)
+{
+  switch (magic) {
+  case NBD_SIMPLE_REPLY_MAGIC: return "simple";
+  case NBD_STRUCTURED_REPLY_MAGIC: return "structured";
+  case NBD_EXTENDED_REPLY_MAGIC: return "extended";
+  default: return "invalid";
+  }
+}
+
+static void
+print_text (FILE *fp, const struct flight_event *ev, uint64_t start,
+            const char *dead_msg)
+{
+  const uint64_t ns = ev->ns - start;
+
+  fprintf (fp, "+%" PRIu64 ".%06" PRIu64 " ",
+           ns / 1000000000, ns / 1000 % 1000000);
+  switch (ev->kind) {
+  case FLIGHT_REQUEST:
+    fprintf (fp, "request %s cookie=%" PRIu64 " offset=%" PRIu64
+             " count=%" PRIu64 " flags=0x%" PRIx16 "\n",
+             nbd_internal_name_of_nbd_cmd (ev->type), ev->cookie,
+             ev->offset, ev->count, ev->flags);
+    break;
+  case FLIGHT_REPLY:
+    fprintf (fp, "reply %s cookie=%" PRIu64,
+             name_of_reply_magic (ev->magic), ev->cookie);
+    switch (ev->magic) {
+    case NBD_SIMPLE_REPLY_MAGIC:
+      fprintf (fp, " error=%" PRIu32 "\n", ev->error);
+      break;
+    case NBD_STRUCTURED_REPLY_MAGIC:
+      fprintf (fp, " type=%" PRIu16 " flags=0x%" PRIx16
+               " length=%" PRIu64 "\n", ev->type, ev->flags, ev->count);
+      break;
+    case NBD_EXTENDED_REPLY_MAGIC:
+      fprintf (fp, " type=%" PRIu16 " flags=0x%" PRIx16
+               " offset=%" PRIu64 " length=%" PRIu64 "\n",
+               ev->type, ev->flags, ev->offset, ev->count);
+      break;
+    default:
+      fprintf (fp, " magic=0x%" PRIx32 "\n", ev->magic);
+    }
+    break;
+  case FLIGHT_COMPLETE:
+    fprintf (fp, "complete %s cookie=%" PRIu64 " error=%" PRIu32 "\n",
+             nbd_internal_name_of_nbd_cmd (ev->type), ev->cookie, ev->error);
+    break;
+  case FLIGHT_STATE:
+    fprintf (fp, "state %s -> %s\n",
+             nbd_internal_state_short_string (ev->from),
+             nbd_internal_state_short_string (ev->to));
+    break;
+  case FLIGHT_DEAD:
+    fprintf (fp, "dead errno=%" PRIu32 " %s\n",
+             ev->error, dead_msg ? dead_msg : "");
+    break;
+  }
+}
+
+static void
+print_json_string (FILE *fp, const char *s)
+{
+  fputc ('"', fp);
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\')
+      fprintf (fp, "\\%c", *s);
+    else if ((unsigned char) *s < 0x20)
+      fprintf (fp, "\\u%04x", (unsigned char) *s);
+    else
+      fputc (*s, fp);
+  }
+  fputc ('"', fp);
+}
+
+static void
+print_json (FILE *fp, const struct flight_event *ev, const char *dead_msg)
+{
+  fprintf (fp, "{ \"ns\": %" PRIu64 ", ", ev->ns);
+  switch (ev->kind) {
+  case FLIGHT_REQUEST:
+    fprintf (fp, "\"event\": \"request\", \"command\": \"%s\", "
+             "\"cookie\": %" PRIu64 ", \"offset\": %" PRIu64 ", "
+             "\"count\": %" PRIu64 ", \"flags\": %" PRIu16 " }",
+             nbd_internal_name_of_nbd_cmd (ev->type), ev->cookie,
+             ev->offset, ev->count, ev->flags);
+    break;
+  case FLIGHT_REPLY:
+    fprintf (fp, "\"event\": \"reply\", \"magic\": %" PRIu32 ", "
+             "\"style\": \"%s\", \"cookie\": %" PRIu64 ", "
+             "\"error\": %" PRIu32 ", \"type\": %" PRIu16 ", "
+             "\"flags\": %" PRIu16 ", \"offset\": %" PRIu64 ", "
+             "\"length\": %" PRIu64 " }",
+             ev->magic, name_of_reply_magic (ev->magic), ev->cookie,
+             ev->error, ev->type, ev->flags, ev->offset, ev->count);
+    break;
+  case FLIGHT_COMPLETE:
+    fprintf (fp, "\"event\": \"complete\", \"command\": \"%s\", "
+             "\"cookie\": %" PRIu64 ", \"error\": %" PRIu32 " }",
+             nbd_internal_name_of_nbd_cmd (ev->type), ev->cookie, ev->error);
+    break;
+  case FLIGHT_STATE:
+    fprintf (fp, "\"event\": \"state\", \"from\": \"%s\", \"to\": \"%s\" }",
+             nbd_internal_state_short_string (ev->from),
+             nbd_internal_state_short_string (ev->to));
+    break;
+  case FLIGHT_DEAD:
+    fprintf (fp, "\"event\": \"dead\", \"errno\": %" PRIu32 ", "
+             "\"message\": ", ev->error);
+    print_json_string (fp, dead_msg ? dead_msg : "");
+    fprintf (fp, " }");
+    break;
+  }
+}
+
+/* Write the ring to fd.  This does not call set_error, because it is
+ * also used when the handle dies, and must not overwrite the error
+ * which killed it.  Returns -1 with errno set on failure.
+ */
+static int
+dump_to_fd (struct nbd_handle *h, int fd, bool json)
+{
+  FILE *fp;
+  uint64_t i, first, n;
+  int dupfd;
+
+  dupfd = dup (fd);
+  if (dupfd == -1)
+    return -1;
+  fp = fdopen (dupfd, "w");
+  if (fp == NULL) {
+    close (dupfd);
+    return -1;
+  }
+
+  n = h->flight_count < h->flight_size ? h->flight_count : h->flight_size;
+  first = h->flight_count - n;
+
+  if (json) {
+    fprintf (fp, "{ \"handle\": ");
+    print_json_string (fp, h->hname);
+    fprintf (fp, ", \"recorded\": %" PRIu64 ", \"events\": [", h->flight_count);
+    for (i = first; i < h->flight_count; ++i) {
+      fprintf (fp, i == first ? "\n  " : ",\n  ");
+      print_json (fp, &h->flight[i % h->flight_size], h->flight_dead_msg);
+    }
+    fprintf (fp, "\n] }\n");
+  }
+  else {
+    fprintf (fp, "flight recorder: %s: last %" PRIu64 " of %" PRIu64
+             " events\n", h->hname, n, h->flight_count);
+    for (i = first; i < h->flight_count; ++i)
+      print_text (fp, &h->flight[i % h->flight_size],
+                  h->flight[first % h->flight_size].ns,
+                  h->flight_dead_msg);
+  }
+
+  return fclose (fp) == EOF ? -1 : 0;
+}
+
+int
+nbd_unlocked_dump_flight_recorder (struct nbd_handle *h, int fd, bool json)
+{
+  if (h->flight == NULL) {
+    set_error (EINVAL, "the flight recorder is not enabled, "
+               "see nbd_set_flight_recorder");
+    return -1;
+  }
+
+  if (dump_to_fd (h, fd, json) == -1) {
+    set_error (errno, "writing flight recorder");
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,640 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Multi-conn connection groups (see nbd_group_create(3)).
+ *
+ * A group is a thin layer over ordinary handles: every command is
+ * issued on one member handle with the public API, so all the usual
+ * locking, error handling and callback rules apply unchanged.  The
+ * group only chooses the handle, and maps group cookies to and from
+ * the cookies of the member handles.
+ *
+ * Replica sets and striped sets are built the same way, and share the
+ * code at the end of this file for polling member handles and for
+ * keeping their own lists of commands.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "internal.h"
+
+/* Every command costs this much on top of its payload when choosing
+ * the least loaded connection, so that a connection busy with many
+ * small or payload-free commands is not always chosen.
+ */
+#define GROUP_COMMAND_COST 4096
+
+struct group_conn {
+  struct nbd_handle *h;
+  _Atomic uint64_t load;        /* Cost of commands in flight. */
+};
+
+struct nbd_group {
+  unsigned nr_conns;
+  _Atomic unsigned next;        /* Rotates tie-breaks and peeking. */
+  struct group_conn conns[];
+};
+
+/* Wraps the caller's completion callback so that the load of the
+ * connection can be dropped again when the command is retired.
+ */
+struct group_command {
+  struct group_conn *conn;
+  uint64_t cost;
+  nbd_completion_callback cb;
+};
+
+/* Group cookies interleave the cookies of the member handles, which
+ * are always >= 1.
+ */
+static int64_t
+encode_cookie (const struct nbd_group *g, unsigned i, int64_t cookie)
+{
+  return (cookie - 1) * g->nr_conns + i + 1;
+}
+
+static unsigned
+decode_cookie (const struct nbd_group *g, int64_t cookie, int64_t *hcookie)
+{
+  *hcookie = (cookie - 1) / g->nr_conns + 1;
+  return (cookie - 1) % g->nr_conns;
+}
+
+struct nbd_group *
+nbd_group_create (unsigned connections,
+                  nbd_group_connect_callback connect, void *user_data)
+{
+  struct nbd_group *g;
+  unsigned i, j;
+  int r;
+
+  nbd_internal_set_error_context ("nbd_group_create");
+
+  if (connections == 0 || connections > 64) {
+    set_error (EINVAL, "connections must be between 1 and 64");
+    return NULL;
+  }
+  if (connect == NULL) {
+    set_error (EFAULT, "connect callback must not be NULL");
+    return NULL;
+  }
+
+  g = calloc (1, sizeof *g + connections * sizeof g->conns[0]);
+  if (g == NULL) {
+    set_error (errno, "calloc");
+    return NULL;
+  }
+
+  /* Open the first connection, and only open the others if the
+   * server says that it is safe.
+   */
+  for (i = 0; i < connections; ++i) {
+    g->conns[i].h = nbd_create ();
+    if (g->conns[i].h == NULL)
+      goto err;
+    g->nr_conns = i + 1;
+    if (connect (user_data, g->conns[i].h, i) == -1)
+      goto err;
+    if (!nbd_aio_is_ready (g->conns[i].h)) {
+      nbd_internal_set_error_context ("nbd_group_create");
+      set_error (EINVAL, "connect callback did not leave connection %u "
+                 "in the ready state", i);
+      goto err;
+    }
+    if (i == 0) {
+      r = nbd_can_multi_conn (g->conns[0].h);
+      if (r == -1)
+        goto err;
+      if (r == 0)
+        break;
+    }
+  }
+
+  /* A write on any connection must invalidate the block status
+   * cached for every connection, so they all use the cache of the
+   * first connection which has one, if any, and drop their own.
+   */
+  for (i = 0; i < g->nr_conns; ++i)
+    if (nbd_get_block_status_cache (g->conns[i].h) > 0)
+      break;
+  for (j = 0; i < g->nr_conns && j < g->nr_conns; ++j)
+    if (j != i)
+      nbd_internal_extent_cache_share (g->conns[i].h, g->conns[j].h);
+
+  return g;
+
+ err:
+  nbd_group_close (g);
+  return NULL;
+}
+
+void
+nbd_group_close (struct nbd_group *g)
+{
+  unsigned i;
+
+  if (g == NULL)
+    return;
+
+  for (i = 0; i < g->nr_conns; ++i)
+    nbd_close (g->conns[i].h);
+  free (g);
+}
+
+unsigned
+nbd_group_get_size (struct nbd_group *g)
+{
+  return g->nr_conns;
+}
+
+struct nbd_handle *
+nbd_group_get_handle (struct nbd_group *g, unsigned i)
+{
+  nbd_internal_set_error_context ("nbd_group_get_handle");
+
+  if (i >= g->nr_conns) {
+    set_error (EINVAL, "connection index %u out of range", i);
+    return NULL;
+  }
+  return g->conns[i].h;
+}
+
+/* Choose the connection with the least outstanding work, rotating
+ * the starting point so that ties are spread across connections.
+ */
+static unsigned
+pick_conn (struct nbd_group *g)
+{
+  const unsigned start = g->next++ % g->nr_conns;
+  unsigned i, j, best = start;
+  uint64_t load, best_load = UINT64_MAX;
+
+  for (i = 0; i < g->nr_conns; ++i) {
+    j = (start + i) % g->nr_conns;
+    load = g->conns[j].load;
+    if (load < best_load) {
+      best = j;
+      best_load = load;
+    }
+  }
+  return best;
+}
+
+static int
+group_command_callback (void *user_data, int *error)
+{
+  struct group_command *cmd = user_data;
+
+  if (cmd->cb.callback)
+    return cmd->cb.callback (cmd->cb.user_data, error);
+  return 0;
+}
+
+/* Called exactly once per command by libnbd, even if the command
+ * could not be issued.
+ */
+static void
+group_command_free (void *user_data)
+{
+  struct group_command *cmd = user_data;
+
+  cmd->conn->load -= cmd->cost;
+  if (cmd->cb.free)
+    cmd->cb.free (cmd->cb.user_data);
+  free (cmd);
+}
+
+/* Pick a connection and account for the command on it.  On success
+ * *wrapped is the completion callback to pass to the member handle.
+ */
+static struct group_conn *
+start_command (struct nbd_group *g, uint64_t payload,
+               nbd_completion_callback *cb, nbd_completion_callback *wrapped)
+{
+  struct group_command *cmd;
+  struct group_conn *conn;
+
+  cmd = malloc (sizeof *cmd);
+  if (cmd == NULL) {
+    set_error (errno, "malloc");
+    if (cb->free)
+      cb->free (cb->user_data);
+    return NULL;
+  }
+  conn = &g->conns[pick_conn (g)];
+  cmd->conn = conn;
+  cmd->cost = payload + GROUP_COMMAND_COST;
+  cmd->cb = *cb;
+  conn->load += cmd->cost;
+
+  wrapped->callback = group_command_callback;
+  wrapped->user_data = cmd;
+  wrapped->free = group_command_free;
+  return conn;
+}
+
+static int64_t
+finish_command (struct nbd_group *g, struct group_conn *conn, int64_t cookie)
+{
+  if (cookie == -1)
+    return -1;
+  return encode_cookie (g, conn - g->conns, cookie);
+}
+
+int64_t
+nbd_group_aio_pread (struct nbd_group *g, void *buf, size_t count,
+                     uint64_t offset,
+                     nbd_completion_callback completion_callback,
+                     uint32_t flags)
+{
+  struct group_conn *conn;
+  nbd_completion_callback cb;
+
+  nbd_internal_set_error_context ("nbd_group_aio_pread");
+  conn = start_command (g, count, &completion_callback, &cb);
+  if (conn == NULL)
+    return -1;
+  return finish_command (g, conn,
+                         nbd_aio_pread (conn->h, buf, count, offset, cb,
+                                        flags));
+}
+
+int64_t
+nbd_group_aio_pwrite (struct nbd_group *g, const void *buf, size_t count,
+                      uint64_t offset,
+                      nbd_completion_callback completion_callback,
+                      uint32_t flags)
+{
+  struct group_conn *conn;
+  nbd_completion_callback cb;
+
+  nbd_internal_set_error_context ("nbd_group_aio_pwrite");
+  conn = start_command (g, count, &completion_callback, &cb);
+  if (conn == NULL)
+    return -1;
+  return finish_command (g, conn,
+                         nbd_aio_pwrite (conn->h, buf, count, offset, cb,
+                                         flags));
+}
+
+/* Multi-conn guarantees that a flush on any connection covers writes
+ * completed on every connection, so flush can go anywhere too.
+ */
+int64_t
+nbd_group_aio_flush (struct nbd_group *g,
+                     nbd_completion_callback completion_callback,
+                     uint32_t flags)
+{
+  struct group_conn *conn;
+  nbd_completion_callback cb;
+
+  nbd_internal_set_error_context ("nbd_group_aio_flush");
+  conn = start_command (g, 0, &completion_callback, &cb);
+  if (conn == NULL)
+    return -1;
+  return finish_command (g, conn, nbd_aio_flush (conn->h, cb, flags));
+}
+
+int64_t
+nbd_group_aio_trim (struct nbd_group *g, uint64_t count, uint64_t offset,
+                    nbd_completion_callback completion_callback,
+                    uint32_t flags)
+{
+  struct group_conn *conn;
+  nbd_completion_callback cb;
+
+  nbd_internal_set_error_context ("nbd_group_aio_trim");
+  conn = start_command (g, 0, &completion_callback, &cb);
+  if (conn == NULL)
+    return -1;
+  return finish_command (g, conn,
+                         nbd_aio_trim (conn->h, count, offset, cb, flags));
+}
+
+int64_t
+nbd_group_aio_zero (struct nbd_group *g, uint64_t count, uint64_t offset,
+                    nbd_completion_callback completion_callback,
+                    uint32_t flags)
+{
+  struct group_conn *conn;
+  nbd_completion_callback cb;
+
+  nbd_internal_set_error_context ("nbd_group_aio_zero");
+  conn = start_command (g, 0, &completion_callback, &cb);
+  if (conn == NULL)
+    return -1;
+  return finish_command (g, conn,
+                         nbd_aio_zero (conn->h, count, offset, cb, flags));
+}
+
+int64_t
+nbd_group_aio_cache (struct nbd_group *g, uint64_t count, uint64_t offset,
+                     nbd_completion_callback completion_callback,
+                     uint32_t flags)
+{
+  struct group_conn *conn;
+  nbd_completion_callback cb;
+
+  nbd_internal_set_error_context ("nbd_group_aio_cache");
+  conn = start_command (g, 0, &completion_callback, &cb);
+  if (conn == NULL)
+    return -1;
+  return finish_command (g, conn,
+                         nbd_aio_cache (conn->h, count, offset, cb, flags));
+}
+
+int
+nbd_group_aio_command_completed (struct nbd_group *g, int64_t cookie)
+{
+  int64_t hcookie;
+  unsigned i;
+
+  if (cookie <= 0) {
+    nbd_internal_set_error_context ("nbd_group_aio_command_completed");
+    set_error (EINVAL, "invalid cookie: %" PRIi64, cookie);
+    return -1;
+  }
+  i = decode_cookie (g, cookie, &hcookie);
+  return nbd_aio_command_completed (g->conns[i].h, hcookie);
+}
+
+/* Returns the first completed command found on any connection, 0 if
+ * commands are in flight but none has completed, or -1 if nothing is
+ * in flight at all.
+ */
+int64_t
+nbd_group_aio_peek_command_completed (struct nbd_group *g)
+{
+  const unsigned start = g->next++ % g->nr_conns;
+  unsigned i, j;
+  int64_t r;
+  bool in_flight = false;
+
+  for (i = 0; i < g->nr_conns; ++i) {
+    j = (start + i) % g->nr_conns;
+    r = nbd_aio_peek_command_completed (g->conns[j].h);
+    if (r > 0)
+      return encode_cookie (g, j, r);
+    if (r == 0)
+      in_flight = true;
+  }
+
+  nbd_internal_set_error_context ("nbd_group_aio_peek_command_completed");
+  if (in_flight) {
+    set_error (0, "no in-flight command has completed yet");
+    return 0;
+  }
+  set_error (EINVAL, "no commands are in flight");
+  return -1;
+}
+
+int
+nbd_group_aio_in_flight (struct nbd_group *g)
+{
+  unsigned i;
+  int r, total = 0;
+
+  for (i = 0; i < g->nr_conns; ++i) {
+    r = nbd_aio_in_flight (g->conns[i].h);
+    if (r == -1)
+      return -1;
+    total += r;
+  }
+  return total;
+}
+
+/* Like nbd_poll, but waiting for any connection in the group. */
+int
+nbd_group_poll (struct nbd_group *g, int timeout)
+{
+  struct nbd_handle *hs[g->nr_conns];
+  unsigned i;
+
+  for (i = 0; i < g->nr_conns; ++i)
+    hs[i] = g->conns[i].h;
+  return nbd_internal_poll_members (hs, g->nr_conns, timeout,
+                                    "nbd_group_poll", "connection");
+}
+
+int
+nbd_group_shutdown (struct nbd_group *g, uint32_t flags)
+{
+  unsigned i;
+
+  for (i = 0; i < g->nr_conns; ++i) {
+    if (nbd_shutdown (g->conns[i].h, flags) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+/* Set up fds to poll the n member handles hs for whatever each is
+ * waiting for.  Returns the number of handles with something to poll
+ * for, or -1 on error.
+ */
+int
+nbd_internal_poll_prepare (struct nbd_handle **hs, unsigned n,
+                           struct pollfd *fds)
+{
+  unsigned i, dir;
+  int nr_polled = 0;
+
+  for (i = 0; i < n; ++i) {
+    fds[i].fd = -1;
+    fds[i].events = 0;
+    fds[i].revents = 0;
+
+    dir = nbd_aio_get_direction (hs[i]);
+    if (dir == 0)
+      continue;
+    fds[i].fd = nbd_aio_get_fd (hs[i]);
+    if (fds[i].fd == -1)
+      return -1;
+    if (dir & LIBNBD_AIO_DIRECTION_READ)
+      fds[i].events |= POLLIN;
+    if (dir & LIBNBD_AIO_DIRECTION_WRITE)
+      fds[i].events |= POLLOUT;
+    nr_polled++;
+  }
+  return nr_polled;
+}
+
+/* Pass the events returned by poll to the member handles.  As in
+ * nbd_poll, prefer notifying on read.  POLLERR may be zero-copy
+ * completions, which nbd_aio_notify_read collects, or a real error,
+ * which it reports.
+ */
+int
+nbd_internal_poll_notify (struct nbd_handle **hs, unsigned n,
+                          const struct pollfd *fds)
+{
+  unsigned i;
+  int r;
+
+  for (i = 0; i < n; ++i) {
+    r = 0;
+    if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+      r = nbd_aio_notify_read (hs[i]);
+    else if ((fds[i].revents & POLLOUT) != 0)
+      r = nbd_aio_notify_write (hs[i]);
+    else if ((fds[i].revents & POLLNVAL) != 0) {
+      set_error (ENOTCONN, "server closed socket unexpectedly");
+      return -1;
+    }
+    if (r == -1)
+      return -1;
+  }
+  return 0;
+}
+
+/* Like nbd_poll, but waiting for any of the member handles.  context
+ * is the calling API, and what names a member in error messages.
+ */
+int
+nbd_internal_poll_members (struct nbd_handle **hs, unsigned n, int timeout,
+                           const char *context, const char *what)
+{
+  struct pollfd fds[n];
+  int r;
+
+  r = nbd_internal_poll_prepare (hs, n, fds);
+  if (r == -1)
+    return -1;
+
+  nbd_internal_set_error_context (context);
+  if (r == 0) {
+    set_error (EINVAL, "nothing to poll for on any %s", what);
+    return -1;
+  }
+
+  do {
+    r = poll (fds, n, timeout);
+  } while (r == -1 && errno == EINTR);
+
+  if (r == -1) {
+    set_error (errno, "poll");
+    return -1;
+  }
+  if (r == 0)
+    return 0;
+
+  if (nbd_internal_poll_notify (hs, n, fds) == -1)
+    return -1;
+  return 1;
+}
+
+/* Give cmd the next cookie of the set and add it to the list of
+ * commands in flight.
+ */
+int64_t
+nbd_internal_member_command_add (struct member_commands *list,
+                                 struct member_command *cmd)
+{
+  cmd->cookie = ++list->next_cookie;
+  cmd->next = NULL;
+  cmd->prev = list->tail;
+  if (list->tail)
+    list->tail->next = cmd;
+  else
+    list->head = cmd;
+  list->tail = cmd;
+  list->in_flight++;
+  return cmd->cookie;
+}
+
+void
+nbd_internal_member_command_remove (struct member_commands *list,
+                                    struct member_command *cmd)
+{
+  if (cmd->prev)
+    cmd->prev->next = cmd->next;
+  else
+    list->head = cmd->next;
+  if (cmd->next)
+    cmd->next->prev = cmd->prev;
+  else
+    list->tail = cmd->prev;
+}
+
+void
+nbd_internal_member_command_done (struct member_commands *list,
+                                  struct member_command *cmd, int error)
+{
+  cmd->done = true;
+  cmd->error = error;
+  list->in_flight--;
+}
+
+/* The common part of nbd_*_aio_command_completed.  retire removes
+ * the command from the list and frees it.  msg is the error message
+ * if the command failed.
+ */
+int
+nbd_internal_member_command_completed (struct member_commands *list,
+                                       int64_t cookie,
+                                       void (*retire)
+                                       (struct member_command *),
+                                       const char *msg)
+{
+  struct member_command *cmd;
+  int error;
+
+  for (cmd = list->head; cmd; cmd = cmd->next)
+    if (cmd->cookie == cookie)
+      break;
+  if (cmd == NULL) {
+    set_error (EINVAL, "invalid cookie: %" PRIi64, cookie);
+    return -1;
+  }
+  if (!cmd->done)
+    return 0;
+
+  error = cmd->error;
+  retire (cmd);
+  if (error) {
+    set_error (error, "%s", msg);
+    return -1;
+  }
+  return 1;
+}
+
+/* The common part of nbd_*_aio_peek_command_completed. */
+int64_t
+nbd_internal_member_command_peek (struct member_commands *list)
+{
+  struct member_command *cmd;
+
+  for (cmd = list->head; cmd; cmd = cmd->next)
+    if (cmd->done)
+      return cmd->cookie;
+
+  if (list->in_flight > 0) {
+    set_error (0, "no in-flight command has completed yet");
+    return 0;
+  }
+  set_error (EINVAL, "no commands are in flight");
+  return -1;
+}
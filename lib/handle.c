@@ -31,13 +31,13 @@
 #include "internal.h"
 
 static void
-free_cmd_list (struct command *list)
+free_cmd_list (struct nbd_handle *h, struct command *list)
 {
   struct command *cmd, *cmd_next;
 
   for (cmd = list; cmd != NULL; cmd = cmd_next) {
     cmd_next = cmd->next;
-    nbd_internal_retire_and_free_command (cmd);
+    nbd_internal_retire_and_free_command (h, cmd);
   }
 }
 
@@ -62,11 +62,15 @@ nbd_create (void)
   }
 
   h->unique = 1;
+  h->wake_fds[0] = h->wake_fds[1] = -1;
+  h->done_fds[0] = h->done_fds[1] = -1;
   h->tls_verify_peer = true;
+  h->request_eh = true;
   h->request_sr = true;
   h->request_meta = true;
   h->request_block_size = true;
   h->pread_initialize = true;
+  h->cmd_cache_limit = 4096;
 
   h->uri_allow_transports = LIBNBD_ALLOW_TRANSPORT_MASK;
   h->uri_allow_tls = LIBNBD_TLS_ALLOW;
@@ -89,23 +93,56 @@ nbd_create (void)
     goto error1;
   }
 
+  if (nbd_internal_command_index_init (&h->cmds_in_flight_index) == -1 ||
+      nbd_internal_command_index_init (&h->cmds_done_index) == -1)
+    goto error1;
+
+  /* LIBNBD_FLIGHT_RECORDER=N records the last N events of every
+   * handle, and dumps them to stderr if the handle dies.
+   */
+  s = getenv ("LIBNBD_FLIGHT_RECORDER");
+  if (s && atoi (s) > 0 &&
+      nbd_unlocked_set_flight_recorder (h, atoi (s),
+                                        LIBNBD_FLIGHT_RECORDER_DUMP_ON_DEAD)
+      == -1)
+    goto error1;
+
   errno = pthread_mutex_init (&h->lock, NULL);
   if (errno != 0) {
     set_error (errno, "pthread_mutex_init");
     goto error1;
   }
 
-  if (nbd_internal_run (h, cmd_create) == -1)
+  errno = pthread_cond_init (&h->poll_cond, NULL);
+  if (errno != 0) {
+    set_error (errno, "pthread_cond_init");
     goto error2;
+  }
+
+  errno = pthread_cond_init (&h->bg_cond, NULL);
+  if (errno != 0) {
+    set_error (errno, "pthread_cond_init");
+    pthread_cond_destroy (&h->poll_cond);
+    goto error2;
+  }
+
+  if (nbd_internal_run (h, cmd_create) == -1)
+    goto error3;
 
   debug (h, "opening handle");
   /*debug (h, "sizeof *h = %zu", sizeof *h);*/
   return h;
 
+ error3:
+  pthread_cond_destroy (&h->bg_cond);
+  pthread_cond_destroy (&h->poll_cond);
  error2:
   pthread_mutex_destroy (&h->lock);
  error1:
   if (h) {
+    nbd_internal_command_index_free (&h->cmds_in_flight_index);
+    nbd_internal_command_index_free (&h->cmds_done_index);
+    free (h->flight);
     free (h->export_name);
     free (h->hname);
     free (h);
@@ -125,19 +162,38 @@ nbd_close (struct nbd_handle *h)
 
   debug (h, "closing handle");
 
+  /* Stop the background thread before anything it uses is freed. */
+  pthread_mutex_lock (&h->lock);
+  nbd_internal_stop_background_thread (h);
+  pthread_mutex_unlock (&h->lock);
+
+  /* Another thread running the reactor may be about to use the
+   * handle, so leave the reactor before anything is freed.
+   */
+  nbd_internal_reactor_close (h);
+
   /* Free user callbacks first. */
   nbd_unlocked_clear_debug_callback (h);
 
   string_vector_empty (&h->querylist);
-  free (h->bs_entries);
+  free (h->bs_raw);
+  free (h->bs_cooked);
+  free (h->rahead);
+  free (h->pipeline_buf);
   nbd_internal_reset_size_and_flags (h);
   for (i = 0; i < h->meta_contexts.len; ++i)
     free (h->meta_contexts.ptr[i].name);
   meta_vector_reset (&h->meta_contexts);
   nbd_internal_free_option (h);
-  free_cmd_list (h->cmds_to_issue);
-  free_cmd_list (h->cmds_in_flight);
-  free_cmd_list (h->cmds_done);
+  free_cmd_list (h, h->cmds_to_issue);
+  free_cmd_list (h, h->cmds_in_flight);
+  free_cmd_list (h, h->cmds_done);
+  free_cmd_list (h, h->cmds_zc_wait);
+  nbd_internal_read_cache_free (h);
+  free_cmd_list (h, h->cmds_rc_wait);
+  nbd_internal_trim_command_cache (h, 0);
+  nbd_internal_command_index_free (&h->cmds_in_flight_index);
+  nbd_internal_command_index_free (&h->cmds_done_index);
   string_vector_empty (&h->argv);
   if (h->sact_sockpath) {
     if (h->pid > 0)
@@ -151,8 +207,7 @@ nbd_close (struct nbd_handle *h)
   }
   free (h->hostname);
   free (h->port);
-  if (h->result)
-    freeaddrinfo (h->result);
+  nbd_internal_connect_tcp_abandon (h);
   if (h->sock)
     h->sock->ops->close (h->sock);
   if (h->pid > 0)
@@ -163,7 +218,21 @@ nbd_close (struct nbd_handle *h)
   free (h->tls_username);
   free (h->tls_psk_file);
   string_vector_empty (&h->request_meta_contexts);
+  free (h->flight);
+  free (h->flight_dead_msg);
+  nbd_internal_extent_cache_free (h);
   free (h->hname);
+  if (h->wake_fds[0] >= 0) {
+    close (h->wake_fds[0]);
+    close (h->wake_fds[1]);
+  }
+  if (h->done_fds[0] >= 0) {
+    close (h->done_fds[0]);
+    if (h->done_fds[1] != h->done_fds[0])
+      close (h->done_fds[1]);
+  }
+  pthread_cond_destroy (&h->bg_cond);
+  pthread_cond_destroy (&h->poll_cond);
   pthread_mutex_destroy (&h->lock);
   free (h);
 }
@@ -380,6 +449,21 @@ nbd_unlocked_clear_meta_contexts (struct nbd_handle *h)
   return 0;
 }
 
+int
+nbd_unlocked_set_request_extended_headers (struct nbd_handle *h,
+                                           bool request)
+{
+  h->request_eh = request;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_request_extended_headers (struct nbd_handle *h)
+{
+  return h->request_eh;
+}
+
 int
 nbd_unlocked_set_request_structured_replies (struct nbd_handle *h,
                                              bool request)
@@ -410,12 +494,32 @@ nbd_unlocked_get_request_meta_context (struct nbd_handle *h)
   return h->request_meta;
 }
 
+int
+nbd_unlocked_set_pipeline_options (struct nbd_handle *h, bool pipeline)
+{
+  h->pipeline_options = pipeline;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_pipeline_options (struct nbd_handle *h)
+{
+  return h->pipeline_options;
+}
+
 int
 nbd_unlocked_get_structured_replies_negotiated (struct nbd_handle *h)
 {
   return h->structured_replies;
 }
 
+int
+nbd_unlocked_get_extended_headers_negotiated (struct nbd_handle *h)
+{
+  return h->extended_headers;
+}
+
 int
 nbd_unlocked_set_handshake_flags (struct nbd_handle *h,
                                   uint32_t flags)
@@ -446,6 +550,35 @@ nbd_unlocked_get_pread_initialize (struct nbd_handle *h)
   return h->pread_initialize;
 }
 
+int
+nbd_unlocked_set_command_cache_limit (struct nbd_handle *h, unsigned limit)
+{
+  h->cmd_cache_limit = limit;
+  nbd_internal_trim_command_cache (h, limit);
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+unsigned
+nbd_unlocked_get_command_cache_limit (struct nbd_handle *h)
+{
+  return h->cmd_cache_limit;
+}
+
+int
+nbd_unlocked_set_zerocopy_send (struct nbd_handle *h, bool enable)
+{
+  h->zerocopy = enable;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_zerocopy_send (struct nbd_handle *h)
+{
+  return h->zerocopy;
+}
+
 int
 nbd_unlocked_set_strict_mode (struct nbd_handle *h, uint32_t flags)
 {
@@ -529,6 +662,17 @@ nbd_unlocked_supports_uri (struct nbd_handle *h)
 #endif
 }
 
+/* NB: is_locked = false, may_set_error = false. */
+int
+nbd_unlocked_supports_uring (struct nbd_handle *h)
+{
+#ifdef HAVE_LIBURING
+  return 1;
+#else
+  return 0;
+#endif
+}
+
 const char *
 nbd_unlocked_get_protocol (struct nbd_handle *h)
 {
@@ -576,6 +720,13 @@ nbd_unlocked_stats_chunks_sent (struct nbd_handle *h)
   return h->chunks_sent;
 }
 
+/* NB: may_set_error = false. */
+uint64_t
+nbd_unlocked_stats_send_calls (struct nbd_handle *h)
+{
+  return h->send_calls;
+}
+
 /* NB: may_set_error = false. */
 uint64_t
 nbd_unlocked_stats_bytes_received (struct nbd_handle *h)
@@ -583,6 +734,13 @@ nbd_unlocked_stats_bytes_received (struct nbd_handle *h)
   return h->bytes_received;
 }
 
+/* NB: may_set_error = false. */
+uint64_t
+nbd_unlocked_stats_recv_calls (struct nbd_handle *h)
+{
+  return h->recv_calls;
+}
+
 /* NB: may_set_error = false. */
 uint64_t
 nbd_unlocked_stats_chunks_received (struct nbd_handle *h)
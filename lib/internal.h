@@ -31,6 +31,7 @@
 #include <string.h>
 #include <netdb.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <pthread.h>
 
@@ -54,6 +55,23 @@
 #define if_debug(h) if ((h)->debug)
 #endif
 
+/* Static tracepoints for bpftrace, perf, systemtap etc, see
+ * libnbd(3) "TRACING".  A disabled probe is a single nop, but its
+ * arguments are still computed, so keep them cheap.  Without
+ * <sys/sdt.h> they compile to nothing.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define probe_command(name, h, cmd)                                     \
+  DTRACE_PROBE6 (libnbd, name, (h)->hname, (cmd)->cookie, (cmd)->type,  \
+                 (cmd)->offset, (cmd)->count, (cmd)->error)
+#define probe_state(h, from, to)                                \
+  DTRACE_PROBE3 (libnbd, state__transition, (h)->hname, (from), (to))
+#else
+#define probe_command(name, h, cmd) do { } while (0)
+#define probe_state(h, from, to) do { } while (0)
+#endif
+
 /* MSG_MORE is an optimization.  If not present, ignore it. */
 #ifndef MSG_MORE
 #define MSG_MORE 0
@@ -61,11 +79,52 @@
 
 /* XXX This is the same as nbdkit, but probably it should be detected
  * from the server (NBD_INFO_BLOCK_SIZE) or made configurable.
+ *
+ * This only limits commands with a data payload (NBD_CMD_READ and
+ * NBD_CMD_WRITE).  Other commands are limited by the width of the
+ * count field on the wire, which is 64 bits when extended headers
+ * were negotiated and 32 bits otherwise.
  */
 #define MAX_REQUEST_SIZE (64 * 1024 * 1024)
 
+/* When several commands are queued, ISSUE_COMMAND.START sends up to
+ * ISSUE_BATCH_MAX requests together, including write payloads up to
+ * a total of ISSUE_BATCH_BYTES.
+ */
+#define ISSUE_BATCH_MAX 64
+#define ISSUE_BATCH_BYTES (64 * 1024)
+
+/* Size of the per-handle read-ahead buffer used for replies, and the
+ * smallest read which bypasses it (see recv_buffered).
+ */
+#define READ_AHEAD_SIZE (16 * 1024)
+#define READ_AHEAD_DIRECT 4096
+
+/* Size of the blocks kept by the read cache, see lib/read-cache.c. */
+#define READ_CACHE_BLOCK_SIZE (64 * 1024)
+
+/* Write payloads of at least this size are sent with MSG_ZEROCOPY
+ * when nbd_set_zerocopy_send is enabled.  Below it, pinning the pages
+ * and handling the completion costs more than the copy it saves.
+ */
+#define ZEROCOPY_MIN (64 * 1024)
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0
+#endif
+
 struct socket;
 struct command;
+struct extent_cache;
+struct read_cache;
+struct read_cache_wait;
+
+/* A request header.  Which member is used depends on
+ * h->extended_headers.
+ */
+union request_header {
+  struct nbd_request compact;
+  struct nbd_request_ext extended;
+};
 
 struct meta_context {
   char *name;                   /* Name of meta context. */
@@ -78,9 +137,47 @@ struct export {
   char *description;
 };
 
+/* Per command type statistics, see lib/stats.c.  latency[0] counts
+ * replies received under 1 microsecond after the request was sent,
+ * latency[i] those from 2^(i-1) up to 2^i microseconds, and the last
+ * bucket everything slower.
+ */
+#define STATS_NR_CMDS (LIBNBD_STATS_CMD_CACHE + 1)
+#define STATS_LATENCY_BUCKETS LIBNBD_STATS_LATENCY_BUCKETS
+
+struct cmd_stats {
+  uint64_t commands;            /* Replies received. */
+  uint64_t latency_ns;          /* Sum of send to reply times. */
+  uint64_t latency[STATS_LATENCY_BUCKETS];
+};
+
+/* An event in the flight recorder, see lib/flight.c.  Which fields
+ * are used depends on kind.
+ */
+enum flight_kind {
+  FLIGHT_REQUEST,               /* Request sent, from struct command. */
+  FLIGHT_REPLY,                 /* Reply header received. */
+  FLIGHT_COMPLETE,              /* Command completed, maybe locally. */
+  FLIGHT_STATE,                 /* State transition. */
+  FLIGHT_DEAD,                  /* Handle entered the DEAD state. */
+};
+
+struct flight_event {
+  uint64_t ns;                  /* CLOCK_MONOTONIC. */
+  uint64_t cookie;
+  uint64_t offset;
+  uint64_t count;               /* Or reply payload length. */
+  uint32_t magic;               /* Reply magic. */
+  uint32_t error;               /* Wire error or errno. */
+  uint16_t kind;                /* enum flight_kind */
+  uint16_t type;                /* NBD_CMD_* or NBD_REPLY_TYPE_* */
+  uint16_t flags;
+  uint16_t from, to;            /* enum state */
+};
+
 struct command_cb {
   union {
-    nbd_extent_callback extent;
+    nbd_extent64_callback extent;
     nbd_chunk_callback chunk;
     nbd_list_callback list;
     nbd_context_callback context;
@@ -88,6 +185,17 @@ struct command_cb {
   nbd_completion_callback completion;
 };
 
+/* Hash table of commands indexed by cookie.  Cookies are allocated
+ * sequentially from h->unique, so masking off the low bits spreads
+ * them evenly over the buckets.  Collisions are chained through
+ * cmd->index_next.  The number of buckets is always a power of 2.
+ */
+struct command_index {
+  struct command **buckets;
+  size_t nr_buckets;
+  size_t nr_entries;
+};
+
 struct nbd_handle {
   /* Unique name assigned to this handle for debug messages
    * (to avoid having to print actual pointers).
@@ -97,6 +205,31 @@ struct nbd_handle {
   /* Lock protecting concurrent access to the handle. */
   pthread_mutex_t lock;
 
+  /* nbd_poll releases the lock while blocked in poll(2), see
+   * lib/poll.c.  in_poll is set meanwhile, and other threads must
+   * wait on poll_cond before running the state machine.  Writing to
+   * wake_fds[1] gets the poller out of poll(2) early.
+   */
+  bool in_poll;
+  bool poll_woken;              /* A wake-up byte has been written. */
+  int wake_fds[2];              /* -1 until first needed. */
+  pthread_cond_t poll_cond;
+  unsigned poll_waiters;        /* Threads waiting on poll_cond. */
+
+  /* Background thread started by nbd_set_background_thread.  While
+   * bg_running, other threads calling nbd_poll wait on bg_cond for
+   * bg_progress to change instead of polling themselves.
+   */
+  pthread_t bg_thread;
+  bool bg_started;              /* bg_thread must be joined. */
+  bool bg_running;
+  bool bg_stop;
+  uint64_t bg_progress;
+  pthread_cond_t bg_cond;
+
+  /* Set while the handle is in a reactor, see lib/reactor.c. */
+  struct reactor_entry *reactor_entry;
+
   /* Private data, for the application to use. */
   _Atomic uintptr_t private_data;
 
@@ -106,10 +239,13 @@ struct nbd_handle {
   int tls;                      /* 0 = disable, 1 = enable, 2 = require */
   char *tls_certificates;       /* Certs dir, NULL = use default path */
   bool tls_verify_peer;         /* Verify the peer certificate. */
+  bool tls_ktls;                /* Request kernel TLS offload. */
+  bool tls_cache;               /* Share credentials and sessions. */
   char *tls_username;           /* Username, NULL = use current username */
   char *tls_psk_file;           /* PSK filename, NULL = no PSK */
 
   /* Desired metadata contexts. */
+  bool request_eh;
   bool request_sr;
   bool request_meta;
   string_vector request_meta_contexts;
@@ -124,6 +260,16 @@ struct nbd_handle {
   uint8_t opt_current; /* 0 or one of NBD_OPT_* */
   struct command_cb opt_cb;
 
+  /* Options written back-to-back, see states-newstyle-opt-pipeline.c.
+   * Replies are expected in the order of pipeline[pipeline_head ..
+   * pipeline_nr-1].  pipeline_buf holds the encoded options until
+   * they have all been sent.
+   */
+  bool pipeline_options;        /* Requested by nbd_set_pipeline_options. */
+  char *pipeline_buf;
+  uint32_t pipeline[3];
+  unsigned pipeline_nr, pipeline_head;
+
   /* Tweak what OPT_INFO/GO requests. */
   bool request_block_size; /* default true, for INFO_BLOCK_SIZE */
   bool full_info; /* default false, for INFO_NAME, INFO_DESCRIPTION */
@@ -158,14 +304,67 @@ struct nbd_handle {
    */
   const char *protocol;
   bool tls_negotiated;
+  bool tls_ktls_active;         /* Session offloaded to kernel TLS. */
+  bool tls_session_resumed;     /* Handshake resumed a cached session. */
+
+  /* io_uring transport, see lib/uring.c. */
+  bool uring;                   /* Requested by nbd_set_uring. */
+  bool uring_active;            /* h->sock is driven by io_uring. */
+
+  /* MSG_ZEROCOPY sends, see lib/socket.c.  Each send(2) call made
+   * with MSG_ZEROCOPY is numbered by the kernel, starting from 0.
+   */
+  bool zerocopy;                /* Requested by nbd_set_zerocopy_send. */
+  bool zerocopy_active;         /* SO_ZEROCOPY is set on the socket. */
+  uint32_t zc_next;             /* Number of the next zero-copy send. */
+  uint32_t zc_done;             /* Sends before this have been released. */
 
   int64_t unique;               /* Used for generating cookie numbers. */
 
   /* Traffic statistics. */
   uint64_t bytes_sent;
   uint64_t chunks_sent;
+  uint64_t send_calls;
   uint64_t bytes_received;
   uint64_t chunks_received;
+  uint64_t recv_calls;
+  struct cmd_stats cmd_stats[STATS_NR_CMDS];
+  uint64_t queue_ns;            /* Total time spent in cmds_to_issue. */
+
+  /* Flight recorder ring, NULL unless enabled.  flight_count is the
+   * number of events ever recorded, so the next one goes in slot
+   * flight_count % flight_size.
+   */
+  struct flight_event *flight;
+  unsigned flight_size;
+  uint64_t flight_count;
+  uint32_t flight_flags;
+  char *flight_dead_msg;        /* Message of the only FLIGHT_DEAD event. */
+
+  /* Block status cache, NULL unless enabled, see lib/extent-cache.c.
+   * The connections of a group share the same cache.
+   */
+  struct extent_cache *extent_cache;
+  uint64_t extent_cache_hits;
+  uint64_t extent_cache_misses;
+
+  /* Read cache, NULL unless enabled, see lib/read-cache.c. */
+  struct read_cache *read_cache;
+  uint64_t read_cache_hits;
+  uint64_t read_cache_misses;
+
+  /* Read-ahead, see lib/readahead.c.  readahead_max is 0 unless
+   * enabled.  The current window is [ra_start, ra_start+ra_size), and
+   * the next one is started when a read goes past its last ra_async
+   * bytes.
+   */
+  uint64_t readahead_max;
+  uint64_t ra_limit;            /* Current maximum window size. */
+  uint64_t ra_prev_end;         /* End of the previous read. */
+  uint64_t ra_start, ra_size, ra_async;
+  uint64_t ra_hint_start, ra_hint_end; /* Hinted with NBD_CMD_CACHE. */
+  uint64_t readahead_useful;
+  uint64_t readahead_wasted;
 
   /* For debugging. */
   bool debug;
@@ -187,6 +386,7 @@ struct nbd_handle {
   enum state state;
 
   bool structured_replies;      /* If we negotiated NBD_OPT_STRUCTURED_REPLY */
+  bool extended_headers;        /* If we negotiated NBD_OPT_EXTENDED_HEADERS */
 
   /* Vector of negotiated metadata contexts. */
   bool meta_valid;
@@ -202,10 +402,28 @@ struct nbd_handle {
   void *rbuf;
   size_t rlen;
 
-  /* As above, but for writing using send_from_wbuf. */
+  /* For vectored reads, the remaining segments to fill once rlen
+   * reaches 0, and the number of bytes still to read into them.
+   */
+  const struct iovec *riov;
+  uint64_t rvec_left;
+
+  /* Read-ahead buffer used in the transmission phase.  The buffered
+   * bytes are rahead[rahead_start .. rahead_start+rahead_len-1].
+   */
+  char *rahead;
+  size_t rahead_start;
+  size_t rahead_len;
+
+  /* As above, but for writing using send_from_wbuf.  For vectored
+   * writes, wiov/wiovcnt are the segments to send after wbuf.  We
+   * maintain the invariant that wlen == 0 implies wiovcnt == 0.
+   */
   const void *wbuf;
   size_t wlen;
   int wflags;
+  const struct iovec *wiov;
+  size_t wiovcnt;
 
   /* Static buffer used for short amounts of data, such as handshake
    * and commands.
@@ -235,34 +453,56 @@ struct nbd_handle {
       } payload;
     }  __attribute__ ((packed)) or;
     struct nbd_export_name_option_reply export_name_reply;
-    struct nbd_simple_reply simple_reply;
     struct {
-      struct nbd_structured_reply structured_reply;
+      /* The reply header is read as a simple reply first, then
+       * extended as needed once the magic number is known.  All
+       * payloads start after the largest header, so the state
+       * machine can share one payload parser no matter which header
+       * style the server used.
+       */
+      union {
+        struct nbd_simple_reply simple;
+        struct nbd_structured_reply structured;
+        struct nbd_extended_reply extended;
+      } hdr;
       union {
         struct nbd_structured_reply_offset_data offset_data;
         struct nbd_structured_reply_offset_hole offset_hole;
+        struct nbd_structured_reply_block_status_hdr bs_hdr;
+        struct nbd_structured_reply_block_status_ext_hdr bs_ext_hdr;
         struct {
           struct nbd_structured_reply_error error;
           char msg[NBD_MAX_STRING]; /* Common to all error types */
           uint64_t offset; /* Only used for NBD_REPLY_TYPE_ERROR_OFFSET */
         } __attribute__ ((packed)) error;
       } payload;
-    }  __attribute__ ((packed)) sr;
+    }  __attribute__ ((packed)) reply;
     uint16_t gflags;
     uint32_t cflags;
     uint32_t len;
     uint16_t nrinfos;
     uint16_t info[3];
-    uint32_t nrqueries;
   } sbuf;
 
   /* Issuing a command must use a buffer separate from sbuf, for the
    * case when we interrupt a request to service a reply.
    */
-  struct nbd_request request;
+  union request_header req;
   bool in_write_payload;
   bool in_write_shutdown;
 
+  /* Batched issue of commands, see ISSUE_COMMAND.START.  batch_hdr
+   * holds the packed request headers, and batch_end[i] is the number
+   * of bytes from the start of the batch to the end of the i'th
+   * command (including any write payload).
+   */
+  char batch_hdr[ISSUE_BATCH_MAX * sizeof (struct nbd_request_ext)];
+  struct iovec batch_iov[ISSUE_BATCH_MAX * 2];
+  uint64_t batch_end[ISSUE_BATCH_MAX];
+  size_t batch_len;             /* Commands in the batch, 0 if none. */
+  size_t batch_done;            /* Commands moved to cmds_in_flight. */
+  uint64_t batch_start;         /* Value of bytes_sent at batch start. */
+
   /* When connecting, this stores the socket address. */
   struct sockaddr_storage connaddr;
   socklen_t connaddrlen;
@@ -281,18 +521,25 @@ struct nbd_handle {
   char *sact_tmpdir;
   char *sact_sockpath;
 
-  /* When connecting to TCP ports, these fields are used. */
+  /* When connecting to TCP ports, these fields are used.  While
+   * connect_tcp is set, a helper thread in lib/connect-tcp.c is
+   * resolving the name and connecting.
+   */
   char *hostname, *port;
-  struct addrinfo hints;
-  struct addrinfo *result, *rp;
-  int connect_errno;
+  struct connect_tcp *connect_tcp;
 
   /* When sending metadata contexts, this is used. */
   string_vector querylist;
-  size_t querynum;
 
-  /* When receiving block status, this is used. */
-  uint32_t *bs_entries;
+  /* When receiving block status, this is used.  bs_raw holds the
+   * descriptors exactly as they arrived on the wire (either struct
+   * nbd_block_descriptor or struct nbd_block_descriptor_ext), and
+   * bs_cooked holds them after conversion to host byte order and 64
+   * bit width, ready to pass to the extent callback.
+   */
+  void *bs_raw;
+  nbd_extent *bs_cooked;
+  size_t bs_count;
 
   /* Commands which are waiting to be issued [meaning the request
    * packet is sent to the server].  This is used as a simple linked
@@ -305,19 +552,53 @@ struct nbd_handle {
 
   /* Commands which have been issued and are waiting for replies.
    * Order does not matter here, since the server can reply out-of-order.
+   * This list is doubly linked (via cmd->prev) and indexed by cookie
+   * so that matching a reply to its command is O(1).
    */
   struct command *cmds_in_flight;
+  struct command_index cmds_in_flight_index;
 
   /* Commands which have received replies, waiting for the main
    * program to acknowledge them.  Maintained as a queue, with new
    * replies at the back, in case a client uses peek to process
-   * replies in server order.
+   * replies in server order.  Like cmds_in_flight this is doubly
+   * linked and indexed by cookie, so that retiring a command out of
+   * order is O(1).
    */
   struct command *cmds_done;
   struct command *cmds_done_tail;
+  struct command_index cmds_done_index;
+
+  /* Readable while cmds_done is not empty, see
+   * nbd_aio_get_completion_fd.  With eventfd(2) both are the same fd.
+   * -1 until first needed.
+   */
+  int done_fds[2];
+
+  /* Write commands which have received replies, but whose payload
+   * was sent with MSG_ZEROCOPY and may still be in use by the kernel.
+   * They are completed once the kernel releases it.  Linked through
+   * cmd->next, in no particular order.
+   */
+  struct command *cmds_zc_wait;
+
+  /* Read commands waiting for the read cache to fill the blocks they
+   * need.  Linked through cmd->next, in no particular order.
+   */
+  struct command *cmds_rc_wait;
 
-  /* length (cmds_to_issue) + length (cmds_in_flight). */
+  /* length (cmds_to_issue) + length (cmds_in_flight) +
+   * length (cmds_zc_wait) + length (cmds_rc_wait).
+   */
   int in_flight;
+  int in_flight_max;            /* Highest value of in_flight seen. */
+
+  /* Retired commands kept for reuse, linked through cmd->next.  The
+   * list is allowed to grow to MIN (in_flight_max, cmd_cache_limit).
+   */
+  struct command *cmd_cache;
+  unsigned cmd_cache_len;
+  unsigned cmd_cache_limit;
 
   /* Current command and POLLIN resumption point during a REPLY cycle */
   struct command *reply_cmd;
@@ -332,10 +613,22 @@ struct socket_ops {
                    struct socket *sock, void *buf, size_t len);
   ssize_t (*send) (struct nbd_handle *h,
                    struct socket *sock, const void *buf, size_t len, int flags);
+  ssize_t (*sendv) (struct nbd_handle *h, struct socket *sock,
+                    const struct iovec *iov, size_t iovcnt, int flags);
   bool (*pending) (struct socket *sock);
   int (*get_fd) (struct socket *sock);
   bool (*shut_writes) (struct nbd_handle *h, struct socket *sock);
   int (*close) (struct socket *sock);
+
+  /* Optional, only for transports which complete I/O asynchronously
+   * (lib/uring.c).  wait submits queued I/O, waits up to timeout
+   * milliseconds for something to complete and runs the state
+   * machine; it returns 1 if anything happened, 0 on timeout or -1 on
+   * error.  Since wait may leave I/O queued for the next call, flush
+   * must be used before returning control to the application.
+   */
+  int (*wait) (struct nbd_handle *h, struct socket *sock, int timeout);
+  int (*flush) (struct nbd_handle *h, struct socket *sock);
 };
 
 struct socket {
@@ -346,26 +639,56 @@ struct socket {
        * headers from this file.
        */
       void *session;            /* really gnutls_session_t */
-      void *pskcreds;           /* really gnutls_psk_client_credentials_t */
-      void *xcreds;             /* really gnutls_certificate_credentials_t */
+      struct tls_creds *creds;  /* see lib/crypto.c */
+      char *ticket_key;         /* Session cache key, or NULL. */
       struct socket *oldsock;
     } tls;
+    void *uring;                /* really struct uring *, see lib/uring.c */
   } u;
   const struct socket_ops *ops;
 };
 
 struct command {
   struct command *next;
+  struct command *prev;         /* Only used in cmds_in_flight, cmds_done */
+  struct command *index_next;   /* Chain in struct command_index */
   uint16_t flags;
   uint16_t type;
   uint64_t cookie;
   uint64_t offset;
-  uint32_t count;
+  uint64_t count;
   void *data; /* Buffer for read/write */
+  struct iovec *iov; /* Or for vectored read/write, non-empty segments */
+  size_t iovcnt;
   struct command_cb cb;
   bool initialized; /* For read, true if getting a hole may skip memset */
   uint32_t data_seen; /* For read, cumulative size of data chunks seen */
   uint32_t error; /* Local errno value */
+  bool zerocopy; /* For write, payload sent with MSG_ZEROCOPY */
+  uint32_t zc_seq; /* And the number of the last send(2) call used */
+  uint64_t queued_ns; /* When added to cmds_to_issue, see lib/stats.c */
+  uint64_t sent_ns; /* When moved to cmds_in_flight */
+  uint64_t cache_gen; /* For block status, see lib/extent-cache.c */
+  uint32_t rc_pending; /* For read, blocks the read cache is filling */
+  struct read_cache_wait *rc_wait; /* And its entries in their waiters */
+};
+
+/* Replica sets and striped sets issue each of their commands as one
+ * or more commands on member handles, so they keep their own list of
+ * commands and cookies (see lib/group.c).  This is the first field
+ * of each of their command structures.
+ */
+struct member_command {
+  struct member_command *prev, *next;
+  int64_t cookie;
+  bool done;
+  int error;
+};
+
+struct member_commands {
+  struct member_command *head, *tail;
+  int64_t next_cookie;
+  unsigned in_flight;           /* Commands not yet completed. */
 };
 
 struct execvpe {
@@ -398,13 +721,55 @@ struct execvpe {
   } while (0)
 
 /* aio.c */
-extern void nbd_internal_retire_and_free_command (struct command *)
+extern struct command *nbd_internal_alloc_command (struct nbd_handle *h)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+extern void nbd_internal_retire_and_free_command (struct nbd_handle *h,
+                                                  struct command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern void nbd_internal_trim_command_cache (struct nbd_handle *h,
+                                             unsigned limit)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+extern int nbd_internal_command_index_init (struct command_index *)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+extern void nbd_internal_command_index_free (struct command_index *)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+extern void nbd_internal_command_index_add (struct command_index *,
+                                            struct command *)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern struct command *nbd_internal_command_index_find (struct command_index *,
+                                                        uint64_t cookie)
   LIBNBD_ATTRIBUTE_NONNULL (1);
+extern void nbd_internal_command_index_remove (struct command_index *,
+                                               struct command *)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern void nbd_internal_push_cmd_in_flight (struct nbd_handle *h,
+                                             struct command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern void nbd_internal_unlink_cmd_in_flight (struct nbd_handle *h,
+                                               struct command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern void nbd_internal_append_cmd_done (struct nbd_handle *h,
+                                          struct command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern void nbd_internal_complete_command (struct nbd_handle *h,
+                                           struct command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern int nbd_internal_redirect_read (struct nbd_handle *h, uint64_t cookie,
+                                       void *buf)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 3);
 
 /* connect.c */
 extern int nbd_internal_wait_until_connected (struct nbd_handle *h)
   LIBNBD_ATTRIBUTE_NONNULL (1);
 
+/* connect-tcp.c */
+extern int nbd_internal_connect_tcp_start (struct nbd_handle *h)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+extern int nbd_internal_connect_tcp_finish (struct nbd_handle *h)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+extern void nbd_internal_connect_tcp_abandon (struct nbd_handle *h)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+
 /* crypto.c */
 extern struct socket *nbd_internal_crypto_create_session (struct nbd_handle *, struct socket *oldsock)
   LIBNBD_ATTRIBUTE_NONNULL (1, 2);
@@ -415,6 +780,10 @@ extern int nbd_internal_crypto_handshake (struct nbd_handle *)
 extern void nbd_internal_crypto_debug_tls_enabled (struct nbd_handle *)
   LIBNBD_ATTRIBUTE_NONNULL (1);
 
+/* uring.c */
+extern void nbd_internal_uring_start (struct nbd_handle *h)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+
 /* debug.c */
 extern void nbd_internal_debug (struct nbd_handle *h, const char *context,
                                 const char *fs, ...)
@@ -436,6 +805,9 @@ extern void nbd_internal_set_error_context (const char *context)
 extern const char *nbd_internal_get_error_context (void);
 extern void nbd_internal_set_last_error (int errnum, char *error)
   LIBNBD_ATTRIBUTE_NONNULL (2);
+extern char *nbd_internal_take_last_error (int *errnum)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+extern void nbd_internal_restore_last_error (int errnum, char *error);
 #define set_error(errnum, fs, ...)                                      \
   do {                                                                  \
     int _e = (errnum);                                                  \
@@ -454,6 +826,50 @@ extern void nbd_internal_set_last_error (int errnum, char *error)
       nbd_internal_set_last_error (_e, fs /* best effort */);           \
   } while (0)
 
+/* extent-cache.c */
+extern void nbd_internal_extent_cache_queued (struct nbd_handle *h,
+                                              struct command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern void nbd_internal_extent_cache_replied (struct nbd_handle *h,
+                                               const struct command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern void nbd_internal_extent_cache_insert (struct nbd_handle *h,
+                                              const struct command *cmd,
+                                              const char *name,
+                                              const nbd_extent *entries,
+                                              size_t n)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2, 3, 4);
+extern int nbd_internal_extent_cache_lookup (struct nbd_handle *h,
+                                             uint64_t count, uint64_t offset,
+                                             nbd_extent64_callback *extent64,
+                                             uint32_t flags)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 4);
+extern void nbd_internal_extent_cache_share (struct nbd_handle *from,
+                                             struct nbd_handle *to)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern void nbd_internal_extent_cache_free (struct nbd_handle *h)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+
+/* flight.c */
+extern void nbd_internal_flight_request (struct nbd_handle *h,
+                                         const struct command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern void nbd_internal_flight_reply (struct nbd_handle *h)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+extern void nbd_internal_flight_complete (struct nbd_handle *h,
+                                          const struct command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern void nbd_internal_flight_state (struct nbd_handle *h,
+                                       enum state from, enum state to)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+extern void nbd_internal_flight_dead (struct nbd_handle *h)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+#define flight_record(h, what, ...)                             \
+  do {                                                          \
+    if (unlikely ((h)->flight != NULL))                         \
+      nbd_internal_flight_##what ((h), ##__VA_ARGS__);          \
+  } while (0)
+
 /* flags.c */
 extern void nbd_internal_reset_size_and_flags (struct nbd_handle *h)
   LIBNBD_ATTRIBUTE_NONNULL (1);
@@ -467,6 +883,37 @@ extern int nbd_internal_set_block_size (struct nbd_handle *h, uint32_t min,
 extern void nbd_internal_set_payload (struct nbd_handle *h)
   LIBNBD_ATTRIBUTE_NONNULL (1);
 
+/* group.c */
+struct pollfd;
+extern int nbd_internal_poll_prepare (struct nbd_handle **hs, unsigned n,
+                                      struct pollfd *fds)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 3);
+extern int nbd_internal_poll_notify (struct nbd_handle **hs, unsigned n,
+                                     const struct pollfd *fds)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 3);
+extern int nbd_internal_poll_members (struct nbd_handle **hs, unsigned n,
+                                      int timeout, const char *context,
+                                      const char *what)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 4, 5);
+extern int64_t nbd_internal_member_command_add (struct member_commands *list,
+                                                struct member_command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern void nbd_internal_member_command_remove (struct member_commands *list,
+                                                struct member_command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern void nbd_internal_member_command_done (struct member_commands *list,
+                                              struct member_command *cmd,
+                                              int error)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern int nbd_internal_member_command_completed (struct member_commands *list,
+                                                  int64_t cookie,
+                                                  void (*retire)
+                                                  (struct member_command *),
+                                                  const char *msg)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 3, 4);
+extern int64_t nbd_internal_member_command_peek (struct member_commands *list)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+
 /* is-state.c */
 extern bool nbd_internal_is_state_created (enum state state);
 extern bool nbd_internal_is_state_connecting (enum state state);
@@ -480,10 +927,51 @@ extern bool nbd_internal_is_state_closed (enum state state);
 extern void nbd_internal_free_option (struct nbd_handle *h)
   LIBNBD_ATTRIBUTE_NONNULL (1);
 
+/* poll.c */
+extern void nbd_internal_wake_poller (struct nbd_handle *h);
+extern void nbd_internal_wait_for_poller (struct nbd_handle *h);
+extern void nbd_internal_stop_background_thread (struct nbd_handle *h);
+
 /* protocol.c */
 extern int nbd_internal_errno_of_nbd_error (uint32_t error);
 extern const char *nbd_internal_name_of_nbd_cmd (uint16_t type);
 
+/* reactor.c */
+extern void nbd_internal_reactor_update (struct nbd_handle *h);
+extern void nbd_internal_reactor_drop (struct nbd_handle *h);
+extern void nbd_internal_reactor_detach (struct nbd_handle *h);
+extern void nbd_internal_reactor_close (struct nbd_handle *h);
+
+/* read-cache.c */
+extern int64_t nbd_internal_read_cache_pread (struct nbd_handle *h, void *buf,
+                                              uint64_t count, uint64_t offset,
+                                              struct command_cb *cb)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2, 5);
+extern void nbd_internal_read_cache_queued (struct nbd_handle *h,
+                                            const struct command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern void nbd_internal_read_cache_replied (struct nbd_handle *h,
+                                             const struct command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern bool nbd_internal_read_cache_usable (struct nbd_handle *h)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+extern int nbd_internal_read_cache_prefetch (struct nbd_handle *h,
+                                             uint64_t count, uint64_t offset)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+extern void nbd_internal_read_cache_free (struct nbd_handle *h)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+
+/* readahead.c */
+extern void nbd_internal_readahead (struct nbd_handle *h,
+                                    uint64_t count, uint64_t offset)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+extern void nbd_internal_readahead_useful (struct nbd_handle *h,
+                                           uint64_t bytes)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+extern void nbd_internal_readahead_wasted (struct nbd_handle *h,
+                                           uint64_t bytes)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+
 /* rw.c */
 extern int64_t nbd_internal_command_common (struct nbd_handle *h,
                                             uint16_t flags, uint16_t type,
@@ -491,9 +979,26 @@ extern int64_t nbd_internal_command_common (struct nbd_handle *h,
                                             int count_err, void *data,
                                             struct command_cb *cb)
   LIBNBD_ATTRIBUTE_NONNULL (1);
+extern int64_t nbd_internal_command_common_iov (struct nbd_handle *h,
+                                                uint16_t flags, uint16_t type,
+                                                uint64_t offset,
+                                                int count_err,
+                                                const struct iovec *iov,
+                                                size_t iovcnt,
+                                                struct command_cb *cb)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 6);
 
 /* socket.c */
 struct socket *nbd_internal_socket_create (int fd);
+extern void nbd_internal_zerocopy_start (struct nbd_handle *h)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+extern int nbd_internal_zerocopy_reap (struct nbd_handle *h)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
+extern bool nbd_internal_zerocopy_released (struct nbd_handle *h,
+                                            const struct command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern void nbd_internal_zerocopy_release_all (struct nbd_handle *h)
+  LIBNBD_ATTRIBUTE_NONNULL (1);
 
 /* states.c */
 extern void nbd_internal_abort_commands (struct nbd_handle *h,
@@ -510,6 +1015,15 @@ extern int nbd_internal_aio_get_direction (enum state state);
 #define get_next_state(h) ((h)->state)
 #define get_public_state(h) ((h)->public_state)
 
+/* stats.c */
+extern uint64_t nbd_internal_stats_now (void);
+extern void nbd_internal_stats_sent (struct nbd_handle *h,
+                                     struct command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+extern void nbd_internal_stats_reply (struct nbd_handle *h,
+                                      const struct command *cmd)
+  LIBNBD_ATTRIBUTE_NONNULL (1, 2);
+
 /* utils.c */
 extern void nbd_internal_hexdump (const void *data, size_t len, FILE *fp)
   LIBNBD_ATTRIBUTE_NONNULL (1, 3);
@@ -530,6 +1044,7 @@ extern char *nbd_internal_printable_string (const char *str)
   LIBNBD_ATTRIBUTE_NONNULL (1);
 extern char *nbd_internal_printable_string_list (char **list)
   LIBNBD_ATTRIBUTE_ALLOC_DEALLOC (free);
+extern void nbd_internal_zero_iovec (const struct iovec *iov, size_t iovcnt);
 
 /* These are wrappers around socket(2) and socketpair(2).  They
  * always set SOCK_CLOEXEC.  nbd_internal_socket can set SOCK_NONBLOCK
@@ -159,5 +159,12 @@ nbd_unlocked_aio_is_closed (struct nbd_handle *h)
 unsigned
 nbd_unlocked_aio_get_direction (struct nbd_handle *h)
 {
-  return nbd_internal_aio_get_direction (get_public_state (h));
+  unsigned dir = nbd_internal_aio_get_direction (get_public_state (h));
+
+  /* With io_uring, nbd_aio_get_fd returns an eventfd which only ever
+   * becomes readable.
+   */
+  if (h->uring_active && dir != 0)
+    dir = LIBNBD_AIO_DIRECTION_READ;
+  return dir;
 }
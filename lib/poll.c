@@ -21,23 +21,198 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
 
 #include "internal.h"
 
-/* A simple main loop implementation using poll(2). */
+/* While blocked in poll(2), nbd_poll releases the handle lock so that
+ * other threads can queue commands.  Those threads only append to
+ * h->cmds_to_issue and wake us; anything which would run the state
+ * machine (and so might close the socket we are polling) first waits
+ * until we have returned from poll(2) and retaken the lock.
+ */
+void
+nbd_internal_wake_poller (struct nbd_handle *h)
+{
+  const char c = 0;
+
+  if (!h->in_poll || h->poll_woken)
+    return;
+  h->poll_woken = true;
+  if (write (h->wake_fds[1], &c, 1) == -1 && errno != EAGAIN)
+    debug (h, "write: wake-up socket: %s", strerror (errno));
+}
+
+/* poll_waiters lets the background thread, which would otherwise
+ * go straight back into poll(2), give waiting threads their turn.
+ */
+void
+nbd_internal_wait_for_poller (struct nbd_handle *h)
+{
+  if (!h->in_poll)
+    return;
+  h->poll_waiters++;
+  while (h->in_poll) {
+    nbd_internal_wake_poller (h);
+    pthread_cond_wait (&h->poll_cond, &h->lock);
+  }
+  if (--h->poll_waiters == 0)
+    pthread_cond_broadcast (&h->poll_cond);
+}
+
 static int
-do_poll (struct nbd_handle *h, int extra_fd, int timeout)
+create_wake_fds (struct nbd_handle *h)
 {
+  int fds[2], i, flags;
+
+  if (nbd_internal_socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+    set_error (errno, "socketpair");
+    return -1;
+  }
+  for (i = 0; i < 2; ++i) {
+    flags = fcntl (fds[i], F_GETFL, 0);
+    if (flags == -1 || fcntl (fds[i], F_SETFL, flags|O_NONBLOCK) == -1) {
+      set_error (errno, "fcntl");
+      close (fds[0]);
+      close (fds[1]);
+      return -1;
+    }
+  }
+  h->wake_fds[0] = fds[0];
+  h->wake_fds[1] = fds[1];
+  return 0;
+}
+
+static void
+drain_wake_fds (struct nbd_handle *h)
+{
+  char buf[16];
+
+  while (read (h->wake_fds[0], buf, sizeof buf) > 0)
+    ;
+  h->poll_woken = false;
+}
+
+/* Main loop for transports which do their own waiting (io_uring). */
+static int
+do_wait (struct nbd_handle *h, int extra_fd, int timeout)
+{
+  struct socket *sock = h->sock;
   struct pollfd fds[2];
   int r;
 
+  if (extra_fd == -1)
+    return sock->ops->wait (h, sock, timeout);
+
+  /* The transport cannot wait for extra_fd, so get everything
+   * submitted and then poll its file descriptor alongside extra_fd.
+   */
+  fds[0].fd = sock->ops->get_fd (sock);
+  if (fds[0].fd == -1) {
+    set_error (errno, "get_fd");
+    return -1;
+  }
+  r = sock->ops->wait (h, sock, 0);
+  if (r != 0)
+    return r;
+  if (sock->ops->flush (h, sock) == -1)
+    return -1;
+
+  fds[0].events = POLLIN;
+  fds[0].revents = 0;
+  fds[1].fd = extra_fd;
+  fds[1].events = POLLIN;
+  fds[1].revents = 0;
+  do {
+    r = poll (fds, 2, timeout);
+    debug (h, "poll end: r=%d revents=%x", r, fds[0].revents);
+  } while (r == -1 && errno == EINTR);
+
+  if (r == -1) {
+    set_error (errno, "poll");
+    return -1;
+  }
+  if (r == 0)
+    return 0;
+  if ((fds[0].revents & POLLIN) != 0 &&
+      sock->ops->wait (h, sock, 0) == -1)
+    return -1;
+  return 1;
+}
+
+/* While the background thread is running, other threads calling
+ * nbd_poll (including the synchronous calls) just wait for it to make
+ * progress.  Returns 1 on progress, or 0 on timeout.
+ */
+static int
+wait_for_background (struct nbd_handle *h, int timeout)
+{
+  const uint64_t progress = h->bg_progress;
+  struct timespec deadline;
+  int err;
+
+  if (timeout >= 0) {
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (long) (timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+
+  while (h->bg_progress == progress) {
+    if (timeout < 0)
+      pthread_cond_wait (&h->bg_cond, &h->lock);
+    else {
+      err = pthread_cond_timedwait (&h->bg_cond, &h->lock, &deadline);
+      if (err == ETIMEDOUT && h->bg_progress == progress)
+        return 0;
+    }
+  }
+  return 1;
+}
+
+/* A simple main loop implementation using poll(2). */
+static int
+do_poll (struct nbd_handle *h, int extra_fd, int timeout)
+{
+  struct pollfd fds[3];
+  int r, err;
+
+  if (h->bg_running && !pthread_equal (h->bg_thread, pthread_self ())) {
+    if (extra_fd >= 0) {
+      set_error (EINVAL, "nbd_poll2 cannot be used "
+                 "while the background thread is running");
+      return -1;
+    }
+    return wait_for_background (h, timeout);
+  }
+
+  if (h->sock && h->sock->ops->wait)
+    return do_wait (h, extra_fd, timeout);
+
+  /* Only one thread at a time can wait in poll(2). */
+  nbd_internal_wait_for_poller (h);
+
+  if (h->wake_fds[0] == -1 && create_wake_fds (h) == -1)
+    return -1;
+
   /* fd might be negative, and poll will ignore it. */
   fds[0].fd = nbd_unlocked_aio_get_fd (h);
   fds[1].fd = extra_fd;
   fds[1].events = POLLIN;
   fds[1].revents = 0;
+  fds[2].fd = h->wake_fds[0];
+  fds[2].events = POLLIN;
+  fds[2].revents = 0;
 
   switch (nbd_internal_aio_get_direction (get_next_state (h))) {
   case LIBNBD_AIO_DIRECTION_READ:
@@ -57,22 +232,52 @@ do_poll (struct nbd_handle *h, int extra_fd, int timeout)
   fds[0].revents = 0;
   debug (h, "poll start: events=%x", fds[0].events);
 
-  /* Note that it's not safe to release the handle lock here, as it
-   * would allow other threads to close file descriptors which we have
-   * passed to poll.
+  /* Release the lock so that other threads can submit commands while
+   * we wait.  It is still not safe for them to close the file
+   * descriptors we are polling, which is why h->in_poll makes them
+   * wait for us before running the state machine.
    */
+  h->in_poll = true;
+  pthread_mutex_unlock (&h->lock);
   do {
-    r = poll (fds, 2, timeout);
-    debug (h, "poll end: r=%d revents=%x", r, fds[0].revents);
+    r = poll (fds, 3, timeout);
   } while (r == -1 && errno == EINTR);
+  err = errno;
+  pthread_mutex_lock (&h->lock);
+  h->in_poll = false;
+  pthread_cond_broadcast (&h->poll_cond);
+  debug (h, "poll end: r=%d revents=%x", r, fds[0].revents);
+
+  if (h->poll_woken)
+    drain_wake_fds (h);
+
+  /* Issue anything queued by other threads while we were waiting.
+   * This must happen even if poll timed out or failed, since the
+   * wakeup has been consumed and nothing else would send them.
+   */
+  if (h->cmds_to_issue != NULL &&
+      nbd_internal_is_state_ready (get_next_state (h)) &&
+      nbd_internal_run (h, cmd_issue) == -1)
+    return -1;
 
   if (r == -1) {
-    set_error (errno, "poll");
+    set_error (err, "poll");
     return -1;
   }
   if (r == 0)
     return 0;
 
+  /* With MSG_ZEROCOPY, POLLERR means that the kernel has queued
+   * completion notifications.
+   */
+  if ((fds[0].revents & POLLERR) != 0 && h->zerocopy_active) {
+    r = nbd_internal_zerocopy_reap (h);
+    if (r == -1)
+      return -1;
+    if (r > 0)
+      fds[0].revents &= ~POLLERR;
+  }
+
   /* POLLIN and POLLOUT might both be set.  However we shouldn't call
    * both nbd_aio_notify_read and nbd_aio_notify_write at this time
    * since the first might change the handle state, making the second
@@ -107,3 +312,97 @@ nbd_unlocked_poll2 (struct nbd_handle *h, int fd, int timeout)
 {
   return do_poll (h, fd, timeout);
 }
+
+/* The background thread calls nbd_poll in a loop until it is
+ * stopped, or until the handle has nothing left to wait for because
+ * it is dead or closed.  Completion callbacks are called from it.
+ */
+static void *
+background_thread (void *vp)
+{
+  struct nbd_handle *h = vp;
+
+  nbd_internal_set_error_context ("nbd_set_background_thread");
+
+  pthread_mutex_lock (&h->lock);
+  for (;;) {
+    while (h->poll_waiters > 0 && !h->bg_stop)
+      pthread_cond_wait (&h->poll_cond, &h->lock);
+    if (h->bg_stop)
+      break;
+    if (do_poll (h, -1, -1) == -1) {
+      debug (h, "background thread: %s", nbd_get_error ());
+      break;
+    }
+    h->bg_progress++;
+    pthread_cond_broadcast (&h->bg_cond);
+  }
+  debug (h, "background thread exiting");
+  h->bg_running = false;
+  h->bg_progress++;
+  pthread_cond_broadcast (&h->bg_cond);
+  pthread_mutex_unlock (&h->lock);
+  return NULL;
+}
+
+/* Stop and join the background thread if there is one.  Called with
+ * the handle lock held, which is released while joining.
+ */
+void
+nbd_internal_stop_background_thread (struct nbd_handle *h)
+{
+  pthread_t thread = h->bg_thread;
+
+  if (!h->bg_started)
+    return;
+  h->bg_stop = true;
+  h->bg_started = false;
+  nbd_internal_wake_poller (h);
+  pthread_cond_broadcast (&h->poll_cond);
+  pthread_mutex_unlock (&h->lock);
+  pthread_join (thread, NULL);
+  pthread_mutex_lock (&h->lock);
+  h->bg_stop = false;
+}
+
+int
+nbd_unlocked_set_background_thread (struct nbd_handle *h, bool enable)
+{
+  int err;
+
+  if (h->bg_started && pthread_equal (h->bg_thread, pthread_self ())) {
+    set_error (EDEADLK, "cannot change the background thread from itself");
+    return -1;
+  }
+
+  if (!enable) {
+    nbd_internal_stop_background_thread (h);
+    return 0;
+  }
+
+  if (h->bg_running)
+    return 0;
+  if (h->sock && h->sock->ops->wait) {
+    set_error (ENOTSUP, "the background thread cannot be used with io_uring");
+    return -1;
+  }
+
+  /* Join a thread which has already exited by itself. */
+  nbd_internal_stop_background_thread (h);
+
+  h->bg_running = true;
+  err = pthread_create (&h->bg_thread, NULL, background_thread, h);
+  if (err != 0) {
+    h->bg_running = false;
+    set_error (err, "pthread_create");
+    return -1;
+  }
+  h->bg_started = true;
+  return 0;
+}
+
+int
+nbd_unlocked_get_background_thread (struct nbd_handle *h)
+{
+  return h->bg_running;
+}
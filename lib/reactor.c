@@ -0,0 +1,630 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Reactors driving many handles from one thread (see
+ * nbd_reactor_create(3)).
+ *
+ * Unlike nbd_group_poll, which rebuilds a pollfd array on every call,
+ * a reactor keeps every handle registered in one epoll set.  The
+ * registration is only changed when the state machine of a handle
+ * finishes running with a different file descriptor or direction
+ * than before (nbd_internal_reactor_update, called from
+ * nbd_internal_run), so the cost of each nbd_reactor_run depends on
+ * the number of handles which are ready, not on the number of
+ * handles.
+ *
+ * Locking: each entry's fd and events belong to its handle and are
+ * only changed with the handle lock held, which is also what makes
+ * it safe to call epoll_ctl from whichever thread ran the state
+ * machine.  The reactor lock protects the list of entries and the
+ * count of registered handles.  The handle lock is always taken
+ * first.
+ *
+ * To use a handle found through an entry, the reactor pins the entry
+ * under the reactor lock and only then drops it to take the handle
+ * lock.  nbd_close waits for the handle to be unpinned before it
+ * frees anything, and entries are not freed while they are pinned or
+ * while some nbd_reactor_run may still have events pointing to them.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "internal.h"
+
+/* Number of ready handles collected by one epoll_wait.  Any more are
+ * picked up by the next nbd_reactor_run.
+ */
+#define REACTOR_MAX_EVENTS 256
+
+struct reactor_entry {
+  struct nbd_reactor *r;
+  struct nbd_handle *h;         /* NULL once the handle has left. */
+  int fd;                       /* Registered fd, or -1. */
+  uint32_t events;              /* Registered events, 0 if none. */
+  bool failed;                  /* epoll_ctl failed, retry from run. */
+  bool closing;                 /* nbd_close is waiting for pins. */
+  unsigned pins;                /* Users of h without the handle lock. */
+  struct reactor_entry *prev, *next;
+};
+
+struct nbd_reactor {
+  int epfd;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;          /* Signalled on unpin and detach. */
+  struct reactor_entry *entries; /* Handles in the reactor. */
+  struct reactor_entry *dead;   /* Left while in use. */
+  unsigned nr_registered;       /* Entries with events != 0. */
+  bool failed;                  /* Some entry has failed set. */
+  unsigned in_run;              /* Calls to nbd_reactor_run. */
+};
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* Pin the handle of an entry, with the reactor lock held.  Returns
+ * NULL if the handle has left the reactor or is being closed.
+ */
+static struct nbd_handle *
+pin_entry (struct reactor_entry *e)
+{
+  if (e->h == NULL || e->closing)
+    return NULL;
+  e->pins++;
+  return e->h;
+}
+
+/* Called with the reactor lock held. */
+static void
+unpin_entry (struct reactor_entry *e)
+{
+  assert (e->pins > 0);
+  if (--e->pins == 0)
+    pthread_cond_broadcast (&e->r->cond);
+}
+
+/* The events which the handle should be waiting for now. */
+static uint32_t
+wanted_events (struct nbd_handle *h)
+{
+  unsigned dir;
+  uint32_t events = 0;
+
+  if (!h->sock)
+    return 0;
+  dir = nbd_internal_aio_get_direction (get_next_state (h));
+  if (dir == 0)
+    return 0;
+
+  /* With io_uring the fd is an eventfd which is always writable, and
+   * only becomes readable when some I/O completed, see do_wait in
+   * lib/poll.c.
+   */
+  if (h->sock->ops->wait)
+    return EPOLLIN;
+
+  if (dir & LIBNBD_AIO_DIRECTION_READ)
+    events |= EPOLLIN;
+  if (dir & LIBNBD_AIO_DIRECTION_WRITE)
+    events |= EPOLLOUT;
+  return events;
+}
+
+/* Called with the handle lock held, and the reactor lock not held. */
+static int
+sync_entry (struct reactor_entry *e)
+{
+  struct nbd_reactor *r = e->r;
+  struct nbd_handle *h = e->h;
+  struct epoll_event ev = { .data.ptr = e };
+  uint32_t events;
+  int fd = -1, was_registered, err;
+
+  events = wanted_events (h);
+  if (events != 0)
+    fd = h->sock->ops->get_fd (h->sock);
+  if (fd == -1)
+    events = 0;
+  if (fd == e->fd && events == e->events)
+    return 0;
+
+  was_registered = e->events != 0;
+  if (was_registered && fd != e->fd) {
+    /* Unlike in nbd_internal_reactor_drop, the old fd is still open
+     * (for example when io_uring takes over the socket).
+     */
+    if (epoll_ctl (r->epfd, EPOLL_CTL_DEL, e->fd, NULL) == -1)
+      debug (h, "epoll_ctl: EPOLL_CTL_DEL: %s", strerror (errno));
+    e->fd = -1;
+    e->events = 0;
+  }
+
+  ev.events = events;
+  if (events == 0) {
+    if (e->events != 0 &&
+        epoll_ctl (r->epfd, EPOLL_CTL_DEL, e->fd, NULL) == -1)
+      debug (h, "epoll_ctl: EPOLL_CTL_DEL: %s", strerror (errno));
+  }
+  else if (e->events != 0) {
+    if (epoll_ctl (r->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+      goto err;
+  }
+  else if (epoll_ctl (r->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    /* The fd may still be registered if an earlier EPOLL_CTL_DEL
+     * failed.
+     */
+    if (errno != EEXIST || epoll_ctl (r->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+      goto err;
+  }
+  e->fd = events != 0 ? fd : -1;
+  e->events = events;
+
+  pthread_mutex_lock (&r->lock);
+  if (was_registered && events == 0)
+    r->nr_registered--;
+  else if (!was_registered && events != 0)
+    r->nr_registered++;
+  e->failed = false;
+  pthread_mutex_unlock (&r->lock);
+  return 0;
+
+ err:
+  err = errno;
+  pthread_mutex_lock (&r->lock);
+  if (was_registered && e->events == 0)
+    r->nr_registered--;
+  e->failed = r->failed = true;
+  pthread_mutex_unlock (&r->lock);
+  errno = err;
+  return -1;
+}
+
+/* Called at the end of every run of the state machine, with the
+ * handle lock held.  Errors are left for nbd_reactor_run to report,
+ * since they must not replace the error of the state machine.
+ */
+void
+nbd_internal_reactor_update (struct nbd_handle *h)
+{
+  if (h->reactor_entry == NULL)
+    return;
+  if (sync_entry (h->reactor_entry) == -1)
+    debug (h, "reactor: cannot update interest: %s", strerror (errno));
+}
+
+/* Called with the handle lock held just before the state machine
+ * closes the socket.  The fd must leave the epoll set while it is
+ * still open, since once it is closed its number may be reused by a
+ * socket belonging to another handle.
+ */
+void
+nbd_internal_reactor_drop (struct nbd_handle *h)
+{
+  struct reactor_entry *e = h->reactor_entry;
+
+  if (e == NULL || e->events == 0)
+    return;
+  if (epoll_ctl (e->r->epfd, EPOLL_CTL_DEL, e->fd, NULL) == -1)
+    debug (h, "epoll_ctl: EPOLL_CTL_DEL: %s", strerror (errno));
+  e->fd = -1;
+  e->events = 0;
+  pthread_mutex_lock (&e->r->lock);
+  e->r->nr_registered--;
+  pthread_mutex_unlock (&e->r->lock);
+}
+
+/* Remove the handle from its reactor, with the handle lock held (or
+ * from nbd_close).  The entry itself is freed later if it is pinned
+ * or the reactor may still have events pointing to it.
+ */
+void
+nbd_internal_reactor_detach (struct nbd_handle *h)
+{
+  struct reactor_entry *e = h->reactor_entry;
+  struct nbd_reactor *r;
+
+  if (e == NULL)
+    return;
+  r = e->r;
+  nbd_internal_reactor_drop (h);
+  h->reactor_entry = NULL;
+
+  pthread_mutex_lock (&r->lock);
+  e->h = NULL;
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    r->entries = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  if (r->in_run > 0 || e->pins > 0) {
+    e->next = r->dead;
+    r->dead = e;
+    e = NULL;
+  }
+  pthread_cond_broadcast (&r->cond);
+  pthread_mutex_unlock (&r->lock);
+  free (e);
+}
+
+/* Called from nbd_close, before anything in the handle is freed.
+ * Another thread may have pinned the handle and be about to take its
+ * lock, so wait for that to finish.
+ */
+void
+nbd_internal_reactor_close (struct nbd_handle *h)
+{
+  struct reactor_entry *e = h->reactor_entry;
+  struct nbd_reactor *r;
+
+  if (e == NULL)
+    return;
+  r = e->r;
+
+  pthread_mutex_lock (&r->lock);
+  e->closing = true;
+  while (e->pins > 0)
+    pthread_cond_wait (&r->cond, &r->lock);
+  pthread_mutex_unlock (&r->lock);
+
+  nbd_internal_reactor_detach (h);
+}
+
+struct nbd_reactor *
+nbd_reactor_create (void)
+{
+  struct nbd_reactor *r;
+  int err;
+
+  nbd_internal_set_error_context ("nbd_reactor_create");
+
+  r = calloc (1, sizeof *r);
+  if (r == NULL) {
+    set_error (errno, "calloc");
+    return NULL;
+  }
+  r->epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (r->epfd == -1) {
+    set_error (errno, "epoll_create1");
+    free (r);
+    return NULL;
+  }
+  err = pthread_mutex_init (&r->lock, NULL);
+  if (err != 0) {
+    set_error (err, "pthread_mutex_init");
+    close (r->epfd);
+    free (r);
+    return NULL;
+  }
+  err = pthread_cond_init (&r->cond, NULL);
+  if (err != 0) {
+    set_error (err, "pthread_cond_init");
+    pthread_mutex_destroy (&r->lock);
+    close (r->epfd);
+    free (r);
+    return NULL;
+  }
+  return r;
+}
+
+void
+nbd_reactor_close (struct nbd_reactor *r)
+{
+  struct reactor_entry *e;
+  struct nbd_handle *h;
+
+  if (r == NULL)
+    return;
+
+  /* Detach the handles, which are left open.  The handle lock must
+   * be taken first, so the reactor lock is dropped each time, with
+   * the handle pinned.  A handle being closed leaves by itself.
+   */
+  pthread_mutex_lock (&r->lock);
+  while ((e = r->entries) != NULL) {
+    h = pin_entry (e);
+    if (h == NULL) {
+      pthread_cond_wait (&r->cond, &r->lock);
+      continue;
+    }
+    pthread_mutex_unlock (&r->lock);
+    pthread_mutex_lock (&h->lock);
+    if (h->reactor_entry == e)
+      nbd_internal_reactor_detach (h);
+    pthread_mutex_unlock (&h->lock);
+    pthread_mutex_lock (&r->lock);
+    unpin_entry (e);
+  }
+  pthread_mutex_unlock (&r->lock);
+
+  while ((e = r->dead) != NULL) {
+    r->dead = e->next;
+    free (e);
+  }
+  close (r->epfd);
+  pthread_cond_destroy (&r->cond);
+  pthread_mutex_destroy (&r->lock);
+  free (r);
+}
+
+int
+nbd_reactor_add (struct nbd_reactor *r, struct nbd_handle *h)
+{
+  struct reactor_entry *e;
+  int ret = 0;
+
+  nbd_internal_set_error_context ("nbd_reactor_add");
+
+  e = calloc (1, sizeof *e);
+  if (e == NULL) {
+    set_error (errno, "calloc");
+    return -1;
+  }
+  e->r = r;
+  e->h = h;
+  e->fd = -1;
+
+  pthread_mutex_lock (&h->lock);
+  if (h->reactor_entry != NULL) {
+    set_error (EBUSY, "handle is already in a reactor");
+    pthread_mutex_unlock (&h->lock);
+    free (e);
+    return -1;
+  }
+  h->reactor_entry = e;
+  pthread_mutex_lock (&r->lock);
+  e->next = r->entries;
+  if (e->next)
+    e->next->prev = e;
+  r->entries = e;
+  pthread_mutex_unlock (&r->lock);
+
+  /* The handle may already be connecting or connected. */
+  if (sync_entry (e) == -1) {
+    set_error (errno, "epoll_ctl");
+    nbd_internal_reactor_detach (h);
+    ret = -1;
+  }
+  pthread_mutex_unlock (&h->lock);
+  return ret;
+}
+
+int
+nbd_reactor_remove (struct nbd_reactor *r, struct nbd_handle *h)
+{
+  int ret = 0;
+
+  nbd_internal_set_error_context ("nbd_reactor_remove");
+
+  pthread_mutex_lock (&h->lock);
+  if (h->reactor_entry == NULL || h->reactor_entry->r != r) {
+    set_error (EINVAL, "handle is not in this reactor");
+    ret = -1;
+  }
+  else
+    nbd_internal_reactor_detach (h);
+  pthread_mutex_unlock (&h->lock);
+  return ret;
+}
+
+/* Retry registrations which failed in nbd_internal_reactor_update.
+ * This is the only part of nbd_reactor_run which visits handles
+ * that are not ready, and only after epoll_ctl failed.
+ */
+static int
+retry_failed (struct nbd_reactor *r)
+{
+  struct reactor_entry *e;
+  struct nbd_handle *h;
+  int err;
+
+  for (;;) {
+    h = NULL;
+    pthread_mutex_lock (&r->lock);
+    r->failed = false;
+    for (e = r->entries; e != NULL; e = e->next) {
+      if (e->failed) {
+        e->failed = false;
+        h = pin_entry (e);
+        if (h != NULL)
+          break;
+      }
+    }
+    pthread_mutex_unlock (&r->lock);
+    if (h == NULL)
+      return 0;
+
+    err = 0;
+    pthread_mutex_lock (&h->lock);
+    if (h->reactor_entry == e && sync_entry (e) == -1)
+      err = errno;
+    pthread_mutex_unlock (&h->lock);
+
+    pthread_mutex_lock (&r->lock);
+    unpin_entry (e);
+    pthread_mutex_unlock (&r->lock);
+    if (err != 0) {
+      set_error (err, "epoll_ctl");
+      return -1;
+    }
+  }
+}
+
+int
+nbd_reactor_run (struct nbd_reactor *r, int timeout)
+{
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  struct reactor_entry *e, *dead;
+  struct nbd_handle *h;
+  unsigned nr_registered;
+  int i, n, ret, dispatched = -1;
+  bool failed;
+
+  nbd_internal_set_error_context ("nbd_reactor_run");
+
+  /* Handles may be closed or removed from the reactor, by callbacks
+   * or by other threads, at any time from here on, including while
+   * we are in epoll_wait.  So entries must stay allocated until we
+   * are done with events[].
+   */
+  pthread_mutex_lock (&r->lock);
+  r->in_run++;
+  failed = r->failed;
+  nr_registered = r->nr_registered;
+  pthread_mutex_unlock (&r->lock);
+  if (failed) {
+    if (retry_failed (r) == -1)
+      goto out;
+    pthread_mutex_lock (&r->lock);
+    nr_registered = r->nr_registered;
+    pthread_mutex_unlock (&r->lock);
+  }
+  if (nr_registered == 0) {
+    set_error (EINVAL, "nothing to poll for on any handle");
+    goto out;
+  }
+
+  do {
+    n = epoll_wait (r->epfd, events, REACTOR_MAX_EVENTS, timeout);
+  } while (n == -1 && errno == EINTR);
+  if (n == -1) {
+    set_error (errno, "epoll_wait");
+    goto out;
+  }
+
+  dispatched = 0;
+  for (i = 0; i < n; ++i) {
+    e = events[i].data.ptr;
+    pthread_mutex_lock (&r->lock);
+    h = pin_entry (e);
+    pthread_mutex_unlock (&r->lock);
+    if (h == NULL)
+      continue;
+
+    /* As in nbd_poll, prefer notifying on read.  EPOLLERR may be
+     * zero-copy completions, which nbd_aio_notify_read collects, or a
+     * real error, which it reports.  A handle which fails here is
+     * dead and its commands have failed, but that does not stop the
+     * other handles.  Running the state machine updates the
+     * registration through nbd_internal_reactor_update.
+     */
+    ret = 0;
+    if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0)
+      ret = nbd_aio_notify_read (h);
+    else if ((events[i].events & EPOLLOUT) != 0)
+      ret = nbd_aio_notify_write (h);
+    if (ret == -1) {
+      pthread_mutex_lock (&h->lock);
+      debug (h, "reactor: %s", nbd_get_error ());
+      pthread_mutex_unlock (&h->lock);
+    }
+    dispatched++;
+
+    pthread_mutex_lock (&r->lock);
+    unpin_entry (e);
+    pthread_mutex_unlock (&r->lock);
+  }
+
+ out:
+  dead = NULL;
+  pthread_mutex_lock (&r->lock);
+  if (--r->in_run == 0) {
+    dead = r->dead;
+    r->dead = NULL;
+  }
+  pthread_mutex_unlock (&r->lock);
+  while ((e = dead) != NULL) {
+    dead = e->next;
+    free (e);
+  }
+
+  return dispatched;
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+void
+nbd_internal_reactor_update (struct nbd_handle *h)
+{
+}
+
+void
+nbd_internal_reactor_drop (struct nbd_handle *h)
+{
+}
+
+void
+nbd_internal_reactor_detach (struct nbd_handle *h)
+{
+}
+
+void
+nbd_internal_reactor_close (struct nbd_handle *h)
+{
+}
+
+struct nbd_reactor *
+nbd_reactor_create (void)
+{
+  nbd_internal_set_error_context ("nbd_reactor_create");
+  set_error (ENOTSUP, "libnbd was compiled without epoll support");
+  return NULL;
+}
+
+void
+nbd_reactor_close (struct nbd_reactor *r)
+{
+}
+
+int
+nbd_reactor_add (struct nbd_reactor *r, struct nbd_handle *h)
+{
+  nbd_internal_set_error_context ("nbd_reactor_add");
+  set_error (ENOTSUP, "libnbd was compiled without epoll support");
+  return -1;
+}
+
+int
+nbd_reactor_remove (struct nbd_reactor *r, struct nbd_handle *h)
+{
+  nbd_internal_set_error_context ("nbd_reactor_remove");
+  set_error (ENOTSUP, "libnbd was compiled without epoll support");
+  return -1;
+}
+
+int
+nbd_reactor_run (struct nbd_reactor *r, int timeout)
+{
+  nbd_internal_set_error_context ("nbd_reactor_run");
+  set_error (ENOTSUP, "libnbd was compiled without epoll support");
+  return -1;
+}
+
+#endif /* !HAVE_SYS_EPOLL_H */
@@ -0,0 +1,685 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Read cache (see nbd_set_read_cache(3)).
+ *
+ * The export is cached in aligned blocks of READ_CACHE_BLOCK_SIZE,
+ * found through a hash table indexed by block number.  A block is
+ * either valid, and on the LRU list, or filling, while an internal
+ * NBD_CMD_READ for the whole block is in flight.
+ *
+ * A read which is entirely covered by valid blocks is copied out and
+ * completed at once.  Otherwise a fill is started for each missing
+ * block, and the read waits in cmds_rc_wait until every block it
+ * needs has been filled.  A read of a block which is already filling
+ * just waits for the same fill, so concurrent readers of one block
+ * cost a single request to the server.
+ *
+ * Writes, zeroes and trims drop the blocks they touch when they are
+ * issued and again when the reply arrives.  A block which is filling
+ * at that point still satisfies the reads waiting for it, since their
+ * order relative to the write was undefined anyway.  But it is taken
+ * out of the hash table at once, so that later reads fill the block
+ * again instead of waiting for the old data, and is freed when its
+ * fill completes.
+ *
+ * Blocks can also be filled ahead of the reader by read-ahead (see
+ * lib/readahead.c).  These are marked prefetched until the first read
+ * which uses them, so that read-ahead can tell how much of what it
+ * fetched was useful.
+ *
+ * Everything here is protected by the handle lock.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "internal.h"
+#include "minmax.h"
+
+struct read_cache_wait {
+  struct command *cmd;
+  struct read_cache_wait *next;
+};
+
+struct cache_block {
+  struct nbd_handle *h;
+  uint64_t offset;              /* Multiple of READ_CACHE_BLOCK_SIZE. */
+  uint32_t length;              /* Shorter at the end of the export. */
+  bool filling;                 /* Fill in flight, not on the LRU list. */
+  bool stale;                   /* Written while filling, not hashed. */
+  bool prefetched;              /* Read ahead and not used yet. */
+  char *data;
+  struct read_cache_wait *waiters;
+  struct cache_block *hash_next; /* Or next free block. */
+  struct cache_block *lru_prev, *lru_next; /* Or stale list. */
+};
+
+struct read_cache {
+  uint64_t max_blocks;
+  uint64_t nr_blocks;           /* Valid or filling. */
+  uint64_t nr_filling;
+  struct cache_block **buckets;
+  size_t nr_buckets;            /* Power of 2. */
+  struct cache_block *lru_head; /* Most recently used. */
+  struct cache_block *lru_tail; /* Least recently used. */
+  struct cache_block *free_blocks; /* Unused, kept with their data. */
+  struct cache_block *stale;    /* Filling, but dropped by a write. */
+};
+
+static struct cache_block **
+bucket (struct read_cache *rc, uint64_t offset)
+{
+  return &rc->buckets[(offset / READ_CACHE_BLOCK_SIZE) &
+                      (rc->nr_buckets - 1)];
+}
+
+static struct cache_block *
+find_block (struct read_cache *rc, uint64_t offset)
+{
+  struct cache_block *b;
+
+  for (b = *bucket (rc, offset); b != NULL; b = b->hash_next)
+    if (b->offset == offset)
+      return b;
+  return NULL;
+}
+
+static void
+lru_unlink (struct read_cache *rc, struct cache_block *b)
+{
+  if (b->lru_prev)
+    b->lru_prev->lru_next = b->lru_next;
+  else
+    rc->lru_head = b->lru_next;
+  if (b->lru_next)
+    b->lru_next->lru_prev = b->lru_prev;
+  else
+    rc->lru_tail = b->lru_prev;
+  b->lru_prev = b->lru_next = NULL;
+}
+
+static void
+lru_push (struct read_cache *rc, struct cache_block *b)
+{
+  b->lru_prev = NULL;
+  b->lru_next = rc->lru_head;
+  if (rc->lru_head)
+    rc->lru_head->lru_prev = b;
+  else
+    rc->lru_tail = b;
+  rc->lru_head = b;
+}
+
+static void
+unhash_block (struct read_cache *rc, struct cache_block *b)
+{
+  struct cache_block **p;
+
+  for (p = bucket (rc, b->offset); *p != b; p = &(*p)->hash_next)
+    ;
+  *p = b->hash_next;
+  b->hash_next = NULL;
+}
+
+/* Keep b, which is not in the table or on any list, for reuse. */
+static void
+free_block (struct read_cache *rc, struct cache_block *b)
+{
+  rc->nr_blocks--;
+  if (b->prefetched) {
+    b->prefetched = false;
+    nbd_internal_readahead_wasted (b->h, b->length);
+  }
+  b->hash_next = rc->free_blocks;
+  rc->free_blocks = b;
+}
+
+/* Remove b, which must not be on the LRU list, from the table and
+ * keep it for reuse.
+ */
+static void
+release_block (struct read_cache *rc, struct cache_block *b)
+{
+  unhash_block (rc, b);
+  free_block (rc, b);
+}
+
+/* Return an unused block, evicting the least recently used valid
+ * block if the cache is full.
+ */
+static struct cache_block *
+get_block (struct nbd_handle *h, struct read_cache *rc)
+{
+  struct cache_block *b;
+
+  if (rc->nr_blocks >= rc->max_blocks) {
+    b = rc->lru_tail;
+    assert (b != NULL);
+    lru_unlink (rc, b);
+    release_block (rc, b);
+  }
+
+  b = rc->free_blocks;
+  if (b != NULL) {
+    rc->free_blocks = b->hash_next;
+    return b;
+  }
+
+  b = calloc (1, sizeof *b);
+  if (b == NULL) {
+    set_error (errno, "calloc");
+    return NULL;
+  }
+  b->data = malloc (READ_CACHE_BLOCK_SIZE);
+  if (b->data == NULL) {
+    set_error (errno, "malloc");
+    free (b);
+    return NULL;
+  }
+  b->h = h;
+  return b;
+}
+
+/* Copy the part of block b which overlaps the read cmd. */
+static void
+copy_out (struct command *cmd, const struct cache_block *b)
+{
+  const uint64_t start = MAX (cmd->offset, b->offset);
+  const uint64_t end = MIN (cmd->offset + cmd->count, b->offset + b->length);
+
+  if (start < end)
+    memcpy ((char *) cmd->data + (start - cmd->offset),
+            b->data + (start - b->offset), end - start);
+}
+
+/* Called once every block needed by a waiting read has been filled. */
+static void
+finish_waiter (struct nbd_handle *h, struct command *cmd)
+{
+  struct command **p;
+
+  for (p = &h->cmds_rc_wait; *p != cmd; p = &(*p)->next)
+    ;
+  *p = cmd->next;
+  cmd->next = NULL;
+  free (cmd->rc_wait);
+  cmd->rc_wait = NULL;
+  nbd_internal_complete_command (h, cmd);
+}
+
+/* Completion callback of the internal read which fills a block, also
+ * called with ENOTCONN if the connection dies first.
+ */
+static int
+fill_complete (void *user_data, int *error)
+{
+  struct cache_block *b = user_data;
+  struct nbd_handle *h = b->h;
+  struct read_cache *rc = h->read_cache;
+  struct read_cache_wait *w;
+  struct command *cmd;
+  const int err = *error;
+
+  while ((w = b->waiters) != NULL) {
+    b->waiters = w->next;
+    cmd = w->cmd;
+    if (err) {
+      if (cmd->error == 0)
+        cmd->error = err;
+    }
+    else
+      copy_out (cmd, b);
+    if (--cmd->rc_pending == 0)
+      finish_waiter (h, cmd);
+  }
+
+  b->filling = false;
+  rc->nr_filling--;
+  if (b->stale) {
+    if (b->lru_prev)
+      b->lru_prev->lru_next = b->lru_next;
+    else
+      rc->stale = b->lru_next;
+    if (b->lru_next)
+      b->lru_next->lru_prev = b->lru_prev;
+    b->lru_prev = b->lru_next = NULL;
+    free_block (rc, b);
+  }
+  else if (err)
+    release_block (rc, b);
+  else
+    lru_push (rc, b);
+
+  /* Retire the internal command. */
+  return 1;
+}
+
+/* Start reading the block at offset from the server. */
+static int
+start_fill (struct nbd_handle *h, struct read_cache *rc, uint64_t offset,
+            bool prefetch)
+{
+  struct cache_block *b;
+  struct command_cb cb = { .completion.callback = fill_complete };
+
+  b = get_block (h, rc);
+  if (b == NULL)
+    return -1;
+  b->offset = offset;
+  b->length = MIN ((uint64_t) READ_CACHE_BLOCK_SIZE, h->exportsize - offset);
+  b->filling = true;
+  b->stale = false;
+  b->prefetched = false;
+  b->waiters = NULL;
+  b->hash_next = *bucket (rc, offset);
+  *bucket (rc, offset) = b;
+  rc->nr_blocks++;
+  rc->nr_filling++;
+
+  /* See the comment about pread_initialize in command_common. */
+  if (h->pread_initialize)
+    memset (b->data, 0, b->length);
+
+  cb.completion.user_data = b;
+  if (nbd_internal_command_common (h, 0, NBD_CMD_READ, offset, b->length,
+                                   EINVAL, b->data, &cb) == -1) {
+    rc->nr_filling--;
+    release_block (rc, b);
+    return -1;
+  }
+  if (prefetch)
+    b->prefetched = true;
+  else
+    h->read_cache_misses++;
+  return 0;
+}
+
+/* Can the cache be used at all with this export? */
+bool
+nbd_internal_read_cache_usable (struct nbd_handle *h)
+{
+  if (h->read_cache == NULL)
+    return false;
+
+  /* Without multi-conn, other clients' writes to a writable export
+   * need not become visible to this connection in any defined way,
+   * so caching is only safe if the server makes that promise.
+   */
+  if (!(h->eflags & NBD_FLAG_READ_ONLY) &&
+      !(h->eflags & NBD_FLAG_CAN_MULTI_CONN))
+    return false;
+
+  return h->block_minimum <= READ_CACHE_BLOCK_SIZE &&
+    h->payload_maximum >= READ_CACHE_BLOCK_SIZE;
+}
+
+/* Can the cache be used for a read of [offset, offset+count)? */
+static bool
+can_use_cache (struct nbd_handle *h, uint64_t count, uint64_t offset)
+{
+  if (!nbd_internal_read_cache_usable (h))
+    return false;
+
+  /* Leave anything the server would reject to the usual path. */
+  return count > 0 && count <= MAX_REQUEST_SIZE &&
+    offset <= h->exportsize && count <= h->exportsize - offset &&
+    !h->disconnect_request && h->in_flight < INT_MAX;
+}
+
+/* Called from nbd_aio_pread.  Returns the cookie of the read if the
+ * cache is handling it, 0 if the read should be sent to the server as
+ * usual, or -1 on error.  The completion callback may already have
+ * been called when this returns.
+ */
+int64_t
+nbd_internal_read_cache_pread (struct nbd_handle *h, void *buf,
+                               uint64_t count, uint64_t offset,
+                               struct command_cb *cb)
+{
+  struct read_cache *rc = h->read_cache;
+  const uint64_t first = offset / READ_CACHE_BLOCK_SIZE
+    * READ_CACHE_BLOCK_SIZE;
+  const uint64_t end = offset + count;
+  const uint64_t nr_blocks =
+    (end - first + READ_CACHE_BLOCK_SIZE - 1) / READ_CACHE_BLOCK_SIZE;
+  struct read_cache_wait *waits = NULL;
+  struct cache_block *b;
+  struct command *cmd;
+  int64_t cookie;
+  uint64_t off;
+  size_t nr_waits = 0;
+
+  if (!can_use_cache (h, count, offset))
+    return 0;
+
+  /* Make sure that filling the blocks of this read never has to
+   * evict another block of the same read, or a filling block.
+   */
+  if (rc->nr_filling + nr_blocks > rc->max_blocks)
+    return 0;
+
+  for (off = first; off < end; off += READ_CACHE_BLOCK_SIZE) {
+    b = find_block (rc, off);
+    if (b == NULL)
+      continue;
+    if (!b->filling) {
+      lru_unlink (rc, b);
+      lru_push (rc, b);
+    }
+    if (b->prefetched) {
+      b->prefetched = false;
+      nbd_internal_readahead_useful (h, b->length);
+    }
+    h->read_cache_hits++;
+  }
+  for (off = first; off < end; off += READ_CACHE_BLOCK_SIZE) {
+    if (find_block (rc, off) == NULL && start_fill (h, rc, off, false) == -1)
+      goto err;
+  }
+
+  for (off = first; off < end; off += READ_CACHE_BLOCK_SIZE) {
+    b = find_block (rc, off);
+    if (b && b->filling)
+      nr_waits++;
+  }
+  if (nr_waits > 0) {
+    waits = malloc (nr_waits * sizeof *waits);
+    if (waits == NULL) {
+      set_error (errno, "malloc");
+      goto err;
+    }
+  }
+
+  cmd = nbd_internal_alloc_command (h);
+  if (cmd == NULL)
+    goto err;
+  cmd->type = NBD_CMD_READ;
+  cmd->cookie = h->unique++;
+  cmd->offset = offset;
+  cmd->count = count;
+  cmd->data = buf;
+  cmd->cb = *cb;
+  cmd->rc_wait = waits;
+  h->in_flight++;
+  if (h->in_flight > h->in_flight_max)
+    h->in_flight_max = h->in_flight;
+  cmd->queued_ns = nbd_internal_stats_now ();
+  probe_command (cmd__queue, h, cmd);
+
+  for (off = first; off < end; off += READ_CACHE_BLOCK_SIZE) {
+    b = find_block (rc, off);
+    if (b == NULL) {
+      /* The fill already failed, so the connection must be dead. */
+      if (cmd->error == 0)
+        cmd->error = ENOTCONN;
+    }
+    else if (b->filling) {
+      waits[cmd->rc_pending].cmd = cmd;
+      waits[cmd->rc_pending].next = b->waiters;
+      b->waiters = &waits[cmd->rc_pending];
+      cmd->rc_pending++;
+    }
+    else
+      copy_out (cmd, b);
+  }
+
+  /* Completing the command may retire and free it. */
+  cookie = cmd->cookie;
+  if (cmd->rc_pending > 0) {
+    cmd->next = h->cmds_rc_wait;
+    h->cmds_rc_wait = cmd;
+  }
+  else {
+    free (cmd->rc_wait);
+    cmd->rc_wait = NULL;
+    nbd_internal_complete_command (h, cmd);
+  }
+  return cookie;
+
+ err:
+  /* Fills which were started carry on, and are kept. */
+  FREE_CALLBACK (cb->completion);
+  free (waits);
+  return -1;
+}
+
+/* Called by read-ahead to start filling the blocks overlapping
+ * [offset, offset+count) which are not cached yet.  Returns -1 if the
+ * cache cannot be used for this range, 0 otherwise.  Errors only
+ * stop the read-ahead early.
+ */
+int
+nbd_internal_read_cache_prefetch (struct nbd_handle *h,
+                                  uint64_t count, uint64_t offset)
+{
+  struct read_cache *rc = h->read_cache;
+  const uint64_t first = offset / READ_CACHE_BLOCK_SIZE
+    * READ_CACHE_BLOCK_SIZE;
+  uint64_t off;
+
+  if (!can_use_cache (h, count, offset))
+    return -1;
+
+  for (off = first; off < offset + count; off += READ_CACHE_BLOCK_SIZE) {
+    if (find_block (rc, off) != NULL)
+      continue;
+    /* Leave room for the reads which are actually made. */
+    if (rc->nr_filling >= rc->max_blocks / 2)
+      break;
+    if (start_fill (h, rc, off, true) == -1)
+      break;
+  }
+  return 0;
+}
+
+/* Drop a block which overlaps a write.  A filling block is moved to
+ * the stale list until its fill completes.
+ */
+static void
+drop_block (struct read_cache *rc, struct cache_block *b)
+{
+  unhash_block (rc, b);
+  if (b->filling) {
+    b->stale = true;
+    b->lru_prev = NULL;
+    b->lru_next = rc->stale;
+    if (rc->stale)
+      rc->stale->lru_prev = b;
+    rc->stale = b;
+  }
+  else {
+    lru_unlink (rc, b);
+    free_block (rc, b);
+  }
+}
+
+/* Drop the blocks overlapping [offset, offset+count). */
+static void
+invalidate (struct read_cache *rc, uint64_t offset, uint64_t count)
+{
+  const uint64_t first = offset / READ_CACHE_BLOCK_SIZE
+    * READ_CACHE_BLOCK_SIZE;
+  struct cache_block *b, *next;
+  uint64_t off;
+  size_t i;
+
+  if (count == 0 || rc->nr_blocks == 0)
+    return;
+
+  /* For large ranges it is quicker to look at every cached block. */
+  if (count / READ_CACHE_BLOCK_SIZE < rc->nr_buckets) {
+    for (off = first; off < offset + count; off += READ_CACHE_BLOCK_SIZE) {
+      b = find_block (rc, off);
+      if (b != NULL)
+        drop_block (rc, b);
+    }
+    return;
+  }
+
+  for (i = 0; i < rc->nr_buckets; ++i) {
+    for (b = rc->buckets[i]; b != NULL; b = next) {
+      next = b->hash_next;
+      if (b->offset + b->length <= offset || b->offset >= offset + count)
+        continue;
+      drop_block (rc, b);
+    }
+  }
+}
+
+static bool
+modifies_data (uint16_t type)
+{
+  return type == NBD_CMD_WRITE || type == NBD_CMD_WRITE_ZEROES ||
+    type == NBD_CMD_TRIM;
+}
+
+/* Called from command_common as each command is queued. */
+void
+nbd_internal_read_cache_queued (struct nbd_handle *h,
+                                const struct command *cmd)
+{
+  if (modifies_data (cmd->type))
+    invalidate (h->read_cache, cmd->offset, cmd->count);
+}
+
+/* Called when the reply to cmd has been received. */
+void
+nbd_internal_read_cache_replied (struct nbd_handle *h,
+                                 const struct command *cmd)
+{
+  if (modifies_data (cmd->type))
+    invalidate (h->read_cache, cmd->offset, cmd->count);
+}
+
+static void
+free_block_list (struct cache_block *b)
+{
+  struct cache_block *next;
+
+  for (; b != NULL; b = next) {
+    next = b->hash_next;
+    free (b->data);
+    free (b);
+  }
+}
+
+static void
+free_stale_list (struct cache_block *b)
+{
+  struct cache_block *next;
+
+  for (; b != NULL; b = next) {
+    next = b->lru_next;
+    free (b->data);
+    free (b);
+  }
+}
+
+/* Called from nbd_close, after the commands in flight have been
+ * freed.  The reads still waiting are left in h->cmds_rc_wait.
+ */
+void
+nbd_internal_read_cache_free (struct nbd_handle *h)
+{
+  struct read_cache *rc = h->read_cache;
+  struct command *cmd;
+  size_t i;
+
+  for (cmd = h->cmds_rc_wait; cmd != NULL; cmd = cmd->next) {
+    free (cmd->rc_wait);
+    cmd->rc_wait = NULL;
+  }
+
+  if (rc == NULL)
+    return;
+  for (i = 0; i < rc->nr_buckets; ++i)
+    free_block_list (rc->buckets[i]);
+  free_block_list (rc->free_blocks);
+  free_stale_list (rc->stale);
+  free (rc->buckets);
+  free (rc);
+  h->read_cache = NULL;
+}
+
+int
+nbd_unlocked_set_read_cache (struct nbd_handle *h, uint64_t size)
+{
+  struct read_cache *rc;
+  const uint64_t max_blocks = size / READ_CACHE_BLOCK_SIZE;
+
+  if (size > 0 && max_blocks == 0) {
+    set_error (EINVAL, "read cache size must be 0 or at least %d",
+               READ_CACHE_BLOCK_SIZE);
+    return -1;
+  }
+
+  nbd_internal_read_cache_free (h);
+  if (max_blocks == 0)
+    return 0;
+
+  rc = calloc (1, sizeof *rc);
+  if (rc == NULL) {
+    set_error (errno, "calloc");
+    return -1;
+  }
+  rc->max_blocks = max_blocks;
+  rc->nr_buckets = 64;
+  while (rc->nr_buckets < max_blocks && rc->nr_buckets < SIZE_MAX / 2)
+    rc->nr_buckets *= 2;
+  rc->buckets = calloc (rc->nr_buckets, sizeof *rc->buckets);
+  if (rc->buckets == NULL) {
+    set_error (errno, "calloc");
+    free (rc);
+    return -1;
+  }
+  h->read_cache = rc;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+uint64_t
+nbd_unlocked_get_read_cache (struct nbd_handle *h)
+{
+  if (h->read_cache == NULL)
+    return 0;
+  return h->read_cache->max_blocks * READ_CACHE_BLOCK_SIZE;
+}
+
+/* NB: may_set_error = false. */
+uint64_t
+nbd_unlocked_stats_read_cache_hits (struct nbd_handle *h)
+{
+  return h->read_cache_hits;
+}
+
+/* NB: may_set_error = false. */
+uint64_t
+nbd_unlocked_stats_read_cache_misses (struct nbd_handle *h)
+{
+  return h->read_cache_misses;
+}
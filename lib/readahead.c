@@ -0,0 +1,242 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Read-ahead (see nbd_set_readahead(3)).
+ *
+ * The window follows the Linux kernel's on-demand read-ahead.  A read
+ * which starts where the previous one ended, or at offset 0, is
+ * sequential.  The first sequential read opens a window a few times
+ * its own size.  When a later read goes into the last ra_async bytes
+ * of the window, the next window is started right after it, 2 or 4
+ * times larger, up to the limit.  Any other read closes the window.
+ *
+ * The window is fetched into the read cache if there is one that can
+ * be used, otherwise the server is told about it with NBD_CMD_CACHE
+ * if it supports that, otherwise nothing is done.
+ *
+ * The limit itself adapts: prefetched data which is thrown away
+ * unused halves it, and prefetched data which is used raises it again
+ * by the same number of bytes, up to readahead_max.
+ *
+ * Everything here is protected by the handle lock.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include "internal.h"
+#include "minmax.h"
+
+#define READAHEAD_MIN 4096
+
+/* Size of the first window for a sequential read of count bytes. */
+static uint64_t
+init_size (uint64_t count, uint64_t max)
+{
+  uint64_t size = 1;
+
+  while (size < count && size < max)
+    size <<= 1;
+
+  if (size <= max / 32)
+    return size * 4;
+  if (size <= max / 4)
+    return size * 2;
+  return max;
+}
+
+/* Size of the window following one of cur bytes. */
+static uint64_t
+next_size (uint64_t cur, uint64_t max)
+{
+  if (cur < max / 16)
+    return cur * 4;
+  if (cur <= max / 2)
+    return cur * 2;
+  return max;
+}
+
+static int
+hint_complete (void *user_data, int *error)
+{
+  /* NBD_CMD_CACHE is only advice, so errors are ignored.  Retire the
+   * internal command.
+   */
+  return 1;
+}
+
+/* Start fetching [offset, offset+count). */
+static void
+start_prefetch (struct nbd_handle *h, uint64_t count, uint64_t offset)
+{
+  struct command_cb cb = { .completion.callback = hint_complete };
+
+  if (offset >= h->exportsize)
+    return;
+  count = MIN (count, h->exportsize - offset);
+
+  if (h->read_cache &&
+      nbd_internal_read_cache_prefetch (h, count, offset) == 0)
+    return;
+
+  if (!(h->eflags & NBD_FLAG_SEND_CACHE))
+    return;
+  if (nbd_internal_command_common (h, 0, NBD_CMD_CACHE, offset, count,
+                                   EINVAL, NULL, &cb) == -1)
+    return;
+
+  /* Windows follow each other, so the hinted range stays contiguous. */
+  if (h->ra_hint_start == h->ra_hint_end)
+    h->ra_hint_start = offset;
+  h->ra_hint_end = offset + count;
+}
+
+/* The read which led here has succeeded, so if read-ahead fails, its
+ * error must not replace whatever the caller last saw.
+ */
+static void
+prefetch (struct nbd_handle *h, uint64_t count, uint64_t offset)
+{
+  char *error;
+  int errnum;
+
+  error = nbd_internal_take_last_error (&errnum);
+  start_prefetch (h, count, offset);
+  nbd_internal_restore_last_error (errnum, error);
+}
+
+/* Called after each read of [offset, offset+count) has been issued. */
+void
+nbd_internal_readahead (struct nbd_handle *h, uint64_t count, uint64_t offset)
+{
+  const uint64_t end = offset + count;
+  const bool continues = offset == h->ra_prev_end;
+  const bool sequential = continues || offset == 0;
+  uint64_t max = h->ra_limit;
+  uint64_t start, used;
+
+  h->ra_prev_end = end;
+
+  /* Account for data hinted with NBD_CMD_CACHE.  Data fetched into
+   * the read cache is accounted for by the cache itself.
+   */
+  if (h->ra_hint_start < h->ra_hint_end) {
+    if (continues && offset <= h->ra_hint_start) {
+      used = MIN (end, h->ra_hint_end);
+      if (used > h->ra_hint_start) {
+        nbd_internal_readahead_useful (h, used - h->ra_hint_start);
+        h->ra_hint_start = used;
+      }
+    }
+    else {
+      nbd_internal_readahead_wasted (h, h->ra_hint_end - h->ra_hint_start);
+      h->ra_hint_start = h->ra_hint_end = 0;
+    }
+  }
+
+  if (!sequential || (offset == 0 && h->ra_size > 0)) {
+    h->ra_start = h->ra_size = h->ra_async = 0;
+    if (!sequential)
+      return;
+  }
+
+  /* Do not let read-ahead take more than half of the read cache, if
+   * it goes there.
+   */
+  if (nbd_internal_read_cache_usable (h))
+    max = MIN (max, nbd_unlocked_get_read_cache (h) / 2);
+  max = MAX (max, (uint64_t) READAHEAD_MIN);
+
+  if (h->ra_size == 0) {
+    h->ra_start = offset;
+    h->ra_size = init_size (count, max);
+    h->ra_async = h->ra_size > count ? h->ra_size - count : h->ra_size;
+  }
+  else if (end > h->ra_start + h->ra_size - h->ra_async) {
+    h->ra_start = MAX (h->ra_start + h->ra_size, end);
+    h->ra_size = MIN (next_size (h->ra_size, max), max);
+    h->ra_async = h->ra_size;
+  }
+  else
+    return;
+
+  start = MAX (h->ra_start, end);
+  if (h->ra_start + h->ra_size > start)
+    prefetch (h, h->ra_start + h->ra_size - start, start);
+}
+
+void
+nbd_internal_readahead_useful (struct nbd_handle *h, uint64_t bytes)
+{
+  h->readahead_useful += bytes;
+  h->ra_limit = MIN (h->ra_limit + bytes, h->readahead_max);
+}
+
+void
+nbd_internal_readahead_wasted (struct nbd_handle *h, uint64_t bytes)
+{
+  h->readahead_wasted += bytes;
+  h->ra_limit = MAX (h->ra_limit / 2,
+                     MIN ((uint64_t) READAHEAD_MIN, h->readahead_max));
+  if (h->ra_size > h->ra_limit) {
+    h->ra_size = h->ra_limit;
+    h->ra_async = MIN (h->ra_async, h->ra_size);
+  }
+}
+
+int
+nbd_unlocked_set_readahead (struct nbd_handle *h, uint64_t size)
+{
+  if (size > 0 && (size < READAHEAD_MIN || size > MAX_REQUEST_SIZE)) {
+    set_error (EINVAL, "read-ahead size must be 0 or between %d and %d",
+               READAHEAD_MIN, MAX_REQUEST_SIZE);
+    return -1;
+  }
+
+  h->readahead_max = h->ra_limit = size;
+  h->ra_start = h->ra_size = h->ra_async = 0;
+  h->ra_hint_start = h->ra_hint_end = 0;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+uint64_t
+nbd_unlocked_get_readahead (struct nbd_handle *h)
+{
+  return h->readahead_max;
+}
+
+/* NB: may_set_error = false. */
+uint64_t
+nbd_unlocked_stats_readahead_useful_bytes (struct nbd_handle *h)
+{
+  return h->readahead_useful;
+}
+
+/* NB: may_set_error = false. */
+uint64_t
+nbd_unlocked_stats_readahead_wasted_bytes (struct nbd_handle *h)
+{
+  return h->readahead_wasted;
+}
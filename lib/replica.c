@@ -0,0 +1,667 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Replica sets with hedged reads (see nbd_replica_create(3)).
+ *
+ * Like connection groups, a replica set only uses the public API of
+ * its member handles.  Each read is an "attempt" on the replica
+ * expected to answer first.  If it has not completed once the
+ * configured percentile of recent read latency has passed, a second
+ * attempt is sent to another replica, and whichever finishes first
+ * completes the read.  The member commands are always auto-retired,
+ * so the replica set keeps its own list of commands and cookies,
+ * using the helpers in lib/group.c.
+ *
+ * The first attempt reads straight into the caller's buffer.  A
+ * hedged attempt reads into a private buffer, copied to the caller's
+ * buffer only if it wins, and because NBD has no way to cancel the
+ * loser, the first attempt is moved to a private buffer of its own
+ * when the hedge is sent.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+
+#include "internal.h"
+
+/* Weight of each new sample in the smoothed latency of a replica, as
+ * for the smoothed round trip time in TCP (RFC 6298).
+ */
+#define REPLICA_EWMA_WEIGHT 0.125
+
+/* The hedging threshold is taken from this many recent reads, and
+ * recalculated after every REPLICA_UPDATE_INTERVAL of them.  No reads
+ * are hedged until REPLICA_MIN_SAMPLES have completed.
+ */
+#define REPLICA_SAMPLES 128
+#define REPLICA_UPDATE_INTERVAL 16
+#define REPLICA_MIN_SAMPLES 16
+
+#define REPLICA_DEFAULT_PERCENTILE 95
+
+struct replica_conn {
+  struct nbd_handle *h;
+  double ewma;                  /* Smoothed read latency (ns), 0 if none. */
+  unsigned in_flight;           /* Attempts in flight. */
+};
+
+struct replica_attempt {
+  struct replica_command *cmd;
+  unsigned conn;
+  char *bounce;                 /* Private buffer, or NULL. */
+  int64_t cookie;
+  int64_t start;
+  bool pending;
+  bool counted;                 /* Latency already fed to the EWMA. */
+};
+
+struct replica_command {
+  struct member_command mc;     /* Must be first. */
+  struct nbd_replica *r;
+  void *buf;
+  size_t count;
+  uint64_t offset;
+  uint32_t flags;
+  nbd_completion_callback cb;
+  int64_t start;
+  unsigned refs;                /* Unfreed attempts, + 1 until retired. */
+  struct replica_attempt attempts[2];
+  unsigned nr_attempts;
+  unsigned pending;             /* Attempts in flight. */
+  bool hedgeable;               /* May send a second attempt. */
+  bool hedged;                  /* Second attempt sent or abandoned. */
+  bool retry;                   /* First attempt failed, try another. */
+};
+
+struct nbd_replica {
+  unsigned nr_conns;
+  unsigned next;                /* Rotates tie-breaks. */
+  unsigned percentile;          /* 0 = hedging disabled. */
+  struct member_commands cmds;  /* Unretired commands. */
+
+  int64_t samples[REPLICA_SAMPLES];
+  unsigned nr_samples, samples_next, since_update;
+  int64_t threshold;            /* Hedging delay (ns), -1 if unknown. */
+
+  struct replica_conn conns[];
+};
+
+static int64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * INT64_C (1000000000) + ts.tv_nsec;
+}
+
+static int
+compare_int64 (const void *av, const void *bv)
+{
+  const int64_t a = *(const int64_t *) av, b = *(const int64_t *) bv;
+
+  return a < b ? -1 : a > b;
+}
+
+static void
+update_threshold (struct nbd_replica *r)
+{
+  int64_t sorted[REPLICA_SAMPLES];
+
+  r->since_update = 0;
+  if (r->nr_samples < REPLICA_MIN_SAMPLES) {
+    r->threshold = -1;
+    return;
+  }
+  memcpy (sorted, r->samples, r->nr_samples * sizeof sorted[0]);
+  qsort (sorted, r->nr_samples, sizeof sorted[0], compare_int64);
+  r->threshold = sorted[(r->nr_samples - 1) * r->percentile / 100];
+}
+
+static void
+update_ewma (struct replica_conn *conn, int64_t latency)
+{
+  if (conn->ewma == 0)
+    conn->ewma = latency;
+  else
+    conn->ewma += (latency - conn->ewma) * REPLICA_EWMA_WEIGHT;
+}
+
+static void
+record_latency (struct nbd_replica *r, struct replica_conn *conn,
+                int64_t latency)
+{
+  update_ewma (conn, latency);
+
+  r->samples[r->samples_next] = latency;
+  r->samples_next = (r->samples_next + 1) % REPLICA_SAMPLES;
+  if (r->nr_samples < REPLICA_SAMPLES)
+    r->nr_samples++;
+  if (++r->since_update >= REPLICA_UPDATE_INTERVAL)
+    update_threshold (r);
+}
+
+/* Choose the replica expected to answer first: the lowest smoothed
+ * latency, scaled by the attempts already queued on it.  A replica
+ * with no measurement yet counts as being as slow as the slowest one
+ * measured, so that reads are spread over unmeasured replicas rather
+ * than piling onto one of them.  Adding the queue length on its own
+ * breaks ties while nothing has been measured.
+ */
+static unsigned
+pick_conn (struct nbd_replica *r, int exclude)
+{
+  const unsigned start = r->next++ % r->nr_conns;
+  unsigned i, j, best = start;
+  double worst = 0, latency, score, best_score = -1;
+
+  for (i = 0; i < r->nr_conns; ++i)
+    if (r->conns[i].ewma > worst)
+      worst = r->conns[i].ewma;
+
+  for (i = 0; i < r->nr_conns; ++i) {
+    j = (start + i) % r->nr_conns;
+    if ((int) j == exclude)
+      continue;
+    latency = r->conns[j].ewma ? r->conns[j].ewma : worst;
+    score = latency * (r->conns[j].in_flight + 1) + r->conns[j].in_flight;
+    if (best_score < 0 || score < best_score) {
+      best = j;
+      best_score = score;
+    }
+  }
+  return best;
+}
+
+static void
+command_unref (struct replica_command *cmd)
+{
+  if (--cmd->refs > 0)
+    return;
+  free (cmd);
+}
+
+static void
+retire_command (struct member_command *mc)
+{
+  struct replica_command *cmd = (struct replica_command *) mc;
+
+  nbd_internal_member_command_remove (&cmd->r->cmds, mc);
+  if (cmd->cb.free)
+    cmd->cb.free (cmd->cb.user_data);
+  command_unref (cmd);
+}
+
+static void
+complete_command (struct replica_command *cmd, int error)
+{
+  struct nbd_replica *r = cmd->r;
+  const int64_t now = now_ns ();
+  unsigned i;
+
+  nbd_internal_member_command_done (&r->cmds, &cmd->mc, error);
+
+  /* A replica still working on the read has taken at least this long,
+   * which is worth knowing long before its reply turns up.  Its reply
+   * is then not counted again.
+   */
+  for (i = 0; i < cmd->nr_attempts; ++i) {
+    if (cmd->attempts[i].pending) {
+      update_ewma (&r->conns[cmd->attempts[i].conn],
+                   now - cmd->attempts[i].start);
+      cmd->attempts[i].counted = true;
+    }
+  }
+
+  if (cmd->cb.callback &&
+      cmd->cb.callback (cmd->cb.user_data, &error) == 1)
+    retire_command (&cmd->mc);
+}
+
+static int
+attempt_callback (void *user_data, int *error)
+{
+  struct replica_attempt *a = user_data;
+  struct replica_command *cmd = a->cmd;
+  struct nbd_replica *r = cmd->r;
+  struct replica_conn *conn = &r->conns[a->conn];
+
+  a->pending = false;
+  cmd->pending--;
+  conn->in_flight--;
+  if (*error == 0 && !a->counted)
+    record_latency (r, conn, now_ns () - a->start);
+
+  if (cmd->mc.done)             /* Lost the race. */
+    return 1;
+
+  if (*error) {
+    if (cmd->mc.error == 0)
+      cmd->mc.error = *error;
+    if (cmd->pending > 0)       /* The other attempt may yet succeed. */
+      return 1;
+    if (!cmd->hedged && r->nr_conns > 1) {
+      /* Retry on another replica from nbd_replica_poll. */
+      cmd->retry = true;
+      return 1;
+    }
+    complete_command (cmd, cmd->mc.error);
+    return 1;
+  }
+
+  if (a->bounce)
+    memcpy (cmd->buf, a->bounce, cmd->count);
+  complete_command (cmd, 0);
+  return 1;
+}
+
+/* Called exactly once per attempt by libnbd, even if the attempt
+ * could not be issued.
+ */
+static void
+attempt_free (void *user_data)
+{
+  struct replica_attempt *a = user_data;
+
+  free (a->bounce);
+  a->bounce = NULL;
+  command_unref (a->cmd);
+}
+
+/* Send the read to a replica other than exclude (or any, if -1).  If
+ * bounce is true, it reads into a private buffer.
+ */
+static int
+issue_attempt (struct nbd_replica *r, struct replica_command *cmd,
+               int exclude, bool bounce, int64_t now)
+{
+  struct replica_attempt *a = &cmd->attempts[cmd->nr_attempts];
+  struct replica_conn *conn;
+  int64_t cookie;
+
+  a->cmd = cmd;
+  a->conn = pick_conn (r, exclude);
+  a->start = now;
+  a->counted = false;
+  a->bounce = NULL;
+  if (bounce) {
+    a->bounce = malloc (cmd->count);
+    if (a->bounce == NULL) {
+      set_error (errno, "malloc");
+      return -1;
+    }
+  }
+  conn = &r->conns[a->conn];
+
+  a->pending = true;
+  cmd->nr_attempts++;
+  cmd->pending++;
+  cmd->refs++;
+  conn->in_flight++;
+  cookie = nbd_aio_pread (conn->h, a->bounce ? a->bounce : cmd->buf,
+                          cmd->count, cmd->offset,
+                          (nbd_completion_callback) {
+                            .callback = attempt_callback,
+                            .user_data = a,
+                            .free = attempt_free,
+                          },
+                          cmd->flags);
+  if (cookie == -1) {
+    /* attempt_free has already dropped the reference. */
+    a->pending = false;
+    cmd->nr_attempts--;
+    cmd->pending--;
+    conn->in_flight--;
+    return -1;
+  }
+  a->cookie = cookie;
+  return 0;
+}
+
+/* Move the first attempt of a read about to be hedged to a private
+ * buffer, so that it cannot write into the caller's buffer after the
+ * hedge has won.  Returns -1 if it cannot be moved now, usually
+ * because its reply is arriving.
+ */
+static int
+bounce_first_attempt (struct nbd_replica *r, struct replica_command *cmd)
+{
+  struct replica_attempt *a = &cmd->attempts[0];
+  struct nbd_handle *h = r->conns[a->conn].h;
+  char *bounce;
+  int ret;
+
+  bounce = malloc (cmd->count);
+  if (bounce == NULL) {
+    set_error (errno, "malloc");
+    return -1;
+  }
+  pthread_mutex_lock (&h->lock);
+  ret = nbd_internal_redirect_read (h, a->cookie, bounce);
+  if (ret == 0)
+    a->bounce = bounce;
+  pthread_mutex_unlock (&h->lock);
+  if (ret == -1)
+    free (bounce);
+  return ret;
+}
+
+/* Send second attempts for reads which are overdue, or whose first
+ * attempt failed.  Returns the number sent, and sets *deadline to the
+ * time the next read becomes overdue, or -1.
+ */
+static int
+issue_hedges (struct nbd_replica *r, int64_t now, int64_t *deadline)
+{
+  struct replica_command *cmd, *next;
+  struct nbd_handle *h;
+  int64_t due;
+  int sent = 0;
+
+  *deadline = -1;
+  for (cmd = (struct replica_command *) r->cmds.head; cmd; cmd = next) {
+    next = (struct replica_command *) cmd->mc.next;
+    if (cmd->mc.done || cmd->hedged)
+      continue;
+    if (!cmd->retry) {
+      if (!cmd->hedgeable || r->threshold < 0 || r->percentile == 0)
+        continue;
+      due = cmd->start + r->threshold;
+      if (now < due) {
+        if (*deadline == -1 || due < *deadline)
+          *deadline = due;
+        continue;
+      }
+      /* Polling the replica wakes us again as the reply arrives. */
+      if (bounce_first_attempt (r, cmd) == -1)
+        continue;
+    }
+
+    cmd->hedged = true;
+    if (issue_attempt (r, cmd, cmd->attempts[0].conn, !cmd->retry,
+                       now) == -1) {
+      if (cmd->pending == 0)
+        complete_command (cmd,
+                          cmd->mc.error ? cmd->mc.error : nbd_get_errno ());
+      continue;
+    }
+    h = r->conns[cmd->attempts[1].conn].h;
+    pthread_mutex_lock (&h->lock);
+    debug (h, "%s read of %zu bytes at offset %" PRIu64 " on replica %u",
+           cmd->retry ? "retrying" : "hedging",
+           cmd->count, cmd->offset, cmd->attempts[1].conn);
+    pthread_mutex_unlock (&h->lock);
+    sent++;
+  }
+  return sent;
+}
+
+struct nbd_replica *
+nbd_replica_create (unsigned replicas,
+                    nbd_replica_connect_callback connect, void *user_data)
+{
+  struct nbd_replica *r;
+  int64_t size, size0 = 0;
+  unsigned i;
+
+  nbd_internal_set_error_context ("nbd_replica_create");
+
+  if (replicas == 0 || replicas > 64) {
+    set_error (EINVAL, "replicas must be between 1 and 64");
+    return NULL;
+  }
+  if (connect == NULL) {
+    set_error (EFAULT, "connect callback must not be NULL");
+    return NULL;
+  }
+
+  r = calloc (1, sizeof *r + replicas * sizeof r->conns[0]);
+  if (r == NULL) {
+    set_error (errno, "calloc");
+    return NULL;
+  }
+  r->percentile = REPLICA_DEFAULT_PERCENTILE;
+  r->threshold = -1;
+
+  for (i = 0; i < replicas; ++i) {
+    r->conns[i].h = nbd_create ();
+    if (r->conns[i].h == NULL)
+      goto err;
+    r->nr_conns = i + 1;
+    if (connect (user_data, r->conns[i].h, i) == -1)
+      goto err;
+    nbd_internal_set_error_context ("nbd_replica_create");
+    if (!nbd_aio_is_ready (r->conns[i].h)) {
+      set_error (EINVAL, "connect callback did not leave replica %u "
+                 "in the ready state", i);
+      goto err;
+    }
+    size = nbd_get_size (r->conns[i].h);
+    if (size == -1)
+      goto err;
+    if (i == 0)
+      size0 = size;
+    else if (size != size0) {
+      nbd_internal_set_error_context ("nbd_replica_create");
+      set_error (EINVAL, "replica %u has size %" PRIi64 ", "
+                 "but replica 0 has size %" PRIi64, i, size, size0);
+      goto err;
+    }
+  }
+
+  return r;
+
+ err:
+  nbd_replica_close (r);
+  return NULL;
+}
+
+void
+nbd_replica_close (struct nbd_replica *r)
+{
+  struct replica_command *cmd, *next;
+  unsigned i;
+
+  if (r == NULL)
+    return;
+
+  /* Closing the handles frees every attempt still in flight. */
+  for (i = 0; i < r->nr_conns; ++i)
+    nbd_close (r->conns[i].h);
+  for (cmd = (struct replica_command *) r->cmds.head; cmd; cmd = next) {
+    next = (struct replica_command *) cmd->mc.next;
+    if (cmd->cb.free)
+      cmd->cb.free (cmd->cb.user_data);
+    free (cmd);
+  }
+  free (r);
+}
+
+unsigned
+nbd_replica_get_size (struct nbd_replica *r)
+{
+  return r->nr_conns;
+}
+
+struct nbd_handle *
+nbd_replica_get_handle (struct nbd_replica *r, unsigned i)
+{
+  nbd_internal_set_error_context ("nbd_replica_get_handle");
+
+  if (i >= r->nr_conns) {
+    set_error (EINVAL, "replica index %u out of range", i);
+    return NULL;
+  }
+  return r->conns[i].h;
+}
+
+int
+nbd_replica_set_hedge_percentile (struct nbd_replica *r, unsigned percentile)
+{
+  nbd_internal_set_error_context ("nbd_replica_set_hedge_percentile");
+
+  if (percentile > 100) {
+    set_error (EINVAL, "percentile must be between 0 and 100");
+    return -1;
+  }
+  r->percentile = percentile;
+  update_threshold (r);
+  return 0;
+}
+
+unsigned
+nbd_replica_get_hedge_percentile (struct nbd_replica *r)
+{
+  return r->percentile;
+}
+
+int64_t
+nbd_replica_aio_pread (struct nbd_replica *r, void *buf, size_t count,
+                       uint64_t offset,
+                       nbd_completion_callback completion_callback,
+                       uint32_t flags)
+{
+  struct replica_command *cmd;
+
+  nbd_internal_set_error_context ("nbd_replica_aio_pread");
+
+  cmd = calloc (1, sizeof *cmd);
+  if (cmd == NULL) {
+    set_error (errno, "calloc");
+    if (completion_callback.free)
+      completion_callback.free (completion_callback.user_data);
+    return -1;
+  }
+  cmd->r = r;
+  cmd->buf = buf;
+  cmd->count = count;
+  cmd->offset = offset;
+  cmd->flags = flags;
+  cmd->cb = completion_callback;
+  cmd->refs = 1;
+  cmd->hedgeable = r->nr_conns > 1 && r->percentile > 0;
+  cmd->start = now_ns ();
+
+  if (issue_attempt (r, cmd, -1, false, cmd->start) == -1) {
+    if (cmd->cb.free)
+      cmd->cb.free (cmd->cb.user_data);
+    free (cmd);
+    return -1;
+  }
+
+  return nbd_internal_member_command_add (&r->cmds, &cmd->mc);
+}
+
+int
+nbd_replica_aio_command_completed (struct nbd_replica *r, int64_t cookie)
+{
+  nbd_internal_set_error_context ("nbd_replica_aio_command_completed");
+  return nbd_internal_member_command_completed (&r->cmds, cookie,
+                                                retire_command,
+                                                "read failed on every "
+                                                "replica tried");
+}
+
+int64_t
+nbd_replica_aio_peek_command_completed (struct nbd_replica *r)
+{
+  nbd_internal_set_error_context ("nbd_replica_aio_peek_command_completed");
+  return nbd_internal_member_command_peek (&r->cmds);
+}
+
+int
+nbd_replica_aio_in_flight (struct nbd_replica *r)
+{
+  return r->cmds.in_flight;
+}
+
+/* Like nbd_group_poll, but also sending hedged reads when they become
+ * due, and waking up in time to do so.
+ */
+int
+nbd_replica_poll (struct nbd_replica *r, int timeout)
+{
+  struct nbd_handle *hs[r->nr_conns];
+  struct pollfd fds[r->nr_conns];
+  unsigned i;
+  int64_t now, deadline, ms;
+  int sent, r2;
+
+  nbd_internal_set_error_context ("nbd_replica_poll");
+
+  now = now_ns ();
+  sent = issue_hedges (r, now, &deadline);
+
+  for (i = 0; i < r->nr_conns; ++i)
+    hs[i] = r->conns[i].h;
+  r2 = nbd_internal_poll_prepare (hs, r->nr_conns, fds);
+  if (r2 == -1)
+    return -1;
+
+  nbd_internal_set_error_context ("nbd_replica_poll");
+  if (r2 == 0) {
+    if (sent > 0)
+      return 1;
+    set_error (EINVAL, "nothing to poll for on any replica");
+    return -1;
+  }
+
+  if (deadline >= 0) {
+    ms = (deadline - now + 999999) / 1000000;
+    if (timeout < 0 || ms < timeout)
+      timeout = ms;
+  }
+
+  do {
+    r2 = poll (fds, r->nr_conns, timeout);
+  } while (r2 == -1 && errno == EINTR);
+
+  if (r2 == -1) {
+    set_error (errno, "poll");
+    return -1;
+  }
+  if (r2 == 0) {
+    sent += issue_hedges (r, now_ns (), &deadline);
+    return sent > 0;
+  }
+
+  if (nbd_internal_poll_notify (hs, r->nr_conns, fds) == -1)
+    return -1;
+  return 1;
+}
+
+int
+nbd_replica_shutdown (struct nbd_replica *r, uint32_t flags)
+{
+  unsigned i;
+
+  for (i = 0; i < r->nr_conns; ++i) {
+    if (nbd_shutdown (r->conns[i].h, flags) == -1)
+      return -1;
+  }
+  return 0;
+}
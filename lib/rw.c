@@ -150,58 +150,94 @@ nbd_unlocked_zero (struct nbd_handle *h,
   return wait_for_command (h, cookie);
 }
 
+static int bs_shim_wrap (nbd_extent_callback *extent,
+                         nbd_extent64_callback *extent64);
+static int check_block_status (struct nbd_handle *h);
+static int check_command (struct nbd_handle *h, uint16_t type,
+                          uint64_t offset, uint64_t count, int count_err);
+
 /* Issue a block status command and wait for the reply. */
 int
 nbd_unlocked_block_status (struct nbd_handle *h,
                            uint64_t count, uint64_t offset,
                            nbd_extent_callback *extent,
                            uint32_t flags)
+{
+  nbd_extent64_callback extent64;
+  int r;
+
+  if (bs_shim_wrap (extent, &extent64) == -1)
+    return -1;
+  r = nbd_unlocked_block_status_64 (h, count, offset, &extent64, flags);
+  /* If the command was not queued, we still own the shim. */
+  FREE_CALLBACK (extent64);
+  return r;
+}
+
+/* Issue a 64 bit block status command and wait for the reply, unless
+ * it can be answered from the block status cache.
+ */
+int
+nbd_unlocked_block_status_64 (struct nbd_handle *h,
+                              uint64_t count, uint64_t offset,
+                              nbd_extent64_callback *extent64,
+                              uint32_t flags)
 {
   int64_t cookie;
   nbd_completion_callback c = NBD_NULL_COMPLETION;
+  int r;
 
-  cookie = nbd_unlocked_aio_block_status (h, count, offset, extent, &c, flags);
+  if (h->extent_cache) {
+    /* Fail in the same way as if the command had been sent. */
+    if (check_block_status (h) == -1 ||
+        check_command (h, NBD_CMD_BLOCK_STATUS, offset, count, EINVAL) == -1)
+      return -1;
+    r = nbd_internal_extent_cache_lookup (h, count, offset, extent64, flags);
+    if (r != 0)
+      return r == 1 ? 0 : -1;
+  }
+
+  cookie = nbd_unlocked_aio_block_status_64 (h, count, offset, extent64, &c,
+                                             flags);
   if (cookie == -1)
     return -1;
 
-  assert (CALLBACK_IS_NULL (*extent));
+  assert (CALLBACK_IS_NULL (*extent64));
   return wait_for_command (h, cookie);
 }
 
-/* count_err represents the errno to return if bounds check fail */
-int64_t
-nbd_internal_command_common (struct nbd_handle *h,
-                             uint16_t flags, uint16_t type,
-                             uint64_t offset, uint64_t count, int count_err,
-                             void *data, struct command_cb *cb)
+/* Check that a command can be queued, setting the error if not.
+ * count_err represents the errno to return if bounds check fail.
+ */
+static int
+check_command (struct nbd_handle *h, uint16_t type,
+               uint64_t offset, uint64_t count, int count_err)
 {
-  struct command *cmd;
-
   if (h->disconnect_request) {
       set_error (EINVAL, "cannot request more commands after NBD_CMD_DISC");
-      goto err;
+      return -1;
   }
   if (h->in_flight == INT_MAX) {
       set_error (ENOMEM, "too many commands already in flight");
-      goto err;
+      return -1;
   }
 
   if (count_err) {
     if ((h->strict & LIBNBD_STRICT_ZERO_SIZE) && count == 0) {
       set_error (EINVAL, "count cannot be 0");
-      goto err;
+      return -1;
     }
 
     if ((h->strict & LIBNBD_STRICT_BOUNDS) &&
         (offset > h->exportsize || count > h->exportsize - offset)) {
       set_error (count_err, "request out of bounds");
-      goto err;
+      return -1;
     }
 
     if (h->block_minimum && (h->strict & LIBNBD_STRICT_ALIGN) &&
         (offset | count) & (h->block_minimum - 1)) {
       set_error (EINVAL, "request is unaligned");
-      goto err;
+      return -1;
     }
   }
 
@@ -212,42 +248,65 @@ nbd_internal_command_common (struct nbd_handle *h,
       set_error (ERANGE,
                  "request too large: maximum payload size is %" PRIu32,
                  h->payload_maximum);
-      goto err;
+      return -1;
     }
     /* fallthrough */
   case NBD_CMD_READ:
     if (count > MAX_REQUEST_SIZE) {
       set_error (ERANGE, "request too large: maximum request size is %d",
                  MAX_REQUEST_SIZE);
-      goto err;
+      return -1;
     }
     break;
 
-    /* Other commands are currently limited by the 32 bit field in the
-     * command structure on the wire, but in future we hope to support
-     * 64 bit values here with a change to the NBD protocol which is
-     * being discussed upstream.
+    /* Other commands are limited by the width of the count field in
+     * the command structure on the wire: 32 bits normally, or 64 bits
+     * when extended headers were negotiated.
      */
   default:
-    if (count > UINT32_MAX) {
+    if (!h->extended_headers && count > UINT32_MAX) {
       set_error (ERANGE, "request too large: maximum request size is %" PRIu32,
                  UINT32_MAX);
-      goto err;
+      return -1;
+    }
+    if (count > INT64_MAX) {
+      set_error (ERANGE, "request too large: maximum request size is %" PRIi64,
+                 INT64_MAX);
+      return -1;
     }
     break;
   }
 
-  cmd = calloc (1, sizeof *cmd);
-  if (cmd == NULL) {
-    set_error (errno, "calloc");
+  return 0;
+}
+
+/* count_err is passed to check_command.
+ * For vectored commands data is NULL and iov is an array allocated
+ * by the caller, which this function takes ownership of.
+ */
+static int64_t
+command_common (struct nbd_handle *h,
+                uint16_t flags, uint16_t type,
+                uint64_t offset, uint64_t count, int count_err,
+                void *data, struct iovec *iov, size_t iovcnt,
+                struct command_cb *cb)
+{
+  struct command *cmd;
+
+  if (check_command (h, type, offset, count, count_err) == -1)
+    goto err;
+
+  cmd = nbd_internal_alloc_command (h);
+  if (cmd == NULL)
     goto err;
-  }
   cmd->flags = flags;
   cmd->type = type;
   cmd->cookie = h->unique++;
   cmd->offset = offset;
   cmd->count = count;
   cmd->data = data;
+  cmd->iov = iov;
+  cmd->iovcnt = iovcnt;
   if (cb)
     cmd->cb = *cb;
 
@@ -275,16 +334,31 @@ nbd_internal_command_common (struct nbd_handle *h,
    * moved on to DEAD at that time.
    */
   h->in_flight++;
+  if (h->in_flight > h->in_flight_max)
+    h->in_flight_max = h->in_flight;
+  cmd->queued_ns = nbd_internal_stats_now ();
+  probe_command (cmd__queue, h, cmd);
+  if (h->extent_cache)
+    nbd_internal_extent_cache_queued (h, cmd);
+  if (h->read_cache)
+    nbd_internal_read_cache_queued (h, cmd);
   if (h->cmds_to_issue != NULL) {
-    assert (nbd_internal_is_state_processing (get_next_state (h)));
+    assert (h->in_poll ||
+            nbd_internal_is_state_processing (get_next_state (h)));
     h->cmds_to_issue_tail = h->cmds_to_issue_tail->next = cmd;
   }
   else {
     assert (h->cmds_to_issue_tail == NULL);
     h->cmds_to_issue = h->cmds_to_issue_tail = cmd;
-    if (nbd_internal_is_state_ready (get_next_state (h)) &&
-        nbd_internal_run (h, cmd_issue) == -1)
-      debug (h, "command queued, ignoring state machine failure");
+    if (nbd_internal_is_state_ready (get_next_state (h))) {
+      /* If another thread is blocked in nbd_poll, leave the command
+       * queued and let that thread issue it.
+       */
+      if (h->in_poll)
+        nbd_internal_wake_poller (h);
+      else if (nbd_internal_run (h, cmd_issue) == -1)
+        debug (h, "command queued, ignoring state machine failure");
+    }
   }
 
   return cmd->cookie;
@@ -298,6 +372,68 @@ nbd_internal_command_common (struct nbd_handle *h,
       FREE_CALLBACK (cb->fn.chunk);
     FREE_CALLBACK (cb->completion);
   }
+  free (iov);
+  return -1;
+}
+
+int64_t
+nbd_internal_command_common (struct nbd_handle *h,
+                             uint16_t flags, uint16_t type,
+                             uint64_t offset, uint64_t count, int count_err,
+                             void *data, struct command_cb *cb)
+{
+  return command_common (h, flags, type, offset, count, count_err,
+                         data, NULL, 0, cb);
+}
+
+/* As above, but the data for a read or write command is described by
+ * the caller's iovec array.  We take a copy of the array, leaving out
+ * any empty segments, so the state machine never has to skip them.
+ */
+int64_t
+nbd_internal_command_common_iov (struct nbd_handle *h,
+                                 uint16_t flags, uint16_t type,
+                                 uint64_t offset, int count_err,
+                                 const struct iovec *iov, size_t iovcnt,
+                                 struct command_cb *cb)
+{
+  struct iovec *copy;
+  uint64_t count = 0;
+  size_t i, n = 0;
+
+  /* +1 so that a zero-length request still gets a non-NULL array. */
+  copy = malloc ((iovcnt + 1) * sizeof *copy);
+  if (copy == NULL) {
+    set_error (errno, "malloc");
+    goto err;
+  }
+
+  for (i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_len == 0)
+      continue;
+    if (iov[i].iov_base == NULL) {
+      set_error (EFAULT, "iov[%zu] has a NULL buffer", i);
+      goto err;
+    }
+    if (iov[i].iov_len > MAX_REQUEST_SIZE - count) {
+      set_error (ERANGE, "request too large: maximum request size is %d",
+                 MAX_REQUEST_SIZE);
+      goto err;
+    }
+    count += iov[i].iov_len;
+    copy[n++] = iov[i];
+  }
+
+  return command_common (h, flags, type, offset, count, count_err,
+                         NULL, copy, n, cb);
+
+ err:
+  if (cb) {
+    if (type == NBD_CMD_READ)
+      FREE_CALLBACK (cb->fn.chunk);
+    FREE_CALLBACK (cb->completion);
+  }
+  free (copy);
   return -1;
 }
 
@@ -308,10 +444,31 @@ nbd_unlocked_aio_pread (struct nbd_handle *h, void *buf,
                         uint32_t flags)
 {
   struct command_cb cb = { .completion = *completion };
+  int64_t cookie = 0;
+
+  SET_CALLBACK_TO_NULL (*completion);
+  if (h->read_cache && flags == 0)
+    cookie = nbd_internal_read_cache_pread (h, buf, count, offset, &cb);
+  if (cookie == 0)
+    cookie = nbd_internal_command_common (h, flags, NBD_CMD_READ, offset,
+                                          count, EINVAL, buf, &cb);
+  if (cookie != -1 && h->readahead_max > 0)
+    nbd_internal_readahead (h, count, offset);
+  return cookie;
+}
+
+int64_t
+nbd_unlocked_aio_preadv (struct nbd_handle *h,
+                         const struct iovec *iov, size_t iovcnt,
+                         uint64_t offset,
+                         nbd_completion_callback *completion,
+                         uint32_t flags)
+{
+  struct command_cb cb = { .completion = *completion };
 
   SET_CALLBACK_TO_NULL (*completion);
-  return nbd_internal_command_common (h, flags, NBD_CMD_READ, offset, count,
-                                      EINVAL, buf, &cb);
+  return nbd_internal_command_common_iov (h, flags, NBD_CMD_READ, offset,
+                                          EINVAL, iov, iovcnt, &cb);
 }
 
 int64_t
@@ -323,6 +480,7 @@ nbd_unlocked_aio_pread_structured (struct nbd_handle *h, void *buf,
 {
   struct command_cb cb = { .fn.chunk = *chunk,
                            .completion = *completion };
+  int64_t cookie;
 
   if (h->strict & LIBNBD_STRICT_COMMANDS) {
     if ((flags & LIBNBD_CMD_FLAG_DF) != 0 &&
@@ -334,8 +492,11 @@ nbd_unlocked_aio_pread_structured (struct nbd_handle *h, void *buf,
 
   SET_CALLBACK_TO_NULL (*chunk);
   SET_CALLBACK_TO_NULL (*completion);
-  return nbd_internal_command_common (h, flags, NBD_CMD_READ, offset, count,
-                                      EINVAL, buf, &cb);
+  cookie = nbd_internal_command_common (h, flags, NBD_CMD_READ, offset, count,
+                                        EINVAL, buf, &cb);
+  if (cookie != -1 && h->readahead_max > 0)
+    nbd_internal_readahead (h, count, offset);
+  return cookie;
 }
 
 int64_t
@@ -364,6 +525,33 @@ nbd_unlocked_aio_pwrite (struct nbd_handle *h, const void *buf,
                                       ENOSPC, (void *) buf, &cb);
 }
 
+int64_t
+nbd_unlocked_aio_pwritev (struct nbd_handle *h,
+                          const struct iovec *iov, size_t iovcnt,
+                          uint64_t offset,
+                          nbd_completion_callback *completion,
+                          uint32_t flags)
+{
+  struct command_cb cb = { .completion = *completion };
+
+  if (h->strict & LIBNBD_STRICT_COMMANDS) {
+    if (nbd_unlocked_is_read_only (h) == 1) {
+      set_error (EPERM, "server does not support write operations");
+      return -1;
+    }
+
+    if ((flags & LIBNBD_CMD_FLAG_FUA) != 0 &&
+        nbd_unlocked_can_fua (h) != 1) {
+      set_error (EINVAL, "server does not support the FUA flag");
+      return -1;
+    }
+  }
+
+  SET_CALLBACK_TO_NULL (*completion);
+  return nbd_internal_command_common_iov (h, flags, NBD_CMD_WRITE, offset,
+                                          ENOSPC, iov, iovcnt, &cb);
+}
+
 int64_t
 nbd_unlocked_aio_flush (struct nbd_handle *h,
                         nbd_completion_callback *completion,
@@ -473,6 +661,86 @@ nbd_unlocked_aio_zero (struct nbd_handle *h,
                                       count, ENOSPC, NULL, &cb);
 }
 
+/* Internally, block status replies are always delivered as 64 bit
+ * extents.  The older 32 bit API wraps the user's callback in this
+ * shim, which converts the entries to the layout it expects.
+ */
+struct bs_shim {
+  nbd_extent_callback cb;
+};
+
+static int
+bs_shim_callback (void *user_data, const char *metacontext,
+                  uint64_t offset, nbd_extent *entries,
+                  size_t nr_entries, int *error)
+{
+  struct bs_shim *shim = user_data;
+  uint32_t *array;
+  size_t i;
+  int r;
+
+  assert (nr_entries > 0);
+  array = malloc (nr_entries * 2 * sizeof *array);
+  if (array == NULL) {
+    *error = errno;
+    return -1;
+  }
+
+  for (i = 0; i < nr_entries; ++i) {
+    /* Flags wider than 32 bits cannot be represented at all. */
+    if (entries[i].flags > UINT32_MAX) {
+      *error = EOVERFLOW;
+      free (array);
+      return -1;
+    }
+    array[i*2+1] = entries[i].flags;
+
+    /* Lengths can only exceed 32 bits if the server supports extended
+     * headers.  Clamp to a large aligned value, and truncate the list
+     * after this entry since the remaining offsets no longer line up.
+     */
+    if (entries[i].length > UINT32_MAX) {
+      array[i*2] = -MAX_REQUEST_SIZE;
+      nr_entries = i + 1;
+      break;
+    }
+    array[i*2] = entries[i].length;
+  }
+
+  r = CALL_CALLBACK (shim->cb, metacontext, offset, array, nr_entries * 2,
+                     error);
+  free (array);
+  return r;
+}
+
+static void
+bs_shim_free (void *user_data)
+{
+  struct bs_shim *shim = user_data;
+
+  FREE_CALLBACK (shim->cb);
+  free (shim);
+}
+
+/* Wrap the 32 bit callback extent in a shim, taking ownership of it. */
+static int
+bs_shim_wrap (nbd_extent_callback *extent, nbd_extent64_callback *extent64)
+{
+  struct bs_shim *shim;
+
+  shim = malloc (sizeof *shim);
+  if (shim == NULL) {
+    set_error (errno, "malloc");
+    return -1;
+  }
+  shim->cb = *extent;
+  SET_CALLBACK_TO_NULL (*extent);
+  extent64->callback = bs_shim_callback;
+  extent64->user_data = shim;
+  extent64->free = bs_shim_free;
+  return 0;
+}
+
 int64_t
 nbd_unlocked_aio_block_status (struct nbd_handle *h,
                                uint64_t count, uint64_t offset,
@@ -480,9 +748,22 @@ nbd_unlocked_aio_block_status (struct nbd_handle *h,
                                nbd_completion_callback *completion,
                                uint32_t flags)
 {
-  struct command_cb cb = { .fn.extent = *extent,
-                           .completion = *completion };
+  nbd_extent64_callback extent64;
+  int64_t cookie;
 
+  if (bs_shim_wrap (extent, &extent64) == -1)
+    return -1;
+  cookie = nbd_unlocked_aio_block_status_64 (h, count, offset, &extent64,
+                                             completion, flags);
+  /* If the command was not queued, we still own the shim. */
+  FREE_CALLBACK (extent64);
+  return cookie;
+}
+
+/* Checks made for block status commands, besides check_command. */
+static int
+check_block_status (struct nbd_handle *h)
+{
   if (h->strict & LIBNBD_STRICT_COMMANDS) {
     if (!h->structured_replies) {
       set_error (ENOTSUP, "server does not support structured replies");
@@ -496,8 +777,23 @@ nbd_unlocked_aio_block_status (struct nbd_handle *h,
       return -1;
     }
   }
+  return 0;
+}
 
-  SET_CALLBACK_TO_NULL (*extent);
+int64_t
+nbd_unlocked_aio_block_status_64 (struct nbd_handle *h,
+                                  uint64_t count, uint64_t offset,
+                                  nbd_extent64_callback *extent64,
+                                  nbd_completion_callback *completion,
+                                  uint32_t flags)
+{
+  struct command_cb cb = { .fn.extent = *extent64,
+                           .completion = *completion };
+
+  if (check_block_status (h) == -1)
+    return -1;
+
+  SET_CALLBACK_TO_NULL (*extent64);
   SET_CALLBACK_TO_NULL (*completion);
   return nbd_internal_command_common (h, flags, NBD_CMD_BLOCK_STATUS, offset,
                                       count, EINVAL, NULL, &cb);
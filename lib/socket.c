@@ -22,10 +22,17 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 
 #include "internal.h"
 
@@ -57,6 +64,24 @@ socket_send (struct nbd_handle *h,
   return r;
 }
 
+static ssize_t
+socket_sendv (struct nbd_handle *h, struct socket *sock,
+              const struct iovec *iov, size_t iovcnt, int flags)
+{
+  struct msghdr msg = {
+    .msg_iov = (struct iovec *) iov,
+    .msg_iovlen = iovcnt,
+  };
+  ssize_t r;
+
+  flags |= MSG_NOSIGNAL;
+
+  r = sendmsg (sock->u.fd, &msg, flags);
+  if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+    set_error (errno, "sendmsg");
+  return r;
+}
+
 static int
 socket_get_fd (struct socket *sock)
 {
@@ -84,6 +109,7 @@ socket_close (struct socket *sock)
 static struct socket_ops socket_ops = {
   .recv = socket_recv,
   .send = socket_send,
+  .sendv = socket_sendv,
   .get_fd = socket_get_fd,
   .shut_writes = socket_shut_writes,
   .close = socket_close,
@@ -103,3 +129,124 @@ nbd_internal_socket_create (int fd)
   sock->ops = &socket_ops;
   return sock;
 }
+
+/* Called when the handshake has finished.  If the application asked
+ * for zero-copy sends, try to enable them on the socket.  This only
+ * works for TCP, and is best effort.
+ */
+void
+nbd_internal_zerocopy_start (struct nbd_handle *h)
+{
+#ifdef SO_ZEROCOPY
+  int one = 1;
+
+  if (!h->zerocopy)
+    return;
+  if (h->tls_negotiated || h->uring_active) {
+    debug (h, "zero-copy send: not used with %s",
+           h->tls_negotiated ? "TLS" : "io_uring");
+    return;
+  }
+  if (setsockopt (h->sock->u.fd, SOL_SOCKET, SO_ZEROCOPY,
+                  &one, sizeof one) == -1) {
+    debug (h, "zero-copy send: setsockopt: SO_ZEROCOPY: %s",
+           strerror (errno));
+    return;
+  }
+  h->zerocopy_active = true;
+  h->zc_next = h->zc_done = 0;
+  debug (h, "zero-copy send: enabled");
+#endif
+}
+
+/* True if the kernel has released the payload of cmd. */
+bool
+nbd_internal_zerocopy_released (struct nbd_handle *h,
+                                const struct command *cmd)
+{
+  return (int32_t) (h->zc_done - cmd->zc_seq) > 0;
+}
+
+/* Read MSG_ZEROCOPY completion notifications from the socket error
+ * queue, and complete any commands in cmds_zc_wait which they
+ * release.  Returns the number of notifications, or -1 on error.
+ */
+int
+nbd_internal_zerocopy_reap (struct nbd_handle *h)
+{
+#ifdef SO_ZEROCOPY
+  char control[CMSG_SPACE (sizeof (struct sock_extended_err)) + 64];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct sock_extended_err *serr;
+  struct command **p, *cmd;
+  int n = 0;
+
+  if (!h->zerocopy_active || h->sock == NULL)
+    return 0;
+
+  for (;;) {
+    memset (&msg, 0, sizeof msg);
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    if (recvmsg (h->sock->u.fd, &msg, MSG_ERRQUEUE) == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      set_error (errno, "recvmsg: MSG_ERRQUEUE");
+      return -1;
+    }
+
+    for (cm = CMSG_FIRSTHDR (&msg); cm != NULL; cm = CMSG_NXTHDR (&msg, cm)) {
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+        continue;
+      serr = (struct sock_extended_err *) CMSG_DATA (cm);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+
+      /* Sends ee_info to ee_data (inclusive) have been released.  TCP
+       * frees its buffers in order, so we only need to track the
+       * highest number seen.
+       */
+      if ((int32_t) (serr->ee_data + 1 - h->zc_done) > 0)
+        h->zc_done = serr->ee_data + 1;
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        debug (h, "zero-copy send: kernel fell back to copying");
+      n++;
+    }
+  }
+
+  for (p = &h->cmds_zc_wait; (cmd = *p) != NULL; ) {
+    if (nbd_internal_zerocopy_released (h, cmd)) {
+      *p = cmd->next;
+      cmd->next = NULL;
+      nbd_internal_complete_command (h, cmd);
+    }
+    else
+      p = &cmd->next;
+  }
+  return n;
+#else
+  return 0;
+#endif
+}
+
+/* The connection is going away, so complete all commands which were
+ * waiting for the kernel to release their payload.  Once the socket
+ * is closed there is no error queue left to tell us when that
+ * happens, and the kernel may still read the pages for a while, as
+ * documented in nbd_set_zerocopy_send(3).
+ */
+void
+nbd_internal_zerocopy_release_all (struct nbd_handle *h)
+{
+  struct command *cmd;
+
+  while ((cmd = h->cmds_zc_wait) != NULL) {
+    h->cmds_zc_wait = cmd->next;
+    cmd->next = NULL;
+    nbd_internal_complete_command (h, cmd);
+  }
+}
@@ -0,0 +1,140 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Per command statistics.  These are always collected: each command
+ * reads the monotonic clock when it is queued, when its request has
+ * been sent and when its reply has been received, and the rest is a
+ * few additions under the handle lock which is already held.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+
+#include "internal.h"
+#include "ispowerof2.h"
+#include "minmax.h"
+
+uint64_t
+nbd_internal_stats_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C (1000000000) + ts.tv_nsec;
+}
+
+/* Map an NBD_CMD_* type to the LIBNBD_STATS_CMD_* index, or -1 for
+ * commands which are not counted.
+ */
+static int
+stats_index (uint16_t type)
+{
+  switch (type) {
+  case NBD_CMD_READ:         return LIBNBD_STATS_CMD_READ;
+  case NBD_CMD_WRITE:        return LIBNBD_STATS_CMD_WRITE;
+  case NBD_CMD_WRITE_ZEROES: return LIBNBD_STATS_CMD_ZERO;
+  case NBD_CMD_TRIM:         return LIBNBD_STATS_CMD_TRIM;
+  case NBD_CMD_FLUSH:        return LIBNBD_STATS_CMD_FLUSH;
+  case NBD_CMD_BLOCK_STATUS: return LIBNBD_STATS_CMD_BLOCK_STATUS;
+  case NBD_CMD_CACHE:        return LIBNBD_STATS_CMD_CACHE;
+  default:                   return -1;
+  }
+}
+
+static unsigned
+latency_bucket (uint64_t ns)
+{
+  uint64_t us = ns / 1000;
+
+  if (us == 0)
+    return 0;
+  us = MIN (us, UINT64_C (1) << (STATS_LATENCY_BUCKETS - 2));
+  return log_2_bits (us) + 1;
+}
+
+/* Called when the request for cmd has been sent in full, as it moves
+ * from cmds_to_issue to cmds_in_flight.
+ */
+void
+nbd_internal_stats_sent (struct nbd_handle *h, struct command *cmd)
+{
+  cmd->sent_ns = nbd_internal_stats_now ();
+  h->queue_ns += cmd->sent_ns - cmd->queued_ns;
+}
+
+/* Called when the whole reply to cmd has been received. */
+void
+nbd_internal_stats_reply (struct nbd_handle *h, const struct command *cmd)
+{
+  const int i = stats_index (cmd->type);
+  struct cmd_stats *stats;
+  uint64_t ns;
+
+  if (i == -1)
+    return;
+  stats = &h->cmd_stats[i];
+  ns = nbd_internal_stats_now () - cmd->sent_ns;
+  stats->commands++;
+  stats->latency_ns += ns;
+  stats->latency[latency_bucket (ns)]++;
+}
+
+int64_t
+nbd_unlocked_stats_commands (struct nbd_handle *h, int type)
+{
+  return h->cmd_stats[type].commands;
+}
+
+int64_t
+nbd_unlocked_stats_latency_ns (struct nbd_handle *h, int type)
+{
+  return h->cmd_stats[type].latency_ns;
+}
+
+int64_t
+nbd_unlocked_stats_latency_bucket (struct nbd_handle *h, int type,
+                                   unsigned bucket)
+{
+  if (bucket >= STATS_LATENCY_BUCKETS) {
+    set_error (EINVAL, "bucket must be less than %d",
+               STATS_LATENCY_BUCKETS);
+    return -1;
+  }
+  return h->cmd_stats[type].latency[bucket];
+}
+
+/* NB: may_set_error = false. */
+uint64_t
+nbd_unlocked_stats_queue_ns (struct nbd_handle *h)
+{
+  return h->queue_ns;
+}
+
+/* NB: may_set_error = false. */
+uint64_t
+nbd_unlocked_stats_in_flight_max (struct nbd_handle *h)
+{
+  return h->in_flight_max;
+}
@@ -0,0 +1,819 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Striped sets (see nbd_stripe_create(3)).
+ *
+ * The virtual disk is divided into stripes of stripe_size bytes,
+ * dealt out to the members in turn, as in RAID-0.  The stripes of a
+ * request which land on one member are contiguous on that member, so
+ * every request becomes one command per member: a vectored read or
+ * write whose buffers are the matching slices of the caller's buffer,
+ * or a zero, trim or block status over the member's range.  Only reads
+ * and writes with too many slices for one command are split further.
+ * Block status replies are mapped back to virtual offsets and merged
+ * into a single list for each meta context before the caller sees
+ * them.
+ *
+ * Like connection groups and replica sets, a striped set only uses
+ * the public API of its member handles, and keeps its own list of
+ * commands and cookies, using the helpers in lib/group.c.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#include "internal.h"
+#include "minmax.h"
+
+/* A member read or write is sent with its request header in the same
+ * sendmsg(2) call, so it can have at most IOV_MAX - 1 slices.  Larger
+ * ones are split into several commands on that member.
+ */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#define STRIPE_MAX_IOV (IOV_MAX - 1)
+
+/* Extents received from one member for one meta context. */
+struct stripe_extents {
+  struct stripe_extents *next;
+  char *context;
+  nbd_extent *entries;
+  size_t nr_entries;
+};
+
+struct stripe_sub {
+  struct stripe_command *cmd;
+  uint64_t offset;              /* Range on the member. */
+  uint64_t count;
+  size_t nr_stripes;
+  struct stripe_extents *extents;
+};
+
+struct stripe_command {
+  struct member_command mc;     /* Must be first. */
+  struct nbd_stripe *s;
+  uint64_t offset, count;       /* Virtual range. */
+  nbd_completion_callback cb;
+  nbd_extent64_callback extent; /* Block status only. */
+  unsigned refs;                /* Unfreed subcommands, + 1 until retired. */
+  unsigned pending;             /* Subcommands not yet completed. */
+  struct stripe_sub subs[];     /* One per member. */
+};
+
+struct nbd_stripe {
+  unsigned nr_members;
+  uint64_t stripe_size;
+  uint64_t size;                /* Size of the virtual disk. */
+  struct member_commands cmds;  /* Unretired commands. */
+  struct nbd_handle *members[];
+};
+
+/* Map a virtual offset to a member and the offset on that member.
+ * Sets *len to the bytes left in the stripe.
+ */
+static unsigned
+map_offset (const struct nbd_stripe *s, uint64_t offset,
+            uint64_t *moffset, uint64_t *len)
+{
+  const uint64_t stripe = offset / s->stripe_size;
+  const uint64_t within = offset % s->stripe_size;
+
+  *moffset = stripe / s->nr_members * s->stripe_size + within;
+  *len = s->stripe_size - within;
+  return stripe % s->nr_members;
+}
+
+/* Work out the range of each member covered by the virtual range of
+ * cmd, and return the number of stripes it touches.
+ */
+static size_t
+map_range (struct stripe_command *cmd)
+{
+  const struct nbd_stripe *s = cmd->s;
+  uint64_t offset = cmd->offset, end = cmd->offset + cmd->count;
+  uint64_t moffset, len;
+  unsigned m;
+  size_t n = 0;
+
+  while (offset < end) {
+    m = map_offset (s, offset, &moffset, &len);
+    if (len > end - offset)
+      len = end - offset;
+    if (cmd->subs[m].count == 0)
+      cmd->subs[m].offset = moffset;
+    cmd->subs[m].count += len;
+    cmd->subs[m].nr_stripes++;
+    offset += len;
+    n++;
+  }
+  return n;
+}
+
+static void
+free_extents (struct stripe_sub *sub)
+{
+  struct stripe_extents *e, *next;
+
+  for (e = sub->extents; e; e = next) {
+    next = e->next;
+    free (e->context);
+    free (e->entries);
+    free (e);
+  }
+  sub->extents = NULL;
+}
+
+static void
+command_unref (struct stripe_command *cmd)
+{
+  unsigned i;
+
+  if (--cmd->refs > 0)
+    return;
+  for (i = 0; i < cmd->s->nr_members; ++i)
+    free_extents (&cmd->subs[i]);
+  free (cmd);
+}
+
+static void
+retire_command (struct member_command *mc)
+{
+  struct stripe_command *cmd = (struct stripe_command *) mc;
+
+  nbd_internal_member_command_remove (&cmd->s->cmds, mc);
+  if (cmd->extent.free)
+    cmd->extent.free (cmd->extent.user_data);
+  if (cmd->cb.free)
+    cmd->cb.free (cmd->cb.user_data);
+  command_unref (cmd);
+}
+
+static struct stripe_extents *
+find_extents (struct stripe_sub *sub, const char *context)
+{
+  struct stripe_extents *e;
+
+  for (e = sub->extents; e; e = e->next)
+    if (strcmp (e->context, context) == 0)
+      return e;
+  return NULL;
+}
+
+static int
+append_extent (nbd_extent **entries, size_t *nr, size_t *alloc,
+               uint64_t length, uint64_t flags)
+{
+  nbd_extent *p;
+
+  if (*nr > 0 && (*entries)[*nr - 1].flags == flags) {
+    (*entries)[*nr - 1].length += length;
+    return 0;
+  }
+  if (*nr == *alloc) {
+    *alloc = *alloc ? *alloc * 2 : 16;
+    p = realloc (*entries, *alloc * sizeof *p);
+    if (p == NULL)
+      return -1;
+    *entries = p;
+  }
+  (*entries)[*nr].length = length;
+  (*entries)[*nr].flags = flags;
+  (*nr)++;
+  return 0;
+}
+
+/* Walk the virtual range in order, taking each stripe from the
+ * extents its member returned for this context.  The merged list
+ * stops early if a member described less than it was asked about.
+ */
+static int
+merge_extents (struct stripe_command *cmd, const char *context)
+{
+  const struct nbd_stripe *s = cmd->s;
+  const unsigned n = s->nr_members;
+  size_t idx[n];
+  uint64_t used[n];
+  uint64_t offset = cmd->offset, end = cmd->offset + cmd->count;
+  uint64_t moffset, len, take;
+  nbd_extent *entries = NULL;
+  size_t nr = 0, alloc = 0;
+  struct stripe_extents *e;
+  unsigned m;
+  int error = 0;
+
+  memset (idx, 0, sizeof idx);
+  memset (used, 0, sizeof used);
+
+  while (offset < end) {
+    m = map_offset (s, offset, &moffset, &len);
+    if (len > end - offset)
+      len = end - offset;
+    e = find_extents (&cmd->subs[m], context);
+    while (len > 0) {
+      if (e == NULL || idx[m] >= e->nr_entries)
+        goto out;
+      take = e->entries[idx[m]].length - used[m];
+      if (take > len)
+        take = len;
+      if (append_extent (&entries, &nr, &alloc,
+                         take, e->entries[idx[m]].flags) == -1) {
+        free (entries);
+        return ENOMEM;
+      }
+      used[m] += take;
+      if (used[m] == e->entries[idx[m]].length) {
+        idx[m]++;
+        used[m] = 0;
+      }
+      len -= take;
+      offset += take;
+    }
+  }
+
+ out:
+  if (nr > 0 &&
+      cmd->extent.callback (cmd->extent.user_data, context, cmd->offset,
+                            entries, nr, &error) == -1 &&
+      error == 0)
+    error = EPROTO;
+  free (entries);
+  return error;
+}
+
+static void
+complete_command (struct stripe_command *cmd)
+{
+  struct nbd_stripe *s = cmd->s;
+  struct stripe_extents *e;
+  struct stripe_sub *first;
+  uint64_t moffset, len;
+  int error = cmd->mc.error;
+  int r;
+
+  /* Every member was asked for the same contexts, so the contexts
+   * returned for the first stripe are the ones to report.
+   */
+  if (error == 0 && cmd->extent.callback) {
+    first = &cmd->subs[map_offset (s, cmd->offset, &moffset, &len)];
+    for (e = first->extents; e; e = e->next) {
+      r = merge_extents (cmd, e->context);
+      if (r != 0 && error == 0)
+        error = r;
+    }
+  }
+  nbd_internal_member_command_done (&s->cmds, &cmd->mc, error);
+
+  if (cmd->cb.callback &&
+      cmd->cb.callback (cmd->cb.user_data, &error) == 1)
+    retire_command (&cmd->mc);
+}
+
+static int
+sub_callback (void *user_data, int *error)
+{
+  struct stripe_sub *sub = user_data;
+  struct stripe_command *cmd = sub->cmd;
+
+  if (*error && cmd->mc.error == 0)
+    cmd->mc.error = *error;
+  if (--cmd->pending == 0)
+    complete_command (cmd);
+  return 1;
+}
+
+/* Called exactly once per subcommand by libnbd, even if the
+ * subcommand could not be issued.
+ */
+static void
+sub_free (void *user_data)
+{
+  struct stripe_sub *sub = user_data;
+
+  command_unref (sub->cmd);
+}
+
+static int
+sub_extent (void *user_data, const char *metacontext, uint64_t offset,
+            nbd_extent *entries, size_t nr_entries, int *error)
+{
+  struct stripe_sub *sub = user_data;
+  struct stripe_extents *e;
+  nbd_extent *p;
+
+  if (offset != sub->offset) {
+    *error = EPROTO;
+    return -1;
+  }
+
+  e = find_extents (sub, metacontext);
+  if (e == NULL) {
+    e = calloc (1, sizeof *e);
+    if (e == NULL || (e->context = strdup (metacontext)) == NULL) {
+      free (e);
+      *error = ENOMEM;
+      return -1;
+    }
+    e->next = sub->extents;
+    sub->extents = e;
+  }
+  p = realloc (e->entries, (e->nr_entries + nr_entries) * sizeof *p);
+  if (p == NULL) {
+    *error = ENOMEM;
+    return -1;
+  }
+  memcpy (&p[e->nr_entries], entries, nr_entries * sizeof *p);
+  e->entries = p;
+  e->nr_entries += nr_entries;
+  return 0;
+}
+
+static struct stripe_command *
+new_command (struct nbd_stripe *s, uint64_t count, uint64_t offset,
+             nbd_completion_callback *cb)
+{
+  struct stripe_command *cmd;
+  unsigned i;
+
+  if (count == 0) {
+    set_error (EINVAL, "count cannot be 0");
+    goto err;
+  }
+  if (offset > s->size || count > s->size - offset) {
+    set_error (EINVAL, "request out of bounds");
+    goto err;
+  }
+
+  cmd = calloc (1, sizeof *cmd + s->nr_members * sizeof cmd->subs[0]);
+  if (cmd == NULL) {
+    set_error (errno, "calloc");
+    goto err;
+  }
+  cmd->s = s;
+  cmd->offset = offset;
+  cmd->count = count;
+  cmd->cb = *cb;
+  cmd->refs = 1;
+  for (i = 0; i < s->nr_members; ++i)
+    cmd->subs[i].cmd = cmd;
+  return cmd;
+
+ err:
+  if (cb->free)
+    cb->free (cb->user_data);
+  return NULL;
+}
+
+/* Account for a subcommand about to be issued. */
+static nbd_completion_callback
+start_sub (struct stripe_sub *sub)
+{
+  sub->cmd->refs++;
+  sub->cmd->pending++;
+  return (nbd_completion_callback) {
+    .callback = sub_callback,
+    .user_data = sub,
+    .free = sub_free,
+  };
+}
+
+/* Called after trying to issue the subcommands.  nr_issued is how many
+ * were accepted by the members.  If none were, the command fails
+ * straight away.  Otherwise it completes, perhaps with an error, once
+ * those have completed.
+ */
+static int64_t
+finish_command (struct stripe_command *cmd, unsigned nr_issued)
+{
+  struct nbd_stripe *s = cmd->s;
+  int64_t cookie;
+
+  if (nr_issued == 0) {
+    if (cmd->extent.free)
+      cmd->extent.free (cmd->extent.user_data);
+    if (cmd->cb.free)
+      cmd->cb.free (cmd->cb.user_data);
+    command_unref (cmd);
+    return -1;
+  }
+
+  cookie = nbd_internal_member_command_add (&s->cmds, &cmd->mc);
+
+  /* Release the hold taken in issue_sub's callers. */
+  if (--cmd->pending == 0)
+    complete_command (cmd);
+  return cookie;
+}
+
+/* Record a failure to issue one subcommand.  The libnbd wrapper has
+ * already freed its callback, which dropped the reference.
+ */
+static void
+sub_failed (struct stripe_sub *sub)
+{
+  struct stripe_command *cmd = sub->cmd;
+
+  cmd->pending--;
+  if (cmd->mc.error == 0)
+    cmd->mc.error = nbd_get_errno ();
+  if (cmd->mc.error == 0)
+    cmd->mc.error = EIO;
+}
+
+static int64_t
+aio_rw (struct nbd_stripe *s, bool write, void *buf, size_t count,
+        uint64_t offset, nbd_completion_callback *cb, uint32_t flags)
+{
+  const unsigned n = s->nr_members;
+  struct stripe_command *cmd;
+  struct iovec *iov, *v;
+  size_t first[n], nr_iov[n];
+  uint64_t pos, end, moffset, len;
+  size_t nr_stripes, i, j, k;
+  unsigned m, nr_issued = 0;
+  int64_t r;
+
+  cmd = new_command (s, count, offset, cb);
+  if (cmd == NULL)
+    return -1;
+  nr_stripes = map_range (cmd);
+
+  /* Each member's slices of buf, in member order, then stripe order. */
+  iov = malloc (nr_stripes * sizeof *iov);
+  if (iov == NULL) {
+    set_error (errno, "malloc");
+    return finish_command (cmd, 0);
+  }
+  memset (nr_iov, 0, sizeof nr_iov);
+  for (m = 0, i = 0; m < n; ++m) {
+    first[m] = i;
+    i += cmd->subs[m].nr_stripes;
+  }
+  end = offset + count;
+  for (pos = offset; pos < end; pos += len) {
+    m = map_offset (s, pos, &moffset, &len);
+    if (len > end - pos)
+      len = end - pos;
+    iov[first[m] + nr_iov[m]].iov_base = (char *) buf + (pos - offset);
+    iov[first[m] + nr_iov[m]].iov_len = len;
+    nr_iov[m]++;
+  }
+
+  cmd->pending++;               /* Hold until all are issued. */
+  for (m = 0; m < n; ++m) {
+    moffset = cmd->subs[m].offset;
+    for (i = 0; i < nr_iov[m]; i += k) {
+      v = &iov[first[m] + i];
+      k = MIN (nr_iov[m] - i, (size_t) STRIPE_MAX_IOV);
+      if (write)
+        r = nbd_aio_pwritev (s->members[m], v, k, moffset,
+                             start_sub (&cmd->subs[m]), flags);
+      else
+        r = nbd_aio_preadv (s->members[m], v, k, moffset,
+                            start_sub (&cmd->subs[m]), flags);
+      if (r == -1)
+        sub_failed (&cmd->subs[m]);
+      else
+        nr_issued++;
+      for (j = 0; j < k; ++j)
+        moffset += v[j].iov_len;
+    }
+  }
+  free (iov);
+  return finish_command (cmd, nr_issued);
+}
+
+struct nbd_stripe *
+nbd_stripe_create (unsigned members, uint64_t stripe_size,
+                   nbd_stripe_connect_callback connect, void *user_data)
+{
+  struct nbd_stripe *s;
+  int64_t size, min_size = INT64_MAX;
+  unsigned i;
+
+  nbd_internal_set_error_context ("nbd_stripe_create");
+
+  if (members == 0 || members > 64) {
+    set_error (EINVAL, "members must be between 1 and 64");
+    return NULL;
+  }
+  if (stripe_size == 0 || stripe_size % 512 != 0 ||
+      stripe_size > MAX_REQUEST_SIZE) {
+    set_error (EINVAL, "stripe size must be a multiple of 512 "
+               "no larger than %d", MAX_REQUEST_SIZE);
+    return NULL;
+  }
+  if (connect == NULL) {
+    set_error (EFAULT, "connect callback must not be NULL");
+    return NULL;
+  }
+
+  s = calloc (1, sizeof *s + members * sizeof s->members[0]);
+  if (s == NULL) {
+    set_error (errno, "calloc");
+    return NULL;
+  }
+  s->stripe_size = stripe_size;
+
+  for (i = 0; i < members; ++i) {
+    s->members[i] = nbd_create ();
+    if (s->members[i] == NULL)
+      goto err;
+    s->nr_members = i + 1;
+    if (connect (user_data, s->members[i], i) == -1)
+      goto err;
+    nbd_internal_set_error_context ("nbd_stripe_create");
+    if (!nbd_aio_is_ready (s->members[i])) {
+      set_error (EINVAL, "connect callback did not leave member %u "
+                 "in the ready state", i);
+      goto err;
+    }
+    size = nbd_get_size (s->members[i]);
+    if (size == -1)
+      goto err;
+    if (size < min_size)
+      min_size = size;
+  }
+
+  /* Only whole stripes are used, and the same number on each member. */
+  s->size = (uint64_t) min_size / stripe_size * stripe_size * members;
+  if (s->size == 0) {
+    nbd_internal_set_error_context ("nbd_stripe_create");
+    set_error (EINVAL, "a member is smaller than the stripe size");
+    goto err;
+  }
+
+  return s;
+
+ err:
+  nbd_stripe_close (s);
+  return NULL;
+}
+
+void
+nbd_stripe_close (struct nbd_stripe *s)
+{
+  struct stripe_command *cmd, *next;
+  unsigned i;
+
+  if (s == NULL)
+    return;
+
+  /* Closing the handles frees every subcommand still in flight. */
+  for (i = 0; i < s->nr_members; ++i)
+    nbd_close (s->members[i]);
+  for (cmd = (struct stripe_command *) s->cmds.head; cmd; cmd = next) {
+    next = (struct stripe_command *) cmd->mc.next;
+    if (cmd->extent.free)
+      cmd->extent.free (cmd->extent.user_data);
+    if (cmd->cb.free)
+      cmd->cb.free (cmd->cb.user_data);
+    command_unref (cmd);
+  }
+  free (s);
+}
+
+unsigned
+nbd_stripe_get_size (struct nbd_stripe *s)
+{
+  return s->nr_members;
+}
+
+struct nbd_handle *
+nbd_stripe_get_handle (struct nbd_stripe *s, unsigned i)
+{
+  nbd_internal_set_error_context ("nbd_stripe_get_handle");
+
+  if (i >= s->nr_members) {
+    set_error (EINVAL, "member index %u out of range", i);
+    return NULL;
+  }
+  return s->members[i];
+}
+
+uint64_t
+nbd_stripe_get_stripe_size (struct nbd_stripe *s)
+{
+  return s->stripe_size;
+}
+
+int64_t
+nbd_stripe_get_export_size (struct nbd_stripe *s)
+{
+  return s->size;
+}
+
+int64_t
+nbd_stripe_aio_pread (struct nbd_stripe *s, void *buf, size_t count,
+                      uint64_t offset,
+                      nbd_completion_callback completion_callback,
+                      uint32_t flags)
+{
+  nbd_internal_set_error_context ("nbd_stripe_aio_pread");
+  return aio_rw (s, false, buf, count, offset, &completion_callback, flags);
+}
+
+int64_t
+nbd_stripe_aio_pwrite (struct nbd_stripe *s, const void *buf, size_t count,
+                       uint64_t offset,
+                       nbd_completion_callback completion_callback,
+                       uint32_t flags)
+{
+  nbd_internal_set_error_context ("nbd_stripe_aio_pwrite");
+  return aio_rw (s, true, (void *) buf, count, offset,
+                 &completion_callback, flags);
+}
+
+/* Each member only persists its own writes, so flush goes to all. */
+int64_t
+nbd_stripe_aio_flush (struct nbd_stripe *s,
+                      nbd_completion_callback completion_callback,
+                      uint32_t flags)
+{
+  struct stripe_command *cmd;
+  unsigned m, nr_issued = 0;
+
+  nbd_internal_set_error_context ("nbd_stripe_aio_flush");
+
+  cmd = new_command (s, s->size, 0, &completion_callback);
+  if (cmd == NULL)
+    return -1;
+
+  cmd->pending++;
+  for (m = 0; m < s->nr_members; ++m) {
+    if (nbd_aio_flush (s->members[m], start_sub (&cmd->subs[m]),
+                       flags) == -1)
+      sub_failed (&cmd->subs[m]);
+    else
+      nr_issued++;
+  }
+  return finish_command (cmd, nr_issued);
+}
+
+static int64_t
+aio_range (struct nbd_stripe *s, int type, uint64_t count, uint64_t offset,
+           nbd_extent64_callback *extent, nbd_completion_callback *cb,
+           uint32_t flags)
+{
+  struct stripe_command *cmd;
+  uint64_t moffset, len;
+  unsigned m, nr_issued = 0;
+  int64_t r;
+
+  /* With REQ_ONE only the first extent matters, which lies within
+   * the first stripe, so only ask its member.
+   */
+  if (type == NBD_CMD_BLOCK_STATUS && (flags & LIBNBD_CMD_FLAG_REQ_ONE)) {
+    map_offset (s, offset, &moffset, &len);
+    if (count > len)
+      count = len;
+  }
+
+  cmd = new_command (s, count, offset, cb);
+  if (cmd == NULL) {
+    if (extent && extent->free)
+      extent->free (extent->user_data);
+    return -1;
+  }
+  if (extent)
+    cmd->extent = *extent;
+  map_range (cmd);
+
+  cmd->pending++;
+  for (m = 0; m < s->nr_members; ++m) {
+    struct stripe_sub *sub = &cmd->subs[m];
+
+    if (sub->count == 0)
+      continue;
+    switch (type) {
+    case NBD_CMD_TRIM:
+      r = nbd_aio_trim (s->members[m], sub->count, sub->offset,
+                        start_sub (sub), flags);
+      break;
+    case NBD_CMD_WRITE_ZEROES:
+      r = nbd_aio_zero (s->members[m], sub->count, sub->offset,
+                        start_sub (sub), flags);
+      break;
+    case NBD_CMD_BLOCK_STATUS:
+      r = nbd_aio_block_status_64 (s->members[m], sub->count, sub->offset,
+                                   (nbd_extent64_callback) {
+                                     .callback = sub_extent,
+                                     .user_data = sub,
+                                   },
+                                   start_sub (sub), flags);
+      break;
+    default:
+      abort ();
+    }
+    if (r == -1)
+      sub_failed (sub);
+    else
+      nr_issued++;
+  }
+  return finish_command (cmd, nr_issued);
+}
+
+int64_t
+nbd_stripe_aio_trim (struct nbd_stripe *s, uint64_t count, uint64_t offset,
+                     nbd_completion_callback completion_callback,
+                     uint32_t flags)
+{
+  nbd_internal_set_error_context ("nbd_stripe_aio_trim");
+  return aio_range (s, NBD_CMD_TRIM, count, offset, NULL,
+                    &completion_callback, flags);
+}
+
+int64_t
+nbd_stripe_aio_zero (struct nbd_stripe *s, uint64_t count, uint64_t offset,
+                     nbd_completion_callback completion_callback,
+                     uint32_t flags)
+{
+  nbd_internal_set_error_context ("nbd_stripe_aio_zero");
+  return aio_range (s, NBD_CMD_WRITE_ZEROES, count, offset, NULL,
+                    &completion_callback, flags);
+}
+
+int64_t
+nbd_stripe_aio_block_status (struct nbd_stripe *s,
+                             uint64_t count, uint64_t offset,
+                             nbd_extent64_callback extent64_callback,
+                             nbd_completion_callback completion_callback,
+                             uint32_t flags)
+{
+  nbd_internal_set_error_context ("nbd_stripe_aio_block_status");
+  if (extent64_callback.callback == NULL) {
+    set_error (EFAULT, "extent64 callback must not be NULL");
+    if (extent64_callback.free)
+      extent64_callback.free (extent64_callback.user_data);
+    if (completion_callback.free)
+      completion_callback.free (completion_callback.user_data);
+    return -1;
+  }
+  return aio_range (s, NBD_CMD_BLOCK_STATUS, count, offset,
+                    &extent64_callback, &completion_callback, flags);
+}
+
+int
+nbd_stripe_aio_command_completed (struct nbd_stripe *s, int64_t cookie)
+{
+  nbd_internal_set_error_context ("nbd_stripe_aio_command_completed");
+  return nbd_internal_member_command_completed (&s->cmds, cookie,
+                                                retire_command,
+                                                "command failed on a member");
+}
+
+int64_t
+nbd_stripe_aio_peek_command_completed (struct nbd_stripe *s)
+{
+  nbd_internal_set_error_context ("nbd_stripe_aio_peek_command_completed");
+  return nbd_internal_member_command_peek (&s->cmds);
+}
+
+int
+nbd_stripe_aio_in_flight (struct nbd_stripe *s)
+{
+  return s->cmds.in_flight;
+}
+
+/* As nbd_group_poll. */
+int
+nbd_stripe_poll (struct nbd_stripe *s, int timeout)
+{
+  return nbd_internal_poll_members (s->members, s->nr_members, timeout,
+                                    "nbd_stripe_poll", "member");
+}
+
+int
+nbd_stripe_shutdown (struct nbd_stripe *s, uint32_t flags)
+{
+  unsigned i;
+
+  for (i = 0; i < s->nr_members; ++i) {
+    if (nbd_shutdown (s->members[i], flags) == -1)
+      return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,594 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* io_uring transport (see nbd_set_uring).
+ *
+ * Once the handshake has finished, the plain socket is wrapped by a
+ * socket whose send and recv operations never make system calls
+ * themselves.  Sends are copied into a staging buffer which is
+ * written to the socket by a single SEND operation at a time, and
+ * there is always a RECV operation posted into the receive buffer.
+ * Both are submitted, and their completions collected, by one
+ * io_uring_enter(2) call in nbd_poll.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+
+#ifdef HAVE_LIBURING
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <liburing.h>
+#endif
+
+#include "internal.h"
+#include "minmax.h"
+
+int
+nbd_unlocked_set_uring (struct nbd_handle *h, bool enable)
+{
+#ifdef HAVE_LIBURING
+  h->uring = enable;
+  return 0;
+#else
+  if (enable) {
+    set_error (ENOTSUP, "libnbd was compiled without io_uring support");
+    return -1;
+  }
+  return 0;
+#endif
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_uring (struct nbd_handle *h)
+{
+  return h->uring;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_uring_active (struct nbd_handle *h)
+{
+  return h->uring_active;
+}
+
+#ifdef HAVE_LIBURING
+
+/* At most one RECV, one SEND and a cancel for each are outstanding. */
+#define URING_ENTRIES 4
+
+/* Size of each of the receive and send buffers. */
+#define URING_BUFFER_SIZE (256 * 1024)
+
+/* user_data of each kind of operation. */
+#define TAG_RECV   ((void *) 1)
+#define TAG_SEND   ((void *) 2)
+#define TAG_CANCEL ((void *) 3)
+
+struct uring {
+  struct io_uring ring;
+  struct socket *oldsock;       /* The plain socket. */
+  int fd;                       /* Its file descriptor. */
+  int efd;                      /* eventfd, or -1 until nbd_aio_get_fd. */
+  bool fixed;                   /* rbuf is a registered buffer. */
+  bool deferred;                /* Leave new operations for wait. */
+  int error;                    /* Sticky errno from a failed operation. */
+  bool eof;
+
+  /* Received data is rbuf[rstart .. rstart+rlen-1].  While a RECV is
+   * posted the kernel owns the rest of the buffer.
+   */
+  char *rbuf;
+  size_t rstart, rlen;
+  bool recv_posted;
+
+  /* Data to send is sbuf[sstart .. sstart+slen-1].  The first
+   * sposted bytes of it belong to a posted SEND.
+   */
+  char *sbuf;
+  size_t sstart, slen, sposted;
+  bool send_done;               /* A SEND completed since notify_write. */
+};
+
+static struct io_uring_sqe *
+get_sqe (struct uring *u)
+{
+  struct io_uring_sqe *sqe = io_uring_get_sqe (&u->ring);
+
+  /* The ring is sized so that this cannot fail. */
+  assert (sqe != NULL);
+  return sqe;
+}
+
+/* Post a RECV into the free space after any buffered data. */
+static void
+post_recv (struct uring *u)
+{
+  struct io_uring_sqe *sqe;
+  size_t start;
+
+  if (u->recv_posted || u->eof || u->error)
+    return;
+
+  if (u->rlen == 0)
+    u->rstart = 0;
+  else if (u->rstart + u->rlen > URING_BUFFER_SIZE * 3 / 4) {
+    memmove (u->rbuf, &u->rbuf[u->rstart], u->rlen);
+    u->rstart = 0;
+  }
+  start = u->rstart + u->rlen;
+  if (start == URING_BUFFER_SIZE)
+    return;
+
+  sqe = get_sqe (u);
+  if (u->fixed)
+    io_uring_prep_read_fixed (sqe, u->fd, &u->rbuf[start],
+                              URING_BUFFER_SIZE - start, 0, 0);
+  else
+    io_uring_prep_recv (sqe, u->fd, &u->rbuf[start],
+                        URING_BUFFER_SIZE - start, 0);
+  io_uring_sqe_set_data (sqe, TAG_RECV);
+  u->recv_posted = true;
+}
+
+/* Post a SEND of everything staged, unless one is already posted. */
+static void
+post_send (struct uring *u)
+{
+  struct io_uring_sqe *sqe;
+
+  if (u->sposted > 0 || u->slen == 0 || u->error)
+    return;
+
+  sqe = get_sqe (u);
+  /* We don't want to die from SIGPIPE, see lib/socket.c. */
+  io_uring_prep_send (sqe, u->fd, &u->sbuf[u->sstart], u->slen,
+                      MSG_NOSIGNAL);
+  io_uring_sqe_set_data (sqe, TAG_SEND);
+  u->sposted = u->slen;
+}
+
+/* Bytes which can be appended to the staged data. */
+static size_t
+send_space (struct uring *u)
+{
+  if (u->sposted == 0 && u->sstart > 0) {
+    memmove (u->sbuf, &u->sbuf[u->sstart], u->slen);
+    u->sstart = 0;
+  }
+  return URING_BUFFER_SIZE - u->sstart - u->slen;
+}
+
+static bool
+is_transient (int err)
+{
+  return err == EAGAIN || err == EWOULDBLOCK || err == EINTR ||
+    err == ECANCELED;
+}
+
+/* Collect completions without blocking.  Returns true if there were
+ * any.
+ */
+static bool
+reap (struct uring *u)
+{
+  struct io_uring_cqe *cqe;
+  unsigned head, n = 0;
+
+  io_uring_for_each_cqe (&u->ring, head, cqe) {
+    void *tag = io_uring_cqe_get_data (cqe);
+    int res = cqe->res;
+
+    n++;
+    if (tag == TAG_RECV) {
+      u->recv_posted = false;
+      if (res > 0)
+        u->rlen += res;
+      else if (res == 0)
+        u->eof = true;
+      else if (!is_transient (-res))
+        u->error = -res;
+    }
+    else if (tag == TAG_SEND) {
+      u->sposted = 0;
+      u->send_done = true;
+      if (res >= 0) {
+        u->sstart += res;
+        u->slen -= res;
+        if (u->slen == 0)
+          u->sstart = 0;
+      }
+      else if (!is_transient (-res))
+        u->error = -res;
+    }
+  }
+  io_uring_cq_advance (&u->ring, n);
+  return n > 0;
+}
+
+static int
+submit (struct nbd_handle *h, struct uring *u)
+{
+  int r;
+
+  while (io_uring_sq_ready (&u->ring) > 0) {
+    r = io_uring_submit (&u->ring);
+    if (r < 0 && r != -EINTR) {
+      set_error (-r, "io_uring_submit");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static ssize_t
+uring_recv (struct nbd_handle *h, struct socket *sock, void *buf, size_t len)
+{
+  struct uring *u = sock->u.uring;
+  size_t n;
+
+  if (u->rlen == 0)
+    reap (u);
+  if (u->rlen > 0) {
+    n = MIN (len, u->rlen);
+    memcpy (buf, &u->rbuf[u->rstart], n);
+    u->rstart += n;
+    u->rlen -= n;
+    return n;
+  }
+  if (u->error) {
+    set_error (u->error, "recv");
+    errno = u->error;
+    return -1;
+  }
+  if (u->eof)
+    return 0;
+
+  post_recv (u);
+  if (!u->deferred && submit (h, u) == -1)
+    return -1;
+  errno = EAGAIN;
+  return -1;
+}
+
+static ssize_t
+uring_sendv (struct nbd_handle *h, struct socket *sock,
+             const struct iovec *iov, size_t iovcnt, int flags)
+{
+  struct uring *u = sock->u.uring;
+  size_t i, n, space;
+  ssize_t done = 0;
+
+  reap (u);
+  if (u->error) {
+    set_error (u->error, "send");
+    errno = u->error;
+    return -1;
+  }
+
+  /* flags (MSG_MORE) can be ignored, since staged data is sent in
+   * large pieces anyway.
+   */
+  space = send_space (u);
+  for (i = 0; i < iovcnt && space > 0; ++i) {
+    n = MIN (iov[i].iov_len, space);
+    memcpy (&u->sbuf[u->sstart + u->slen], iov[i].iov_base, n);
+    u->slen += n;
+    space -= n;
+    done += n;
+  }
+  if (done == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  post_send (u);
+  if (!u->deferred && submit (h, u) == -1)
+    return -1;
+  return done;
+}
+
+static ssize_t
+uring_send (struct nbd_handle *h,
+            struct socket *sock, const void *buf, size_t len, int flags)
+{
+  struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+
+  return uring_sendv (h, sock, &iov, 1, flags);
+}
+
+static bool
+uring_pending (struct socket *sock)
+{
+  struct uring *u = sock->u.uring;
+
+  reap (u);
+  return u->rlen > 0 || u->eof || u->error;
+}
+
+/* Applications with their own main loop poll this for POLLIN. */
+static int
+uring_get_fd (struct socket *sock)
+{
+  struct uring *u = sock->u.uring;
+  int fd, r;
+
+  if (u->efd == -1) {
+    fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd == -1)
+      return -1;
+    r = io_uring_register_eventfd (&u->ring, fd);
+    if (r < 0) {
+      close (fd);
+      errno = -r;
+      return -1;
+    }
+    u->efd = fd;
+
+    /* Completions which arrived earlier did not signal it. */
+    if (io_uring_cq_ready (&u->ring) > 0)
+      eventfd_write (fd, 1);
+  }
+  return u->efd;
+}
+
+static bool
+uring_shut_writes (struct nbd_handle *h, struct socket *sock)
+{
+  struct uring *u = sock->u.uring;
+
+  /* Everything staged must reach the server first. */
+  reap (u);
+  if (u->slen > 0 && !u->error) {
+    post_send (u);
+    if (!u->deferred)
+      submit (h, u);
+    return false;
+  }
+  return u->oldsock->ops->shut_writes (h, u->oldsock);
+}
+
+/* Which notification, if any, lets the state machine make progress. */
+static enum external_event
+ready_event (struct nbd_handle *h, struct uring *u, bool *ready)
+{
+  unsigned dir = nbd_internal_aio_get_direction (get_next_state (h));
+
+  *ready = true;
+  if ((dir & LIBNBD_AIO_DIRECTION_READ) != 0 &&
+      (u->rlen > 0 || u->eof || u->error))
+    return notify_read;
+  if ((dir & LIBNBD_AIO_DIRECTION_WRITE) != 0 &&
+      (u->send_done || u->error))
+    return notify_write;
+  *ready = false;
+  return notify_read;
+}
+
+static int
+uring_wait (struct nbd_handle *h, struct socket *sock, int timeout)
+{
+  struct uring *u = sock->u.uring;
+  struct io_uring_cqe *cqe;
+  struct __kernel_timespec ts, *tsp = NULL;
+  enum external_event ev;
+  eventfd_t junk;
+  bool ready;
+  int r;
+
+  post_recv (u);
+  post_send (u);
+
+  /* Drain the eventfd before collecting completions, so that any
+   * completion arriving after reap signals it again.
+   */
+  if (u->efd >= 0)
+    eventfd_read (u->efd, &junk);
+
+  ready_event (h, u, &ready);
+  if (timeout != 0 && !ready && io_uring_cq_ready (&u->ring) == 0) {
+    if (timeout > 0) {
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000L;
+      tsp = &ts;
+    }
+    debug (h, "io_uring wait start");
+    r = io_uring_submit_and_wait_timeout (&u->ring, &cqe, 1, tsp, NULL);
+    debug (h, "io_uring wait end: r=%d", r);
+    if (r < 0 && r != -ETIME && r != -EINTR) {
+      set_error (-r, "io_uring_submit_and_wait_timeout");
+      return -1;
+    }
+  }
+  else if (submit (h, u) == -1)
+    return -1;
+
+  reap (u);
+  ev = ready_event (h, u, &ready);
+  if (!ready)
+    return 0;
+
+  /* Operations posted while the state machine runs are submitted
+   * together by the next call.
+   */
+  if (ev == notify_write)
+    u->send_done = false;
+  u->deferred = true;
+  r = nbd_internal_run (h, ev);
+  /* The DEAD and CLOSED states free the socket. */
+  if (h->sock == sock)
+    u->deferred = false;
+  if (r == -1)
+    return -1;
+  return 1;
+}
+
+static int
+uring_flush (struct nbd_handle *h, struct socket *sock)
+{
+  struct uring *u = sock->u.uring;
+
+  post_recv (u);
+  post_send (u);
+  return submit (h, u);
+}
+
+/* Cancel posted operations and wait for them to finish, since the
+ * kernel may still be using our buffers.
+ */
+static void
+cancel_all (struct uring *u)
+{
+  struct io_uring_sqe *sqe;
+
+  if (u->recv_posted) {
+    sqe = get_sqe (u);
+    io_uring_prep_cancel (sqe, TAG_RECV, 0);
+    io_uring_sqe_set_data (sqe, TAG_CANCEL);
+  }
+  if (u->sposted > 0) {
+    sqe = get_sqe (u);
+    io_uring_prep_cancel (sqe, TAG_SEND, 0);
+    io_uring_sqe_set_data (sqe, TAG_CANCEL);
+  }
+  while (u->recv_posted || u->sposted > 0) {
+    int r = io_uring_submit_and_wait (&u->ring, 1);
+
+    if (r < 0 && r != -EINTR)
+      break;
+    reap (u);
+  }
+}
+
+static int
+uring_close (struct socket *sock)
+{
+  struct uring *u = sock->u.uring;
+  int r;
+
+  cancel_all (u);
+  io_uring_queue_exit (&u->ring);
+  if (u->efd >= 0)
+    close (u->efd);
+  r = u->oldsock->ops->close (u->oldsock);
+  free (u->rbuf);
+  free (u->sbuf);
+  free (u);
+  free (sock);
+  return r;
+}
+
+static struct socket_ops uring_ops = {
+  .recv = uring_recv,
+  .send = uring_send,
+  .sendv = uring_sendv,
+  .pending = uring_pending,
+  .get_fd = uring_get_fd,
+  .shut_writes = uring_shut_writes,
+  .close = uring_close,
+  .wait = uring_wait,
+  .flush = uring_flush,
+};
+
+#endif /* HAVE_LIBURING */
+
+/* Called when the handshake has finished.  If the application asked
+ * for io_uring, switch the connection over to it.  This is best
+ * effort: on any failure we just carry on with the plain socket.
+ */
+void
+nbd_internal_uring_start (struct nbd_handle *h)
+{
+#ifdef HAVE_LIBURING
+  struct uring *u;
+  struct socket *sock;
+  struct iovec iov;
+  int flags, r;
+
+  if (!h->uring)
+    return;
+  if (h->tls_negotiated) {
+    debug (h, "io_uring: not used with TLS");
+    return;
+  }
+
+  u = calloc (1, sizeof *u);
+  sock = malloc (sizeof *sock);
+  if (u == NULL || sock == NULL)
+    goto err_malloc;
+  u->rbuf = malloc (URING_BUFFER_SIZE);
+  u->sbuf = malloc (URING_BUFFER_SIZE);
+  if (u->rbuf == NULL || u->sbuf == NULL)
+    goto err_malloc;
+
+  r = io_uring_queue_init (URING_ENTRIES, &u->ring, 0);
+  if (r < 0) {
+    debug (h, "io_uring: io_uring_queue_init: %s", strerror (-r));
+    goto err;
+  }
+
+  /* Registering the receive buffer saves the kernel mapping it on
+   * every read, but counts against RLIMIT_MEMLOCK, so it is optional.
+   */
+  iov.iov_base = u->rbuf;
+  iov.iov_len = URING_BUFFER_SIZE;
+  u->fixed = io_uring_register_buffers (&u->ring, &iov, 1) == 0;
+
+  /* The socket was made non-blocking for the handshake.  io_uring
+   * would then complete a RECV with no data with -EAGAIN instead of
+   * waiting for it.
+   */
+  u->fd = h->sock->ops->get_fd (h->sock);
+  flags = fcntl (u->fd, F_GETFL);
+  if (flags == -1 || fcntl (u->fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+    debug (h, "io_uring: fcntl: %s", strerror (errno));
+    io_uring_queue_exit (&u->ring);
+    goto err;
+  }
+
+  u->oldsock = h->sock;
+  u->efd = -1;
+  sock->u.uring = u;
+  sock->ops = &uring_ops;
+  h->sock = sock;
+  h->uring_active = true;
+  debug (h, "io_uring: enabled%s",
+         u->fixed ? " with registered buffers" : "");
+  return;
+
+ err_malloc:
+  debug (h, "io_uring: malloc: %s", strerror (errno));
+ err:
+  if (u) {
+    free (u->rbuf);
+    free (u->sbuf);
+  }
+  free (u);
+  free (sock);
+#endif
+}
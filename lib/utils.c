@@ -107,6 +107,21 @@ nbd_internal_set_argv (struct nbd_handle *h, char **argv)
   return 0;
 }
 
+/* Zero the buffers described by an iovec array.  Segments with a
+ * NULL buffer are skipped here, and rejected later by
+ * nbd_internal_command_common_iov.
+ */
+void
+nbd_internal_zero_iovec (const struct iovec *iov, size_t iovcnt)
+{
+  size_t i;
+
+  for (i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_base != NULL)
+      memset (iov[i].iov_base, 0, iov[i].iov_len);
+  }
+}
+
 /* Copy queries (defaulting to h->request_meta_contexts) into h->querylist.
  * Set an error on failure.
  */
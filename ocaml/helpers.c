@@ -133,6 +133,57 @@ nbd_internal_ocaml_alloc_int64_from_uint32_array (uint32_t *a, size_t len)
   CAMLreturn (rv);
 }
 
+value
+nbd_internal_ocaml_alloc_extent64_array (nbd_extent *a, size_t len)
+{
+  CAMLparam0 ();
+  CAMLlocal3 (s, v, rv);
+  size_t i;
+
+  rv = caml_alloc (len, 0);
+  for (i = 0; i < len; ++i) {
+    s = caml_alloc (2, 0);
+    v = caml_copy_int64 (a[i].length);
+    Store_field (s, 0, v);
+    v = caml_copy_int64 (a[i].flags);
+    Store_field (s, 1, v);
+    Store_field (rv, i, s);
+  }
+
+  CAMLreturn (rv);
+}
+
+/* Convert a list of NBD.Buffer.t to a newly allocated array of
+ * struct iovec.  The caller must free the array, but the buffers
+ * themselves are still owned by OCaml.
+ */
+struct iovec *
+nbd_internal_ocaml_iovec (value bufsv, size_t *iovcnt)
+{
+  CAMLparam1 (bufsv);
+  CAMLlocal1 (bv);
+  size_t i, len;
+  struct iovec *r;
+
+  bv = bufsv;
+  for (len = 0; bv != Val_emptylist; bv = Field (bv, 1))
+    len++;
+
+  r = malloc (sizeof (struct iovec) * (len > 0 ? len : 1));
+  if (r == NULL) caml_raise_out_of_memory ();
+
+  bv = bufsv;
+  for (i = 0; bv != Val_emptylist; bv = Field (bv, 1), i++) {
+    struct nbd_buffer *buf = NBD_buffer_val (Field (bv, 0));
+
+    r[i].iov_base = buf->data;
+    r[i].iov_len = buf->len;
+  }
+
+  *iovcnt = len;
+  CAMLreturnT (struct iovec *, r);
+}
+
 /* Convert a Unix.sockaddr to a C struct sockaddr. */
 void
 nbd_internal_unix_sockaddr_to_sa (value sockaddrv,
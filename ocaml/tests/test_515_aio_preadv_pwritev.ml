@@ -0,0 +1,49 @@
+(* hey emacs, this is OCaml code: -*- tuareg -*- *)
+(* libnbd OCaml test case
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *)
+
+let () =
+  let nbd = NBD.create () in
+  NBD.connect_command nbd ["nbdkit"; "-s"; "--exit-with-parent"; "-v";
+                           "memory"; "size=1M"];
+
+  (* Write from several segments, including an empty one. *)
+  let segs = [ Bytes.make 300 '\x55'; Bytes.make 212 '\xAA';
+               Bytes.empty; Bytes.init 512 (fun i -> Char.chr (i land 255)) ] in
+  let expected = Bytes.concat Bytes.empty segs in
+  let bufs = List.map NBD.Buffer.of_bytes segs in
+  let cookie = NBD.aio_pwritev nbd bufs 1000_L in
+  while not (NBD.aio_command_completed nbd cookie) do
+    ignore (NBD.poll nbd (-1))
+  done;
+
+  let buf = Bytes.create (Bytes.length expected) in
+  NBD.pread nbd buf 1000_L;
+  assert (buf = expected);
+
+  (* Read back into a different split. *)
+  let bufs = [ NBD.Buffer.alloc 1; NBD.Buffer.alloc 600;
+               NBD.Buffer.alloc 423 ] in
+  let cookie = NBD.aio_preadv nbd bufs 1000_L in
+  while not (NBD.aio_command_completed nbd cookie) do
+    ignore (NBD.poll nbd (-1))
+  done;
+  let got = Bytes.concat Bytes.empty (List.map NBD.Buffer.to_bytes bufs) in
+  assert (got = expected)
+
+let () = Gc.compact ()
@@ -137,6 +137,80 @@ nbd_internal_py_init_aio_buffer (PyObject *object)
   return 0;
 }
 
+/* Convert a sequence of buffer-like objects or nbd.Buffer into an
+ * array of struct iovec, as used by nbd_aio_preadv and
+ * nbd_aio_pwritev.  On success, *iov is a newly allocated array which
+ * the caller must free, and the return value is a tuple holding a
+ * memoryview for each element, which must be kept alive until the
+ * command completes.  On error, returns NULL with an exception set.
+ */
+PyObject *
+nbd_internal_py_get_aio_iovec (PyObject *object, int buffertype,
+                               struct iovec **iov, size_t *iovcnt)
+{
+  PyObject *seq, *views = NULL;
+  Py_ssize_t i, n;
+
+  *iov = NULL;
+  seq = PySequence_Fast (object, "aio_buffer: expecting a sequence of buffers");
+  if (!seq)
+    return NULL;
+
+  n = PySequence_Fast_GET_SIZE (seq);
+  views = PyTuple_New (n);
+  if (!views)
+    goto err;
+  *iov = malloc ((n > 0 ? n : 1) * sizeof **iov);
+  if (*iov == NULL) {
+    PyErr_NoMemory ();
+    goto err;
+  }
+
+  for (i = 0; i < n; ++i) {
+    PyObject *view;
+    Py_buffer *buf;
+
+    view = nbd_internal_py_get_aio_view (PySequence_Fast_GET_ITEM (seq, i),
+                                         buffertype);
+    if (!view)
+      goto err;
+    PyTuple_SET_ITEM (views, i, view);
+    buf = PyMemoryView_GET_BUFFER (view);
+    (*iov)[i].iov_base = buf->buf;
+    (*iov)[i].iov_len = buf->len;
+  }
+  *iovcnt = n;
+
+  Py_DECREF (seq);
+  return views;
+
+ err:
+  free (*iov);
+  *iov = NULL;
+  Py_XDECREF (views);
+  Py_DECREF (seq);
+  return NULL;
+}
+
+int
+nbd_internal_py_init_aio_iovec (PyObject *object)
+{
+  PyObject *seq;
+  Py_ssize_t i, n;
+  int r = 0;
+
+  seq = PySequence_Fast (object, "aio_buffer: expecting a sequence of buffers");
+  if (!seq)
+    return -1;
+
+  n = PySequence_Fast_GET_SIZE (seq);
+  for (i = 0; i < n && r == 0; ++i)
+    r = nbd_internal_py_init_aio_buffer (PySequence_Fast_GET_ITEM (seq, i));
+
+  Py_DECREF (seq);
+  return r;
+}
+
 /* Allocate an uninitialized persistent buffer used for nbd_aio_pread. */
 PyObject *
 nbd_internal_py_alloc_aio_buffer (PyObject *self, PyObject *args)
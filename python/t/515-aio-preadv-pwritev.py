@@ -0,0 +1,44 @@
+# libnbd Python bindings
+# Copyright Red Hat
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+import nbd
+
+h = nbd.NBD()
+h.connect_command(["nbdkit", "-s", "--exit-with-parent", "-v",
+                   "memory", "size=1M"])
+
+# Write from a mix of bytearray and nbd.Buffer segments, including
+# an empty one.
+seg1 = bytearray(b"\x55" * 300)
+seg2 = nbd.Buffer.from_bytearray(bytearray(b"\xAA" * 212))
+seg3 = bytearray()
+seg4 = bytearray(range(256)) * 2
+cookie = h.aio_pwritev([seg1, seg2, seg3, seg4], 1000)
+while not h.aio_command_completed(cookie):
+    h.poll(-1)
+
+expected = seg1 + seg2.to_bytearray() + seg4
+assert h.pread(len(expected), 1000) == expected
+
+# Read back into a different split.
+bufs = [nbd.Buffer(1), bytearray(600), nbd.Buffer(423)]
+cookie = h.aio_preadv(bufs, 1000)
+while not h.aio_command_completed(cookie):
+    h.poll(-1)
+
+got = bufs[0].to_bytearray() + bufs[1] + bufs[2].to_bytearray()
+assert got == expected
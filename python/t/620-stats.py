@@ -24,8 +24,14 @@
 cs0 = h.stats_chunks_sent()
 br0 = h.stats_bytes_received()
 cr0 = h.stats_chunks_received()
+sc0 = h.stats_send_calls()
+rc0 = h.stats_recv_calls()
 
+assert h.stats_queue_ns() == 0
+assert h.stats_in_flight_max() == 0
 assert bs0 == 0
+assert sc0 == 0
+assert rc0 == 0
 assert cs0 == 0
 assert br0 == 0
 assert cr0 == 0
@@ -39,26 +45,47 @@
 cs1 = h.stats_chunks_sent()
 br1 = h.stats_bytes_received()
 cr1 = h.stats_chunks_received()
+sc1 = h.stats_send_calls()
+rc1 = h.stats_recv_calls()
 
 assert cs1 > 0
+assert sc1 > 0
+assert rc1 > 0
 assert bs1 > cs1
 assert cr1 > 0
 assert br1 > cr1
 
 # A flush command should be one chunk out, one chunk back (even if
-# structured replies are in use)
+# structured replies are in use).  Extended headers, if nbdkit supports
+# them, make both the request and the reply 32 bytes.
+if h.get_extended_headers_negotiated():
+    req_size = reply_size = 32
+else:
+    req_size = 28
+    reply_size = 16   # assumes nbdkit uses simple reply
 h.flush()
 
 bs2 = h.stats_bytes_sent()
 cs2 = h.stats_chunks_sent()
 br2 = h.stats_bytes_received()
 cr2 = h.stats_chunks_received()
+sc2 = h.stats_send_calls()
 
-assert bs2 == bs1 + 28
+assert bs2 == bs1 + req_size
+assert sc2 == sc1 + 1
 assert cs2 == cs1 + 1
-assert br2 == br1 + 16   # assumes nbdkit uses simple reply
+assert br2 == br1 + reply_size
 assert cr2 == cr1 + 1
 
+# The flush is also counted by command type, in exactly one bucket
+assert h.stats_commands(nbd.STATS_CMD_FLUSH) == 1
+assert h.stats_commands(nbd.STATS_CMD_READ) == 0
+assert h.stats_latency_ns(nbd.STATS_CMD_FLUSH) > 0
+buckets = [h.stats_latency_bucket(nbd.STATS_CMD_FLUSH, i)
+           for i in range(nbd.STATS_LATENCY_BUCKETS)]
+assert sum(buckets) == 1
+assert h.stats_in_flight_max() == 1
+
 # Stats are still readable after the connection closes; we don't know if
 # the server sent reply bytes to our NBD_CMD_DISC, so don't insist on it.
 h.shutdown()
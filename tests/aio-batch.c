@@ -0,0 +1,145 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that commands queued while the state machine is busy are sent
+ * together.  We start a large write, and while it is still being
+ * sent queue a mix of small writes and flushes.  These cannot be
+ * issued until the large write has been sent, at which point they
+ * should go out in far fewer send calls than chunks.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <libnbd.h>
+
+#define SIZE (64 * 1024 * 1024)
+#define XSTR(s) #s
+#define STR(s) XSTR (s)
+
+#define BIG (32 * 1024 * 1024)
+#define NR_WRITES 16
+#define WRITE_SIZE 512
+
+static char big[BIG];
+static char wbuf[NR_WRITES][WRITE_SIZE];
+static char rbuf[NR_WRITES][WRITE_SIZE];
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                   "memory", "size=" STR (SIZE), NULL };
+  uint64_t calls, chunks, calls_before;
+  int64_t cookie;
+  int i;
+  bool started = false;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Start a large write.  It cannot all fit in the socket buffer, so
+   * this leaves the state machine part way through sending it.
+   */
+  if (nbd_aio_pwrite (nbd, big, BIG, 0, NBD_NULL_COMPLETION, 0) == -1) {
+    fprintf (stderr, "nbd_aio_pwrite: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  calls = nbd_stats_send_calls (nbd);
+  chunks = nbd_stats_chunks_sent (nbd);
+
+  /* Queue more commands behind the read. */
+  for (i = 0; i < NR_WRITES; ++i) {
+    memset (wbuf[i], 'a' + i, WRITE_SIZE);
+    if (nbd_aio_pwrite (nbd, wbuf[i], WRITE_SIZE,
+                        BIG + (uint64_t) i * 4096,
+                        NBD_NULL_COMPLETION, 0) == -1 ||
+        nbd_aio_flush (nbd, NBD_NULL_COMPLETION, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Only count send calls from the poll in which the queued commands
+   * start to be issued, which may also finish off the large write.
+   */
+  while (nbd_aio_in_flight (nbd) > 0) {
+    calls_before = nbd_stats_send_calls (nbd);
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "nbd_poll: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (!started && nbd_stats_chunks_sent (nbd) > chunks) {
+      started = true;
+      calls = calls_before;
+    }
+  }
+  while ((cookie = nbd_aio_peek_command_completed (nbd)) > 0) {
+    if (nbd_aio_command_completed (nbd, cookie) != 1) {
+      fprintf (stderr, "nbd_aio_command_completed: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  calls = nbd_stats_send_calls (nbd) - calls;
+  chunks = nbd_stats_chunks_sent (nbd) - chunks;
+  printf ("%" PRIu64 " chunks sent in %" PRIu64 " calls\n", chunks, calls);
+  if (chunks != NR_WRITES * 2) {
+    fprintf (stderr, "unexpected number of chunks sent\n");
+    exit (EXIT_FAILURE);
+  }
+  if (calls >= chunks) {
+    fprintf (stderr, "queued commands were not sent together\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Check the writes landed in the right place. */
+  for (i = 0; i < NR_WRITES; ++i) {
+    if (nbd_pread (nbd, rbuf[i], WRITE_SIZE, BIG + (uint64_t) i * 4096,
+                   0) == -1) {
+      fprintf (stderr, "nbd_pread: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (memcmp (rbuf[i], wbuf[i], WRITE_SIZE) != 0) {
+      fprintf (stderr, "data written at offset %d differs\n", BIG + i * 4096);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,320 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Issue many small nbd_aio_pread calls against a trivial in-process
+ * server, with and without the per-handle command cache (see
+ * nbd_set_command_cache_limit).  Using a server thread in the same
+ * process keeps the measurement focused on libnbd itself.
+ *
+ * By default this runs a quick pass as a correctness test.  Every
+ * read lands in a buffer which was dirtied first and is checked by
+ * its completion callback, so a recycled command which kept stale
+ * state from its previous use would be caught.  Halfway through, the
+ * cache is trimmed to one entry and allowed to grow again.  Set
+ * LIBNBD_BENCH=1 to run more requests and print timings.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <libnbd.h>
+
+#include "byte-swapping.h"
+
+#define SIZE (64 * 1024 * 1024)
+#define REQUEST_SIZE 4096
+#define DEPTH 64
+
+/* Just enough of the protocol for an oldstyle read-only server. */
+#define OLD_MAGIC    UINT64_C (0x4e42444d41474943)
+#define OLD_VERSION  UINT64_C (0x0000420281861253)
+#define REQUEST_MAGIC 0x25609513
+#define REPLY_MAGIC   0x67446698
+#define CMD_READ 0
+#define CMD_DISC 2
+
+struct request {
+  uint32_t magic;
+  uint16_t flags;
+  uint16_t type;
+  uint64_t handle;
+  uint64_t offset;
+  uint32_t count;
+} __attribute__ ((__packed__));
+
+struct reply {
+  uint32_t magic;
+  uint32_t error;
+  uint64_t handle;
+} __attribute__ ((__packed__));
+
+static int
+xread (int fd, void *buf, size_t n)
+{
+  char *p = buf;
+
+  while (n > 0) {
+    ssize_t r = read (fd, p, n);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    p += r;
+    n -= r;
+  }
+  return 0;
+}
+
+static int
+xwrite (int fd, const void *buf, size_t n)
+{
+  const char *p = buf;
+
+  while (n > 0) {
+    ssize_t r = write (fd, p, n);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    p += r;
+    n -= r;
+  }
+  return 0;
+}
+
+static void *
+server (void *arg)
+{
+  int fd = *(int *) arg;
+  char handshake[152] = { 0 };
+  uint64_t v;
+  uint16_t eflags = htobe16 (1 /* HAS_FLAGS */ | 2 /* READ_ONLY */);
+  static char zero[REQUEST_SIZE];
+
+  v = htobe64 (OLD_MAGIC);
+  memcpy (&handshake[0], &v, 8);
+  v = htobe64 (OLD_VERSION);
+  memcpy (&handshake[8], &v, 8);
+  v = htobe64 (SIZE);
+  memcpy (&handshake[16], &v, 8);
+  memcpy (&handshake[26], &eflags, 2);
+  if (xwrite (fd, handshake, sizeof handshake) == -1)
+    goto out;
+
+  for (;;) {
+    struct request req;
+    struct reply rep;
+
+    if (xread (fd, &req, sizeof req) == -1)
+      break;
+    if (be32toh (req.magic) != REQUEST_MAGIC)
+      break;
+    if (be16toh (req.type) == CMD_DISC)
+      break;
+
+    rep.magic = htobe32 (REPLY_MAGIC);
+    rep.error = 0;
+    rep.handle = req.handle;
+    if (be16toh (req.type) != CMD_READ ||
+        be32toh (req.count) > REQUEST_SIZE) {
+      rep.error = htobe32 (22 /* EINVAL */);
+      if (xwrite (fd, &rep, sizeof rep) == -1)
+        break;
+      continue;
+    }
+    if (xwrite (fd, &rep, sizeof rep) == -1 ||
+        xwrite (fd, zero, be32toh (req.count)) == -1)
+      break;
+  }
+
+ out:
+  close (fd);
+  return NULL;
+}
+
+struct slot {
+  char buf[REQUEST_SIZE];
+  bool busy;
+};
+
+static struct slot slots[DEPTH];
+static unsigned completed;
+
+static int
+read_done (void *user_data, int *error)
+{
+  struct slot *slot = user_data;
+  size_t i;
+
+  if (*error) {
+    fprintf (stderr, "read failed: %s\n", strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < REQUEST_SIZE; ++i) {
+    if (slot->buf[i] != 0) {
+      fprintf (stderr, "read into slot %td has wrong data\n", slot - slots);
+      exit (EXIT_FAILURE);
+    }
+  }
+  slot->busy = false;
+  completed++;
+  return 1;
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+run (unsigned limit, unsigned nr_requests)
+{
+  struct nbd_handle *nbd;
+  pthread_t thread;
+  int sv[2];
+  unsigned issued = 0, i;
+  double start, t;
+  int err;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+    perror ("socketpair");
+    exit (EXIT_FAILURE);
+  }
+  err = pthread_create (&thread, NULL, server, &sv[1]);
+  if (err != 0) {
+    errno = err;
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_command_cache_limit (nbd) != 4096) {
+    fprintf (stderr, "unexpected default command cache limit\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_command_cache_limit (nbd, limit) == -1 ||
+      nbd_get_command_cache_limit (nbd) != limit) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_socket (nbd, sv[0]) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  completed = 0;
+  start = now ();
+  while (issued < nr_requests || nbd_aio_in_flight (nbd) > 0) {
+    /* Keep the queue full. */
+    for (i = 0; issued < nr_requests && i < DEPTH; ++i) {
+      if (slots[i].busy)
+        continue;
+      memset (slots[i].buf, 0xff, REQUEST_SIZE);
+      slots[i].busy = true;
+      if (nbd_aio_pread (nbd, slots[i].buf, REQUEST_SIZE,
+                         (uint64_t) issued * REQUEST_SIZE % SIZE,
+                         (nbd_completion_callback) {
+                           .callback = read_done,
+                           .user_data = &slots[i] },
+                         0) == -1) {
+        fprintf (stderr, "nbd_aio_pread: %s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+      issued++;
+
+      /* Trim the cache while commands are in flight, then let it
+       * grow back.
+       */
+      if (limit > 0 && issued == nr_requests / 2) {
+        if (nbd_set_command_cache_limit (nbd, 1) == -1 ||
+            nbd_set_command_cache_limit (nbd, limit) == -1) {
+          fprintf (stderr, "%s\n", nbd_get_error ());
+          exit (EXIT_FAILURE);
+        }
+      }
+    }
+
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "nbd_poll: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  t = now () - start;
+
+  /* The queue was kept full, and never grew beyond its depth. */
+  if (completed != nr_requests ||
+      nbd_stats_in_flight_max (nbd) != DEPTH) {
+    fprintf (stderr, "expected %u reads at depth %d, "
+             "got %u at depth %" PRIu64 "\n",
+             nr_requests, DEPTH, completed, nbd_stats_in_flight_max (nbd));
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  pthread_join (thread, NULL);
+
+  return t;
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char *s;
+  bool bench;
+  unsigned nr_requests;
+  double t_nocache, t_cache;
+
+  s = getenv ("LIBNBD_BENCH");
+  bench = s && strcmp (s, "1") == 0;
+  nr_requests = bench ? 1000000 : 10000;
+
+  t_nocache = run (0, nr_requests);
+  t_cache = run (4096, nr_requests);
+
+  if (bench) {
+    printf ("%u x %d byte reads, depth %d\n",
+            nr_requests, REQUEST_SIZE, DEPTH);
+    printf ("command cache disabled: %8.0f IOPS\n", nr_requests / t_nocache);
+    printf ("command cache enabled:  %8.0f IOPS\n", nr_requests / t_cache);
+  }
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,127 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_aio_connect_tcp.  nbdkit listens on IPv4 only, so if
+ * "localhost" also resolves to ::1 the IPv6 attempt fails and the
+ * IPv4 one has to win.  The connect call itself must not block, and
+ * the handle must ask to be polled for reading while the name is
+ * looked up.  Looking up a name which does not exist must fail
+ * cleanly.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#include "pick-a-port.h"
+
+#define PIDFILE "aio-connect-tcp.pid"
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  int port = pick_a_port ();
+  char port_str[16];
+  pid_t pid;
+  size_t i;
+  unsigned dir;
+
+  unlink (PIDFILE);
+
+  snprintf (port_str, sizeof port_str, "%d", port);
+
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    execlp ("nbdkit",
+            "nbdkit", "-f", "-p", port_str, "-i", "127.0.0.1",
+            "-P", PIDFILE, "--exit-with-parent", "null", NULL);
+    perror ("nbdkit");
+    _exit (EXIT_FAILURE);
+  }
+
+  /* Wait for nbdkit to start listening. */
+  for (i = 0; i < 60; ++i) {
+    if (access (PIDFILE, F_OK) == 0)
+      break;
+    sleep (1);
+  }
+  unlink (PIDFILE);
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_aio_connect_tcp (nbd, "localhost", port_str) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_is_connecting (nbd) != 1) {
+    fprintf (stderr, "handle should be connecting\n");
+    exit (EXIT_FAILURE);
+  }
+  dir = nbd_aio_get_direction (nbd);
+  if (nbd_aio_get_fd (nbd) == -1 || (dir & LIBNBD_AIO_DIRECTION_BOTH) == 0) {
+    fprintf (stderr, "nothing to poll while connecting\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Wait until we have connected. */
+  while (!nbd_aio_is_ready (nbd)) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  /* A name which cannot be resolved. */
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_tcp (nbd, "nonexistent.invalid", port_str) != -1) {
+    fprintf (stderr, "connecting to nonexistent.invalid should fail\n");
+    exit (EXIT_FAILURE);
+  }
+  if (strstr (nbd_get_error (), "getaddrinfo") == NULL) {
+    fprintf (stderr, "unexpected error: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,155 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Keep a very deep queue of commands in flight and measure the cost
+ * of each reply.  Matching a reply to its command and retiring a
+ * completed command should not depend on the queue depth.
+ *
+ * By default this runs a quick pass as a correctness test.  Set
+ * LIBNBD_BENCH=1 to run more iterations and print timings.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include <libnbd.h>
+
+#define SIZE (64 * 1024 * 1024)
+#define XSTR(s) #s
+#define STR(s) XSTR (s)
+
+#define REQUEST_SIZE 512
+#define MIN_DEPTH 16
+#define MAX_DEPTH 16384
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Issue depth reads, wait for them all to be replied to, then retire
+ * them newest first, which is the worst case for a linear search of
+ * the completed list.  Returns the elapsed time.
+ */
+static double
+run_once (struct nbd_handle *nbd, char *buf, int64_t *cookies, size_t depth)
+{
+  double start;
+  size_t i;
+
+  start = now ();
+  for (i = 0; i < depth; ++i) {
+    cookies[i] = nbd_aio_pread (nbd, &buf[i * REQUEST_SIZE], REQUEST_SIZE,
+                                (i * REQUEST_SIZE) % SIZE,
+                                NBD_NULL_COMPLETION, 0);
+    if (cookies[i] == -1) {
+      fprintf (stderr, "nbd_aio_pread: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "nbd_poll: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  for (i = depth; i-- > 0; ) {
+    if (nbd_aio_command_completed (nbd, cookies[i]) != 1) {
+      fprintf (stderr, "nbd_aio_command_completed: cookie %" PRIi64
+               " did not complete successfully: %s\n",
+               cookies[i], nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_aio_peek_command_completed (nbd) != -1) {
+    fprintf (stderr, "completed commands were not all retired\n");
+    exit (EXIT_FAILURE);
+  }
+
+  return now () - start;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                   "null", "size=" STR (SIZE), NULL };
+  char *buf;
+  int64_t *cookies;
+  size_t depth;
+  unsigned iterations, j;
+  const char *s;
+  bool bench;
+
+  s = getenv ("LIBNBD_BENCH");
+  bench = s && strcmp (s, "1") == 0;
+  iterations = bench ? 20 : 1;
+
+  buf = malloc (MAX_DEPTH * REQUEST_SIZE);
+  cookies = malloc (MAX_DEPTH * sizeof *cookies);
+  if (buf == NULL || cookies == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  for (depth = MIN_DEPTH; depth <= MAX_DEPTH; depth *= 4) {
+    double t = 0;
+
+    for (j = 0; j < iterations; ++j)
+      t += run_once (nbd, buf, cookies, depth);
+
+    if (bench)
+      printf ("depth %5zu: %8.3f us per reply\n",
+              depth, t * 1e6 / (depth * iterations));
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  free (cookies);
+  free (buf);
+  exit (EXIT_SUCCESS);
+}
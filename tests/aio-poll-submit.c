@@ -0,0 +1,207 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* One thread sits in nbd_poll (h, -1) while other threads submit
+ * commands on the same handle.  Before nbd_poll released the handle
+ * lock, the submitters would block until a reply arrived, and as the
+ * poller starts with nothing in flight no reply would ever arrive.
+ *
+ * Then the poller uses a short timeout while one thread submits
+ * commands one at a time and waits for each to complete.  A command
+ * queued just as poll timed out used to stay queued, since the
+ * poller consumed the wakeup without issuing it.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <libnbd.h>
+
+#define SIZE (16 * 1024 * 1024)
+#define XSTR(s) #s
+#define STR(s) XSTR (s)
+
+#define NR_SUBMITTERS 4
+#define NR_REQUESTS 1000
+#define REQUEST_SIZE 4096
+
+static struct nbd_handle *nbd;
+static _Atomic bool done;
+static _Atomic unsigned completed;
+
+static void *
+poller (void *arg)
+{
+  const int timeout = (intptr_t) arg;
+
+  while (!done) {
+    if (nbd_poll (nbd, timeout) == -1) {
+      fprintf (stderr, "nbd_poll: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  return NULL;
+}
+
+static int
+read_done (void *user_data, int *error)
+{
+  if (*error) {
+    fprintf (stderr, "read failed: %s\n", strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  completed++;
+  return 1;
+}
+
+static void *
+submitter (void *arg)
+{
+  static char buf[NR_SUBMITTERS][REQUEST_SIZE];
+  const uintptr_t id = (uintptr_t) arg;
+  unsigned i;
+
+  for (i = 0; i < NR_REQUESTS; ++i) {
+    /* Bound the queue, without otherwise waiting for replies. */
+    while (nbd_aio_in_flight (nbd) > 64)
+      usleep (100);
+    if (nbd_aio_pread (nbd, buf[id], REQUEST_SIZE,
+                       (uint64_t) i * REQUEST_SIZE % SIZE,
+                       (nbd_completion_callback) { .callback = read_done },
+                       0) == -1) {
+      fprintf (stderr, "nbd_aio_pread: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  return NULL;
+}
+
+static void
+start_poller (pthread_t *thread, int timeout)
+{
+  int err;
+
+  done = false;
+  err = pthread_create (thread, NULL, poller, (void *) (intptr_t) timeout);
+  if (err != 0) {
+    errno = err;
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Submit one command at a time and wait for it without polling, so
+ * that only the poller thread can issue it.
+ */
+static void
+submit_serially (void)
+{
+  static char buf[REQUEST_SIZE];
+  unsigned i;
+  int64_t cookie;
+  int r;
+
+  for (i = 0; i < NR_REQUESTS; ++i) {
+    cookie = nbd_aio_pread (nbd, buf, REQUEST_SIZE,
+                            (uint64_t) i * REQUEST_SIZE % SIZE,
+                            NBD_NULL_COMPLETION, 0);
+    if (cookie == -1) {
+      fprintf (stderr, "nbd_aio_pread: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    while ((r = nbd_aio_command_completed (nbd, cookie)) == 0)
+      usleep (10);
+    if (r == -1) {
+      fprintf (stderr, "nbd_aio_command_completed: %s\n",
+               nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent",
+                   "memory", "size=" STR (SIZE), NULL };
+  pthread_t poll_thread, submit_threads[NR_SUBMITTERS];
+  uintptr_t i;
+  int err;
+
+  /* If submitters are stuck behind the poller, fail rather than hang. */
+  alarm (60);
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Start polling with nothing in flight. */
+  start_poller (&poll_thread, -1);
+  sleep (1);
+
+  for (i = 0; i < NR_SUBMITTERS; ++i) {
+    err = pthread_create (&submit_threads[i], NULL, submitter, (void *) i);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_SUBMITTERS; ++i)
+    pthread_join (submit_threads[i], NULL);
+
+  while (completed < NR_SUBMITTERS * NR_REQUESTS)
+    usleep (1000);
+
+  /* The poller is blocked again with nothing in flight.  A final
+   * command wakes it up to see that we are done.
+   */
+  done = true;
+  if (nbd_aio_flush (nbd, NBD_NULL_COMPLETION, 0) == -1) {
+    fprintf (stderr, "nbd_aio_flush: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  pthread_join (poll_thread, NULL);
+
+  /* Now poll with a timeout short enough to expire often. */
+  start_poller (&poll_thread, 1);
+  submit_serially ();
+  done = true;
+  pthread_join (poll_thread, NULL);
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,167 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_aio_pwritev and nbd_aio_preadv, using oddly sized
+ * segments (including empty ones) so that segment boundaries do not
+ * line up with the request header or with each other.  Both simple
+ * and structured replies are tested.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include <libnbd.h>
+
+#include "array-size.h"
+
+#define SIZE (1024 * 1024)
+#define XSTR(s) #s
+#define STR(s) XSTR (s)
+
+/* Segment lengths, summing to LEN. */
+static const size_t seglens[] = { 1, 511, 0, 4096, 3, 0, 65536, 7, 1000 };
+#define LEN (1 + 511 + 4096 + 3 + 65536 + 7 + 1000)
+#define OFFSET 12345
+
+static char wbuf[LEN], rbuf[LEN];
+
+static void
+wait_for (struct nbd_handle *nbd, int64_t cookie, const char *what)
+{
+  int r;
+
+  if (cookie == -1) {
+    fprintf (stderr, "%s: %s\n", what, nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while ((r = nbd_aio_command_completed (nbd, cookie)) == 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "nbd_poll: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (r == -1) {
+    fprintf (stderr, "%s: %s\n", what, nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Split buf into segments, rotating seglens by skew so that reads
+ * and writes are split differently.
+ */
+static size_t
+make_iov (struct iovec *iov, char *buf, size_t skew)
+{
+  size_t i, n = ARRAY_SIZE (seglens), pos = 0;
+
+  for (i = 0; i < n; ++i) {
+    iov[i].iov_base = &buf[pos];
+    iov[i].iov_len = seglens[(i + skew) % n];
+    pos += iov[i].iov_len;
+  }
+  return n;
+}
+
+static void
+test (bool structured)
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                   "memory", "size=" STR (SIZE), NULL };
+  struct iovec iov[ARRAY_SIZE (seglens)];
+  size_t iovcnt, skew, i;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_request_structured_replies (nbd, structured) == -1 ||
+      nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < LEN; ++i)
+    wbuf[i] = (char) (i * 7 + structured);
+
+  /* Write with one segmentation. */
+  iovcnt = make_iov (iov, wbuf, 0);
+  wait_for (nbd,
+            nbd_aio_pwritev (nbd, iov, iovcnt, OFFSET,
+                             NBD_NULL_COMPLETION, 0),
+            "nbd_aio_pwritev");
+
+  /* Read back contiguously. */
+  if (nbd_pread (nbd, rbuf, LEN, OFFSET, 0) == -1) {
+    fprintf (stderr, "nbd_pread: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (rbuf, wbuf, LEN) != 0) {
+    fprintf (stderr, "data written by nbd_aio_pwritev differs\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Read back with every other segmentation. */
+  for (skew = 1; skew < ARRAY_SIZE (seglens); ++skew) {
+    memset (rbuf, 0, LEN);
+    iovcnt = make_iov (iov, rbuf, skew);
+    wait_for (nbd,
+              nbd_aio_preadv (nbd, iov, iovcnt, OFFSET,
+                              NBD_NULL_COMPLETION, 0),
+              "nbd_aio_preadv");
+    if (memcmp (rbuf, wbuf, LEN) != 0) {
+      fprintf (stderr, "data read by nbd_aio_preadv differs (skew %zu)\n",
+               skew);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* A non-empty segment must have a buffer. */
+  iov[0].iov_base = NULL;
+  iov[0].iov_len = 1;
+  if (nbd_aio_preadv (nbd, iov, 1, 0, NBD_NULL_COMPLETION, 0) != -1) {
+    fprintf (stderr, "nbd_aio_preadv with NULL segment should fail\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_errno () != EFAULT) {
+    fprintf (stderr, "unexpected errno: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+}
+
+int
+main (int argc, char *argv[])
+{
+  test (false);
+  test (true);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,181 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Exercise the reply read-ahead buffer.  First keep a queue of
+ * NBD_CMD_WRITE_ZEROES commands in flight, whose replies carry no
+ * payload, then a queue of reads of mixed sizes so that payloads are
+ * received both through the buffer and directly, checking the data.
+ *
+ * By default this runs a quick pass as a correctness test.  Set
+ * LIBNBD_BENCH=1 to run more requests and print the number of send
+ * and recv calls per completed command.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <libnbd.h>
+
+#define SIZE (64 * 1024 * 1024)
+#define XSTR(s) #s
+#define STR(s) XSTR (s)
+
+#define DEPTH 64
+#define DATA_SIZE (4 * 1024 * 1024)
+#define SMALL 512
+#define LARGE (64 * 1024)
+
+static char data[DATA_SIZE];
+static char rbuf[DEPTH][LARGE];
+
+/* Offset and size of the i'th read. */
+static uint64_t
+read_offset (unsigned i)
+{
+  return (uint64_t) i * 7919 % (DATA_SIZE - LARGE);
+}
+
+static size_t
+read_size (unsigned i)
+{
+  return i & 1 ? LARGE : SMALL;
+}
+
+/* Keep DEPTH commands in flight until nr_requests have completed.  If
+ * reads is true, issue reads and check the data, otherwise issue
+ * write zeroes.
+ */
+static void
+run (struct nbd_handle *nbd, unsigned nr_requests, bool reads, bool bench)
+{
+  uint64_t sent0, recv0;
+  int64_t cookies[DEPTH] = { 0 };
+  unsigned issued[DEPTH];
+  unsigned nr_issued = 0, nr_done = 0, i;
+  int64_t cookie;
+  int r;
+
+  sent0 = nbd_stats_send_calls (nbd);
+  recv0 = nbd_stats_recv_calls (nbd);
+
+  while (nr_done < nr_requests) {
+    /* Fill any free slots. */
+    for (i = 0; i < DEPTH && nr_issued < nr_requests; ++i) {
+      if (cookies[i] != 0)
+        continue;
+      if (reads)
+        cookie = nbd_aio_pread (nbd, rbuf[i], read_size (nr_issued),
+                                read_offset (nr_issued),
+                                NBD_NULL_COMPLETION, 0);
+      else
+        cookie = nbd_aio_zero (nbd, SMALL,
+                               DATA_SIZE + (uint64_t) nr_issued * SMALL %
+                               (SIZE - DATA_SIZE),
+                               NBD_NULL_COMPLETION, 0);
+      if (cookie == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+      cookies[i] = cookie;
+      issued[i] = nr_issued++;
+    }
+
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "nbd_poll: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+
+    /* Retire completed commands. */
+    for (i = 0; i < DEPTH; ++i) {
+      if (cookies[i] == 0)
+        continue;
+      r = nbd_aio_command_completed (nbd, cookies[i]);
+      if (r == -1) {
+        fprintf (stderr, "nbd_aio_command_completed: %s\n",
+                 nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+      if (r == 0)
+        continue;
+      if (reads &&
+          memcmp (rbuf[i], &data[read_offset (issued[i])],
+                  read_size (issued[i])) != 0) {
+        fprintf (stderr, "read %u returned the wrong data\n", issued[i]);
+        exit (EXIT_FAILURE);
+      }
+      cookies[i] = 0;
+      nr_done++;
+    }
+  }
+
+  if (bench)
+    printf ("%-12s %u requests: %.3f send calls, %.3f recv calls "
+            "per command\n",
+            reads ? "pread" : "zero", nr_requests,
+            (double) (nbd_stats_send_calls (nbd) - sent0) / nr_requests,
+            (double) (nbd_stats_recv_calls (nbd) - recv0) / nr_requests);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                   "memory", "size=" STR (SIZE), NULL };
+  const char *s;
+  bool bench;
+  unsigned nr_requests;
+  size_t i;
+
+  s = getenv ("LIBNBD_BENCH");
+  bench = s && strcmp (s, "1") == 0;
+  nr_requests = bench ? 200000 : 2000;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < DATA_SIZE; ++i)
+    data[i] = (char) (i * 31 + (i >> 12));
+  if (nbd_pwrite (nbd, data, DATA_SIZE, 0, 0) == -1) {
+    fprintf (stderr, "nbd_pwrite: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  run (nbd, nr_requests, false, bench);
+  run (nbd, nr_requests, true, bench);
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
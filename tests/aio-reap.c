@@ -0,0 +1,157 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_aio_reap_completed and nbd_aio_get_completion_fd. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <poll.h>
+
+#include <libnbd.h>
+
+#define NR_REQUESTS 32
+#define BATCH 10
+
+static char buf[NR_REQUESTS][512];
+
+/* Is the completion fd readable right now? */
+static bool
+readable (int fd)
+{
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+  if (poll (&pfd, 1, 0) == -1) {
+    perror ("poll");
+    exit (EXIT_FAILURE);
+  }
+  return (pfd.revents & POLLIN) != 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] =
+    { "nbdkit", "-s", "--exit-with-parent", "memory", "size=1M", NULL };
+  int64_t issued[NR_REQUESTS], cookies[NR_REQUESTS];
+  int errors[NR_REQUESTS];
+  bool seen[NR_REQUESTS] = { false };
+  ssize_t n, total;
+  size_t i, j;
+  int fd;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  fd = nbd_aio_get_completion_fd (nbd);
+  if (fd == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_get_completion_fd (nbd) != fd) {
+    fprintf (stderr, "completion fd changed between calls\n");
+    exit (EXIT_FAILURE);
+  }
+  if (readable (fd)) {
+    fprintf (stderr, "completion fd readable before any command\n");
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_REQUESTS; ++i) {
+    issued[i] = nbd_aio_pread (nbd, buf[i], sizeof buf[i], i * 512,
+                               NBD_NULL_COMPLETION, 0);
+    if (issued[i] == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (!readable (fd)) {
+    fprintf (stderr, "completion fd not readable with commands to retire\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* A short batch leaves the rest for later. */
+  n = nbd_aio_reap_completed (nbd, cookies, errors, BATCH);
+  if (n != BATCH) {
+    fprintf (stderr, "first batch retired %zd commands\n", n);
+    exit (EXIT_FAILURE);
+  }
+  if (!readable (fd)) {
+    fprintf (stderr, "completion fd not readable after partial reap\n");
+    exit (EXIT_FAILURE);
+  }
+  total = n;
+  n = nbd_aio_reap_completed (nbd, cookies + total, errors + total,
+                              NR_REQUESTS);
+  total += n;
+  if (total != NR_REQUESTS) {
+    fprintf (stderr, "retired %zd of %d commands\n", total, NR_REQUESTS);
+    exit (EXIT_FAILURE);
+  }
+  if (readable (fd)) {
+    fprintf (stderr, "completion fd still readable after reaping all\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_reap_completed (nbd, cookies, errors, NR_REQUESTS) != 0) {
+    fprintf (stderr, "nothing should be left to retire\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Every issued command is retired exactly once, successfully. */
+  for (i = 0; i < NR_REQUESTS; ++i) {
+    if (errors[i] != 0) {
+      fprintf (stderr, "command %" PRIi64 " failed: %s\n",
+               cookies[i], strerror (errors[i]));
+      exit (EXIT_FAILURE);
+    }
+    for (j = 0; j < NR_REQUESTS; ++j)
+      if (issued[j] == cookies[i])
+        break;
+    if (j == NR_REQUESTS || seen[j]) {
+      fprintf (stderr, "unexpected cookie %" PRIi64 "\n", cookies[i]);
+      exit (EXIT_FAILURE);
+    }
+    seen[j] = true;
+  }
+  if (nbd_aio_command_completed (nbd, issued[0]) != 0) {
+    fprintf (stderr, "reaped command is still waiting to be retired\n");
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,336 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Issue many small nbd_aio_pread calls against a trivial in-process
+ * server, using the normal poll(2) transport and the io_uring
+ * transport (see nbd_set_uring).  The io_uring transport is driven
+ * both by nbd_poll and by an application main loop using
+ * nbd_aio_get_fd and nbd_aio_notify_read.
+ *
+ * By default this runs a quick pass as a correctness test.  Set
+ * LIBNBD_BENCH=1 to run more requests and print timings.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <libnbd.h>
+
+#include "byte-swapping.h"
+
+#define SIZE (64 * 1024 * 1024)
+#define REQUEST_SIZE 4096
+#define DEPTH 64
+
+/* Just enough of the protocol for an oldstyle read-only server. */
+#define OLD_MAGIC    UINT64_C (0x4e42444d41474943)
+#define OLD_VERSION  UINT64_C (0x0000420281861253)
+#define REQUEST_MAGIC 0x25609513
+#define REPLY_MAGIC   0x67446698
+#define CMD_READ 0
+#define CMD_DISC 2
+
+struct request {
+  uint32_t magic;
+  uint16_t flags;
+  uint16_t type;
+  uint64_t handle;
+  uint64_t offset;
+  uint32_t count;
+} __attribute__ ((__packed__));
+
+struct reply {
+  uint32_t magic;
+  uint32_t error;
+  uint64_t handle;
+} __attribute__ ((__packed__));
+
+static int
+xread (int fd, void *buf, size_t n)
+{
+  char *p = buf;
+
+  while (n > 0) {
+    ssize_t r = read (fd, p, n);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    p += r;
+    n -= r;
+  }
+  return 0;
+}
+
+static int
+xwrite (int fd, const void *buf, size_t n)
+{
+  const char *p = buf;
+
+  while (n > 0) {
+    ssize_t r = write (fd, p, n);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    p += r;
+    n -= r;
+  }
+  return 0;
+}
+
+static void *
+server (void *arg)
+{
+  int fd = *(int *) arg;
+  char handshake[152] = { 0 };
+  uint64_t v;
+  uint16_t eflags = htobe16 (1 /* HAS_FLAGS */ | 2 /* READ_ONLY */);
+  static char zero[REQUEST_SIZE];
+
+  v = htobe64 (OLD_MAGIC);
+  memcpy (&handshake[0], &v, 8);
+  v = htobe64 (OLD_VERSION);
+  memcpy (&handshake[8], &v, 8);
+  v = htobe64 (SIZE);
+  memcpy (&handshake[16], &v, 8);
+  memcpy (&handshake[26], &eflags, 2);
+  if (xwrite (fd, handshake, sizeof handshake) == -1)
+    goto out;
+
+  for (;;) {
+    struct request req;
+    struct reply rep;
+
+    if (xread (fd, &req, sizeof req) == -1)
+      break;
+    if (be32toh (req.magic) != REQUEST_MAGIC)
+      break;
+    if (be16toh (req.type) == CMD_DISC)
+      break;
+
+    rep.magic = htobe32 (REPLY_MAGIC);
+    rep.error = 0;
+    rep.handle = req.handle;
+    if (be16toh (req.type) != CMD_READ ||
+        be32toh (req.count) > REQUEST_SIZE) {
+      rep.error = htobe32 (22 /* EINVAL */);
+      if (xwrite (fd, &rep, sizeof rep) == -1)
+        break;
+      continue;
+    }
+    if (xwrite (fd, &rep, sizeof rep) == -1 ||
+        xwrite (fd, zero, be32toh (req.count)) == -1)
+      break;
+  }
+
+ out:
+  close (fd);
+  return NULL;
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+enum mode { MODE_POLL, MODE_URING, MODE_URING_FD };
+
+/* Wait for something to happen, either with nbd_poll or with our
+ * own main loop.
+ */
+static void
+wait_once (struct nbd_handle *nbd, enum mode mode)
+{
+  struct pollfd pfd;
+
+  if (mode != MODE_URING_FD) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "nbd_poll: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    return;
+  }
+
+  pfd.fd = nbd_aio_get_fd (nbd);
+  if (pfd.fd == -1) {
+    fprintf (stderr, "nbd_aio_get_fd: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_get_direction (nbd) != LIBNBD_AIO_DIRECTION_READ) {
+    fprintf (stderr, "unexpected direction with io_uring\n");
+    exit (EXIT_FAILURE);
+  }
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  if (poll (&pfd, 1, -1) == -1) {
+    perror ("poll");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_notify_read (nbd) == -1) {
+    fprintf (stderr, "nbd_aio_notify_read: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Returns the elapsed time, or -1 if io_uring could not be used. */
+static double
+run (enum mode mode, unsigned nr_requests)
+{
+  struct nbd_handle *nbd;
+  pthread_t thread;
+  int sv[2];
+  static char buf[DEPTH][REQUEST_SIZE];
+  unsigned issued = 0, i;
+  double start, t;
+  int err;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+    perror ("socketpair");
+    exit (EXIT_FAILURE);
+  }
+  err = pthread_create (&thread, NULL, server, &sv[1]);
+  if (err != 0) {
+    errno = err;
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_uring (nbd) != false) {
+    fprintf (stderr, "unexpected default io_uring setting\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_uring (nbd, mode != MODE_POLL) == -1 ||
+      nbd_connect_socket (nbd, sv[0]) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_uring_active (nbd) != (mode != MODE_POLL)) {
+    if (mode == MODE_POLL) {
+      fprintf (stderr, "io_uring used without being requested\n");
+      exit (EXIT_FAILURE);
+    }
+    /* The kernel may not support io_uring. */
+    t = -1;
+    goto out;
+  }
+
+  start = now ();
+  while (issued < nr_requests || nbd_aio_in_flight (nbd) > 0) {
+    int64_t cookie;
+
+    /* Keep the queue full. */
+    while (issued < nr_requests && nbd_aio_in_flight (nbd) < DEPTH) {
+      i = issued % DEPTH;
+      if (nbd_aio_pread (nbd, buf[i], REQUEST_SIZE,
+                         (uint64_t) issued * REQUEST_SIZE % SIZE,
+                         NBD_NULL_COMPLETION, 0) == -1) {
+        fprintf (stderr, "nbd_aio_pread: %s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+      issued++;
+    }
+
+    wait_once (nbd, mode);
+
+    while ((cookie = nbd_aio_peek_command_completed (nbd)) > 0) {
+      if (nbd_aio_command_completed (nbd, cookie) != 1) {
+        fprintf (stderr, "nbd_aio_command_completed: %s\n",
+                 nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+  t = now () - start;
+
+ out:
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  pthread_join (thread, NULL);
+
+  return t;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  const char *s;
+  bool bench;
+  unsigned nr_requests;
+  double t_poll, t_uring, t_uring_fd;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (!nbd_supports_uring (nbd)) {
+    fprintf (stderr, "%s: skipped: libnbd compiled without io_uring\n",
+             argv[0]);
+    exit (77);
+  }
+  nbd_close (nbd);
+
+  s = getenv ("LIBNBD_BENCH");
+  bench = s && strcmp (s, "1") == 0;
+  nr_requests = bench ? 1000000 : 10000;
+
+  t_poll = run (MODE_POLL, nr_requests);
+  t_uring = run (MODE_URING, nr_requests);
+  if (t_uring < 0) {
+    fprintf (stderr, "%s: skipped: io_uring not available\n", argv[0]);
+    exit (77);
+  }
+  t_uring_fd = run (MODE_URING_FD, nr_requests);
+
+  if (bench) {
+    printf ("%u x %d byte reads, depth %d\n",
+            nr_requests, REQUEST_SIZE, DEPTH);
+    printf ("poll:                    %8.0f IOPS\n", nr_requests / t_poll);
+    printf ("io_uring, nbd_poll:      %8.0f IOPS\n", nr_requests / t_uring);
+    printf ("io_uring, own main loop: %8.0f IOPS\n",
+            nr_requests / t_uring_fd);
+  }
+
+  exit (EXIT_SUCCESS);
+}
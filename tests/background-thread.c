@@ -0,0 +1,154 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_set_background_thread.  Several threads share one handle
+ * using the synchronous API, and an asynchronous command completes
+ * without the test ever calling nbd_poll.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <libnbd.h>
+
+#define NR_THREADS 4
+#define NR_REQUESTS 64
+#define REQUEST_SIZE 4096
+
+static struct nbd_handle *nbd;
+
+static void *
+start_thread (void *arg)
+{
+  const size_t n = (uintptr_t) arg;
+  char wbuf[REQUEST_SIZE], rbuf[REQUEST_SIZE];
+  uint64_t offset;
+  size_t i;
+
+  for (i = 0; i < NR_REQUESTS; ++i) {
+    offset = (n * NR_REQUESTS + i) * REQUEST_SIZE;
+    memset (wbuf, 'a' + (n + i) % 26, sizeof wbuf);
+    if (nbd_pwrite (nbd, wbuf, sizeof wbuf, offset, 0) == -1 ||
+        nbd_pread (nbd, rbuf, sizeof rbuf, offset, 0) == -1) {
+      fprintf (stderr, "thread %zu: %s\n", n, nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (memcmp (rbuf, wbuf, sizeof wbuf) != 0) {
+      fprintf (stderr, "thread %zu: data read back differs\n", n);
+      exit (EXIT_FAILURE);
+    }
+  }
+  return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  char *args[] =
+    { "nbdkit", "-s", "--exit-with-parent", "memory", "size=4M", NULL };
+  pthread_t threads[NR_THREADS];
+  char buf[512];
+  struct pollfd pfd;
+  int64_t cookie;
+  size_t i;
+  int err, r;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* The thread can only be started once connected. */
+  if (nbd_set_background_thread (nbd, true) != -1) {
+    fprintf (stderr, "nbd_set_background_thread should fail "
+             "before connecting\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_connect_command (nbd, args) == -1 ||
+      nbd_set_background_thread (nbd, true) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_background_thread (nbd) != 1) {
+    fprintf (stderr, "background thread is not running\n");
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_THREADS; ++i) {
+    err = pthread_create (&threads[i], NULL, start_thread, (void *) i);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_THREADS; ++i) {
+    err = pthread_join (threads[i], NULL);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_join");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Nothing but the background thread drives this command. */
+  pfd.fd = nbd_aio_get_completion_fd (nbd);
+  pfd.events = POLLIN;
+  cookie = nbd_aio_pread (nbd, buf, sizeof buf, 0, NBD_NULL_COMPLETION, 0);
+  if (pfd.fd == -1 || cookie == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (poll (&pfd, 1, -1) == -1) {
+    perror ("poll");
+    exit (EXIT_FAILURE);
+  }
+  r = nbd_aio_command_completed (nbd, cookie);
+  if (r != 1) {
+    fprintf (stderr, "command not completed: %s\n",
+             r == -1 ? nbd_get_error () : "still in flight");
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_set_background_thread (nbd, false) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_background_thread (nbd) != 0) {
+    fprintf (stderr, "background thread is still running\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Without the thread the handle is driven as usual. */
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
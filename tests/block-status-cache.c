@@ -0,0 +1,220 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_set_block_status_cache. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define SIZE (1024 * 1024)
+#define MAX_EXTENTS 64
+
+struct extents {
+  uint64_t offset;
+  size_t n;
+  nbd_extent entries[MAX_EXTENTS];
+};
+
+static int
+save_extents (void *user_data, const char *metacontext, uint64_t offset,
+              nbd_extent *entries, size_t nr_entries, int *error)
+{
+  struct extents *exts = user_data;
+
+  if (strcmp (metacontext, LIBNBD_CONTEXT_BASE_ALLOCATION) != 0)
+    return 0;
+  if (nr_entries > MAX_EXTENTS) {
+    fprintf (stderr, "too many extents: %zu\n", nr_entries);
+    exit (EXIT_FAILURE);
+  }
+  exts->offset = offset;
+  exts->n = nr_entries;
+  memcpy (exts->entries, entries, nr_entries * sizeof *entries);
+  return 0;
+}
+
+/* Call nbd_block_status_64 and check how it was answered. */
+static void
+block_status (struct nbd_handle *nbd, uint64_t count, uint64_t offset,
+              struct extents *exts, bool expect_hit)
+{
+  const uint64_t hits = nbd_stats_block_status_cache_hits (nbd);
+  const uint64_t misses = nbd_stats_block_status_cache_misses (nbd);
+
+  memset (exts, 0, sizeof *exts);
+  if (nbd_block_status_64 (nbd, count, offset,
+                           (nbd_extent64_callback) {
+                             .callback = save_extents,
+                             .user_data = exts },
+                           0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_stats_block_status_cache_hits (nbd) != hits + expect_hit ||
+      nbd_stats_block_status_cache_misses (nbd) != misses + !expect_hit) {
+    fprintf (stderr, "block status of [%" PRIu64 ", +%" PRIu64 "] "
+             "should have been a cache %s\n",
+             offset, count, expect_hit ? "hit" : "miss");
+    exit (EXIT_FAILURE);
+  }
+  if (exts->n == 0 || exts->offset != offset) {
+    fprintf (stderr, "unexpected extents at offset %" PRIu64 "\n",
+             exts->offset);
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Call nbd_block_status_64 on a range which the server would not
+ * accept, and check that it fails without looking in the cache.
+ */
+static void
+block_status_fails (struct nbd_handle *nbd, uint64_t count, uint64_t offset,
+                    int expect_errno)
+{
+  const uint64_t misses = nbd_stats_block_status_cache_misses (nbd);
+  struct extents exts;
+
+  if (nbd_block_status_64 (nbd, count, offset,
+                           (nbd_extent64_callback) {
+                             .callback = save_extents,
+                             .user_data = &exts },
+                           0) != -1) {
+    fprintf (stderr, "block status of [%" PRIu64 ", +%" PRIu64 "] "
+             "should have failed\n", offset, count);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_errno () != expect_errno) {
+    fprintf (stderr, "block status of [%" PRIu64 ", +%" PRIu64 "] "
+             "failed with the wrong errno: %s\n",
+             offset, count, nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_stats_block_status_cache_misses (nbd) != misses) {
+    fprintf (stderr, "invalid block status should not reach the cache\n");
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] =
+    { "nbdkit", "-s", "--exit-with-parent", "memory", "size=1M", NULL };
+  struct extents server, cached;
+  char buf[4096];
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_get_block_status_cache (nbd) != 0) {
+    fprintf (stderr, "block status cache should be disabled by default\n");
+    exit (EXIT_FAILURE);
+  }
+  /* Without extended headers block status is limited to 32 bits. */
+  if (nbd_set_block_status_cache (nbd, 1024) == -1 ||
+      nbd_set_request_extended_headers (nbd, false) == -1 ||
+      nbd_add_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1 ||
+      nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_block_status_cache (nbd) != 1024) {
+    fprintf (stderr, "block status cache size not set\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Make some data so that there is more than one extent. */
+  memset (buf, 'a', sizeof buf);
+  if (nbd_pwrite (nbd, buf, sizeof buf, 65536, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* The first query goes to the server, repeating it does not. */
+  block_status (nbd, SIZE, 0, &server, false);
+  block_status (nbd, SIZE, 0, &cached, true);
+  if (server.n != cached.n ||
+      memcmp (server.entries, cached.entries,
+              server.n * sizeof server.entries[0]) != 0) {
+    fprintf (stderr, "cached extents differ from the server's\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* A range inside what is cached is a hit too. */
+  block_status (nbd, 4096, 65536, &cached, true);
+  if (cached.entries[0].flags != 0) {
+    fprintf (stderr, "unexpected flags 0x%" PRIx64 " for written data\n",
+             cached.entries[0].flags);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Trimming invalidates the range, but not the rest. */
+  if (nbd_trim (nbd, sizeof buf, 65536, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  block_status (nbd, 4096, 0, &cached, true);
+  block_status (nbd, SIZE, 0, &cached, false);
+  block_status (nbd, SIZE, 0, &cached, true);
+
+  /* Requests which would fail if sent fail in the same way. */
+  block_status_fails (nbd, SIZE, 4096, EINVAL);
+  if (nbd_set_strict_mode (nbd,
+                           nbd_get_strict_mode (nbd) & ~LIBNBD_STRICT_BOUNDS)
+      == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  block_status_fails (nbd, (uint64_t) UINT32_MAX + 1, 0, ERANGE);
+
+  /* Disabling the cache stops lookups altogether. */
+  if (nbd_set_block_status_cache (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  memset (&cached, 0, sizeof cached);
+  if (nbd_block_status_64 (nbd, SIZE, 0,
+                           (nbd_extent64_callback) {
+                             .callback = save_extents,
+                             .user_data = &cached },
+                           0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_stats_block_status_cache_hits (nbd) != 4 ||
+      nbd_stats_block_status_cache_misses (nbd) != 2) {
+    fprintf (stderr, "disabled cache should not be used\n");
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
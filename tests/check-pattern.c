@@ -0,0 +1,49 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Check data read from nbdkit-pattern-plugin, which stores the offset
+ * of each 8 byte word in that word, big endian.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "check-pattern.h"
+
+/* Exits if buf, read from offset, does not hold the pattern. */
+void
+check_pattern (const char *buf, size_t count, uint64_t offset)
+{
+  const unsigned char *p = (const unsigned char *) buf;
+  uint64_t v;
+  size_t i, j;
+
+  for (i = 0; i < count; i += 8) {
+    v = 0;
+    for (j = 0; j < 8; ++j)
+      v = (v << 8) | p[i+j];
+    if (v != offset + i) {
+      fprintf (stderr, "wrong data at offset %" PRIu64 "\n", offset + i);
+      exit (EXIT_FAILURE);
+    }
+  }
+}
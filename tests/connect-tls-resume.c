@@ -0,0 +1,164 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that handles with nbd_set_tls_cache share credentials and
+ * resume TLS sessions with an nbdkit server over TCP, and that a
+ * session is only resumed by a handle which checks the server
+ * certificate the same way.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#include "requires.h"
+
+static bool reused_creds;
+
+static int
+debug_fn (void *user_data, const char *context, const char *msg)
+{
+  if (strstr (msg, "reusing cached TLS credentials") != NULL)
+    reused_creds = true;
+  return 0;
+}
+
+/* Connect a new handle to the server, read from it and shut it down.
+ * Returns whether the TLS session was resumed.
+ */
+static bool
+connect_once (bool verify_peer)
+{
+  struct nbd_handle *nbd;
+  char buf[512];
+  int r;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  reused_creds = false;
+  if (nbd_set_debug (nbd, true) == -1 ||
+      nbd_set_debug_callback (nbd,
+                              (nbd_debug_callback) { .callback = debug_fn })
+      == -1 ||
+      nbd_set_tls (nbd, LIBNBD_TLS_REQUIRE) == -1 ||
+      nbd_set_tls_certificates (nbd, "pki") == -1 ||
+      nbd_set_tls_verify_peer (nbd, verify_peer) == -1 ||
+      nbd_set_tls_cache (nbd, true) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_connect_tcp (nbd, "localhost", PORT) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* With TLS 1.3 the server sends the session ticket after the
+   * handshake, so make sure we read something before shutting down.
+   */
+  if (nbd_pread (nbd, buf, sizeof buf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  r = nbd_get_tls_session_resumed (nbd);
+  if (r == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  return r;
+}
+
+static void
+expect (const char *what, bool resumed, bool expected)
+{
+  if (resumed != expected) {
+    fprintf (stderr, "%s: session was %sresumed\n",
+             what, resumed ? "" : "not ");
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  pid_t pid;
+  size_t i;
+
+  requires ("nbdkit --tls-verify-peer -U - null --run 'exit 0'");
+
+  unlink (PIDFILE);
+
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    execlp ("nbdkit",
+            "nbdkit", "-f", "--exit-with-parent",
+            "-P", PIDFILE, "-p", PORT,
+            "--tls=require", "--tls-certificates=pki",
+            "pattern", "size=1M", NULL);
+    perror ("nbdkit");
+    _exit (EXIT_FAILURE);
+  }
+
+  /* Wait for nbdkit to start listening. */
+  for (i = 0; i < 60; ++i) {
+    if (access (PIDFILE, F_OK) == 0)
+      break;
+    sleep (1);
+  }
+  unlink (PIDFILE);
+
+  /* The first handle has nothing to resume, the second must resume
+   * its session and share its credentials.
+   */
+  expect ("first verified handle", connect_once (true), false);
+  expect ("second verified handle", connect_once (true), true);
+  if (!reused_creds) {
+    fprintf (stderr, "second verified handle: credentials not reused\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* A handle which does not verify the server must not resume a
+   * session from one which did.  Sessions are kept separately for
+   * each setting, so the verified session is still there after.
+   */
+  expect ("first unverified handle", connect_once (false), false);
+  expect ("second unverified handle", connect_once (false), true);
+  expect ("third verified handle", connect_once (true), true);
+
+  exit (EXIT_SUCCESS);
+}
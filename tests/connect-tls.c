@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <fcntl.h>
@@ -61,6 +62,25 @@ main (int argc, char *argv[])
     exit (EXIT_FAILURE);
   }
 
+  /* Ask for kernel TLS.  nbd_connect_command uses a Unix domain
+   * socket which the kernel cannot offload, so this checks that we
+   * fall back to GnuTLS.
+   */
+  if (nbd_set_tls_ktls (nbd, true) == -1 ||
+      nbd_get_tls_ktls (nbd) != true) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Sharing credentials must still work when sessions cannot be
+   * resumed, as there is no server name or address to key them on.
+   */
+  if (nbd_set_tls_cache (nbd, true) == -1 ||
+      nbd_get_tls_cache (nbd) != true) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
 #if CERTS
   if (nbd_set_tls_certificates (nbd, "pki") == -1) {
     fprintf (stderr, "%s\n", nbd_get_error ());
@@ -88,6 +108,17 @@ main (int argc, char *argv[])
     exit (EXIT_FAILURE);
   }
 
+  if (nbd_get_tls_ktls_active (nbd) != false) {
+    fprintf (stderr, "%s: unexpected kTLS offload over a Unix socket\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_get_tls_session_resumed (nbd) != 0) {
+    fprintf (stderr, "%s: unexpected session resumption\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
   actual_size = nbd_get_size (nbd);
   if (actual_size != 1024 * 1024) {
     fprintf (stderr, "%s: actual size %" PRIi64 " != expected size",
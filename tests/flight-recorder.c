@@ -0,0 +1,151 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_set_flight_recorder and nbd_dump_flight_recorder. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define NR_ENTRIES 16
+
+/* Dump the flight recorder to a temporary file and return its
+ * contents, which the caller must free.
+ */
+static char *
+dump (struct nbd_handle *nbd, bool json)
+{
+  FILE *fp;
+  char *buf;
+  long len;
+
+  fp = tmpfile ();
+  if (fp == NULL) {
+    perror ("tmpfile");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_dump_flight_recorder (nbd, fileno (fp), json) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  len = ftell (fp);
+  if (len <= 0) {
+    fprintf (stderr, "nothing was dumped\n");
+    exit (EXIT_FAILURE);
+  }
+  buf = calloc (1, len + 1);
+  if (buf == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  rewind (fp);
+  if (fread (buf, 1, len, fp) != (size_t) len) {
+    perror ("fread");
+    exit (EXIT_FAILURE);
+  }
+  fclose (fp);
+  return buf;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] =
+    { "nbdkit", "-s", "--exit-with-parent", "memory", "size=1M", NULL };
+  char buf[512];
+  char *text, *json, *p;
+  size_t i, lines;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Disabled by default, and cannot be dumped then. */
+  if (getenv ("LIBNBD_FLIGHT_RECORDER") == NULL &&
+      nbd_get_flight_recorder (nbd) != 0) {
+    fprintf (stderr, "flight recorder should be disabled by default\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_flight_recorder (nbd, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_dump_flight_recorder (nbd, 1, false) != -1 ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "dumping a disabled flight recorder should fail\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_set_flight_recorder (nbd, NR_ENTRIES, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_flight_recorder (nbd) != NR_ENTRIES) {
+    fprintf (stderr, "flight recorder size not set\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* The handshake alone records more events than the ring holds. */
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < 4; ++i) {
+    if (nbd_pread (nbd, buf, sizeof buf, i * sizeof buf, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  text = dump (nbd, false);
+  lines = 0;
+  for (p = text; (p = strchr (p, '\n')) != NULL; ++p)
+    lines++;
+  if (lines != NR_ENTRIES + 1) {
+    fprintf (stderr, "expected %d events after the heading, got:\n%s",
+             NR_ENTRIES, text);
+    exit (EXIT_FAILURE);
+  }
+  if (strstr (text, "request read cookie=") == NULL ||
+      strstr (text, "complete read cookie=") == NULL ||
+      strstr (text, "state ") == NULL) {
+    fprintf (stderr, "expected events missing from dump:\n%s", text);
+    exit (EXIT_FAILURE);
+  }
+
+  json = dump (nbd, true);
+  if (strncmp (json, "{ \"handle\": ", 12) != 0 ||
+      strstr (json, "\"event\": \"request\"") == NULL) {
+    fprintf (stderr, "unexpected JSON dump:\n%s", json);
+    exit (EXIT_FAILURE);
+  }
+
+  free (text);
+  free (json);
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
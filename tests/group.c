@@ -0,0 +1,235 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_group_create and friends.  nbdkit memory supports
+ * multi-conn and, being a single server on a TCP port, all
+ * connections see the same disk.  Writes are issued through the group
+ * and read back through it, and every connection should have been
+ * used.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#include "pick-a-port.h"
+
+#define PIDFILE "group.pid"
+#define SIZE (16 * 1024 * 1024)
+#define XSTR(s) #s
+#define STR(s) XSTR (s)
+
+#define CONNECTIONS 4
+#define NR_REQUESTS 64
+#define REQUEST_SIZE 65536
+
+static char wbuf[NR_REQUESTS][REQUEST_SIZE], rbuf[NR_REQUESTS][REQUEST_SIZE];
+static unsigned completions[NR_REQUESTS];
+static unsigned connects;
+
+static int
+connect_one (void *user_data, struct nbd_handle *nbd, unsigned i)
+{
+  const char *port_str = user_data;
+
+  if (i != connects) {
+    fprintf (stderr, "connect callback called out of order\n");
+    exit (EXIT_FAILURE);
+  }
+  connects++;
+  return nbd_connect_tcp (nbd, "localhost", port_str);
+}
+
+static int
+request_done (void *user_data, int *error)
+{
+  unsigned *count = user_data;
+
+  if (*error) {
+    fprintf (stderr, "request failed: %s\n", strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  (*count)++;
+  return 1;
+}
+
+static void
+wait_all (struct nbd_group *g)
+{
+  while (nbd_group_aio_in_flight (g) > 0) {
+    if (nbd_group_poll (g, -1) == -1) {
+      fprintf (stderr, "nbd_group_poll: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_group *g;
+  int port = pick_a_port ();
+  char port_str[16];
+  pid_t pid;
+  size_t i, j;
+  int64_t cookie;
+  int r;
+
+  unlink (PIDFILE);
+
+  snprintf (port_str, sizeof port_str, "%d", port);
+
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    execlp ("nbdkit",
+            "nbdkit", "-f", "-p", port_str, "-P", PIDFILE,
+            "--exit-with-parent", "memory", "size=" STR (SIZE), NULL);
+    perror ("nbdkit");
+    _exit (EXIT_FAILURE);
+  }
+
+  /* Wait for nbdkit to start listening. */
+  for (i = 0; i < 60; ++i) {
+    if (access (PIDFILE, F_OK) == 0)
+      break;
+    sleep (1);
+  }
+  unlink (PIDFILE);
+
+  g = nbd_group_create (CONNECTIONS, connect_one, port_str);
+  if (g == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (connects != CONNECTIONS || nbd_group_get_size (g) != CONNECTIONS) {
+    fprintf (stderr, "unexpected number of connections: %u\n",
+             nbd_group_get_size (g));
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_group_get_handle (g, CONNECTIONS) != NULL) {
+    fprintf (stderr, "nbd_group_get_handle out of range should fail\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Queue all the writes at once, then a flush. */
+  for (i = 0; i < NR_REQUESTS; ++i) {
+    for (j = 0; j < REQUEST_SIZE; ++j)
+      wbuf[i][j] = (char) (i * 3 + j);
+    if (nbd_group_aio_pwrite (g, wbuf[i], REQUEST_SIZE, i * REQUEST_SIZE,
+                              (nbd_completion_callback) {
+                                .callback = request_done,
+                                .user_data = &completions[i] },
+                              0) == -1) {
+      fprintf (stderr, "nbd_group_aio_pwrite: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  wait_all (g);
+  for (i = 0; i < NR_REQUESTS; ++i) {
+    if (completions[i] != 1) {
+      fprintf (stderr, "write %zu completed %u times\n", i, completions[i]);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Every connection should have carried some of the writes. */
+  for (i = 0; i < CONNECTIONS; ++i) {
+    struct nbd_handle *nbd = nbd_group_get_handle (g, i);
+
+    if (nbd_stats_bytes_sent (nbd) < REQUEST_SIZE) {
+      fprintf (stderr, "connection %zu was not used\n", i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Flush, retiring it by cookie. */
+  cookie = nbd_group_aio_flush (g, NBD_NULL_COMPLETION, 0);
+  if (cookie == -1) {
+    fprintf (stderr, "nbd_group_aio_flush: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while ((r = nbd_group_aio_command_completed (g, cookie)) == 0) {
+    if (nbd_group_poll (g, -1) == -1) {
+      fprintf (stderr, "nbd_group_poll: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (r == -1) {
+    fprintf (stderr, "nbd_group_aio_command_completed: %s\n",
+             nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Read everything back, retiring commands by peeking. */
+  for (i = 0; i < NR_REQUESTS; ++i) {
+    if (nbd_group_aio_pread (g, rbuf[i], REQUEST_SIZE, i * REQUEST_SIZE,
+                             NBD_NULL_COMPLETION, 0) == -1) {
+      fprintf (stderr, "nbd_group_aio_pread: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_REQUESTS; ) {
+    cookie = nbd_group_aio_peek_command_completed (g);
+    if (cookie == -1) {
+      fprintf (stderr, "nbd_group_aio_peek_command_completed: %s\n",
+               nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (cookie == 0) {
+      if (nbd_group_poll (g, -1) == -1) {
+        fprintf (stderr, "nbd_group_poll: %s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+      continue;
+    }
+    if (nbd_group_aio_command_completed (g, cookie) != 1) {
+      fprintf (stderr, "nbd_group_aio_command_completed: %s\n",
+               nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    i++;
+  }
+  if (nbd_group_aio_peek_command_completed (g) != -1) {
+    fprintf (stderr, "commands unexpectedly still in flight\n");
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (rbuf, wbuf, sizeof wbuf) != 0) {
+    fprintf (stderr, "data read back differs\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_group_shutdown (g, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_group_close (g);
+  exit (EXIT_SUCCESS);
+}
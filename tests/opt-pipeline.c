@@ -0,0 +1,321 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_set_pipeline_options.  The connection to nbdkit goes
+ * through a relay thread which records the options sent by the
+ * client.  For the pipelined connection, the relay also holds back
+ * everything from the server after the client starts on
+ * NBD_OPT_SET_META_CONTEXT until the client has sent NBD_OPT_GO,
+ * which only works if the client does not wait for the replies.
+ * Connecting with pipelined options should negotiate the same things
+ * as connecting without.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <libnbd.h>
+
+#define PIDFILE "opt-pipeline.pid"
+
+/* From lib/nbd-protocol.h. */
+#define NBD_OPT_ABORT            2
+#define NBD_OPT_GO               7
+#define NBD_OPT_SET_META_CONTEXT 10
+
+/* How long the relay waits for the client while holding back the
+ * server's replies, in milliseconds.
+ */
+#define HOLD_TIMEOUT 60000
+
+#define MAX_OPTS 16
+
+static char sockpath[] = "/tmp/opt-pipeline-sock-XXXXXX";
+
+struct relay {
+  int fds[2];                   /* client side, server side */
+  bool hold;                    /* hold back replies while pipelining */
+
+  /* Parser for the options sent by the client. */
+  bool done;                    /* seen NBD_OPT_GO or NBD_OPT_ABORT */
+  uint64_t skip;                /* bytes to skip before the next header */
+  unsigned char hdr[16];        /* option header */
+  size_t hdr_len;
+  uint32_t opts[MAX_OPTS];
+  size_t nr_opts;
+};
+
+static uint32_t
+get_be32 (const unsigned char *p)
+{
+  return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* Record the options in data sent by the client. */
+static void
+parse_options (struct relay *relay, const char *data, size_t len)
+{
+  while (len > 0 && !relay->done) {
+    size_t n;
+
+    if (relay->skip > 0) {
+      n = relay->skip < len ? relay->skip : len;
+      relay->skip -= n;
+    }
+    else {
+      n = sizeof relay->hdr - relay->hdr_len;
+      if (n > len)
+        n = len;
+      memcpy (&relay->hdr[relay->hdr_len], data, n);
+      relay->hdr_len += n;
+      if (relay->hdr_len == sizeof relay->hdr) {
+        uint32_t opt = get_be32 (&relay->hdr[8]);
+
+        if (relay->nr_opts == MAX_OPTS) {
+          fprintf (stderr, "too many options\n");
+          exit (EXIT_FAILURE);
+        }
+        relay->opts[relay->nr_opts++] = opt;
+        relay->skip = get_be32 (&relay->hdr[12]);
+        relay->hdr_len = 0;
+        relay->done = opt == NBD_OPT_GO || opt == NBD_OPT_ABORT;
+      }
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+/* True while the server's replies are being held back. */
+static bool
+holding (struct relay *relay)
+{
+  size_t i;
+
+  if (!relay->hold || relay->done)
+    return false;
+  for (i = 0; i < relay->nr_opts; ++i) {
+    if (relay->opts[i] == NBD_OPT_SET_META_CONTEXT)
+      return true;
+  }
+  return false;
+}
+
+/* Copy data between the two fds until either side closes. */
+static void *
+relay_thread (void *arg)
+{
+  struct relay *relay = arg;
+  int *fds = relay->fds;
+  char buf[65536];
+
+  for (;;) {
+    const bool hold = holding (relay);
+    struct pollfd pfds[2] = {
+      { .fd = fds[0], .events = POLLIN },
+      { .fd = fds[1], .events = hold ? 0 : POLLIN },
+    };
+    size_t i;
+    int r;
+
+    r = poll (pfds, 2, hold ? HOLD_TIMEOUT : -1);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      perror ("poll");
+      exit (EXIT_FAILURE);
+    }
+    if (r == 0) {
+      fprintf (stderr, "client waited for a reply to a pipelined option\n");
+      exit (EXIT_FAILURE);
+    }
+    for (i = 0; i < 2; ++i) {
+      ssize_t n, w;
+      char *p;
+
+      if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) ||
+          (i == 1 && hold))
+        continue;
+      n = read (fds[i], buf, sizeof buf);
+      if (n <= 0)
+        goto out;
+      if (i == 0)
+        parse_options (relay, buf, n);
+      for (p = buf; n > 0; p += w, n -= w) {
+        w = write (fds[!i], p, n);
+        if (w == -1)
+          goto out;
+      }
+    }
+  }
+
+ out:
+  close (fds[0]);
+  close (fds[1]);
+  return NULL;
+}
+
+static void
+try_connect (bool pipeline)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  struct relay relay = {
+    .hold = pipeline,
+    .skip = 4,                  /* client flags */
+  };
+  struct nbd_handle *nbd;
+  pthread_t thread;
+  int sv[2], err;
+  size_t i;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+    perror ("socketpair");
+    exit (EXIT_FAILURE);
+  }
+  relay.fds[0] = sv[1];
+  relay.fds[1] = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (relay.fds[1] == -1) {
+    perror ("socket");
+    exit (EXIT_FAILURE);
+  }
+  strcpy (addr.sun_path, sockpath);
+  if (connect (relay.fds[1], (struct sockaddr *) &addr, sizeof addr) == -1) {
+    perror (sockpath);
+    exit (EXIT_FAILURE);
+  }
+  err = pthread_create (&thread, NULL, relay_thread, &relay);
+  if (err != 0) {
+    errno = err;
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_pipeline_options (nbd, pipeline) == -1 ||
+      nbd_get_pipeline_options (nbd) != pipeline) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_add_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_socket (nbd, sv[0]) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_get_structured_replies_negotiated (nbd) != 1 &&
+      nbd_get_extended_headers_negotiated (nbd) != 1) {
+    fprintf (stderr, "structured replies were not negotiated\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_can_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) != 1) {
+    fprintf (stderr, "base:allocation was not negotiated\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_size (nbd) != 1024 * 1024) {
+    fprintf (stderr, "unexpected export size\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  err = pthread_join (thread, NULL);
+  if (err != 0) {
+    errno = err;
+    perror ("pthread_join");
+    exit (EXIT_FAILURE);
+  }
+
+  printf ("options sent %s pipelining:", pipeline ? "with" : "without");
+  for (i = 0; i < relay.nr_opts; ++i)
+    printf (" %" PRIu32, relay.opts[i]);
+  printf ("\n");
+  fflush (stdout);
+
+  /* Both ways end with NBD_OPT_SET_META_CONTEXT and NBD_OPT_GO. */
+  if (relay.nr_opts < 2 ||
+      relay.opts[relay.nr_opts - 2] != NBD_OPT_SET_META_CONTEXT ||
+      relay.opts[relay.nr_opts - 1] != NBD_OPT_GO) {
+    fprintf (stderr, "unexpected options\n");
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  pid_t pid;
+  size_t i;
+
+  if (mkstemp (sockpath) == -1) {
+    perror (sockpath);
+    exit (EXIT_FAILURE);
+  }
+
+  unlink (sockpath);
+  unlink (PIDFILE);
+
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    execlp ("nbdkit",
+            "nbdkit", "-f", "-U", sockpath, "-P", PIDFILE,
+            "--exit-with-parent", "memory", "size=1M", NULL);
+    perror ("nbdkit");
+    _exit (EXIT_FAILURE);
+  }
+
+  /* Wait for nbdkit to start listening. */
+  for (i = 0; i < 60; ++i) {
+    if (access (PIDFILE, F_OK) == 0)
+      break;
+    sleep (1);
+  }
+  unlink (PIDFILE);
+
+  try_connect (false);
+  try_connect (true);
+
+  unlink (sockpath);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,201 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_reactor_create and friends.  Several handles are added to
+ * a reactor before they connect, and are then driven through the
+ * handshake and a batch of writes and reads by nbd_reactor_run alone.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#define NR_HANDLES 8
+#define NR_REQUESTS 16
+#define REQUEST_SIZE 4096
+
+static char *args[] =
+  { "nbdkit", "-s", "--exit-with-parent", "memory", "size=1M", NULL };
+
+static struct nbd_handle *nbd[NR_HANDLES];
+static char wbuf[NR_HANDLES][NR_REQUESTS][REQUEST_SIZE];
+static char rbuf[NR_HANDLES][NR_REQUESTS][REQUEST_SIZE];
+
+static int
+command_done (void *user_data, int *error)
+{
+  if (*error) {
+    fprintf (stderr, "command failed: %s\n", strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  return 1;
+}
+
+static bool
+all_ready (void)
+{
+  size_t i;
+
+  for (i = 0; i < NR_HANDLES; ++i) {
+    if (nbd[i] && !nbd_aio_is_ready (nbd[i]))
+      return false;
+  }
+  return true;
+}
+
+static bool
+all_done (void)
+{
+  size_t i;
+
+  for (i = 0; i < NR_HANDLES; ++i) {
+    if (nbd[i] && nbd_aio_in_flight (nbd[i]) > 0)
+      return false;
+  }
+  return true;
+}
+
+static void
+run (struct nbd_reactor *r, bool (*done) (void))
+{
+  while (!done ()) {
+    if (nbd_reactor_run (r, -1) == -1) {
+      fprintf (stderr, "nbd_reactor_run: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_reactor *r;
+  size_t i, j;
+  uint64_t offset;
+
+  r = nbd_reactor_create ();
+  if (r == NULL) {
+    if (nbd_get_errno () == ENOTSUP) {
+      fprintf (stderr, "%s: skipped: %s\n", argv[0], nbd_get_error ());
+      exit (77);
+    }
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_HANDLES; ++i) {
+    nbd[i] = nbd_create ();
+    if (nbd[i] == NULL ||
+        nbd_reactor_add (r, nbd[i]) == -1 ||
+        nbd_aio_connect_command (nbd[i], args) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_reactor_add (r, nbd[0]) != -1 || nbd_get_errno () != EBUSY) {
+    fprintf (stderr, "adding a handle twice should fail with EBUSY\n");
+    exit (EXIT_FAILURE);
+  }
+  run (r, all_ready);
+
+  /* Every handle is now idle, so the reactor should time out. */
+  if (nbd_reactor_run (r, 0) != 0) {
+    fprintf (stderr, "nbd_reactor_run on idle handles should return 0\n");
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_HANDLES; ++i) {
+    for (j = 0; j < NR_REQUESTS; ++j) {
+      offset = j * REQUEST_SIZE;
+      memset (wbuf[i][j], 'a' + i + j, REQUEST_SIZE);
+      if (nbd_aio_pwrite (nbd[i], wbuf[i][j], REQUEST_SIZE, offset,
+                          (nbd_completion_callback) {
+                            .callback = command_done },
+                          0) == -1) {
+        fprintf (stderr, "nbd_aio_pwrite: %s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+  run (r, all_done);
+
+  for (i = 0; i < NR_HANDLES; ++i) {
+    for (j = 0; j < NR_REQUESTS; ++j) {
+      offset = j * REQUEST_SIZE;
+      if (nbd_aio_pread (nbd[i], rbuf[i][j], REQUEST_SIZE, offset,
+                         (nbd_completion_callback) {
+                           .callback = command_done },
+                         0) == -1) {
+        fprintf (stderr, "nbd_aio_pread: %s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+  run (r, all_done);
+  if (memcmp (rbuf, wbuf, sizeof wbuf) != 0) {
+    fprintf (stderr, "data read back differs from data written\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Handles can leave the reactor either explicitly or by closing. */
+  if (nbd_reactor_remove (r, nbd[0]) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_reactor_remove (r, nbd[0]) != -1 || nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "removing a handle twice should fail with EINVAL\n");
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd[1]);
+  nbd[1] = NULL;
+
+  /* Shutting down the rest goes through the reactor too. */
+  for (i = 2; i < NR_HANDLES; ++i) {
+    if (nbd_aio_disconnect (nbd[i], 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 2; i < NR_HANDLES; ++i) {
+    while (!nbd_aio_is_closed (nbd[i])) {
+      if (nbd_reactor_run (r, -1) == -1) {
+        fprintf (stderr, "nbd_reactor_run: %s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  /* With every handle closed there is nothing left to wait for. */
+  if (nbd_reactor_run (r, -1) != -1 || nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "nbd_reactor_run should fail with nothing to do\n");
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_reactor_close (r);
+  for (i = 0; i < NR_HANDLES; ++i)
+    nbd_close (nbd[i]);
+  exit (EXIT_SUCCESS);
+}
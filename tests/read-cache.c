@@ -0,0 +1,379 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_set_read_cache. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#include "check-pattern.h"
+#include "requires.h"
+
+#define BLOCK (64 * 1024)
+
+static struct nbd_handle *nbd;
+
+static void
+check_stats (uint64_t hits, uint64_t misses)
+{
+  if (nbd_stats_read_cache_hits (nbd) != hits ||
+      nbd_stats_read_cache_misses (nbd) != misses ||
+      nbd_stats_commands (nbd, LIBNBD_STATS_CMD_READ) != (int64_t) misses) {
+    fprintf (stderr, "expected %" PRIu64 " hits and %" PRIu64 " misses, "
+             "got %" PRIu64 " and %" PRIu64 " with %" PRIi64 " reads sent\n",
+             hits, misses,
+             nbd_stats_read_cache_hits (nbd),
+             nbd_stats_read_cache_misses (nbd),
+             nbd_stats_commands (nbd, LIBNBD_STATS_CMD_READ));
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+pread_and_check (size_t count, uint64_t offset,
+                 uint64_t hits, uint64_t misses)
+{
+  char buf[4096];
+
+  if (nbd_pread (nbd, buf, count, offset, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_pattern (buf, count, offset);
+  check_stats (hits, misses);
+}
+
+/* Check that buf is filled with the byte c. */
+static void
+check_data (const char *buf, size_t count, uint64_t offset, char c)
+{
+  size_t i;
+
+  for (i = 0; i < count; ++i) {
+    if (buf[i] != c) {
+      fprintf (stderr, "wrong data at offset %" PRIu64 ": "
+               "expected 0x%02x, got 0x%02x\n",
+               offset + i, (unsigned char) c, (unsigned char) buf[i]);
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+static void
+wait_for (int64_t cookie)
+{
+  int r;
+
+  while ((r = nbd_aio_command_completed (nbd, cookie)) == 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (r == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Connect to a server, with a read cache of 4 blocks. */
+static void
+connect_with_cache (char **args)
+{
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_read_cache (nbd, 4 * BLOCK) == -1 ||
+      nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+test_read_only (void)
+{
+  char *args[] =
+    { "nbdkit", "-s", "--exit-with-parent", "-r",
+      "pattern", "size=1M", NULL };
+  char buf1[512], buf2[512];
+  int64_t cookie1, cookie2;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_get_read_cache (nbd) != 0) {
+    fprintf (stderr, "read cache should be disabled by default\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_read_cache (nbd, 1000) != -1 || nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "a read cache smaller than a block should fail\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_read_cache (nbd, 4 * BLOCK) == -1 ||
+      nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_read_cache (nbd) != 4 * BLOCK) {
+    fprintf (stderr, "read cache size not set\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* The first read fetches block 0, the second is served from it. */
+  pread_and_check (4096, 0, 0, 1);
+  pread_and_check (4096, 8192, 1, 1);
+
+  /* Two reads of block 1 in flight together cost one request. */
+  cookie1 = nbd_aio_pread (nbd, buf1, sizeof buf1, BLOCK,
+                           NBD_NULL_COMPLETION, 0);
+  cookie2 = nbd_aio_pread (nbd, buf2, sizeof buf2, BLOCK + 4096,
+                           NBD_NULL_COMPLETION, 0);
+  if (cookie1 == -1 || cookie2 == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  wait_for (cookie1);
+  wait_for (cookie2);
+  check_pattern (buf1, sizeof buf1, BLOCK);
+  check_pattern (buf2, sizeof buf2, BLOCK + 4096);
+  check_stats (2, 2);
+
+  /* A read across blocks 1 and 2 only fetches block 2. */
+  pread_and_check (1024, 2 * BLOCK - 512, 3, 3);
+
+  /* Filling the cache evicts the least recently used blocks. */
+  pread_and_check (4096, 3 * BLOCK, 3, 4);
+  pread_and_check (4096, 4 * BLOCK, 3, 5);
+  pread_and_check (4096, 2 * BLOCK, 4, 5);
+  pread_and_check (4096, 0, 4, 6);
+
+  nbd_close (nbd);
+}
+
+static void
+pread_data_and_check (uint64_t offset, char c,
+                      uint64_t hits, uint64_t misses)
+{
+  char buf[4096];
+
+  if (nbd_pread (nbd, buf, sizeof buf, offset, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_data (buf, sizeof buf, offset, c);
+  check_stats (hits, misses);
+}
+
+/* Writes, zeroes and trims drop what they overwrite. */
+static void
+test_invalidate (void)
+{
+  char *args[] =
+    { "nbdkit", "-s", "--exit-with-parent", "memory", "size=1M", NULL };
+  char buf[4096];
+
+  connect_with_cache (args);
+  if (nbd_can_multi_conn (nbd) != 1) {
+    fprintf (stderr, "nbdkit-memory-plugin should support multi-conn\n");
+    exit (EXIT_FAILURE);
+  }
+
+  memset (buf, 'a', sizeof buf);
+  if (nbd_pwrite (nbd, buf, sizeof buf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  pread_data_and_check (0, 'a', 0, 1);
+  pread_data_and_check (0, 'a', 1, 1);
+
+  if (nbd_zero (nbd, sizeof buf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  pread_data_and_check (0, 0, 1, 2);
+
+  memset (buf, 'b', sizeof buf);
+  if (nbd_pwrite (nbd, buf, sizeof buf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  pread_data_and_check (0, 'b', 1, 3);
+
+  if (nbd_trim (nbd, sizeof buf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  pread_data_and_check (0, 0, 1, 4);
+
+  nbd_close (nbd);
+}
+
+/* A read issued after a write has completed must not wait for a
+ * fill which started before the write.  The delay filter keeps the
+ * first fill in flight while the write completes.
+ */
+static void
+test_write_while_filling (void)
+{
+  char *args[] =
+    { "nbdkit", "-s", "--exit-with-parent", "--filter=delay",
+      "memory", "size=1M", "rdelay=2", NULL };
+  char wbuf[4096], buf1[4096], buf2[4096];
+  int64_t cookie1, cookie2, wcookie;
+
+  connect_with_cache (args);
+
+  cookie1 = nbd_aio_pread (nbd, buf1, sizeof buf1, BLOCK,
+                           NBD_NULL_COMPLETION, 0);
+  memset (wbuf, 'c', sizeof wbuf);
+  wcookie = nbd_aio_pwrite (nbd, wbuf, sizeof wbuf, BLOCK,
+                            NBD_NULL_COMPLETION, 0);
+  if (cookie1 == -1 || wcookie == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  wait_for (wcookie);
+
+  cookie2 = nbd_aio_pread (nbd, buf2, sizeof buf2, BLOCK,
+                           NBD_NULL_COMPLETION, 0);
+  if (cookie2 == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  wait_for (cookie1);
+  wait_for (cookie2);
+  check_data (buf2, sizeof buf2, BLOCK, 'c');
+  check_stats (0, 2);
+
+  /* Only the second fill was kept. */
+  pread_data_and_check (BLOCK, 'c', 1, 2);
+
+  nbd_close (nbd);
+}
+
+static int
+retire_cb (void *user_data, int *error)
+{
+  unsigned *called = user_data;
+
+  (*called)++;
+  return 1;
+}
+
+/* A hit which is retired by its completion callback, with no command
+ * cache to keep it, is freed before nbd_aio_pread returns.
+ */
+static void
+test_retire_hit (void)
+{
+  char *args[] =
+    { "nbdkit", "-s", "--exit-with-parent", "-r",
+      "pattern", "size=1M", NULL };
+  char buf[512];
+  unsigned called = 0;
+  int64_t cookie;
+
+  connect_with_cache (args);
+  if (nbd_set_command_cache_limit (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  pread_and_check (4096, 0, 0, 1);
+
+  cookie = nbd_aio_pread (nbd, buf, sizeof buf, 512,
+                          (nbd_completion_callback) {
+                            .callback = retire_cb, .user_data = &called },
+                          0);
+  if (cookie == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (cookie <= 0 || called != 1 || nbd_aio_in_flight (nbd) != 0) {
+    fprintf (stderr, "retired cache hit: cookie %" PRIi64 ", "
+             "callback called %u times, %d in flight\n",
+             cookie, called, nbd_aio_in_flight (nbd));
+    exit (EXIT_FAILURE);
+  }
+  check_pattern (buf, sizeof buf, 512);
+  check_stats (1, 1);
+
+  nbd_close (nbd);
+}
+
+/* Without multi-conn, the cache is not used for a writable export. */
+static void
+test_no_multi_conn (void)
+{
+  char *args[] =
+    { "nbdkit", "-s", "--exit-with-parent", "--filter=multi-conn",
+      "memory", "size=1M", "multi-conn-mode=disable", NULL };
+  char buf[4096];
+
+  connect_with_cache (args);
+  if (nbd_can_multi_conn (nbd) != 0) {
+    fprintf (stderr, "multi-conn should be disabled\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_read_cache (nbd) != 4 * BLOCK) {
+    fprintf (stderr, "read cache size should be kept\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_pread (nbd, buf, sizeof buf, 0, 0) == -1 ||
+      nbd_pread (nbd, buf, sizeof buf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_stats_read_cache_hits (nbd) != 0 ||
+      nbd_stats_read_cache_misses (nbd) != 0 ||
+      nbd_stats_commands (nbd, LIBNBD_STATS_CMD_READ) != 2) {
+    fprintf (stderr, "read cache should not be used without multi-conn\n");
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+}
+
+int
+main (int argc, char *argv[])
+{
+  requires ("nbdkit --version --filter=delay null");
+  requires ("nbdkit --version --filter=multi-conn null");
+
+  test_read_only ();
+  test_invalidate ();
+  test_write_while_filling ();
+  test_no_multi_conn ();
+  test_retire_hit ();
+  exit (EXIT_SUCCESS);
+}
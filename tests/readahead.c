@@ -0,0 +1,184 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_set_readahead with a read cache and with NBD_CMD_CACHE. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#include "check-pattern.h"
+#include "requires.h"
+
+#define SIZE (1024 * 1024)
+#define BLOCK (64 * 1024)
+
+static struct nbd_handle *
+connect_args (char **args, uint64_t cache, uint64_t readahead)
+{
+  struct nbd_handle *nbd;
+
+  nbd = nbd_create ();
+  if (nbd == NULL ||
+      nbd_set_read_cache (nbd, cache) == -1 ||
+      nbd_set_readahead (nbd, readahead) == -1 ||
+      nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return nbd;
+}
+
+static struct nbd_handle *
+connect (uint64_t cache, uint64_t readahead)
+{
+  char *args[] =
+    { "nbdkit", "-s", "--exit-with-parent", "-r",
+      "pattern", "size=1M", NULL };
+
+  return connect_args (args, cache, readahead);
+}
+
+static void
+pread_and_check (struct nbd_handle *nbd, uint64_t offset)
+{
+  char buf[4096];
+
+  if (nbd_pread (nbd, buf, sizeof buf, offset, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_pattern (buf, sizeof buf, offset);
+}
+
+int
+main (int argc, char *argv[])
+{
+  char *cache_args[] =
+    { "nbdkit", "-s", "--exit-with-parent",
+      "--filter=nocache", "--filter=multi-conn",
+      "memory", "size=1M", "cachemode=emulate", "multi-conn-mode=disable",
+      NULL };
+  char buf[4096];
+  struct nbd_handle *nbd;
+  uint64_t offset;
+
+  requires ("nbdkit --version --filter=nocache null");
+  requires ("nbdkit --version --filter=multi-conn null");
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_readahead (nbd) != 0) {
+    fprintf (stderr, "read-ahead should be disabled by default\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_readahead (nbd, 100) != -1 || nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "a tiny read-ahead window should fail\n");
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  /* Reading the whole export sequentially, only the first block is
+   * waited for; every other block has been read ahead, once.
+   */
+  nbd = connect (SIZE, 256 * 1024);
+  if (nbd_get_readahead (nbd) != 256 * 1024) {
+    fprintf (stderr, "read-ahead size not set\n");
+    exit (EXIT_FAILURE);
+  }
+  for (offset = 0; offset < SIZE; offset += 4096)
+    pread_and_check (nbd, offset);
+  if (nbd_stats_read_cache_misses (nbd) != 1 ||
+      nbd_stats_commands (nbd, LIBNBD_STATS_CMD_READ) != SIZE / BLOCK ||
+      nbd_stats_readahead_useful_bytes (nbd) != SIZE - BLOCK ||
+      nbd_stats_readahead_wasted_bytes (nbd) != 0) {
+    fprintf (stderr, "sequential read: %" PRIu64 " misses, "
+             "%" PRIi64 " reads sent, %" PRIu64 " bytes useful, "
+             "%" PRIu64 " bytes wasted\n",
+             nbd_stats_read_cache_misses (nbd),
+             nbd_stats_commands (nbd, LIBNBD_STATS_CMD_READ),
+             nbd_stats_readahead_useful_bytes (nbd),
+             nbd_stats_readahead_wasted_bytes (nbd));
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  /* With a 4 block cache, a short sequential run reads block 1 ahead,
+   * then random reads evict it before it is used.
+   */
+  nbd = connect (4 * BLOCK, 128 * 1024);
+  for (offset = 0; offset <= 16384; offset += 4096)
+    pread_and_check (nbd, offset);
+  for (offset = SIZE - BLOCK; offset >= 4 * BLOCK; offset -= BLOCK)
+    pread_and_check (nbd, offset);
+  if (nbd_stats_readahead_useful_bytes (nbd) != 0 ||
+      nbd_stats_readahead_wasted_bytes (nbd) != BLOCK) {
+    fprintf (stderr, "random read: %" PRIu64 " bytes useful, "
+             "%" PRIu64 " bytes wasted\n",
+             nbd_stats_readahead_useful_bytes (nbd),
+             nbd_stats_readahead_wasted_bytes (nbd));
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  /* With a read cache which cannot be used, because the export is
+   * writable and has no multi-conn, the server is told about the
+   * window with NBD_CMD_CACHE instead.
+   */
+  nbd = connect_args (cache_args, 4 * BLOCK, 256 * 1024);
+  if (nbd_can_cache (nbd) != 1 || nbd_can_multi_conn (nbd) != 0) {
+    fprintf (stderr, "server should support NBD_CMD_CACHE "
+             "and not multi-conn\n");
+    exit (EXIT_FAILURE);
+  }
+  for (offset = 0; offset < SIZE; offset += sizeof buf) {
+    if (nbd_pread (nbd, buf, sizeof buf, offset, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_stats_read_cache_misses (nbd) != 0 ||
+      nbd_stats_commands (nbd, LIBNBD_STATS_CMD_READ) != SIZE / 4096 ||
+      nbd_stats_commands (nbd, LIBNBD_STATS_CMD_CACHE) == 0 ||
+      nbd_stats_readahead_useful_bytes (nbd) == 0 ||
+      nbd_stats_readahead_wasted_bytes (nbd) != 0) {
+    fprintf (stderr, "NBD_CMD_CACHE: %" PRIu64 " misses, "
+             "%" PRIi64 " reads sent, %" PRIi64 " cache hints sent, "
+             "%" PRIu64 " bytes useful, %" PRIu64 " bytes wasted\n",
+             nbd_stats_read_cache_misses (nbd),
+             nbd_stats_commands (nbd, LIBNBD_STATS_CMD_READ),
+             nbd_stats_commands (nbd, LIBNBD_STATS_CMD_CACHE),
+             nbd_stats_readahead_useful_bytes (nbd),
+             nbd_stats_readahead_wasted_bytes (nbd));
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,160 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_replica_create and friends.  Two nbdkit pattern plugins
+ * serve the same data, but one of them delays every read by much
+ * longer than the whole test should take.  Reads which first go to
+ * the slow replica have to be hedged to the fast one, and the data
+ * must still be correct.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <libnbd.h>
+
+#include "byte-swapping.h"
+
+#define SIZE (1024 * 1024)
+#define XSTR(s) #s
+#define STR(s) XSTR (s)
+
+#define SLOW_DELAY 20           /* seconds */
+#define NR_REQUESTS 256
+#define MAX_IN_FLIGHT 16
+#define REQUEST_SIZE 4096
+
+static char *fast[] =
+  { "nbdkit", "-s", "--exit-with-parent",
+    "pattern", "size=" STR (SIZE), NULL };
+static char *slow[] =
+  { "nbdkit", "-s", "--exit-with-parent",
+    "--filter=delay", "pattern", "size=" STR (SIZE),
+    "delay-read=" STR (SLOW_DELAY), NULL };
+
+static char buf[NR_REQUESTS][REQUEST_SIZE];
+static unsigned completed;
+
+static int
+connect_one (void *user_data, struct nbd_handle *nbd, unsigned i)
+{
+  return nbd_connect_command (nbd, i == 0 ? slow : fast);
+}
+
+static int
+read_done (void *user_data, int *error)
+{
+  if (*error) {
+    fprintf (stderr, "read failed: %s\n", strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  completed++;
+  return 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_replica *r;
+  time_t start;
+  size_t i, j;
+  uint64_t offset, expected, actual;
+
+  r = nbd_replica_create (2, connect_one, NULL);
+  if (r == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_replica_get_size (r) != 2) {
+    fprintf (stderr, "unexpected number of replicas\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_replica_get_hedge_percentile (r) != 95) {
+    fprintf (stderr, "unexpected default percentile\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_replica_set_hedge_percentile (r, 101) != -1) {
+    fprintf (stderr, "percentile 101 should be rejected\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_replica_get_handle (r, 2) != NULL) {
+    fprintf (stderr, "replica index 2 should be out of range\n");
+    exit (EXIT_FAILURE);
+  }
+
+  start = time (NULL);
+  for (i = 0; i < NR_REQUESTS; ++i) {
+    while (nbd_replica_aio_in_flight (r) >= MAX_IN_FLIGHT) {
+      if (nbd_replica_poll (r, -1) == -1) {
+        fprintf (stderr, "nbd_replica_poll: %s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+    offset = (uint64_t) i * REQUEST_SIZE % SIZE;
+    if (nbd_replica_aio_pread (r, buf[i], REQUEST_SIZE, offset,
+                               (nbd_completion_callback) {
+                                 .callback = read_done },
+                               0) == -1) {
+      fprintf (stderr, "nbd_replica_aio_pread: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  while (nbd_replica_aio_in_flight (r) > 0) {
+    if (nbd_replica_poll (r, -1) == -1) {
+      fprintf (stderr, "nbd_replica_poll: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (completed != NR_REQUESTS) {
+    fprintf (stderr, "only %u of %d reads completed\n",
+             completed, NR_REQUESTS);
+    exit (EXIT_FAILURE);
+  }
+  if (time (NULL) - start >= SLOW_DELAY) {
+    fprintf (stderr, "reads waited for the slow replica\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* The pattern plugin stores the offset of each 8 byte word in it. */
+  for (i = 0; i < NR_REQUESTS; ++i) {
+    offset = (uint64_t) i * REQUEST_SIZE % SIZE;
+    for (j = 0; j < REQUEST_SIZE; j += 8) {
+      expected = offset + j;
+      memcpy (&actual, &buf[i][j], sizeof actual);
+      actual = be64toh (actual);
+      if (actual != expected) {
+        fprintf (stderr, "read %zu: unexpected data at offset %" PRIu64 "\n",
+                 i, expected);
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  /* Don't wait for the reads still queued on the slow replica. */
+  nbd_replica_close (r);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,235 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_stripe_create and friends over three nbdkit memory disks.
+ * Data written through the striped set must be read back unchanged,
+ * must land on the members where RAID-0 puts it, and block status
+ * must be merged across members.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#define MEMBERS 3
+#define MEMBER_SIZE (1024 * 1024)
+#define STRIPE_SIZE 65536
+#define SIZE (MEMBERS * MEMBER_SIZE)
+
+static char *args[] =
+  { "nbdkit", "-s", "--exit-with-parent", "memory", "size=1M", NULL };
+
+static char wbuf[SIZE], rbuf[SIZE];
+
+struct extents {
+  uint64_t offset;
+  nbd_extent entries[64];
+  size_t nr_entries;
+};
+
+static int
+connect_one (void *user_data, struct nbd_handle *nbd, unsigned i)
+{
+  if (nbd_add_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1)
+    return -1;
+  return nbd_connect_command (nbd, args);
+}
+
+static int
+command_done (void *user_data, int *error)
+{
+  if (*error) {
+    fprintf (stderr, "command failed: %s\n", strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  return 1;
+}
+
+static int
+extent_cb (void *user_data, const char *metacontext, uint64_t offset,
+           nbd_extent *entries, size_t nr_entries, int *error)
+{
+  struct extents *e = user_data;
+
+  if (strcmp (metacontext, LIBNBD_CONTEXT_BASE_ALLOCATION) != 0)
+    return 0;
+  if (nr_entries > sizeof e->entries / sizeof e->entries[0]) {
+    fprintf (stderr, "too many extents: %zu\n", nr_entries);
+    exit (EXIT_FAILURE);
+  }
+  e->offset = offset;
+  memcpy (e->entries, entries, nr_entries * sizeof *entries);
+  e->nr_entries = nr_entries;
+  return 0;
+}
+
+static void
+wait_all (struct nbd_stripe *s)
+{
+  while (nbd_stripe_aio_in_flight (s) > 0) {
+    if (nbd_stripe_poll (s, -1) == -1) {
+      fprintf (stderr, "nbd_stripe_poll: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+static void
+block_status (struct nbd_stripe *s, uint64_t count, uint64_t offset,
+              struct extents *e)
+{
+  memset (e, 0, sizeof *e);
+  if (nbd_stripe_aio_block_status (s, count, offset,
+                                   (nbd_extent64_callback) {
+                                     .callback = extent_cb,
+                                     .user_data = e },
+                                   (nbd_completion_callback) {
+                                     .callback = command_done },
+                                   0) == -1) {
+    fprintf (stderr, "nbd_stripe_aio_block_status: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  wait_all (s);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_stripe *s;
+  struct extents e;
+  char buf[512];
+  size_t i;
+  uint64_t total;
+
+  s = nbd_stripe_create (MEMBERS, STRIPE_SIZE, connect_one, NULL);
+  if (s == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_stripe_get_size (s) != MEMBERS ||
+      nbd_stripe_get_stripe_size (s) != STRIPE_SIZE ||
+      nbd_stripe_get_export_size (s) != SIZE) {
+    fprintf (stderr, "unexpected striped set geometry\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* A fresh memory disk is one hole, and the holes on every member
+   * should be merged into one extent.
+   */
+  block_status (s, SIZE, 0, &e);
+  if (e.offset != 0 || e.nr_entries != 1 ||
+      e.entries[0].length != SIZE ||
+      e.entries[0].flags != (LIBNBD_STATE_HOLE | LIBNBD_STATE_ZERO)) {
+    fprintf (stderr, "unexpected block status of empty disk\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Write everything except the first and last few bytes, so that
+   * the request starts and ends part way through a stripe.
+   */
+  for (i = 0; i < SIZE; ++i)
+    wbuf[i] = i * 7 + i / STRIPE_SIZE;
+  if (nbd_stripe_aio_pwrite (s, wbuf + 100, SIZE - 200, 100,
+                             (nbd_completion_callback) {
+                               .callback = command_done },
+                             0) == -1 ||
+      nbd_stripe_aio_flush (s, (nbd_completion_callback) {
+                                 .callback = command_done },
+                            0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  wait_all (s);
+  memset (wbuf, 0, 100);
+  memset (wbuf + SIZE - 200 + 100, 0, 100);
+
+  if (nbd_stripe_aio_pread (s, rbuf, SIZE, 0,
+                            (nbd_completion_callback) {
+                              .callback = command_done },
+                            0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  wait_all (s);
+  if (memcmp (rbuf, wbuf, SIZE) != 0) {
+    fprintf (stderr, "data read back differs from data written\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Stripe 4 is the second stripe on member 1. */
+  if (nbd_pread (nbd_stripe_get_handle (s, 1), buf, sizeof buf,
+                 STRIPE_SIZE, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (buf, wbuf + 4 * STRIPE_SIZE, sizeof buf) != 0) {
+    fprintf (stderr, "data is not on the expected member\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Zero stripes 2 to 4, and check that block status sees data,
+   * then zeroes, then data, wherever the members put them.
+   */
+  if (nbd_stripe_aio_zero (s, 3 * STRIPE_SIZE, 2 * STRIPE_SIZE,
+                           (nbd_completion_callback) {
+                             .callback = command_done },
+                           0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  wait_all (s);
+  block_status (s, 8 * STRIPE_SIZE, 0, &e);
+  if (e.nr_entries != 3 ||
+      e.entries[0].length != 2 * STRIPE_SIZE ||
+      (e.entries[0].flags & LIBNBD_STATE_ZERO) != 0 ||
+      e.entries[1].length != 3 * STRIPE_SIZE ||
+      (e.entries[1].flags & LIBNBD_STATE_ZERO) == 0 ||
+      (e.entries[2].flags & LIBNBD_STATE_ZERO) != 0) {
+    fprintf (stderr, "unexpected block status after zeroing\n");
+    exit (EXIT_FAILURE);
+  }
+  for (total = 0, i = 0; i < e.nr_entries; ++i)
+    total += e.entries[i].length;
+  if (total != 8 * STRIPE_SIZE) {
+    fprintf (stderr, "merged block status covers %" PRIu64 " bytes\n",
+             total);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Requests beyond the end of the striped disk are refused. */
+  if (nbd_stripe_aio_pread (s, buf, sizeof buf, SIZE,
+                            NBD_NULL_COMPLETION, 0) != -1) {
+    fprintf (stderr, "read beyond the end should fail\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_stripe_shutdown (s, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_stripe_close (s);
+  exit (EXIT_SUCCESS);
+}
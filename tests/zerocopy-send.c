@@ -0,0 +1,187 @@
+/* NBD client library in userspace
+ * Copyright Red Hat
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_set_zerocopy_send over TCP, with a mix of writes above
+ * and below the zero-copy threshold in flight at once.  Every write
+ * must complete exactly once, and the data must arrive intact.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#include "pick-a-port.h"
+
+#define PIDFILE "zerocopy-send.pid"
+#define SIZE (64 * 1024 * 1024)
+#define XSTR(s) #s
+#define STR(s) XSTR (s)
+
+#define NR_WRITES 32
+static const size_t lens[] = { 1024 * 1024, 4096, 65536, 65535, 512 * 1024 };
+
+static char *wbuf[NR_WRITES], *rbuf;
+static unsigned completions[NR_WRITES];
+
+static int
+write_done (void *user_data, int *error)
+{
+  unsigned *count = user_data;
+
+  if (*error) {
+    fprintf (stderr, "write failed: %s\n", strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  (*count)++;
+  return 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  int port = pick_a_port ();
+  char port_str[16];
+  pid_t pid;
+  size_t i, j, len;
+  uint64_t offset;
+
+  unlink (PIDFILE);
+
+  snprintf (port_str, sizeof port_str, "%d", port);
+
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    execlp ("nbdkit",
+            "nbdkit", "-f", "-p", port_str, "-P", PIDFILE,
+            "--exit-with-parent", "memory", "size=" STR (SIZE), NULL);
+    perror ("nbdkit");
+    _exit (EXIT_FAILURE);
+  }
+
+  /* Wait for nbdkit to start listening. */
+  for (i = 0; i < 60; ++i) {
+    if (access (PIDFILE, F_OK) == 0)
+      break;
+    sleep (1);
+  }
+  unlink (PIDFILE);
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_zerocopy_send (nbd) != false) {
+    fprintf (stderr, "unexpected default zero-copy setting\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_zerocopy_send (nbd, true) == -1 ||
+      nbd_get_zerocopy_send (nbd) != true) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_tcp (nbd, "localhost", port_str) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Queue all the writes at once. */
+  offset = 0;
+  for (i = 0; i < NR_WRITES; ++i) {
+    len = lens[i % (sizeof lens / sizeof lens[0])];
+    wbuf[i] = malloc (len);
+    if (wbuf[i] == NULL) {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+    for (j = 0; j < len; ++j)
+      wbuf[i][j] = (char) (i + j * 13);
+    if (nbd_aio_pwrite (nbd, wbuf[i], len, offset,
+                        (nbd_completion_callback) {
+                          .callback = write_done,
+                          .user_data = &completions[i] },
+                        0) == -1) {
+      fprintf (stderr, "nbd_aio_pwrite: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    offset += len;
+  }
+
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "nbd_poll: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_WRITES; ++i) {
+    if (completions[i] != 1) {
+      fprintf (stderr, "write %zu completed %u times\n", i, completions[i]);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Read everything back. */
+  rbuf = malloc (lens[0]);
+  if (rbuf == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  offset = 0;
+  for (i = 0; i < NR_WRITES; ++i) {
+    len = lens[i % (sizeof lens / sizeof lens[0])];
+    if (nbd_pread (nbd, rbuf, len, offset, 0) == -1) {
+      fprintf (stderr, "nbd_pread: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (memcmp (rbuf, wbuf[i], len) != 0) {
+      fprintf (stderr, "data of write %zu differs\n", i);
+      exit (EXIT_FAILURE);
+    }
+    offset += len;
+  }
+
+  /* A synchronous write must also wait for the kernel. */
+  if (nbd_pwrite (nbd, wbuf[0], lens[0], 0, 0) == -1) {
+    fprintf (stderr, "nbd_pwrite: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  for (i = 0; i < NR_WRITES; ++i)
+    free (wbuf[i]);
+  free (rbuf);
+  exit (EXIT_SUCCESS);
+}
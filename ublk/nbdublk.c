@@ -33,6 +33,7 @@
 
 #include "nbdublk.h"
 
+#include "flight-recorder.h"
 #include "ispowerof2.h"
 #include "vector.h"
 #include "version.h"
@@ -474,7 +475,7 @@ main (int argc, char *argv[])
 static struct nbd_handle *
 create_and_connect (enum mode mode, int argc, char **argv)
 {
-  int fd;
+  int fd, r = -1;
   uint32_t cid, port;
   struct nbd_handle *h;
 
@@ -489,17 +490,11 @@ create_and_connect (enum mode mode, int argc, char **argv)
   /* Connect to the NBD server synchronously. */
   switch (mode) {
   case MODE_URI:
-    if (nbd_connect_uri (h, argv[optind]) == -1) {
-      fprintf (stderr, "%s\n", nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    r = nbd_connect_uri (h, argv[optind]);
     break;
 
   case MODE_COMMAND:
-    if (nbd_connect_command (h, &argv[optind]) == -1) {
-      fprintf (stderr, "%s\n", nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    r = nbd_connect_command (h, &argv[optind]);
     break;
 
   case MODE_SQUARE_BRACKET:
@@ -510,10 +505,7 @@ create_and_connect (enum mode mode, int argc, char **argv)
     argv[argc-1] = NULL;
     /*FALLTHROUGH*/
   case MODE_SOCKET_ACTIVATION:
-    if (nbd_connect_systemd_socket_activation (h, &argv[optind]) == -1) {
-      fprintf (stderr, "%s\n", nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    r = nbd_connect_systemd_socket_activation (h, &argv[optind]);
     break;
 
   case MODE_FD:
@@ -522,24 +514,15 @@ create_and_connect (enum mode mode, int argc, char **argv)
                argv[0], argv[optind]);
       exit (EXIT_FAILURE);
     }
-    if (nbd_connect_socket (h, fd) == -1) {
-      fprintf (stderr, "%s\n", nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    r = nbd_connect_socket (h, fd);
     break;
 
   case MODE_TCP:
-    if (nbd_connect_tcp (h, argv[optind], argv[optind+1]) == -1) {
-      fprintf (stderr, "%s\n", nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    r = nbd_connect_tcp (h, argv[optind], argv[optind+1]);
     break;
 
   case MODE_UNIX:
-    if (nbd_connect_unix (h, argv[optind]) == -1) {
-      fprintf (stderr, "%s\n", nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    r = nbd_connect_unix (h, argv[optind]);
     break;
 
   case MODE_VSOCK:
@@ -553,13 +536,16 @@ create_and_connect (enum mode mode, int argc, char **argv)
                argv[0], argv[optind]);
       exit (EXIT_FAILURE);
     }
-    if (nbd_connect_vsock (h, cid, port) == -1) {
-      fprintf (stderr, "%s\n", nbd_get_error ());
-      exit (EXIT_FAILURE);
-    }
+    r = nbd_connect_vsock (h, cid, port);
     break;
   }
 
+  if (r == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    dump_flight_recorder_on_error (h);
+    exit (EXIT_FAILURE);
+  }
+
   return h;
 }
 
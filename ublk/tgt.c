@@ -39,6 +39,7 @@
 
 #include <libnbd.h>
 
+#include "flight-recorder.h"
 #include "ispowerof2.h"
 #include "vector.h"
 
@@ -211,6 +212,7 @@ nbd_work_thread (void *vpinfo)
 
     if (nbd_poll2 (h, ublksrv_aio_get_efd (aio_ctx), -1) == -1) {
       fprintf (stderr, "%s\n", nbd_get_error ());
+      dump_flight_recorder_on_error (h);
       exit (EXIT_FAILURE);
     }
   }